@@ -0,0 +1,313 @@
+#ifndef VERSE_COMMON_CONTAINER_H_
+#define VERSE_COMMON_CONTAINER_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Bytecode container. Bare bytecode doesn't say what it is or what it needs,
+ * so the assemblers wrap it in this:
+ *
+ *   header      magic, version, ISA, entry point, max stack depth, checksum
+ *               and where each section is
+ *   code        the bytecode itself
+ *   constants   empty for now, since both ISAs only have inline immediates
+ *   line map    a (code offset, source line) pair for every instruction
+ *
+ * The header is at the start of the file and every section starts on a page
+ * boundary, so a loader can mmap the file and run the code section in place.
+ * max_stack is the verifier's bound on the stack depth. A loader can allocate
+ * exactly that much stack and skip verifying the program again. It's
+ * CONTAINER_UNVERIFIED if the assembler couldn't verify the program, and 0 for
+ * register code, which has no stack. The checksum covers the header and the
+ * contents of every section, so a truncated or corrupted file can't get a
+ * bound it didn't earn.
+ *
+ * The header and the line map are written straight from memory and mapped
+ * straight back, so they're in the host's byte order. We only build on
+ * little-endian hosts, which makes that little-endian, the same as the
+ * operands in the bytecode. Files without the magic still load and are taken
+ * to be bare code.
+ */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Containers are little-endian and read in place, so the host has to be too"
+#endif
+
+#define CONTAINER_MAGIC      "VRSE"
+#define CONTAINER_VERSION    1
+#define CONTAINER_PAGE       4096
+#define CONTAINER_UNVERIFIED UINT32_MAX
+
+typedef enum {
+    CONTAINER_ISA_NONE,
+    CONTAINER_ISA_STACK,
+    CONTAINER_ISA_REG,
+    CONTAINER_ISA_REG_WIDE
+} container_isa;
+
+typedef enum {
+    SECTION_CODE,
+    SECTION_CONSTANTS,
+    SECTION_LINES,
+    NUM_SECTIONS
+} container_section_id;
+
+struct container_section {
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct container_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t isa;
+
+    /*
+     * Where execution starts, in bytes from the start of the code section.
+     */
+    uint32_t entry;
+    uint32_t max_stack;
+    uint32_t checksum;
+    uint32_t num_sections;
+    struct container_section sections[NUM_SECTIONS];
+};
+
+/*
+ * Offsets are in bytes for stack code and in instructions for register code.
+ */
+struct container_line {
+    uint32_t offset;
+    uint32_t line;
+};
+
+typedef enum {
+    CONTAINER_OK,
+    CONTAINER_CANT_OPEN,
+    CONTAINER_EMPTY,
+    CONTAINER_TRUNCATED,
+    CONTAINER_BAD_VERSION,
+    CONTAINER_BAD_SECTION,
+    CONTAINER_BAD_CHECKSUM
+} container_status;
+
+const char *container_messages[] = {
+        "OK",
+        "can't open file",
+        "file is empty",
+        "header runs past the end of the file",
+        "unsupported container version",
+        "section is misaligned or runs past the end of the file",
+        "checksum mismatch"
+};
+
+const char *isa_names[] = {
+        "bare",
+        "stack",
+        "register",
+        "wide register"
+};
+
+/*
+ * A program as we found it or are about to write it. The pointers point into
+ * whatever the program was parsed from.
+ */
+struct container_info {
+    int is_container;
+    container_isa isa;
+    uint32_t entry;
+    uint32_t max_stack;
+    uint8_t *code;
+    size_t code_len;
+    uint8_t *constants;
+    size_t constants_len;
+    struct container_line *lines;
+    size_t num_lines;
+
+    /*
+     * The file mapping, if container_map made one.
+     */
+    void *map;
+    size_t map_len;
+};
+
+/*
+ * 32-bit FNV-1a, picking up where a previous call left off.
+ */
+uint32_t container_hash(uint32_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t container_checksum(struct container_header *header, uint8_t *sections[NUM_SECTIONS]) {
+    struct container_header copy = *header;
+    copy.checksum = 0;
+    uint32_t h = container_hash(2166136261u, &copy, sizeof(copy));
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        h = container_hash(h, sections[i], header->sections[i].size);
+    }
+    return h;
+}
+
+size_t page_align(size_t n) {
+    return (n + CONTAINER_PAGE - 1) & ~(size_t) (CONTAINER_PAGE - 1);
+}
+
+/*
+ * Make sense of a program in memory. Anything without the magic is bare code,
+ * which we can't say anything about.
+ */
+container_status container_parse(uint8_t *data, size_t len, struct container_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->max_stack = CONTAINER_UNVERIFIED;
+    if (len == 0) {
+        return CONTAINER_EMPTY;
+    }
+    if (len < sizeof(CONTAINER_MAGIC) - 1 || memcmp(data, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC) - 1) != 0) {
+        info->code = data;
+        info->code_len = len;
+        return CONTAINER_OK;
+    }
+    struct container_header header;
+    if (len < sizeof(header)) {
+        return CONTAINER_TRUNCATED;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.version != CONTAINER_VERSION || header.num_sections != NUM_SECTIONS) {
+        return CONTAINER_BAD_VERSION;
+    }
+    uint8_t *sections[NUM_SECTIONS];
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        struct container_section *s = &header.sections[i];
+        if (s->offset % CONTAINER_PAGE != 0 || s->offset > len || s->size > len - s->offset) {
+            return CONTAINER_BAD_SECTION;
+        }
+        sections[i] = data + s->offset;
+    }
+    if (header.sections[SECTION_LINES].size % sizeof(struct container_line) != 0) {
+        return CONTAINER_BAD_SECTION;
+    }
+    if (container_checksum(&header, sections) != header.checksum) {
+        return CONTAINER_BAD_CHECKSUM;
+    }
+    info->is_container = 1;
+    info->isa = header.isa < sizeof(isa_names) / sizeof(isa_names[0]) ? header.isa : CONTAINER_ISA_NONE;
+    info->entry = header.entry;
+    info->max_stack = header.max_stack;
+    info->code = sections[SECTION_CODE];
+    info->code_len = header.sections[SECTION_CODE].size;
+    info->constants = sections[SECTION_CONSTANTS];
+    info->constants_len = header.sections[SECTION_CONSTANTS].size;
+    info->lines = (struct container_line *) sections[SECTION_LINES];
+    info->num_lines = header.sections[SECTION_LINES].size / sizeof(struct container_line);
+    return CONTAINER_OK;
+}
+
+/*
+ * Map a file and parse it. The code stays in the page cache rather than being
+ * copied, and the mapping is private, so a loader that patches the code
+ * doesn't touch the file. Call container_unmap when done.
+ */
+container_status container_map(const char *path, struct container_info *info) {
+    memset(info, 0, sizeof(*info));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return CONTAINER_CANT_OPEN;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return CONTAINER_EMPTY;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return CONTAINER_CANT_OPEN;
+    }
+    container_status status = container_parse(map, st.st_size, info);
+    info->map = map;
+    info->map_len = st.st_size;
+    if (status != CONTAINER_OK) {
+        munmap(map, st.st_size);
+        info->map = NULL;
+    }
+    return status;
+}
+
+void container_unmap(struct container_info *info) {
+    if (info->map != NULL) {
+        munmap(info->map, info->map_len);
+        info->map = NULL;
+    }
+}
+
+/*
+ * Pad the file out with zeros up to the given offset.
+ */
+int pad_to(FILE *f, size_t *pos, size_t offset) {
+    static const uint8_t zeros[CONTAINER_PAGE];
+    while (*pos < offset) {
+        size_t n = offset - *pos < sizeof(zeros) ? offset - *pos : sizeof(zeros);
+        if (fwrite(zeros, 1, n, f) != n) {
+            return 0;
+        }
+        *pos += n;
+    }
+    return 1;
+}
+
+/*
+ * Write a program out as a container. Takes the ISA, entry point, stack bound
+ * and sections from info. Returns 0 if the program is too big for the format
+ * or the write fails.
+ */
+int write_container(FILE *f, struct container_info *info) {
+    struct container_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+    header.version = CONTAINER_VERSION;
+    header.isa = info->isa;
+    header.entry = info->entry;
+    header.max_stack = info->max_stack;
+    header.num_sections = NUM_SECTIONS;
+    uint8_t *sections[NUM_SECTIONS] = {info->code, info->constants, (uint8_t *) info->lines};
+    size_t sizes[NUM_SECTIONS] = {info->code_len, info->constants_len,
+                                  info->num_lines * sizeof(struct container_line)};
+    size_t offset = page_align(sizeof(header));
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        if (offset + sizes[i] > UINT32_MAX) {
+            return 0;
+        }
+        header.sections[i].offset = (uint32_t) offset;
+        header.sections[i].size = (uint32_t) sizes[i];
+        offset = page_align(offset + sizes[i]);
+    }
+    header.checksum = container_checksum(&header, sections);
+
+    size_t pos = 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        return 0;
+    }
+    pos += sizeof(header);
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        if (!pad_to(f, &pos, header.sections[i].offset) ||
+            (sizes[i] > 0 && fwrite(sections[i], 1, sizes[i], f) != sizes[i])) {
+            return 0;
+        }
+        pos += sizes[i];
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Tests for libverse. Every program from the command line that verifies has to
+ * come out of the library the same way it comes out of the inline
+ * interpreter: same status, same result and, if it finished, the same stack.
+ * Then it has to do that again when it's run one instruction at a time, and
+ * when several threads run all of them at once, each on its own contexts.
+ *
+ * We link against libverse.a, which carries its own copies of the verifier and
+ * the container code. That only works if it keeps them to itself, so this
+ * checks that too.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../common/container.h"
+#include "../stack/verify.h"
+#include "../stack/vm.h"
+#include "verse.h"
+
+#define USAGE_STR "Usage: ./test-lib <bytecode files>\n"
+
+#define THREADS 4
+
+/*
+ * What the inline interpreter made of a program.
+ */
+struct expected {
+    const char *path;
+    uint8_t *data;
+    size_t len;
+    verse_status status;
+    uint64_t result;
+    size_t depth;
+    uint64_t stack[STACK_MAX];
+};
+
+struct expected *programs;
+int num_programs;
+
+verse_status from_result(result r) {
+    switch (r) {
+        case SUCCESS:
+            return VERSE_OK;
+        case ERR_DIV_ZERO:
+            return VERSE_ERR_DIV_ZERO;
+        case ERR_MEM_OUT_OF_BOUNDS:
+            return VERSE_ERR_MEM_OUT_OF_BOUNDS;
+        case ERR_TOO_MANY_TASKS:
+            return VERSE_ERR_TOO_MANY_TASKS;
+        case ERR_BAD_HANDLE:
+            return VERSE_ERR_BAD_HANDLE;
+        default:
+            return VERSE_ERR_UNVERIFIED;
+    }
+}
+
+/*
+ * Run a loaded program to the end with the given budget per call, and say
+ * what's wrong if it doesn't match. Returns NULL if it does.
+ */
+const char *check_run(verse_ctx *ctx, struct expected *p, uint64_t budget) {
+    verse_status status;
+    uint64_t total = 0;
+    uint64_t executed;
+    do {
+        status = verse_run(ctx, budget, &executed);
+        if (budget != 0 && executed > budget) {
+            return "ran past its budget";
+        }
+        total += executed;
+    } while (status == VERSE_PAUSED);
+    if (status != p->status) {
+        return "status differs";
+    }
+    if (verse_result(ctx) != p->result) {
+        return "result differs";
+    }
+    if (status == VERSE_OK) {
+        if (verse_stack_depth(ctx) != p->depth) {
+            return "stack depth differs";
+        }
+        for (size_t i = 0; i < p->depth; i++) {
+            if (verse_stack_get(ctx, i) != p->stack[i]) {
+                return "stack differs";
+            }
+        }
+    }
+    if (verse_run(ctx, budget, &executed) != status || executed != 0) {
+        return "ran again after finishing";
+    }
+    if (total == 0) {
+        return "didn't count any instructions";
+    }
+    return NULL;
+}
+
+void *run_all(void *arg) {
+    int *failures = arg;
+    verse_ctx *ctx = verse_create(0);
+    if (ctx == NULL) {
+        (*failures)++;
+        return NULL;
+    }
+    for (int i = 0; i < num_programs; i++) {
+        if (verse_load(ctx, programs[i].data, programs[i].len) != VERSE_OK || check_run(ctx, &programs[i], 0)) {
+            (*failures)++;
+        }
+    }
+    verse_destroy(ctx);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * The engines print when they finish.
+     */
+    fflush(stdout);
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Can't redirect output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    programs = calloc(argc, sizeof(*programs));
+    verse_ctx *ctx = verse_create(0);
+    if (programs == NULL || ctx == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    int failures = 0;
+    int skipped = 0;
+    for (int i = 1; i < argc; i++) {
+        struct container_info info;
+        container_status status = container_map(argv[i], &info);
+        if (status != CONTAINER_OK) {
+            fprintf(stderr, "Can't load %s: %s\n", argv[i], container_messages[status]);
+            exit(EXIT_FAILURE);
+        }
+        struct expected *p = &programs[num_programs];
+        p->path = argv[i];
+        p->len = info.map_len;
+        p->data = malloc(p->len);
+        memcpy(p->data, info.map, p->len);
+
+        struct verify_info verified;
+        int loadable = (!info.is_container || info.isa == CONTAINER_ISA_STACK) && info.entry == 0 &&
+                       verify_bytecode(info.code, info.code_len, &verified) == VERIFY_OK;
+        verse_status loaded = verse_load(ctx, p->data, p->len);
+        if (!loadable) {
+            if (loaded == VERSE_OK) {
+                fprintf(out, "%s: loaded a program that doesn't verify\n", p->path);
+                failures++;
+            }
+            free(p->data);
+            container_unmap(&info);
+            skipped++;
+            continue;
+        }
+        if (loaded != VERSE_OK) {
+            fprintf(out, "%s: %s\n", p->path, verse_status_message(loaded));
+            failures++;
+            free(p->data);
+            container_unmap(&info);
+            continue;
+        }
+
+        reset_vm();
+        vm.result = 0;
+        result r = run_engine(engines, info.code);
+        p->status = from_result(r);
+        p->result = vm.result;
+        p->depth = vm.stack_top - vm.stack;
+        memcpy(p->stack, vm.stack, p->depth * sizeof(uint64_t));
+        container_unmap(&info);
+        num_programs++;
+
+        const char *problem = check_run(ctx, p, 0);
+        if (problem == NULL) {
+            verse_reset(ctx);
+            problem = check_run(ctx, p, 1);
+        }
+        if (problem != NULL) {
+            fprintf(out, "%s: %s\n", p->path, problem);
+            failures++;
+        }
+    }
+    verse_destroy(ctx);
+
+    pthread_t threads[THREADS];
+    int thread_failures[THREADS] = {0};
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, run_all, &thread_failures[t]);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        if (thread_failures[t] > 0) {
+            fprintf(out, "thread %d: %d programs came out differently\n", t, thread_failures[t]);
+            failures++;
+        }
+    }
+
+    for (int i = 0; i < num_programs; i++) {
+        free(programs[i].data);
+    }
+    free(programs);
+    fprintf(out, "%d programs through libverse, %d that don't verify, %d failures\n", num_programs, skipped,
+            failures);
+    if (failures == 0) {
+        fprintf(out, "All tests passed\n");
+    }
+    fflush(out);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
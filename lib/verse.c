@@ -0,0 +1,585 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../common/container.h"
+#include "../stack/isa.h"
+#include "../stack/strength.h"
+#include "../stack/verify.h"
+#include "verse.h"
+
+/*
+ * A context owns everything a run touches. The interpreter works on locals
+ * and writes them back here when it stops, so a paused run picks up exactly
+ * where it left off.
+ */
+struct verse_ctx {
+
+    /*
+     * The code we run, strength-reduced from what was loaded.
+     */
+    uint8_t *code;
+    size_t code_len;
+
+    /*
+     * Magic numbers for the divisors the code's DIV_CONSTs use. stckvm keeps
+     * one table for the whole process, but that's a global.
+     */
+    struct div_magic div_magics[256];
+
+    /*
+     * Offset of the next instruction to run.
+     */
+    size_t pc;
+
+    /*
+     * Operand stack, sized by the verifier, with the floor slot in front of
+     * it like the vm's. sp is the number of values on it.
+     */
+    uint64_t *stack;
+    size_t sp;
+
+    /*
+     * Where each active CALL returns to, as offsets into the code.
+     */
+    uint32_t return_stack[RETURN_STACK_MAX];
+    size_t return_top;
+
+    /*
+     * The base of the current frame, and of the frame each active CALL
+     * returns to, as a number of values from the bottom of the stack.
+     */
+    size_t frame;
+    uint32_t frame_stack[RETURN_STACK_MAX];
+
+    /*
+     * One more than how many values each active SPAWN copied, and 0 for a
+     * CALL. See verse_run.
+     */
+    uint8_t spawned[RETURN_STACK_MAX];
+
+    /*
+     * What the tasks returned, under their handles, if the program has a
+     * SPAWN or a JOIN.
+     */
+    struct serial_tasks *tasks;
+
+    uint64_t result;
+
+    /*
+     * How the last run ended. Anything but VERSE_PAUSED means the program
+     * won't go any further until it's reset.
+     */
+    verse_status status;
+
+    /*
+     * Linear memory. Unlike stckvm we can't take over SIGSEGV in somebody
+     * else's process, so accesses are checked rather than guarded.
+     */
+    uint8_t *memory;
+    size_t memory_size;
+};
+
+static const char *const status_messages[] = {
+        "OK",
+        "paused, budget used up",
+        "out of memory",
+        "not a valid container",
+        "not stack bytecode",
+        "bytecode doesn't verify",
+        "no program loaded",
+        "division by zero",
+        "memory access out of bounds",
+        "too many tasks spawned and not joined",
+        "JOIN on something that isn't a live handle of ours"
+};
+
+const char *verse_status_message(verse_status status) {
+    if ((size_t) status >= sizeof(status_messages) / sizeof(status_messages[0])) {
+        return "unknown status";
+    }
+    return status_messages[status];
+}
+
+verse_ctx *verse_create(size_t memory_size) {
+    if (memory_size == 0) {
+        memory_size = VERSE_DEFAULT_MEMORY;
+    }
+
+    /*
+     * Every access reads 8 bytes, so anything smaller would be useless, and
+     * addresses are 32 bits, so anything bigger can't be reached.
+     */
+    if (memory_size < sizeof(uint64_t) || memory_size > ((size_t) 1 << 32)) {
+        return NULL;
+    }
+    verse_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ctx->memory == MAP_FAILED) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->memory_size = memory_size;
+    ctx->status = VERSE_ERR_NOT_LOADED;
+    return ctx;
+}
+
+void verse_reset(verse_ctx *ctx) {
+    ctx->pc = 0;
+    ctx->sp = 0;
+    ctx->return_top = 0;
+    ctx->frame = 0;
+    ctx->result = 0;
+    ctx->status = ctx->code == NULL ? VERSE_ERR_NOT_LOADED : VERSE_PAUSED;
+    if (ctx->tasks != NULL) {
+        serial_reset(ctx->tasks);
+    }
+
+    /*
+     * Dropping the pages is cheaper than clearing them, as in reset_vm.
+     */
+    madvise(ctx->memory, ctx->memory_size, MADV_DONTNEED);
+}
+
+static void unload(verse_ctx *ctx) {
+    free(ctx->code);
+    free(ctx->stack);
+    free(ctx->tasks);
+    ctx->code = NULL;
+    ctx->code_len = 0;
+    ctx->stack = NULL;
+    ctx->tasks = NULL;
+}
+
+verse_status verse_load(verse_ctx *ctx, const void *data, size_t len) {
+    unload(ctx);
+    verse_reset(ctx);
+    uint8_t *image = malloc(len > 0 ? len : 1);
+    if (image == NULL) {
+        return VERSE_ERR_NO_MEMORY;
+    }
+    memcpy(image, data, len);
+
+    struct container_info info;
+    if (container_parse(image, len, &info) != CONTAINER_OK || info.entry != 0) {
+        free(image);
+        return VERSE_ERR_BAD_CONTAINER;
+    }
+    if (info.is_container && info.isa != CONTAINER_ISA_STACK) {
+        free(image);
+        return VERSE_ERR_WRONG_ISA;
+    }
+
+    /*
+     * Don't take a container's word for its stack bound. It was only checked
+     * against a checksum, and the interpreter trusts the bound completely.
+     */
+    struct verify_info verified;
+    verify_status v = verify_bytecode(info.code, info.code_len, &verified);
+    if (v != VERIFY_OK) {
+        free(image);
+        return v == VERIFY_OUT_OF_MEMORY ? VERSE_ERR_NO_MEMORY : VERSE_ERR_UNVERIFIED;
+    }
+
+    /*
+     * Fusing a PUSH_IMM into the instruction after it never makes the stack
+     * any deeper, so the bound still holds afterwards.
+     */
+    struct strength_report report;
+    size_t code_len;
+    uint8_t *code = reduce_strength(info.code, info.code_len, &code_len, &report);
+    free(image);
+    uint64_t *stack = calloc((size_t) verified.max_depth + 1, sizeof(uint64_t));
+    if (code == NULL || stack == NULL) {
+        free(code);
+        free(stack);
+        return VERSE_ERR_NO_MEMORY;
+    }
+    int uses_tasks = 0;
+    for (size_t pc = 0; pc < code_len; pc += 1 + operand_bytes(code[pc])) {
+        if (code[pc] == DIV_CONST) {
+            ctx->div_magics[code[pc + 1]] = div_magic(code[pc + 1]);
+        }
+        uses_tasks |= code[pc] == SPAWN || code[pc] == JOIN;
+    }
+    if (uses_tasks) {
+        ctx->tasks = malloc(sizeof(struct serial_tasks));
+        if (ctx->tasks == NULL) {
+            free(code);
+            free(stack);
+            return VERSE_ERR_NO_MEMORY;
+        }
+        serial_reset(ctx->tasks);
+    }
+    ctx->code = code;
+    ctx->code_len = code_len;
+    ctx->stack = stack;
+    ctx->status = VERSE_PAUSED;
+    return VERSE_OK;
+}
+
+/*
+ * Memory is addressed like the vm's, by the low 32 bits of the address.
+ */
+#define mem_in_bounds(addr) ((uint32_t) (addr) <= memory_size - sizeof(uint64_t))
+#define mem_cell(addr)      (*(unaligned_u64 *) (memory + (uint32_t) (addr)))
+
+typedef uint64_t unaligned_u64 __attribute__((aligned(1), may_alias));
+
+/*
+ * Direct threading, with a budget check in front of every instruction. The
+ * verifier has already ruled out everything but what's checked here.
+ */
+#define dispatch              \
+    if (fuel == 0) {          \
+        goto out_of_fuel;     \
+    }                         \
+    fuel--;                   \
+    goto *table[*ip]
+
+#define binary(expr)          \
+    {                         \
+        uint64_t b = *--sp;   \
+        uint64_t a = sp[-1];  \
+        sp[-1] = (expr);      \
+        ip++;                 \
+        dispatch;             \
+    }
+
+verse_status verse_run(verse_ctx *ctx, uint64_t budget, uint64_t *executed) {
+    if (executed != NULL) {
+        *executed = 0;
+    }
+    if (ctx->status != VERSE_PAUSED) {
+        return ctx->status;
+    }
+    static void *const table[NUM_OPCODES] = {
+            [PUSH_IMM] = &&push_imm,
+            [ADD] = &&add,
+            [SUB] = &&sub,
+            [MUL] = &&mul,
+            [DIV] = &&div,
+            [AND] = &&and,
+            [OR] = &&or,
+            [XOR] = &&xor,
+            [NOT] = &&not,
+            [LSHIFT] = &&lshift,
+            [RSHIFT] = &&rshift,
+            [JIF] = &&jif,
+            [POP_RES] = &&pop_res,
+            [DONE] = &&done,
+            [JIF_LONG] = &&jif_long,
+            [LOAD] = &&load,
+            [STORE] = &&store,
+            [CALL] = &&call,
+            [RET] = &&ret,
+            [LOOP] = &&loop,
+            [FADD] = &&fadd,
+            [FSUB] = &&fsub,
+            [FMUL] = &&fmul,
+            [FDIV] = &&fdiv,
+            [ITOF] = &&itof,
+            [FTOI] = &&ftoi,
+            [JMP] = &&jmp,
+            [JIZ] = &&jiz,
+            [DIV_CONST] = &&div_const,
+            [LSHIFT_CONST] = &&lshift_const,
+            [RSHIFT_CONST] = &&rshift_const,
+            [DUP] = &&dup,
+            [DROP] = &&drop,
+            [SWAP] = &&swap,
+            [OVER] = &&over,
+            [ROT] = &&rot,
+            [LOAD_LOCAL] = &&load_local,
+            [STORE_LOCAL] = &&store_local,
+            [SPAWN] = &&spawn,
+            [JOIN] = &&join
+    };
+    uint8_t *code = ctx->code;
+    uint8_t *ip = code + ctx->pc;
+    uint64_t *bottom = ctx->stack + 1;
+    uint64_t *sp = bottom + ctx->sp;
+    uint64_t *frame = bottom + ctx->frame;
+    uint32_t *return_stack = ctx->return_stack;
+    uint32_t *frame_stack = ctx->frame_stack;
+    uint8_t *spawned = ctx->spawned;
+    size_t return_top = ctx->return_top;
+    uint8_t *memory = ctx->memory;
+    size_t memory_size = ctx->memory_size;
+    struct div_magic *div_magics = ctx->div_magics;
+    uint64_t fuel = budget == 0 ? UINT64_MAX : budget;
+    verse_status status;
+
+    dispatch;
+
+    push_imm:
+    *sp++ = ip[1];
+    ip += 2;
+    dispatch;
+
+    add:
+    binary(a + b)
+
+    sub:
+    binary(a - b)
+
+    mul:
+    binary(a * b)
+
+    div:
+    if (sp[-1] == 0) {
+        status = VERSE_ERR_DIV_ZERO;
+        goto stop;
+    }
+    binary(a / b)
+
+    and:
+    binary(a & b)
+
+    or:
+    binary(a | b)
+
+    xor:
+    binary(a ^ b)
+
+    not:
+    sp[-1] = ~sp[-1];
+    ip++;
+    dispatch;
+
+    lshift:
+    binary(a << b)
+
+    rshift:
+    binary(a >> b)
+
+    jif:
+    ip = sp[-1] != 0 ? code + ip[1] - 1 : ip + 2;
+    dispatch;
+
+    pop_res:
+    ctx->result = *--sp;
+    ip++;
+    dispatch;
+
+    jif_long:
+    ip = sp[-1] != 0 ? code + read_u32(ip + 1) : ip + 5;
+    dispatch;
+
+    load:
+    if (!mem_in_bounds(sp[-1])) {
+        status = VERSE_ERR_MEM_OUT_OF_BOUNDS;
+        goto stop;
+    }
+    sp[-1] = mem_cell(sp[-1]);
+    ip++;
+    dispatch;
+
+    store:
+    if (!mem_in_bounds(sp[-2])) {
+        status = VERSE_ERR_MEM_OUT_OF_BOUNDS;
+        goto stop;
+    }
+    mem_cell(sp[-2]) = sp[-1];
+    sp -= 2;
+    ip++;
+    dispatch;
+
+    call:
+    frame_stack[return_top] = (uint32_t) (frame - bottom);
+    frame = sp;
+    spawned[return_top] = 0;
+    return_stack[return_top++] = (uint32_t) (ip + 5 - code);
+    ip = code + read_u32(ip + 1);
+    dispatch;
+
+    /*
+     * When a spawned procedure returns, its copies and whatever it left on
+     * top of them give way to a handle for its result.
+     */
+    ret:
+    ip = code + return_stack[--return_top];
+    if (spawned[return_top] != 0) {
+        uint64_t value = sp[-1];
+        sp = frame - (spawned[return_top] - 1);
+        *sp++ = serial_return(ctx->tasks, value);
+    }
+    frame = bottom + frame_stack[return_top];
+    dispatch;
+
+    loop:
+    sp[-1] -= ip[2];
+    ip = sp[-1] != 0 ? code + ip[1] - 1 : ip + 3;
+    dispatch;
+
+    fadd:
+    binary(value_fadd(a, b))
+
+    fsub:
+    binary(value_fsub(a, b))
+
+    fmul:
+    binary(value_fmul(a, b))
+
+    fdiv:
+    binary(value_fdiv(a, b))
+
+    itof:
+    sp[-1] = value_itof(sp[-1]);
+    ip++;
+    dispatch;
+
+    ftoi:
+    sp[-1] = value_ftoi(sp[-1]);
+    ip++;
+    dispatch;
+
+    jmp:
+    ip = code + read_u32(ip + 1);
+    dispatch;
+
+    jiz:
+    ip = sp[-1] == 0 ? code + read_u32(ip + 1) : ip + 5;
+    dispatch;
+
+    div_const:
+    sp[-1] = div_by_magic(sp[-1], div_magics[ip[1]]);
+    ip += 2;
+    dispatch;
+
+    lshift_const:
+    sp[-1] <<= ip[1];
+    ip += 2;
+    dispatch;
+
+    rshift_const:
+    sp[-1] >>= ip[1];
+    ip += 2;
+    dispatch;
+
+    dup:
+    *sp = sp[-1];
+    sp++;
+    ip++;
+    dispatch;
+
+    drop:
+    sp--;
+    ip++;
+    dispatch;
+
+    swap: {
+        uint64_t b = sp[-1];
+        sp[-1] = sp[-2];
+        sp[-2] = b;
+        ip++;
+        dispatch;
+    }
+
+    over:
+    *sp = sp[-2];
+    sp++;
+    ip++;
+    dispatch;
+
+    rot: {
+        uint64_t a = sp[-3];
+        sp[-3] = sp[-2];
+        sp[-2] = sp[-1];
+        sp[-1] = a;
+        ip++;
+        dispatch;
+    }
+
+    load_local:
+    *sp++ = frame[(int8_t) ip[1]];
+    ip += 2;
+    dispatch;
+
+    store_local:
+    frame[(int8_t) ip[1]] = *--sp;
+    ip += 2;
+    dispatch;
+
+    /*
+     * The verifier counts a SPAWN as a CALL on top of its copies, so both
+     * stacks have room for this.
+     */
+    spawn:
+    if (serial_spawn(ctx->tasks) != SUCCESS) {
+        status = VERSE_ERR_TOO_MANY_TASKS;
+        goto stop;
+    }
+    memcpy(sp, sp - ip[5], ip[5] * sizeof(uint64_t));
+    sp += ip[5];
+    frame_stack[return_top] = (uint32_t) (frame - bottom);
+    frame = sp;
+    spawned[return_top] = ip[5] + 1;
+    return_stack[return_top++] = (uint32_t) (ip + 6 - code);
+    ip = code + read_u32(ip + 1);
+    dispatch;
+
+    join:
+    if (serial_join(ctx->tasks, &sp[-1]) != SUCCESS) {
+        status = VERSE_ERR_BAD_HANDLE;
+        goto stop;
+    }
+    ip++;
+    dispatch;
+
+    done:
+    status = VERSE_OK;
+    goto stop;
+
+    out_of_fuel:
+    status = VERSE_PAUSED;
+
+    /*
+     * A failing instruction doesn't count as run, and leaves everything as it
+     * was before it.
+     */
+    stop:
+    if (status != VERSE_OK && status != VERSE_PAUSED) {
+        fuel++;
+    }
+    ctx->pc = ip - code;
+    ctx->sp = sp - bottom;
+    ctx->frame = frame - bottom;
+    ctx->return_top = return_top;
+    ctx->status = status;
+    if (executed != NULL) {
+        *executed = (budget == 0 ? UINT64_MAX : budget) - fuel;
+    }
+    return status;
+}
+
+uint64_t verse_result(const verse_ctx *ctx) {
+    return ctx->result;
+}
+
+size_t verse_stack_depth(const verse_ctx *ctx) {
+    return ctx->sp;
+}
+
+uint64_t verse_stack_get(const verse_ctx *ctx, size_t index) {
+    return index < ctx->sp ? ctx->stack[1 + index] : 0;
+}
+
+uint8_t *verse_memory(verse_ctx *ctx, size_t *size) {
+    if (size != NULL) {
+        *size = ctx->memory_size;
+    }
+    return ctx->memory;
+}
+
+void verse_destroy(verse_ctx *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    unload(ctx);
+    munmap(ctx->memory, ctx->memory_size);
+    free(ctx);
+}
@@ -0,0 +1,117 @@
+#ifndef VERSE_LIB_VERSE_H_
+#define VERSE_LIB_VERSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libverse runs stack bytecode inside another program. Everything a run needs
+ * lives in a context: its own copy of the code, operand and return stacks and
+ * linear memory, so any number of contexts can run at once on different
+ * threads without locking. Nothing is global, nothing is printed and nothing
+ * exits; every failure comes back as a status.
+ *
+ * A context runs one program at a time. Load it, then call verse_run as often
+ * as you like with a budget of instructions. A run that uses up its budget
+ * pauses and carries on from there on the next call, so a host can time-slice
+ * untrusted code. Every program is verified when it's loaded, which is what
+ * lets the interpreter skip checking the stacks as it goes.
+ *
+ * A context never starts threads of its own, so SPAWN runs its task right
+ * there, as a call, and JOIN takes the result it left. A JOIN of something
+ * that isn't a handle the code running got and hasn't joined yet fails, and
+ * so does the run as soon as a task does, joined or not, which is how the
+ * same program ends up on stckvm's pool.
+ *
+ * Only the stack ISA is supported for now.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VERSE_API __attribute__((visibility("default")))
+
+/*
+ * Linear memory a context gets if you ask for 0 bytes, the same as stckvm's.
+ */
+#define VERSE_DEFAULT_MEMORY (1 << 20)
+
+typedef struct verse_ctx verse_ctx;
+
+typedef enum {
+    VERSE_OK,
+
+    /*
+     * The run used up its budget and can be resumed.
+     */
+    VERSE_PAUSED,
+    VERSE_ERR_NO_MEMORY,
+    VERSE_ERR_BAD_CONTAINER,
+    VERSE_ERR_WRONG_ISA,
+    VERSE_ERR_UNVERIFIED,
+    VERSE_ERR_NOT_LOADED,
+    VERSE_ERR_DIV_ZERO,
+    VERSE_ERR_MEM_OUT_OF_BOUNDS,
+    VERSE_ERR_TOO_MANY_TASKS,
+    VERSE_ERR_BAD_HANDLE
+} verse_status;
+
+/*
+ * What a status means, in a few words.
+ */
+VERSE_API const char *verse_status_message(verse_status status);
+
+/*
+ * Make a context with memory_size bytes of linear memory, or
+ * VERSE_DEFAULT_MEMORY if that's 0. Returns NULL if we're out of memory.
+ */
+VERSE_API verse_ctx *verse_create(size_t memory_size);
+
+/*
+ * Load a program from memory, either a container as written by stacka or bare
+ * stack bytecode. The context keeps its own copy, so data can go away as soon
+ * as this returns. Loading resets the context, and a program that doesn't
+ * verify leaves it with nothing loaded.
+ */
+VERSE_API verse_status verse_load(verse_ctx *ctx, const void *data, size_t len);
+
+/*
+ * Run until the program gets to DONE, fails, or has run budget instructions,
+ * whichever comes first. A budget of 0 means no limit. If executed isn't NULL
+ * it gets how many instructions this call ran. Once the program has finished,
+ * running it again just returns how it finished until it's reset.
+ */
+VERSE_API verse_status verse_run(verse_ctx *ctx, uint64_t budget, uint64_t *executed);
+
+/*
+ * What the program last popped with POP_RES.
+ */
+VERSE_API uint64_t verse_result(const verse_ctx *ctx);
+
+/*
+ * How many values are on the operand stack, and the value at index, counting
+ * from the bottom. Reading past the top gives 0.
+ */
+VERSE_API size_t verse_stack_depth(const verse_ctx *ctx);
+VERSE_API uint64_t verse_stack_get(const verse_ctx *ctx, size_t index);
+
+/*
+ * The context's linear memory, for passing data in and out. Its size goes in
+ * size if that isn't NULL.
+ */
+VERSE_API uint8_t *verse_memory(verse_ctx *ctx, size_t *size);
+
+/*
+ * Go back to the start of the loaded program with empty stacks and zeroed
+ * memory.
+ */
+VERSE_API void verse_reset(verse_ctx *ctx);
+
+VERSE_API void verse_destroy(verse_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,22 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define BYTE_LEN 8
-#define USAGE_STR "Usage: ./reg-assemble <source> <dest>\n"
+#include "../common/container.h"
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./reg-assemble [--wide] [--raw] <source> <dest>\n"
+
+/*
+ * Whether we're emitting the wide 32-bit format rather than the 16-bit one.
+ */
+int wide;
+
+/*
+ * The line of the source we read last.
+ */
+uint32_t line_number;
 
 /*
  * Macro-ify the instruction strings to avoid having any "magic literals" in my
@@ -18,48 +31,117 @@
 #define DIV_STR         "DIV\n"
 #define MOV_RES_STR     "MOV_RES\n"
 #define DONE_STR        "DONE\n"
+#define VLOAD_IMM_STR   "VLOAD_IMM\n"
+#define VADD_STR        "VADD\n"
+#define VSUB_STR        "VSUB\n"
+#define VMUL_STR        "VMUL\n"
+#define VAND_STR        "VAND\n"
+#define VXOR_STR        "VXOR\n"
+#define VREDUCE_STR     "VREDUCE\n"
+#define ADDI_STR        "ADDI\n"
+#define SUBI_STR        "SUBI\n"
+#define MULI_STR        "MULI\n"
+#define ANDI_STR        "ANDI\n"
+#define SHLI_STR        "SHLI\n"
+#define SHRI_STR        "SHRI\n"
 
 /*
- * Define binary strings corresponding to each opcode we recognize.
- *
- * TODO
- * This actually might be a bit more complicated because of encoding operands. I
- * guess the opcode is the first 4 bits?
+ * Read the next operand, which has to be on its own line and fit in the given
+ * number of bits.
+ */
+uint16_t read_operand(FILE *src_f, unsigned long limit) {
+    char line[100];
+    if (fgets(line, sizeof(line), src_f) == NULL) {
+        fprintf(stderr, "Could not read operand\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    line_number++;
+    printf("%s", line);
+    char *end;
+    unsigned long val = strtoul(line, &end, 10);
+    if (end == line || val >= limit) {
+        fprintf(stderr, "Operand out of range\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    return (uint16_t) val;
+}
+
+uint16_t read_reg(FILE *src_f) {
+    return read_operand(src_f, wide ? NUM_REGS : NUM_NARROW_REGS);
+}
+
+uint16_t read_imm(FILE *src_f) {
+    return read_operand(src_f, wide ? 1 << 16 : 1 << 8);
+}
+
+/*
+ * Encode an instruction in whichever format we're emitting.
  */
-#define LOAD_IMM_BIN    "0000"
-#define ADD_BIN         "0001"
-#define SUB_BIN         "0010"
-#define MUL_BIN         "0011"
-#define DIV_BIN         "0100"
-#define MOVE_RES_BIN    "0101"
-#define DONE_BIN        "0110"
+uint32_t encode_op_regs(uint8_t op, uint16_t r0, uint16_t r1, uint16_t r2) {
+    return wide ? WIDE_ENCODE_OP_REGS(op, r0, r1, r2) : ENCODE_OP_REGS(op, r0, r1, r2);
+}
+
+uint32_t encode_op_reg_imm(uint8_t op, uint16_t r0, uint16_t imm) {
+    return wide ? WIDE_ENCODE_OP_REG_IMM(op, r0, imm) : ENCODE_OP_REG_IMM(op, r0, imm);
+}
+
+uint16_t read_vreg(FILE *src_f) {
+    return read_operand(src_f, NUM_VREGS);
+}
+
+/*
+ * Encode an instruction of the form <op> <a> <b> <c>, which is every
+ * three-register operation, scalar or vector.
+ */
+uint32_t assemble_regs(uint8_t op, uint16_t (*read)(FILE *), FILE *src_f) {
+    uint16_t r0 = read(src_f);
+    uint16_t r1 = read(src_f);
+    uint16_t r2 = read(src_f);
+    return encode_op_regs(op, r0, r1, r2);
+}
 
 /*
- * Define a helper function for converting immediate values into binary strings.
+ * Encode <op> <source> <immediate> <destination>, the immediate forms of the
+ * scalar arithmetic. Only ADDI and SUBI have an opcode in the 16-bit format,
+ * and there the immediate is 4 bits. Shifting by 64 or more doesn't mean
+ * anything, so we don't accept it.
  */
-char *imm_bin_str(uint8_t imm) {
-    char *bin_str = (char *) malloc(BYTE_LEN + 1);
-    if (bin_str == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
+uint32_t assemble_imm(uint8_t op, FILE *src_f) {
+    if (!wide && op >= MAX_OPCODES) {
+        fprintf(stderr, "Instruction only exists in the wide format\n");
         fflush(stderr);
         exit(EXIT_FAILURE);
     }
-    for (int i = BYTE_LEN - 1; i >= 0; i--) {
-        bin_str[i] = (imm & 1) ? '1' : '0';
-        imm >>= 1;
-    }
-    bin_str[BYTE_LEN] = '\0';
-    return bin_str;
+    uint16_t r0 = read_reg(src_f);
+    unsigned long limit = op == SHLI || op == SHRI ? 64 : wide ? 1 << 8 : 1 << 4;
+    uint16_t imm = read_operand(src_f, limit);
+    return encode_op_regs(op, r0, imm, read_reg(src_f));
 }
 
 /*
- * Convert a human-readable source file into bytecode.
+ * Convert a human-readable source file into bytecode. The output is a
+ * container (see common/container.h) with a line map, or bare instructions with
+ * --raw.
  */
 int main(int argc, char *argv[]) {
 
     /*
      * Check for the correct number of arguments.
      */
+    int raw = 0;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--wide") == 0) {
+            wide = 1;
+        } else if (strcmp(argv[1], "--raw") == 0) {
+            raw = 1;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
     if (argc != 3) {
         printf(USAGE_STR);
         exit(EXIT_FAILURE);
@@ -92,13 +174,32 @@ int main(int argc, char *argv[]) {
     /*
      * Read lines until we reach the end of the file.
      */
+    size_t insn_size = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    uint8_t *code = NULL;
+    struct container_line *lines = NULL;
+    size_t len = 0;
+    size_t cap = 0;
     char line[100];
     while (fgets(line, sizeof(line), src_f) != NULL) {
+        line_number++;
+        if (len == cap) {
+            cap = cap ? cap * 2 : 256;
+            code = realloc(code, cap * insn_size);
+            lines = realloc(lines, cap * sizeof(struct container_line));
+            if (code == NULL || lines == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                fflush(stderr);
+                exit(EXIT_FAILURE);
+            }
+        }
+        lines[len].offset = (uint32_t) len;
+        lines[len].line = line_number;
 
         /*
-         * Instructions in this language are 2 bytes long.
+         * Instructions in this language are 2 bytes long, or 4 in the wide
+         * format.
          */
-        uint16_t instruction;
+        uint32_t instruction;
 
         /*
          * "Parse" the source file. We'll require that each token is on its own
@@ -106,29 +207,102 @@ int main(int argc, char *argv[]) {
          */
         if (strcmp(line, LOAD_IMM_STR) == 0) {
             printf(LOAD_IMM_STR);
+            uint16_t r0 = read_reg(src_f);
+            instruction = encode_op_reg_imm(LOAD_IMM, r0, read_imm(src_f));
         } else if (strcmp(line, ADD_STR) == 0) {
             printf(ADD_STR);
+            instruction = assemble_regs(ADD, read_reg, src_f);
         } else if (strcmp(line, SUB_STR) == 0) {
             printf(SUB_STR);
+            instruction = assemble_regs(SUB, read_reg, src_f);
         } else if (strcmp(line, MUL_STR) == 0) {
             printf(MUL_STR);
+            instruction = assemble_regs(MUL, read_reg, src_f);
         } else if (strcmp(line, DIV_STR) == 0) {
             printf(DIV_STR);
+            instruction = assemble_regs(DIV, read_reg, src_f);
         } else if (strcmp(line, MOV_RES_STR) == 0) {
             printf(MOV_RES_STR);
+            instruction = encode_op_regs(MOV_RES, read_reg(src_f), 0, 0);
         } else if (strcmp(line, DONE_STR) == 0) {
             printf(DONE_STR);
+            instruction = encode_op_regs(DONE, 0, 0, 0);
+        } else if (strcmp(line, VLOAD_IMM_STR) == 0) {
+            printf(VLOAD_IMM_STR);
+            uint16_t v0 = read_vreg(src_f);
+            instruction = encode_op_reg_imm(VLOAD_IMM, v0, read_imm(src_f));
+        } else if (strcmp(line, VADD_STR) == 0) {
+            printf(VADD_STR);
+            instruction = assemble_regs(VADD, read_vreg, src_f);
+        } else if (strcmp(line, VSUB_STR) == 0) {
+            printf(VSUB_STR);
+            instruction = assemble_regs(VSUB, read_vreg, src_f);
+        } else if (strcmp(line, VMUL_STR) == 0) {
+            printf(VMUL_STR);
+            instruction = assemble_regs(VMUL, read_vreg, src_f);
+        } else if (strcmp(line, VAND_STR) == 0) {
+            printf(VAND_STR);
+            instruction = assemble_regs(VAND, read_vreg, src_f);
+        } else if (strcmp(line, VXOR_STR) == 0) {
+            printf(VXOR_STR);
+            instruction = assemble_regs(VXOR, read_vreg, src_f);
+        } else if (strcmp(line, VREDUCE_STR) == 0) {
+
+            /*
+             * VREDUCE <vector source> <scalar destination>
+             */
+            printf(VREDUCE_STR);
+            uint16_t v0 = read_vreg(src_f);
+            instruction = encode_op_regs(VREDUCE, v0, 0, read_reg(src_f));
+        } else if (strcmp(line, ADDI_STR) == 0) {
+            printf(ADDI_STR);
+            instruction = assemble_imm(ADDI, src_f);
+        } else if (strcmp(line, SUBI_STR) == 0) {
+            printf(SUBI_STR);
+            instruction = assemble_imm(SUBI, src_f);
+        } else if (strcmp(line, MULI_STR) == 0) {
+            printf(MULI_STR);
+            instruction = assemble_imm(MULI, src_f);
+        } else if (strcmp(line, ANDI_STR) == 0) {
+            printf(ANDI_STR);
+            instruction = assemble_imm(ANDI, src_f);
+        } else if (strcmp(line, SHLI_STR) == 0) {
+            printf(SHLI_STR);
+            instruction = assemble_imm(SHLI, src_f);
+        } else if (strcmp(line, SHRI_STR) == 0) {
+            printf(SHRI_STR);
+            instruction = assemble_imm(SHRI, src_f);
         } else {
             fprintf(stderr, "Cannot parse line\n");
             fflush(stderr);
             exit(EXIT_FAILURE);
         }
 
-        /*
-         * Write the instruction into the destination file.
-         */
-        fwrite(&instruction, sizeof(instruction), 1, dest_f);
+        if (wide) {
+            ((uint32_t *) code)[len++] = instruction;
+        } else {
+            ((uint16_t *) code)[len++] = (uint16_t) instruction;
+        }
+    }
+
+    /*
+     * Write the program out. Register code has no stack to bound.
+     */
+    struct container_info out;
+    memset(&out, 0, sizeof(out));
+    out.isa = wide ? CONTAINER_ISA_REG_WIDE : CONTAINER_ISA_REG;
+    out.max_stack = 0;
+    out.code = code;
+    out.code_len = len * insn_size;
+    out.lines = lines;
+    out.num_lines = len;
+    int written = raw ? fwrite(code, insn_size, len, dest_f) == len : write_container(dest_f, &out);
+    if (!written) {
+        fprintf(stderr, "Can't write %s\n", dest);
+        exit(EXIT_FAILURE);
     }
+    free(code);
+    free(lines);
 
     /*
      * Close the source and destination files.
@@ -0,0 +1,186 @@
+/*
+ * Compare the 16-bit and wide 32-bit instruction formats. The first kernel is
+ * the same instruction stream in both encodings, so the difference is what the
+ * bigger instructions cost to fetch and decode. The second one needs more live
+ * values than the 16-bit format has registers for. The wide version keeps them
+ * all in registers, while the 16-bit one has to reload each of them right
+ * before it's used. There's no memory to spill to, so a LOAD_IMM stands in for
+ * the reload.
+ */
+
+#include <time.h>
+
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./regfmtbench [dispatch type]\n"
+
+/*
+ * Instructions in the decode kernel, and terms per block and blocks in the
+ * spill kernel.
+ */
+#define DECODE_INSNS 16384
+#define TERMS 64
+#define BLOCKS 128
+#define REPS 200
+
+#define PROGRAM_MAX (DECODE_INSNS + 3 * TERMS * BLOCKS + TERMS + 16)
+
+/*
+ * Where the wide spill kernel keeps its constants.
+ */
+#define CONST_BASE 16
+
+/*
+ * A program in both encodings, as far as the kernel can be expressed in both.
+ */
+struct program {
+    uint16_t narrow[PROGRAM_MAX];
+    uint32_t wide[PROGRAM_MAX];
+    size_t narrow_len;
+    size_t wide_len;
+};
+
+/*
+ * Append an instruction to one or both encodings.
+ */
+void emit_narrow(struct program *p, uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2) {
+    p->narrow[p->narrow_len++] = ENCODE_OP_REGS(op, r0, r1, r2);
+}
+
+void emit_wide(struct program *p, uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2) {
+    p->wide[p->wide_len++] = WIDE_ENCODE_OP_REGS(op, r0, r1, r2);
+}
+
+void emit_both(struct program *p, uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2) {
+    emit_narrow(p, op, r0, r1, r2);
+    emit_wide(p, op, r0, r1, r2);
+}
+
+void emit_load_imm(struct program *p, int narrow, uint8_t reg, uint8_t imm) {
+    if (narrow) {
+        p->narrow[p->narrow_len++] = ENCODE_OP_REG_IMM(LOAD_IMM, reg, imm);
+    } else {
+        p->wide[p->wide_len++] = WIDE_ENCODE_OP_REG_IMM(LOAD_IMM, reg, imm);
+    }
+}
+
+/*
+ * Shuffle 8 registers through ADD, MUL and SUB.
+ */
+void build_decode(struct program *p) {
+    p->narrow_len = p->wide_len = 0;
+    for (int r = 0; r < 8; r++) {
+        emit_load_imm(p, 1, r, r + 1);
+        emit_load_imm(p, 0, r, r + 1);
+    }
+    uint8_t ops[] = {ADD, MUL, SUB};
+    for (int i = 0; i < DECODE_INSNS; i++) {
+        emit_both(p, ops[i % 3], i % 8, (i + 3) % 8, (i + 5) % 8);
+    }
+    emit_both(p, MOV_RES, 0, 0, 0);
+    emit_both(p, DONE, 0, 0, 0);
+}
+
+/*
+ * Add up c[j] * x for TERMS different constants c[j], BLOCKS times over. R0 is
+ * the sum, R1 is x and R2/R3 are scratch.
+ */
+void build_spill(struct program *p) {
+    p->narrow_len = p->wide_len = 0;
+    emit_load_imm(p, 1, 0, 0);
+    emit_load_imm(p, 1, 1, 5);
+    emit_load_imm(p, 0, 0, 0);
+    emit_load_imm(p, 0, 1, 5);
+    for (int j = 0; j < TERMS; j++) {
+        emit_load_imm(p, 0, CONST_BASE + j, 3 * j + 1);
+    }
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int j = 0; j < TERMS; j++) {
+            emit_load_imm(p, 1, 2, 3 * j + 1);
+            emit_narrow(p, MUL, 2, 1, 3);
+            emit_narrow(p, ADD, 0, 3, 0);
+            emit_wide(p, MUL, CONST_BASE + j, 1, 3);
+            emit_wide(p, ADD, 0, 3, 0);
+        }
+    }
+    emit_both(p, MOV_RES, 0, 0, 0);
+    emit_both(p, DONE, 0, 0, 0);
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Run both encodings REPS times and keep the fastest run of each. Both have to
+ * come up with the same answer.
+ */
+void measure(struct engine *e, struct program *p, double *narrow_ns, double *wide_ns) {
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec t0, t1, t2;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        result r1 = e->interpret(p->narrow);
+        uint64_t narrow_result = vm.result;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        result r2 = e->interpret_wide(p->wide);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        if (r1 != SUCCESS || r2 != SUCCESS || vm.result != narrow_result) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (rep == 0 || elapsed_ns(&t0, &t1) < *narrow_ns) {
+            *narrow_ns = elapsed_ns(&t0, &t1);
+        }
+        if (rep == 0 || elapsed_ns(&t1, &t2) < *wide_ns) {
+            *wide_ns = elapsed_ns(&t1, &t2);
+        }
+    }
+}
+
+void report(const char *kernel, struct engine *e, struct program *p, double narrow_ns, double wide_ns) {
+    printf("%-8s %-10s %8s %10zu %10zu %12.3f %12.3f\n", kernel, e->name, "16-bit", p->narrow_len,
+           p->narrow_len * sizeof(uint16_t), narrow_ns / p->narrow_len, narrow_ns / 1000);
+    printf("%-8s %-10s %8s %10zu %10zu %12.3f %12.3f\n", kernel, e->name, "32-bit", p->wide_len,
+           p->wide_len * sizeof(uint32_t), wide_ns / p->wide_len, wide_ns / 1000);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    static struct program decode;
+    static struct program spill;
+    build_decode(&decode);
+    build_spill(&spill);
+
+    vm_quiet = 1;
+    double times[NUM_ENGINES][4];
+    for (struct engine *e = first; e < last; e++) {
+        double *t = times[e - engines];
+        reset_vm();
+        measure(e, &decode, &t[0], &t[1]);
+        measure(e, &spill, &t[2], &t[3]);
+    }
+
+    printf("%-8s %-10s %8s %10s %10s %12s %12s\n", "kernel", "engine", "format", "insns", "bytes", "ns/insn",
+           "us total");
+    for (struct engine *e = first; e < last; e++) {
+        double *t = times[e - engines];
+        report("decode", e, &decode, t[0], t[1]);
+        report("spill", e, &spill, t[2], t[3]);
+    }
+}
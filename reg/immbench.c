@@ -0,0 +1,183 @@
+/*
+ * Measure what the immediate forms buy on loop counters. The kernel steps
+ * COUNTERS counters by different small amounts, some up and some down, STEPS
+ * times over, the way an unrolled loop keeps its induction variables. It comes
+ * in three versions:
+ *
+ *   reload  LOAD_IMM the step into a scratch register, then ADD or SUB it
+ *   held    load every step into a register of its own once, then ADD or SUB
+ *   imm     ADDI or SUBI the step
+ *
+ * The register VM has no jumps, so every instruction is also one dispatch.
+ * Reloading takes two of them per step. Holding the steps takes one, but costs
+ * a register per distinct step, which is all 16 of the 16-bit format here. The
+ * immediate forms take one dispatch and no extra registers. All three have to
+ * come up with the same answer, in both formats.
+ */
+
+#include <time.h>
+
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./regimmbench [dispatch type]\n"
+
+#define COUNTERS 8
+#define STEPS 4096
+#define REPS 200
+
+#define PROGRAM_MAX (2 * COUNTERS * STEPS + 4 * COUNTERS + 16)
+
+/*
+ * Where the reload version keeps its scratch value, and where the held one
+ * keeps its steps.
+ */
+#define SCRATCH COUNTERS
+#define STEP_BASE COUNTERS
+
+enum variant {
+    RELOAD,
+    HELD,
+    IMM,
+    NUM_VARIANTS
+};
+
+const char *variant_names[NUM_VARIANTS] = {"reload", "held", "imm"};
+
+struct program {
+    uint16_t narrow[PROGRAM_MAX];
+    uint32_t wide[PROGRAM_MAX];
+    size_t len;
+    unsigned regs;
+};
+
+void emit(struct program *p, uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2) {
+    p->narrow[p->len] = ENCODE_OP_REGS(op, r0, r1, r2);
+    p->wide[p->len++] = WIDE_ENCODE_OP_REGS(op, r0, r1, r2);
+}
+
+void emit_load_imm(struct program *p, uint8_t reg, uint8_t imm) {
+    p->narrow[p->len] = ENCODE_OP_REG_IMM(LOAD_IMM, reg, imm);
+    p->wide[p->len++] = WIDE_ENCODE_OP_REG_IMM(LOAD_IMM, reg, imm);
+}
+
+/*
+ * Counter c steps by c + 1, up if c is even and down if it's odd. Afterwards
+ * the counters get added up into R0.
+ */
+void build(struct program *p, enum variant v) {
+    p->len = 0;
+    for (int c = 0; c < COUNTERS; c++) {
+        emit_load_imm(p, c, 100);
+        if (v == HELD) {
+            emit_load_imm(p, STEP_BASE + c, c + 1);
+        }
+    }
+    for (int i = 0; i < STEPS; i++) {
+        for (int c = 0; c < COUNTERS; c++) {
+            uint8_t op = c % 2 == 0 ? ADD : SUB;
+            if (v == IMM) {
+                emit(p, op == ADD ? ADDI : SUBI, c, c + 1, c);
+            } else if (v == HELD) {
+                emit(p, op, c, STEP_BASE + c, c);
+            } else {
+                emit_load_imm(p, SCRATCH, c + 1);
+                emit(p, op, c, SCRATCH, c);
+            }
+        }
+    }
+    for (int c = 1; c < COUNTERS; c++) {
+        emit(p, ADD, 0, c, 0);
+    }
+    emit(p, MOV_RES, 0, 0, 0);
+    emit(p, DONE, 0, 0, 0);
+    p->regs = COUNTERS + (v == HELD ? COUNTERS : v == RELOAD ? 1 : 0);
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Run both encodings REPS times and keep the fastest run of each. Both have to
+ * come up with the expected answer.
+ */
+void measure(struct engine *e, struct program *p, uint64_t expected, double *narrow_ns, double *wide_ns) {
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec t0, t1, t2;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        result r1 = e->interpret(p->narrow);
+        uint64_t narrow_result = vm.result;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        result r2 = e->interpret_wide(p->wide);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        if (r1 != SUCCESS || r2 != SUCCESS || narrow_result != expected || vm.result != expected) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (rep == 0 || elapsed_ns(&t0, &t1) < *narrow_ns) {
+            *narrow_ns = elapsed_ns(&t0, &t1);
+        }
+        if (rep == 0 || elapsed_ns(&t1, &t2) < *wide_ns) {
+            *wide_ns = elapsed_ns(&t1, &t2);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    static struct program programs[NUM_VARIANTS];
+    for (int v = 0; v < NUM_VARIANTS; v++) {
+        build(&programs[v], v);
+    }
+
+    /*
+     * Every counter goes up or down by its step STEPS times, and the odd ones
+     * wrap around.
+     */
+    uint64_t expected = 0;
+    for (int c = 0; c < COUNTERS; c++) {
+        uint64_t delta = (uint64_t) (c + 1) * STEPS;
+        expected += c % 2 == 0 ? 100 + delta : 100 - delta;
+    }
+
+    vm_quiet = 1;
+    double times[NUM_ENGINES][NUM_VARIANTS][2];
+    for (struct engine *e = first; e < last; e++) {
+        for (int v = 0; v < NUM_VARIANTS; v++) {
+            double *t = times[e - engines][v];
+            reset_vm();
+            measure(e, &programs[v], expected, &t[0], &t[1]);
+        }
+    }
+
+    printf("%d counters stepped %d times, result %" PRIu64 "\n", COUNTERS, STEPS, expected);
+    printf("%-10s %-8s %8s %11s %6s %12s %12s %9s\n", "engine", "variant", "format", "dispatches", "regs",
+           "ns/step", "us total", "vs reload");
+    for (struct engine *e = first; e < last; e++) {
+        for (int v = 0; v < NUM_VARIANTS; v++) {
+            struct program *p = &programs[v];
+            for (int wide = 0; wide < 2; wide++) {
+                double ns = times[e - engines][v][wide];
+                printf("%-10s %-8s %8s %11zu %6u %12.3f %12.3f %8.2fx\n", e->name, variant_names[v],
+                       wide ? "32-bit" : "16-bit", p->len, p->regs, ns / (COUNTERS * STEPS), ns / 1000,
+                       times[e - engines][RELOAD][wide] / ns);
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "../common/container.h"
+#include "ssa.h"
+
+#define USAGE_STR "Usage: ./reg-opt <bytecode file> <output file> [--wide]\n"
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "--wide") != 0)) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    int wide = argc == 4;
+
+    /*
+     * Map the program. A container says which format it's in, which overrides
+     * --wide.
+     */
+    struct container_info info;
+    container_status status = container_map(argv[1], &info);
+    if (status != CONTAINER_OK) {
+        fprintf(stderr, "Error loading %s: %s\n", argv[1], container_messages[status]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (info.is_container) {
+        if (info.isa != CONTAINER_ISA_REG && info.isa != CONTAINER_ISA_REG_WIDE) {
+            fprintf(stderr, "%s holds %s bytecode, not register bytecode\n", argv[1], isa_names[info.isa]);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        wide = info.isa == CONTAINER_ISA_REG_WIDE;
+    }
+    size_t insn_size = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    if (info.entry % insn_size != 0 || info.entry >= info.code_len) {
+        fprintf(stderr, "Entry point is outside the code\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Work on a copy, since the instructions in the mapping needn't be
+     * aligned.
+     */
+    size_t len = (info.code_len - info.entry) / insn_size;
+    void *code = malloc(len * insn_size + 1);
+    if (code == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(code, info.code + info.entry, len * insn_size);
+    container_unmap(&info);
+
+    struct ssa_report report;
+    size_t optimized_len;
+    void *optimized = optimize_reg(code, len, wide, &optimized_len, &report);
+    if (optimized == NULL) {
+        fprintf(stderr, "Can't optimize %s: it has an unknown opcode, never gets to DONE or needs too many registers\n",
+                argv[1]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    print_ssa_report(stdout, &report);
+
+    /*
+     * The optimized program starts at the beginning. Its instructions don't
+     * line up with the source anymore, so it has no line map.
+     */
+    struct container_info out;
+    memset(&out, 0, sizeof(out));
+    out.isa = report.wide_after ? CONTAINER_ISA_REG_WIDE : CONTAINER_ISA_REG;
+    out.code = optimized;
+    out.code_len = optimized_len * (report.wide_after ? sizeof(uint32_t) : sizeof(uint16_t));
+    FILE *f = fopen(argv[2], "wb");
+    if (f == NULL || !write_container(f, &out) || fclose(f) != 0) {
+        fprintf(stderr, "Error writing %s\n", argv[2]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    free(code);
+    free(optimized);
+}
@@ -0,0 +1,185 @@
+/*
+ * Measure what the SSA optimizer buys on the register benchmarks. The decode
+ * and hot kernels are the ones from regfmtbench and regpinbench. They only
+ * ever compute on constants, so the optimizer folds them down to their
+ * result. The other two work on an input the host puts in R1 before each run,
+ * the way translated code would:
+ *
+ *   reload      the 16-bit spill kernel from regfmtbench, reloading each
+ *               constant right before it's used
+ *   translated  the same sum, but with the copies through a zero register and
+ *               the dead scratch values a naive translator leaves behind
+ *
+ * Each kernel runs as written and as optimized, and both have to come up with
+ * the same answer. The optimized programs need more than 16 registers to keep
+ * every product live, so they come out in the wide format.
+ */
+
+#include <time.h>
+
+#include "ssa.h"
+
+#define USAGE_STR "Usage: ./regoptbench [dispatch type]\n"
+
+#define INSNS 16384
+#define TERMS 64
+#define BLOCKS 128
+#define REPS 200
+
+#define PROGRAM_MAX (INSNS + 6 * TERMS * BLOCKS + 16)
+
+/*
+ * What the host leaves in R1.
+ */
+#define INPUT 5
+
+struct kernel {
+    const char *name;
+    uint16_t code[PROGRAM_MAX];
+    size_t len;
+    void *optimized;
+    size_t optimized_len;
+    struct ssa_report report;
+};
+
+/*
+ * Shuffle count registers through ADD, MUL and SUB.
+ */
+size_t build_shuffle(uint16_t *code, int count, int src_step, int dst_step) {
+    size_t n = 0;
+    for (int r = 0; r < count; r++) {
+        code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, r, r + 1);
+    }
+    uint8_t ops[] = {ADD, MUL, SUB};
+    for (int i = 0; i < INSNS; i++) {
+        code[n++] = ENCODE_OP_REGS(ops[i % 3], i % count, (i + src_step) % count, (i + dst_step) % count);
+    }
+    code[n++] = ENCODE_OP_REG(MOV_RES, 0);
+    code[n++] = ENCODE_OP(DONE);
+    return n;
+}
+
+/*
+ * Add up c[j] * x for TERMS different constants c[j], BLOCKS times over. R0 is
+ * the sum and R1 is x.
+ */
+size_t build_reload(uint16_t *code, int translated) {
+    size_t n = 0;
+    code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, 0, 0);
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int j = 0; j < TERMS; j++) {
+            code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, 2, 3 * j + 1);
+            if (translated) {
+                code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, 4, 0);
+                code[n++] = ENCODE_OP_REGS(ADD, 1, 4, 5);
+                code[n++] = ENCODE_OP_REGS(MUL, 2, 5, 3);
+                code[n++] = ENCODE_OP_REGS(SUB, 3, 2, 6);
+            } else {
+                code[n++] = ENCODE_OP_REGS(MUL, 2, 1, 3);
+            }
+            code[n++] = ENCODE_OP_REGS(ADD, 0, 3, 0);
+        }
+    }
+    code[n++] = ENCODE_OP_REG(MOV_RES, 0);
+    code[n++] = ENCODE_OP(DONE);
+    return n;
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Run a program once on a fresh VM with the input in place.
+ */
+result run(struct engine *e, void *code, int wide) {
+    reset_vm();
+    vm.regs[1] = INPUT;
+    return wide ? e->interpret_wide(code) : e->interpret(code);
+}
+
+/*
+ * Run a program REPS times and return the fastest run in nanoseconds.
+ */
+double measure(struct engine *e, void *code, int wide, uint64_t expected) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result r = run(e, code, wide);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (r != SUCCESS || vm.result != expected) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (rep == 0 || elapsed_ns(&start, &end) < best) {
+            best = elapsed_ns(&start, &end);
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    static struct kernel kernels[4] = {{"decode"}, {"hot"}, {"reload"}, {"translated"}};
+    kernels[0].len = build_shuffle(kernels[0].code, 8, 3, 5);
+    kernels[1].len = build_shuffle(kernels[1].code, 4, 1, 3);
+    kernels[2].len = build_reload(kernels[2].code, 0);
+    kernels[3].len = build_reload(kernels[3].code, 1);
+    for (int k = 0; k < 4; k++) {
+        struct kernel *kn = &kernels[k];
+        kn->optimized = optimize_reg(kn->code, kn->len, 0, &kn->optimized_len, &kn->report);
+        if (kn->optimized == NULL) {
+            fprintf(stderr, "Can't optimize the %s kernel\n", kn->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vm_quiet = 1;
+    double times[NUM_ENGINES][4][2];
+    for (struct engine *e = first; e < last; e++) {
+        for (int k = 0; k < 4; k++) {
+            struct kernel *kn = &kernels[k];
+            run(e, kn->code, 0);
+            uint64_t expected = vm.result;
+            times[e - engines][k][0] = measure(e, kn->code, 0, expected);
+            times[e - engines][k][1] = measure(e, kn->optimized, kn->report.wide_after, expected);
+        }
+    }
+
+    printf("%-10s %8s %8s %6s %8s %8s %8s %8s\n", "kernel", "before", "after", "format", "folded", "copies",
+           "reused", "dead");
+    for (int k = 0; k < 4; k++) {
+        struct ssa_report *r = &kernels[k].report;
+        printf("%-10s %8zu %8zu %6s %8zu %8zu %8zu %8zu\n", kernels[k].name, r->insns_before, r->insns_after,
+               r->wide_after ? "32-bit" : "16-bit", r->folded, r->copies, r->reused, r->dead);
+    }
+    printf("\n%-10s %-10s %12s %12s %10s\n", "kernel", "engine", "before us", "after us", "speedup");
+    for (struct engine *e = first; e < last; e++) {
+        for (int k = 0; k < 4; k++) {
+            double *t = times[e - engines][k];
+            printf("%-10s %-10s %12.3f %12.3f %9.2fx\n", kernels[k].name, e->name, t[0] / 1000, t[1] / 1000,
+                   t[0] / t[1]);
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        free(kernels[k].optimized);
+    }
+}
@@ -0,0 +1,125 @@
+/*
+ * Measure what pinning registers in C locals buys over the plain switch
+ * engine. The hot kernel only touches registers that get pinned, so every
+ * operand comes out of a local. The cold kernel does the same arithmetic on
+ * registers past the pinned ones, so whatever it gains comes from the
+ * instructions being decoded ahead of time rather than from pinning.
+ *
+ * The pinned engine translates a program before running it. A host would do
+ * that once and then run the program many times, so we time the translation
+ * on its own and leave it out of the per-run numbers.
+ */
+
+#include <time.h>
+
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./regpinbench\n"
+
+#define INSNS 16384
+#define REPS 200
+
+#define PROGRAM_MAX (INSNS + 16)
+
+/*
+ * Shuffle 4 registers starting at base through ADD, MUL and SUB.
+ */
+size_t build_kernel(uint16_t *code, uint8_t base) {
+    size_t n = 0;
+    for (int r = 0; r < 4; r++) {
+        code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, base + r, r + 1);
+    }
+    uint8_t ops[] = {ADD, MUL, SUB};
+    for (int i = 0; i < INSNS; i++) {
+        code[n++] = ENCODE_OP_REGS(ops[i % 3], base + i % 4, base + (i + 1) % 4, base + (i + 3) % 4);
+    }
+    code[n++] = ENCODE_OP_REG(MOV_RES, base);
+    code[n++] = ENCODE_OP(DONE);
+    return n;
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void check(const char *name, result r, uint64_t expected) {
+    if (r != SUCCESS || vm.result != expected) {
+        fprintf(stderr, "Benchmark program failed on %s\n", name);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Run a program REPS times on the switch engine and return the fastest run in
+ * nanoseconds.
+ */
+double measure_switch(uint16_t *code, uint64_t expected) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result r = interpret(code);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        check("switch", r, expected);
+        if (rep == 0 || elapsed_ns(&start, &end) < best) {
+            best = elapsed_ns(&start, &end);
+        }
+    }
+    return best;
+}
+
+/*
+ * Same for the pinned engine, except that we also hand back the fastest
+ * translation.
+ */
+double measure_pinned(uint16_t *code, uint64_t expected, double *translate_ns) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec t0, t1, t2;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        struct pinned_insn *translated = translate_pinned(code, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        result r = run_pinned(translated);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        free(translated);
+        check("pinned", r, expected);
+        if (rep == 0 || elapsed_ns(&t0, &t1) < *translate_ns) {
+            *translate_ns = elapsed_ns(&t0, &t1);
+        }
+        if (rep == 0 || elapsed_ns(&t1, &t2) < best) {
+            best = elapsed_ns(&t1, &t2);
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 1) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+
+    static uint16_t hot[PROGRAM_MAX];
+    static uint16_t cold[PROGRAM_MAX];
+    size_t hot_len = build_kernel(hot, 0);
+    size_t cold_len = build_kernel(cold, NUM_NARROW_REGS - 4);
+
+    vm_quiet = 1;
+    reset_vm();
+    interpret(hot);
+    uint64_t expected = vm.result;
+    double times[2][3];
+    times[0][0] = measure_switch(hot, expected);
+    times[0][1] = measure_pinned(hot, expected, &times[0][2]);
+    times[1][0] = measure_switch(cold, expected);
+    times[1][1] = measure_pinned(cold, expected, &times[1][2]);
+
+    printf("Pinned registers: %d\n", PINNED_REGS);
+    printf("%-8s %10s %14s %14s %10s %14s\n", "kernel", "insns", "switch ns/insn", "pinned ns/insn", "speedup",
+           "xlate ns/insn");
+    printf("%-8s %10zu %14.3f %14.3f %9.2fx %14.3f\n", "hot", hot_len, times[0][0] / hot_len,
+           times[0][1] / hot_len, times[0][0] / times[0][1], times[0][2] / hot_len);
+    printf("%-8s %10zu %14.3f %14.3f %9.2fx %14.3f\n", "cold", cold_len, times[1][0] / cold_len,
+           times[1][1] / cold_len, times[1][0] / times[1][1], times[1][2] / cold_len);
+}
@@ -0,0 +1,791 @@
+#ifndef VERSE_REG_SSA_H_
+#define VERSE_REG_SSA_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+/*
+ * Register bytecode optimizer. Register programs are straight-line code, so
+ * lifting them into SSA is just value numbering: every instruction that
+ * writes a register defines a new value, and every register it reads names
+ * whatever value was last written there. There are no joins, so there are no
+ * phis either.
+ *
+ * While we number the values we fold constants, collapse identities like
+ * x + 0 and x * 1 onto the value they copy, and look every computation up in a
+ * table so a recomputation becomes the value we already have. Afterwards only
+ * the values the result depends on get emitted, which takes care of dead code,
+ * and a linear scan over them picks registers from scratch. That fits in the
+ * 16 registers of the narrow format whenever no more than 16 values are live
+ * at once. Otherwise we emit the wide format.
+ *
+ * A register the program reads before writing it is an input. Reset leaves it
+ * zero, but a host could set it, so we don't fold it and keep it where it is.
+ * What a program leaves in its registers isn't part of its behavior, only the
+ * result and the status are. DIVs that might divide by zero still get
+ * emitted, and that's the only kind of instruction whose order we keep. The
+ * result of a program that fails doesn't count either.
+ *
+ * Vector values get numbered and dropped the same way, but we don't fold
+ * them.
+ *
+ * ADDI, SUBI, MULI and SHLI get lifted as the three-register operation on a
+ * constant, so they fold like any other. ANDI and SHRI have no three-register
+ * form and stay values of their own. When emitting, an ADD, SUB or MUL whose
+ * constant operand fits in an immediate goes back to the immediate form,
+ * which saves the LOAD_IMM and the register it takes.
+ */
+
+#define SSA_NONE UINT32_MAX
+
+struct ssa_value {
+
+    /*
+     * The opcode that computes the value. Constants are LOAD_IMM or
+     * VLOAD_IMM, and inputs are NUM_OPCODES.
+     */
+    uint8_t op;
+    uint8_t is_vector;
+    uint8_t is_const;
+    uint8_t traps;
+    uint32_t a;
+    uint32_t b;
+
+    /*
+     * The value of a constant, the broadcast immediate of a vector constant,
+     * or the register an input comes in.
+     */
+    uint64_t k;
+
+    /*
+     * How a scalar constant too big for an immediate gets built. If we folded
+     * it from two constants that aren't, via says with which opcode.
+     */
+    uint8_t via;
+    uint32_t via_a;
+    uint32_t via_b;
+    uint32_t built;
+
+    /*
+     * Filled in while emitting.
+     */
+    uint32_t last_use;
+    uint16_t reg;
+    uint8_t emitted;
+};
+
+struct ssa_report {
+    size_t insns_before;
+    size_t insns_after;
+    size_t folded;
+    size_t copies;
+    size_t reused;
+    size_t dead;
+    unsigned regs_before;
+    unsigned regs_after;
+    int wide_before;
+    int wide_after;
+};
+
+struct ssa {
+    struct ssa_value *values;
+    size_t num_values;
+    size_t cap_values;
+    uint32_t *table;
+    size_t table_mask;
+    size_t table_count;
+
+    /*
+     * The biggest immediate the format we're emitting can hold.
+     */
+    uint64_t imm_max;
+};
+
+void *ssa_grow(void *array, size_t *cap, size_t size) {
+    *cap = *cap ? *cap * 2 : 256;
+    array = realloc(array, *cap * size);
+    if (array == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+uint64_t ssa_hash(struct ssa_value *v) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t parts[4] = {v->op | (uint64_t) v->is_vector << 8, v->a, v->b, v->k};
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ parts[i]) * 0x100000001b3ull;
+    }
+    return h ^ (h >> 29);
+}
+
+int ssa_same(struct ssa_value *x, struct ssa_value *y) {
+    return x->op == y->op && x->is_vector == y->is_vector && x->a == y->a && x->b == y->b && x->k == y->k;
+}
+
+uint32_t ssa_append(struct ssa *s, struct ssa_value *v) {
+    if (s->num_values == s->cap_values) {
+        s->values = ssa_grow(s->values, &s->cap_values, sizeof(struct ssa_value));
+    }
+    v->via = 0;
+    v->built = SSA_NONE;
+    s->values[s->num_values] = *v;
+    return (uint32_t) s->num_values++;
+}
+
+/*
+ * Find a value that's computed the same way, or add this one. Sets *hit if it
+ * was already there.
+ */
+uint32_t ssa_number(struct ssa *s, struct ssa_value *v, int *hit) {
+    if (2 * (s->table_count + 1) > s->table_mask + 1) {
+        size_t slots = s->table_mask ? 2 * (s->table_mask + 1) : 1024;
+        uint32_t *table = malloc(slots * sizeof(uint32_t));
+        if (table == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(table, 0xFF, slots * sizeof(uint32_t));
+        for (size_t i = 0; s->table_mask && i <= s->table_mask; i++) {
+            if (s->table[i] != SSA_NONE) {
+                size_t j = ssa_hash(&s->values[s->table[i]]) & (slots - 1);
+                while (table[j] != SSA_NONE) {
+                    j = (j + 1) & (slots - 1);
+                }
+                table[j] = s->table[i];
+            }
+        }
+        free(s->table);
+        s->table = table;
+        s->table_mask = slots - 1;
+    }
+    size_t i = ssa_hash(v) & s->table_mask;
+    while (s->table[i] != SSA_NONE) {
+        if (ssa_same(&s->values[s->table[i]], v)) {
+            *hit = 1;
+            return s->table[i];
+        }
+        i = (i + 1) & s->table_mask;
+    }
+    *hit = 0;
+    s->table[i] = ssa_append(s, v);
+    s->table_count++;
+    return s->table[i];
+}
+
+uint32_t ssa_const(struct ssa *s, uint64_t k) {
+    struct ssa_value v = {LOAD_IMM, 0, 1, 0, 0, 0, k};
+    int hit;
+    return ssa_number(s, &v, &hit);
+}
+
+uint32_t ssa_op(struct ssa *s, uint8_t op, uint32_t a, uint32_t b, int *hit) {
+    struct ssa_value v = {op, op >= VLOAD_IMM && op < VREDUCE, 0, 0, a, b, 0};
+    return ssa_number(s, &v, hit);
+}
+
+/*
+ * Number a scalar ADD, SUB, MUL or DIV, folding it or collapsing it onto one of
+ * its operands if we can. Counts what happened in the report.
+ */
+uint32_t ssa_arith(struct ssa *s, uint8_t op, uint32_t a, uint32_t b, struct ssa_report *report) {
+    struct ssa_value *x = &s->values[a];
+    struct ssa_value *y = &s->values[b];
+    if (x->is_const && y->is_const && (op != DIV || y->k != 0)) {
+        uint64_t k = op == ADD ? x->k + y->k : op == SUB ? x->k - y->k : op == MUL ? x->k * y->k : x->k / y->k;
+        int small = x->k <= 0xFFFF && y->k <= 0xFFFF;
+        int hit;
+        struct ssa_value v = {LOAD_IMM, 0, 1, 0, 0, 0, k};
+        uint32_t id = ssa_number(s, &v, &hit);
+
+        /*
+         * Remember how we got a constant that doesn't fit in an immediate,
+         * since computing it the same way is as cheap as anything.
+         */
+        if (k > 0xFF && !s->values[id].via && small) {
+            s->values[id].via = op;
+            s->values[id].via_a = a;
+            s->values[id].via_b = b;
+        }
+        report->folded++;
+        return id;
+    }
+    int is_zero_a = x->is_const && x->k == 0;
+    int is_zero_b = y->is_const && y->k == 0;
+    int is_one_a = x->is_const && x->k == 1;
+    int is_one_b = y->is_const && y->k == 1;
+    if ((op == ADD && is_zero_b) || (op == SUB && is_zero_b) || (op == MUL && is_one_b) ||
+        (op == DIV && is_one_b)) {
+        report->copies++;
+        return a;
+    }
+    if ((op == ADD && is_zero_a) || (op == MUL && is_one_a)) {
+        report->copies++;
+        return b;
+    }
+    if ((op == SUB && a == b) || (op == MUL && (is_zero_a || is_zero_b))) {
+        report->folded++;
+        return ssa_const(s, 0);
+    }
+    if ((op == ADD || op == MUL) && a > b) {
+        uint32_t t = a;
+        a = b;
+        b = t;
+    }
+    int divisor_known = y->is_const && y->k != 0;
+    int hit;
+    uint32_t id = ssa_op(s, op, a, b, &hit);
+    if (hit) {
+        report->reused++;
+    } else if (op == DIV) {
+        s->values[id].traps = !divisor_known;
+    }
+    return id;
+}
+
+/*
+ * Number an ANDI or SHRI of a by k, folding it if a is a constant.
+ */
+uint32_t ssa_imm(struct ssa *s, uint8_t op, uint32_t a, uint64_t k, struct ssa_report *report) {
+    struct ssa_value *x = &s->values[a];
+    if (x->is_const) {
+        report->folded++;
+        return ssa_const(s, op == ANDI ? x->k & k : x->k >> k);
+    }
+    if (op == SHRI && k == 0) {
+        report->copies++;
+        return a;
+    }
+    if (op == ANDI && k == 0) {
+        report->folded++;
+        return ssa_const(s, 0);
+    }
+    int hit;
+    struct ssa_value v = {op, 0, 0, 0, a, 0, k};
+    uint32_t id = ssa_number(s, &v, &hit);
+    report->reused += hit;
+    return id;
+}
+
+/*
+ * A scalar constant too big for an immediate gets built an immediate at a
+ * time, most significant first: shift what we have left by multiplying, then
+ * add the next piece. The 16-bit format takes bytes and shifts by 256, which
+ * is 16 * 16. The wide one takes 16 bits and shifts by 65536, or 256 * 256.
+ */
+uint32_t ssa_build_const(struct ssa *s, uint64_t k) {
+    if (k <= s->imm_max) {
+        return ssa_const(s, k);
+    }
+    int bits = s->imm_max == 0xFF ? 8 : 16;
+    int hit;
+    uint32_t half = ssa_const(s, (uint64_t) 1 << (bits / 2));
+    uint32_t shift = ssa_op(s, MUL, half, half, &hit);
+    uint32_t acc = ssa_build_const(s, k >> bits);
+    acc = ssa_op(s, MUL, acc, shift, &hit);
+    if ((k & s->imm_max) != 0) {
+        acc = ssa_op(s, ADD, acc, ssa_const(s, k & s->imm_max), &hit);
+    }
+    return acc;
+}
+
+/*
+ * What actually gets emitted for a value.
+ */
+uint32_t ssa_resolve(struct ssa *s, uint32_t id) {
+    struct ssa_value *v = &s->values[id];
+    if (v->is_const && !v->is_vector && v->k > s->imm_max) {
+        if (v->built == SSA_NONE) {
+            int hit;
+            int via = v->via && s->values[v->via_a].k <= s->imm_max && s->values[v->via_b].k <= s->imm_max;
+            uint32_t built = via ? ssa_op(s, v->via, v->via_a, v->via_b, &hit) : ssa_build_const(s, v->k);
+            s->values[id].built = built;
+            return built;
+        }
+        return v->built;
+    }
+    return id;
+}
+
+/*
+ * Whether a value gets emitted with an immediate in the format we're emitting.
+ * If so, returns the opcode and stores the operand it reads in a and the
+ * immediate in imm. Otherwise returns NUM_OPCODES. The 16-bit format only has
+ * ADDI and SUBI, with 4-bit immediates.
+ */
+uint8_t ssa_imm_form(struct ssa *s, struct ssa_value *v, uint32_t *a, uint64_t *imm) {
+    int narrow = s->imm_max == 0xFF;
+    uint64_t max = narrow ? 0xF : 0xFF;
+    if (v->op == ANDI || v->op == SHRI) {
+        *a = v->a;
+        *imm = v->k;
+        return v->op;
+    }
+    if (v->is_vector || (v->op != ADD && v->op != SUB && v->op != MUL) || (narrow && v->op == MUL)) {
+        return NUM_OPCODES;
+    }
+    struct ssa_value *x = &s->values[v->a];
+    struct ssa_value *y = &s->values[v->b];
+    struct ssa_value *c;
+    if (y->is_const) {
+        c = y;
+        *a = v->a;
+    } else if (x->is_const && v->op != SUB) {
+        c = x;
+        *a = v->b;
+    } else {
+        return NUM_OPCODES;
+    }
+    if (c->k <= max) {
+        *imm = c->k;
+        return v->op == ADD ? ADDI : v->op == SUB ? SUBI : MULI;
+    }
+    if (v->op == MUL && (c->k & (c->k - 1)) == 0) {
+        *imm = (uint64_t) __builtin_ctzll(c->k);
+        return SHLI;
+    }
+    return NUM_OPCODES;
+}
+
+/*
+ * The operands an emitted value reads, resolved. Returns how many.
+ */
+int ssa_operands(struct ssa *s, uint32_t id, uint32_t ops[2]) {
+    struct ssa_value *v = &s->values[id];
+    if (v->op == NUM_OPCODES || v->op == LOAD_IMM || v->op == VLOAD_IMM) {
+        return 0;
+    }
+    uint32_t a;
+    uint64_t imm;
+    if (ssa_imm_form(s, v, &a, &imm) != NUM_OPCODES) {
+        ops[0] = ssa_resolve(s, a);
+        return 1;
+    }
+    uint8_t op = v->op;
+    uint32_t b = v->b;
+    ops[0] = ssa_resolve(s, v->a);
+    if (op == VREDUCE) {
+        return 1;
+    }
+    ops[1] = ssa_resolve(s, b);
+    return 2;
+}
+
+/*
+ * Put a value and everything it needs on the schedule, operands first. The
+ * dependency chains in generated code can be as long as the program, so we
+ * keep our own stack rather than recursing.
+ */
+void ssa_schedule(struct ssa *s, uint32_t root, uint32_t **order, size_t *len, size_t *cap) {
+    size_t stack_cap = 64;
+    size_t depth = 0;
+    uint32_t *stack = malloc(stack_cap * sizeof(uint32_t));
+    if (stack == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    stack[depth++] = ssa_resolve(s, root);
+    while (depth > 0) {
+        uint32_t id = stack[depth - 1];
+        if (s->values[id].emitted) {
+            depth--;
+            continue;
+        }
+        uint32_t ops[2];
+        int n = ssa_operands(s, id, ops);
+        int ready = 1;
+        for (int i = 0; i < n; i++) {
+            if (!s->values[ops[i]].emitted) {
+                if (depth == stack_cap) {
+                    stack = ssa_grow(stack, &stack_cap, sizeof(uint32_t));
+                }
+                stack[depth++] = ops[i];
+                ready = 0;
+            }
+        }
+        if (!ready) {
+            continue;
+        }
+        depth--;
+        s->values[id].emitted = 1;
+        if (s->values[id].op == NUM_OPCODES) {
+            continue;
+        }
+        if (*len == *cap) {
+            *order = ssa_grow(*order, cap, sizeof(uint32_t));
+        }
+        (*order)[(*len)++] = id;
+    }
+    free(stack);
+}
+
+/*
+ * Give every scheduled value a register, lowest free first, reusing a
+ * register as soon as the last read of the value in it is done. Inputs have
+ * to stay where they came in. Returns 0 if that takes more than max_regs
+ * scalar registers.
+ */
+int ssa_allocate(struct ssa *s, uint32_t *order, size_t len, uint32_t result, int has_result, unsigned max_regs,
+                 unsigned *regs_used) {
+    uint8_t busy[NUM_REGS] = {0};
+    uint8_t vbusy[NUM_VREGS] = {0};
+    *regs_used = 0;
+    for (size_t i = 0; i < s->num_values; i++) {
+        struct ssa_value *v = &s->values[i];
+        v->last_use = SSA_NONE;
+        if (v->op == NUM_OPCODES && v->emitted) {
+            if (!v->is_vector && v->k >= max_regs) {
+                return 0;
+            }
+            v->reg = (uint16_t) v->k;
+            if (v->is_vector) {
+                vbusy[v->reg] = 1;
+            } else {
+                busy[v->reg] = 1;
+                if (v->reg + 1u > *regs_used) {
+                    *regs_used = v->reg + 1;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        uint32_t ops[2];
+        int n = ssa_operands(s, order[i], ops);
+        for (int j = 0; j < n; j++) {
+            s->values[ops[j]].last_use = (uint32_t) i;
+        }
+    }
+    if (has_result) {
+        s->values[ssa_resolve(s, result)].last_use = (uint32_t) len;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        struct ssa_value *v = &s->values[order[i]];
+        uint32_t ops[2];
+        int n = ssa_operands(s, order[i], ops);
+        for (int j = 0; j < n; j++) {
+            struct ssa_value *o = &s->values[ops[j]];
+            if (o->last_use == i) {
+                if (o->is_vector) {
+                    vbusy[o->reg] = 0;
+                } else {
+                    busy[o->reg] = 0;
+                }
+            }
+        }
+        uint8_t *file = v->is_vector ? vbusy : busy;
+        unsigned limit = v->is_vector ? NUM_VREGS : max_regs;
+        unsigned r = 0;
+        while (r < limit && file[r]) {
+            r++;
+        }
+        if (r == limit) {
+            return 0;
+        }
+        v->reg = (uint16_t) r;
+        if (!v->is_vector && r + 1 > *regs_used) {
+            *regs_used = r + 1;
+        }
+        file[r] = v->last_use != SSA_NONE;
+    }
+    return 1;
+}
+
+/*
+ * Schedule, allocate and encode the program in one format. Returns NULL if it
+ * takes more registers than the format has.
+ */
+void *ssa_emit(struct ssa *s, uint32_t *traps, size_t num_traps, uint32_t result, int wide, size_t *len,
+               unsigned *regs_used) {
+    s->imm_max = wide ? 0xFFFF : 0xFF;
+    for (size_t i = 0; i < s->num_values; i++) {
+        s->values[i].emitted = 0;
+        s->values[i].built = SSA_NONE;
+    }
+
+    /*
+     * Schedule the DIVs that might fail in their original order, then the
+     * result. Anything that isn't on the schedule by then is dead.
+     */
+    uint32_t *order = NULL;
+    size_t num_order = 0;
+    size_t cap_order = 0;
+    for (size_t i = 0; i < num_traps; i++) {
+        ssa_schedule(s, traps[i], &order, &num_order, &cap_order);
+    }
+    if (result != SSA_NONE) {
+        ssa_schedule(s, result, &order, &num_order, &cap_order);
+    }
+    int fits = 1;
+    for (size_t i = 0; i < num_order; i++) {
+        uint8_t op = s->values[order[i]].op;
+        fits &= op != VLOAD_IMM || s->values[order[i]].k <= s->imm_max;
+        fits &= wide || (op != ANDI && op != SHRI);
+    }
+    if (!fits || !ssa_allocate(s, order, num_order, result, result != SSA_NONE,
+                               wide ? NUM_REGS : NUM_NARROW_REGS, regs_used)) {
+        free(order);
+        return NULL;
+    }
+
+    size_t n = 0;
+    uint8_t *out = malloc((num_order + 2) * (wide ? sizeof(uint32_t) : sizeof(uint16_t)));
+    if (out == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_order + 2; i++) {
+        uint8_t op;
+        uint16_t r0 = 0;
+        uint16_t r1 = 0;
+        uint16_t r2 = 0;
+        uint64_t imm = 0;
+        int with_imm = 0;
+        if (i < num_order) {
+            struct ssa_value *v = &s->values[order[i]];
+            uint32_t a;
+            uint64_t k;
+            uint8_t imm_op = ssa_imm_form(s, v, &a, &k);
+            op = v->op;
+            if (imm_op != NUM_OPCODES) {
+                op = imm_op;
+                r0 = s->values[ssa_resolve(s, a)].reg;
+                r1 = (uint16_t) k;
+                r2 = v->reg;
+            } else if (op == LOAD_IMM || op == VLOAD_IMM) {
+                r0 = v->reg;
+                imm = v->k;
+                with_imm = 1;
+            } else if (op == VREDUCE) {
+                r0 = s->values[ssa_resolve(s, v->a)].reg;
+                r2 = v->reg;
+            } else {
+                r0 = s->values[ssa_resolve(s, v->a)].reg;
+                r1 = s->values[ssa_resolve(s, v->b)].reg;
+                r2 = v->reg;
+            }
+        } else if (i == num_order) {
+            if (result == SSA_NONE) {
+                continue;
+            }
+            op = MOV_RES;
+            r0 = s->values[ssa_resolve(s, result)].reg;
+        } else {
+            op = DONE;
+        }
+        if (wide) {
+            ((uint32_t *) out)[n++] =
+                    with_imm ? WIDE_ENCODE_OP_REG_IMM(op, r0, imm) : WIDE_ENCODE_OP_REGS(op, r0, r1, r2);
+        } else {
+            ((uint16_t *) out)[n++] = with_imm ? ENCODE_OP_REG_IMM(op, r0, imm) : ENCODE_OP_REGS(op, r0, r1, r2);
+        }
+    }
+    free(order);
+    *len = n;
+    return out;
+}
+
+/*
+ * Optimize a program in either format. Returns the optimized program as a
+ * malloc'd array of 16-bit or 32-bit instructions, depending on what
+ * report->wide_after says, and stores how many there are in new_len. Returns
+ * NULL if the program has an opcode we don't know, never reaches a DONE, or
+ * needs more than 256 registers.
+ */
+void *optimize_reg(void *code, size_t len, int wide, size_t *new_len, struct ssa_report *report) {
+    memset(report, 0, sizeof(*report));
+    report->wide_before = wide;
+    struct ssa s = {NULL, 0, 0, NULL, 0, 0, 0};
+    uint32_t cur[NUM_REGS];
+    uint32_t vcur[NUM_VREGS];
+    uint8_t named[NUM_REGS] = {0};
+    for (int r = 0; r < NUM_REGS; r++) {
+        cur[r] = SSA_NONE;
+    }
+    for (int r = 0; r < NUM_VREGS; r++) {
+        vcur[r] = SSA_NONE;
+    }
+    uint32_t *traps = NULL;
+    size_t num_traps = 0;
+    size_t cap_traps = 0;
+    uint32_t result = SSA_NONE;
+    int done = 0;
+    size_t pc;
+    for (pc = 0; pc < len && !done; pc++) {
+        uint32_t insn = wide ? ((uint32_t *) code)[pc] : ((uint16_t *) code)[pc];
+        uint8_t op = wide ? WIDE_DECODE_OP(insn) : DECODE_OP(insn);
+        uint8_t r[3] = {wide ? WIDE_DECODE_R0(insn) : DECODE_R0(insn), wide ? WIDE_DECODE_R1(insn) : DECODE_R1(insn),
+                        wide ? WIDE_DECODE_R2(insn) : DECODE_R2(insn)};
+        uint64_t imm = wide ? WIDE_DECODE_IMM16(insn) : DECODE_IMM(insn);
+        if (op >= NUM_OPCODES) {
+            break;
+        }
+        int is_vector_op = op >= VLOAD_IMM && op <= VREDUCE;
+        int is_imm_op = op >= ADDI;
+
+        /*
+         * Reading a register nobody has written yet reads an input.
+         */
+        int reads = op == LOAD_IMM || op == VLOAD_IMM || op == DONE ? 0
+                    : op == MOV_RES || op == VREDUCE || is_imm_op ? 1 : 2;
+        uint32_t in[2];
+        for (int i = 0; i < reads; i++) {
+            if (is_vector_op) {
+                uint8_t v = r[i] & (NUM_VREGS - 1);
+                if (vcur[v] == SSA_NONE) {
+                    struct ssa_value input = {NUM_OPCODES, 1, 0, 0, 0, 0, v};
+                    vcur[v] = ssa_append(&s, &input);
+                }
+                in[i] = vcur[v];
+            } else {
+                named[r[i]] = 1;
+                if (cur[r[i]] == SSA_NONE) {
+                    struct ssa_value input = {NUM_OPCODES, 0, 0, 0, 0, 0, r[i]};
+                    cur[r[i]] = ssa_append(&s, &input);
+                }
+                in[i] = cur[r[i]];
+            }
+        }
+
+        int hit = 0;
+        switch (op) {
+            case LOAD_IMM:
+                named[r[0]] = 1;
+                cur[r[0]] = ssa_const(&s, imm);
+                break;
+            case ADD:
+            case SUB:
+            case MUL:
+            case DIV: {
+                named[r[2]] = 1;
+                uint32_t id = ssa_arith(&s, op, in[0], in[1], report);
+                if (s.values[id].traps && !s.values[id].emitted) {
+                    if (num_traps == cap_traps) {
+                        traps = ssa_grow(traps, &cap_traps, sizeof(uint32_t));
+                    }
+                    traps[num_traps++] = id;
+                    s.values[id].emitted = 1;
+                }
+                cur[r[2]] = id;
+                break;
+            }
+            case ADDI:
+            case SUBI:
+            case MULI:
+            case SHLI: {
+                named[r[2]] = 1;
+                uint64_t k = op == SHLI ? (uint64_t) 1 << (r[1] & 63) : r[1];
+                uint8_t arith = op == ADDI ? ADD : op == SUBI ? SUB : MUL;
+                cur[r[2]] = ssa_arith(&s, arith, in[0], ssa_const(&s, k), report);
+                break;
+            }
+            case ANDI:
+            case SHRI:
+                named[r[2]] = 1;
+                cur[r[2]] = ssa_imm(&s, op, in[0], op == SHRI ? r[1] & 63 : r[1], report);
+                break;
+            case MOV_RES:
+                result = in[0];
+                break;
+            case DONE:
+                done = 1;
+                break;
+            case VLOAD_IMM: {
+                struct ssa_value v = {VLOAD_IMM, 1, 1, 0, 0, 0, imm};
+                vcur[r[0] & (NUM_VREGS - 1)] = ssa_number(&s, &v, &hit);
+                report->reused += hit;
+                break;
+            }
+            case VREDUCE: {
+                named[r[2]] = 1;
+                struct ssa_value *v = &s.values[in[0]];
+                if (v->is_const) {
+                    cur[r[2]] = ssa_const(&s, v->k * VEC_LANES);
+                    report->folded++;
+                } else {
+                    cur[r[2]] = ssa_op(&s, VREDUCE, in[0], 0, &hit);
+                    report->reused += hit;
+                }
+                break;
+            }
+            default: {
+                uint32_t a = in[0];
+                uint32_t b = in[1];
+                if (op != VSUB && a > b) {
+                    a = in[1];
+                    b = in[0];
+                }
+                vcur[r[2] & (NUM_VREGS - 1)] = ssa_op(&s, op, a, b, &hit);
+                report->reused += hit;
+                break;
+            }
+        }
+    }
+    report->insns_before = pc;
+    for (int r = 0; r < NUM_REGS; r++) {
+        report->regs_before += named[r];
+    }
+    if (!done) {
+        free(s.values);
+        free(s.table);
+        free(traps);
+        return NULL;
+    }
+
+    size_t lifted = s.num_values;
+
+    /*
+     * Try the 16-bit format, then the wide one if the program is wide to begin
+     * with or doesn't fit. The wide one can have bigger immediates, so it can
+     * come out shorter. Keep whichever does, and the 16-bit one on a tie.
+     */
+    size_t n;
+    unsigned regs;
+    void *out = ssa_emit(&s, traps, num_traps, result, 0, &n, &regs);
+    if (out == NULL || wide) {
+        size_t wide_n;
+        unsigned wide_regs;
+        void *wide_out = ssa_emit(&s, traps, num_traps, result, 1, &wide_n, &wide_regs);
+        if (wide_out != NULL && (out == NULL || wide_n < n)) {
+            free(out);
+            out = wide_out;
+            n = wide_n;
+            regs = wide_regs;
+            report->wide_after = 1;
+        } else {
+            free(wide_out);
+        }
+    }
+    if (out != NULL) {
+        report->insns_after = *new_len = n;
+        report->regs_after = regs;
+    }
+
+    /*
+     * Count the computations that didn't make it into the program. Whichever
+     * format we emitted, those are the same ones.
+     */
+    for (size_t i = 0; i < lifted; i++) {
+        struct ssa_value *v = &s.values[i];
+        report->dead += v->op != NUM_OPCODES && !v->is_const && !v->emitted;
+    }
+    free(s.values);
+    free(s.table);
+    free(traps);
+    return out;
+}
+
+void print_ssa_report(FILE *f, struct ssa_report *r) {
+    fprintf(f, "Instructions: %zu -> %zu\n", r->insns_before, r->insns_after);
+    fprintf(f, "Folded %zu, copies propagated %zu, subexpressions reused %zu, dead values %zu\n", r->folded,
+            r->copies, r->reused, r->dead);
+    fprintf(f, "Registers: %u (%s) -> %u (%s)\n", r->regs_before, r->wide_before ? "wide" : "16-bit",
+            r->regs_after, r->wide_after ? "wide" : "16-bit");
+}
+
+#endif
@@ -24,6 +24,51 @@ int main() {
     assert(DECODE_R1(0x4012) == 1);
     assert(DECODE_R2(0x4012) == 2);
 
+    /*
+     * Test vector instructions, which use the same layouts.
+     */
+    assert(ENCODE_OP_REG_IMM(VLOAD_IMM, 7, 0xFF) == 0x77FF);
+    assert(ENCODE_OP_REGS(VMUL, 1, 2, 3) == 0xA123);
+    assert(ENCODE_OP_REGS(VREDUCE, 5, 0, 15) == 0xD50F);
+    assert(DECODE_OP(0xD50F) == VREDUCE);
+    assert(DECODE_V0(0xD50F) == 5);
+    assert(DECODE_R2(0xD50F) == 15);
+    assert(DECODE_V0(0x8F00) == 7);
+
+    /*
+     * Test the immediate forms, which keep their immediate where R1 would be.
+     * Only ADDI and SUBI have room in the 16-bit format.
+     */
+    assert(ENCODE_OP_REGS(ADDI, 3, 1, 3) == 0xE313);
+    assert(ENCODE_OP_REGS(SUBI, 0, 15, 2) == 0xF0F2);
+    assert(DECODE_OP(0xE313) == ADDI);
+    assert(DECODE_IMM4(0xF0F2) == 15);
+    assert(SUBI < MAX_OPCODES && MULI >= MAX_OPCODES);
+    assert(NUM_OPCODES <= MAX_WIDE_OPCODES);
+
+    /*
+     * Test the wide format.
+     * 0x04FF0102 = 00000100 11111111 00000001 00000010
+     *            = DIV      R255     R1       R2
+     */
+    assert(WIDE_ENCODE_OP_REGS(DIV, 255, 1, 2) == 0x04FF0102);
+    assert(WIDE_ENCODE_OP_REG_IMM(LOAD_IMM, 200, 0xBEEF) == 0x00C8BEEF);
+    assert(WIDE_ENCODE_OP_REG(MOV_RES, 17) == 0x05110000);
+    assert(WIDE_ENCODE_OP(DONE) == 0x06000000);
+    assert(WIDE_ENCODE_OP_IMM(0xFE, 0xABCDEF) == 0xFEABCDEF);
+    assert(WIDE_DECODE_OP(0x04FF0102) == DIV);
+    assert(WIDE_DECODE_R0(0x04FF0102) == 255);
+    assert(WIDE_DECODE_R1(0x04FF0102) == 1);
+    assert(WIDE_DECODE_R2(0x04FF0102) == 2);
+    assert(WIDE_DECODE_IMM16(0x00C8BEEF) == 0xBEEF);
+    assert(WIDE_DECODE_IMM24(0xFEABCDEF) == 0xABCDEF);
+    assert(WIDE_DECODE_OP(0xFEABCDEF) == 0xFE);
+    assert(WIDE_DECODE_V2(0x0D0000FF) == 7);
+    assert(WIDE_ENCODE_OP_REGS(SHRI, 9, 63, 200) == 0x13093FC8);
+    assert(WIDE_DECODE_OP(0x13093FC8) == SHRI);
+    assert(WIDE_DECODE_IMM8(0x13093FC8) == 63);
+    assert(WIDE_DECODE_R2(0x13093FC8) == 200);
+
     printf("All tests passed\n");
     fflush(stdout);
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "ssa.h"
+
+int main() {
+
+    /*
+     * The first program folds down to its result, the second computes R1 * R1
+     * once, and the third keeps a DIV by an input even though nothing uses
+     * what it computes.
+     */
+    struct ssa_report report;
+    size_t len;
+    uint16_t folds[] = {0x0002, 0x0103, 0x3012, 0x0300, 0x1234, 0x5400, 0x6000};
+    uint16_t *optimized = optimize_reg(folds, 7, 0, &len, &report);
+    assert(len == 3 && optimized[0] == 0x0006 && optimized[1] == 0x5000 && optimized[2] == 0x6000);
+    assert(report.folded == 2 && !report.wide_after);
+    free(optimized);
+    uint16_t reuses[] = {0x3112, 0x3113, 0x1234, 0x5400, 0x6000};
+    optimized = optimize_reg(reuses, 5, 0, &len, &report);
+    assert(len == 4 && optimized[0] == 0x3110 && optimized[1] == 0x1000 && report.reused == 1);
+    free(optimized);
+    uint16_t traps[] = {0x0001, 0x4056, 0x5000, 0x6000};
+    optimized = optimize_reg(traps, 4, 0, &len, &report);
+    assert(len == 4 && optimized[0] == 0x0001 && optimized[1] == 0x4051);
+    free(optimized);
+
+    /*
+     * Adding a small constant to an input becomes an ADDI, folding through
+     * SHRI works, and ANDI needs the wide format but its MUL by a small
+     * constant can then be a MULI.
+     */
+    uint16_t adds[] = {0x0005, 0x1102, 0x5200, 0x6000};
+    optimized = optimize_reg(adds, 4, 0, &len, &report);
+    assert(len == 3 && optimized[0] == 0xE150 && optimized[1] == 0x5000 && !report.wide_after);
+    free(optimized);
+    uint32_t shifts[] = {0x000000C8, 0x13000301, 0x05010000, 0x06000000};
+    optimized = optimize_reg(shifts, 4, 1, &len, &report);
+    assert(len == 3 && optimized[0] == 0x0019 && optimized[1] == 0x5000 && !report.wide_after);
+    free(optimized);
+    uint32_t masks[] = {0x1101F002, 0x00030008, 0x03020304, 0x05040000, 0x06000000};
+    uint32_t *wide_optimized = optimize_reg(masks, 5, 1, &len, &report);
+    assert(len == 4 && report.wide_after && wide_optimized[0] == 0x1101F000 && wide_optimized[1] == 0x10000800);
+    free(wide_optimized);
+    uint16_t no_done[] = {0x0001, 0x5000};
+    assert(optimize_reg(no_done, 2, 0, &len, &report) == NULL);
+
+    printf("All tests passed\n");
+    fflush(stdout);
+}
@@ -0,0 +1,125 @@
+/*
+ * Measure how much a vector instruction saves over doing the same work with
+ * scalar ones. Both programs keep 4 running sums and add the same value to
+ * each of them ROWS times, one with 4 scalar ADDs per row and one with a
+ * single VADD, and we report the time per element and per dispatch on each
+ * engine.
+ */
+
+#include <time.h>
+
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./regbench [dispatch type]\n"
+
+/*
+ * How many rows each program adds up, and how many times we run it. There are
+ * no jumps in the register VM, so the rows are all spelled out.
+ */
+#define ROWS 4096
+#define REPS 200
+#define ADDEND 3
+
+#define PROGRAM_MAX (VEC_LANES * ROWS + 16)
+
+/*
+ * Scalar version: R0-R3 hold the sums and R4 what we add to them.
+ */
+size_t build_scalar(uint16_t *code) {
+    size_t n = 0;
+    for (int i = 0; i < VEC_LANES; i++) {
+        code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, i, 0);
+    }
+    code[n++] = ENCODE_OP_REG_IMM(LOAD_IMM, VEC_LANES, ADDEND);
+    for (int row = 0; row < ROWS; row++) {
+        for (int i = 0; i < VEC_LANES; i++) {
+            code[n++] = ENCODE_OP_REGS(ADD, i, VEC_LANES, i);
+        }
+    }
+    for (int i = 1; i < VEC_LANES; i++) {
+        code[n++] = ENCODE_OP_REGS(ADD, 0, i, 0);
+    }
+    code[n++] = ENCODE_OP_REG(MOV_RES, 0);
+    code[n++] = ENCODE_OP(DONE);
+    return n;
+}
+
+/*
+ * Vector version: V0 holds the sums and V1 what we add to them.
+ */
+size_t build_vector(uint16_t *code) {
+    size_t n = 0;
+    code[n++] = ENCODE_OP_REG_IMM(VLOAD_IMM, 0, 0);
+    code[n++] = ENCODE_OP_REG_IMM(VLOAD_IMM, 1, ADDEND);
+    for (int row = 0; row < ROWS; row++) {
+        code[n++] = ENCODE_OP_REGS(VADD, 0, 1, 0);
+    }
+    code[n++] = ENCODE_OP_REGS(VREDUCE, 0, 0, 0);
+    code[n++] = ENCODE_OP_REG(MOV_RES, 0);
+    code[n++] = ENCODE_OP(DONE);
+    return n;
+}
+
+/*
+ * Run a program REPS times and return the fastest run in nanoseconds.
+ */
+double measure(struct engine *e, uint16_t *code) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result r = e->interpret(code);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (r != SUCCESS || vm.result != (uint64_t) VEC_LANES * ROWS * ADDEND) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+        if (rep == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    static uint16_t scalar[PROGRAM_MAX];
+    static uint16_t vector[PROGRAM_MAX];
+    size_t scalar_len = build_scalar(scalar);
+    size_t vector_len = build_vector(vector);
+    double elements = (double) VEC_LANES * ROWS;
+
+    vm_quiet = 1;
+    double times[NUM_ENGINES][2];
+    for (struct engine *e = first; e < last; e++) {
+        reset_vm();
+        times[e - engines][0] = measure(e, scalar);
+        times[e - engines][1] = measure(e, vector);
+    }
+
+    printf("Vector implementation: %s, %d lanes\n", VEC_IMPL, VEC_LANES);
+    printf("%-10s %8s %14s %14s %10s\n", "engine", "kernel", "ns/element", "ns/dispatch", "speedup");
+    for (struct engine *e = first; e < last; e++) {
+        double *t = times[e - engines];
+        printf("%-10s %8s %14.3f %14.3f %10s\n", e->name, "scalar", t[0] / elements, t[0] / scalar_len, "");
+        printf("%-10s %8s %14.3f %14.3f %9.2fx\n", e->name, "vector", t[1] / elements, t[1] / vector_len,
+               t[0] / t[1]);
+    }
+}
@@ -1,9 +1,16 @@
 #include <assert.h>
+#include <string.h>
 #include <time.h>
 
+#include "../common/container.h"
 #include "vm.h"
 
-#define MAX_SIZE 100
+/*
+ * Only print this many instructions of the program before running it.
+ */
+#define DUMP_MAX 100
+
+#define USAGE_STR "Usage: ./reg-vm <bytecode file> [dispatch type] [--wide]\n"
 
 int main(int argc, char *argv[]) {
 
@@ -15,49 +22,78 @@ int main(int argc, char *argv[]) {
     /*
      * Check for the correct number of arguments.
      */
-    if (argc != 2) {
-        printf("Usage: ./reg-vm <bytecode file>\n");
+    if (argc < 2 || argc > 4) {
+        printf(USAGE_STR);
         exit(EXIT_FAILURE);
     }
 
     /*
-     * Try opening the input file and complain if things go wrong.
+     * Run every engine unless we're asked for a particular one. Programs are in
+     * the 16-bit format unless we're told they're wide.
      */
-    FILE *file = fopen(argv[1], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening source file\n");
-        fflush(stderr);
-        exit(EXIT_FAILURE);
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    int wide = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--wide") == 0) {
+            wide = 1;
+            continue;
+        }
+        first = find_engine(argv[i]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
     }
-
     /*
-     * Read the program source into memory.
+     * Map the program. A container says which format it's in, which overrides
+     * --wide.
      */
-    /*uint16_t code[MAX_SIZE];
-    size_t size_read = fread(code, sizeof(uint16_t), MAX_SIZE, file);
-    if (size_read == 0) {
-        fprintf(stderr, "Error reading source file\n");
+    struct container_info info;
+    container_status status = container_map(argv[1], &info);
+    if (status != CONTAINER_OK) {
+        fprintf(stderr, "Error loading %s: %s\n", argv[1], container_messages[status]);
         fflush(stderr);
         exit(EXIT_FAILURE);
-    }*/
-
-    uint16_t code[] = {
-            ENCODE_OP_REG_IMM(LOAD_IMM, 3, 5),
-            ENCODE_OP_REG(MOV_RES, 3),
-            ENCODE_OP(DONE)
-    };
+    }
+    if (info.is_container) {
+        if (info.isa != CONTAINER_ISA_REG && info.isa != CONTAINER_ISA_REG_WIDE) {
+            fprintf(stderr, "%s holds %s bytecode, not register bytecode\n", argv[1], isa_names[info.isa]);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        wide = info.isa == CONTAINER_ISA_REG_WIDE;
+    }
+    size_t insn_size = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    if (info.entry % insn_size != 0 || info.entry >= info.code_len) {
+        fprintf(stderr, "Entry point is outside the code\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *code = info.code + info.entry;
+    size_t size_read = (info.code_len - info.entry) / insn_size;
 
     /*
      * Print out whatever we just read in.
      */
-    for (size_t i = 0; i < 3; i++) {
-        printf("%zu: %X\n", i, code[i]);
+    for (size_t i = 0; i < size_read && i < DUMP_MAX; i++) {
+        if (wide) {
+            printf("%zu: %08" PRIX32 "\n", i, ((uint32_t *) code)[i]);
+        } else {
+            printf("%zu: %04" PRIX16 "\n", i, ((uint16_t *) code)[i]);
+        }
     }
 
-    reset_vm();
-    result res = interpret(code);
-    assert(res == SUCCESS);
-    assert(vm.result == 5);
+    for (struct engine *e = first; e < last; e++) {
+        reset_vm();
+        printf("Invoking %s\n", e->name);
+        result res = wide ? e->interpret_wide((uint32_t *) code) : e->interpret((uint16_t *) code);
+        assert(res == SUCCESS);
+        printf("Result: %" PRIu64 "\n", vm.result);
+    }
+    container_unmap(&info);
 
     /*
      * Stop the clock.
@@ -65,4 +101,4 @@ int main(int argc, char *argv[]) {
     clock_t end = clock();
     double time_spent = (double) (end - begin) / CLOCKS_PER_SEC;
     printf("Execution took %lf seconds\n", time_spent);
-}
\ No newline at end of file
+}
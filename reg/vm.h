@@ -5,11 +5,47 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /*
- * Our virtual machine has 16 registers with 64 bits each.
+ * Our virtual machine has 256 registers with 64 bits each. The 16-bit
+ * instruction format only has room to name the first 16 of them, so programs
+ * that need more have to use the wide 32-bit format.
+ */
+#define NUM_REGS 256
+#define NUM_NARROW_REGS 16
+
+/*
+ * It also has 8 vector registers with 256 bits each, split into 4 lanes of 64
+ * bits that behave just like the scalar registers. One vector instruction does
+ * the work of 4 scalar ones for the price of a single dispatch.
+ *
+ * The vector operations use AVX2 if we're built with it (-mavx2), pairs of SSE2
+ * registers otherwise, and plain loops over the lanes if we have neither.
  */
-#define NUM_REGS 16
+#define NUM_VREGS 8
+#define VEC_LANES 4
+
+#if defined(__AVX2__)
+#define VEC_IMPL "avx2"
+#elif defined(__SSE2__)
+#define VEC_IMPL "sse2"
+#else
+#define VEC_IMPL "scalar"
+#endif
+
+typedef union {
+    uint64_t lanes[VEC_LANES];
+#if defined(__AVX2__)
+    __m256i ymm;
+#elif defined(__SSE2__)
+    __m128i xmm[2];
+#endif
+} __attribute__((aligned(32))) vreg;
 
 /*
  * Helpful macros for writing bytecode.
@@ -27,18 +63,65 @@
 #define DECODE_R1(instruction)  ((instruction & 0x00F0) >> 4)
 #define DECODE_R2(instruction)  (instruction & 0x000F)
 #define DECODE_IMM(instruction) (instruction & 0x00FF)
+#define DECODE_IMM4(instruction) DECODE_R1(instruction)
 
 /*
- * Helpful macro for direct threading dispatch.
+ * The wide 32-bit format has an 8-bit opcode followed by one of
  *
- * TODO
- * Might have to modify this.
+ *   | op:8 | r0:8 | r1:8 | r2:8 |
+ *   | op:8 | r0:8 | imm:8 | r2:8 |
+ *   | op:8 | r0:8 |   imm:16    |
+ *   | op:8 |       imm:24       |
+ *
+ * Opcodes mean the same thing in both formats; the wide one just has bigger
+ * fields. Nothing uses the 24-bit immediate yet, it's there for jump targets.
+ */
+#define WIDE_ENCODE_OP(op)                   ((uint32_t) (op) << 24)
+#define WIDE_ENCODE_OP_REG(op, reg)          (WIDE_ENCODE_OP(op) | ((uint32_t) (reg) << 16))
+#define WIDE_ENCODE_OP_REG_IMM(op, reg, imm) (WIDE_ENCODE_OP_REG(op, reg) | (imm))
+#define WIDE_ENCODE_OP_REGS(op, r0, r1, r2)  (WIDE_ENCODE_OP_REG(op, r0) | ((r1) << 8) | (r2))
+#define WIDE_ENCODE_OP_IMM(op, imm)          (WIDE_ENCODE_OP(op) | (imm))
+
+#define WIDE_DECODE_OP(instruction)    ((instruction) >> 24)
+#define WIDE_DECODE_R0(instruction)    (((instruction) >> 16) & 0xFF)
+#define WIDE_DECODE_R1(instruction)    (((instruction) >> 8) & 0xFF)
+#define WIDE_DECODE_R2(instruction)    ((instruction) & 0xFF)
+#define WIDE_DECODE_IMM8(instruction)  WIDE_DECODE_R1(instruction)
+#define WIDE_DECODE_IMM16(instruction) ((instruction) & 0xFFFF)
+#define WIDE_DECODE_IMM24(instruction) ((instruction) & 0xFFFFFF)
+
+/*
+ * Vector register operands only have 8 registers to pick from.
+ */
+#define DECODE_V0(instruction)  (DECODE_R0(instruction) & (NUM_VREGS - 1))
+#define DECODE_V1(instruction)  (DECODE_R1(instruction) & (NUM_VREGS - 1))
+#define DECODE_V2(instruction)  (DECODE_R2(instruction) & (NUM_VREGS - 1))
+#define WIDE_DECODE_V0(instruction) (WIDE_DECODE_R0(instruction) & (NUM_VREGS - 1))
+#define WIDE_DECODE_V1(instruction) (WIDE_DECODE_R1(instruction) & (NUM_VREGS - 1))
+#define WIDE_DECODE_V2(instruction) (WIDE_DECODE_R2(instruction) & (NUM_VREGS - 1))
+
+/*
+ * Helpful macro for direct threading dispatch. The opcode lives in the top 4
+ * bits of the instruction, so that's what we index the table with.
+ */
+#define go_next goto *table[DECODE_OP(*vm.instruction_ptr)]
+#define wide_go_next goto *table[WIDE_DECODE_OP(*ip)]
+
+/*
+ * The interpreters can print every instruction as they run it, which is handy
+ * for debugging but swamps everything else. Build with -DREG_TRACE to turn it
+ * on.
  */
-#define go_next goto *table[*vm.instruction_ptr]
+#ifdef REG_TRACE
+#define trace(...) printf(__VA_ARGS__)
+#else
+#define trace(...)
+#endif
 
 struct {
     uint16_t *instruction_ptr;
     uint64_t regs[NUM_REGS];
+    vreg vregs[NUM_VREGS];
     uint64_t result;
 } vm;
 
@@ -52,9 +135,44 @@ typedef enum {
     MUL,
     DIV,
     MOV_RES,
-    DONE
+    DONE,
+
+    /*
+     * Vector instructions. VLOAD_IMM copies its immediate into every lane.
+     * The arithmetic ones work lane by lane with the same operand layout as
+     * their scalar counterparts, and VREDUCE adds up the lanes of V0 into the
+     * scalar register R2.
+     */
+    VLOAD_IMM,
+    VADD,
+    VSUB,
+    VMUL,
+    VAND,
+    VXOR,
+    VREDUCE,
+
+    /*
+     * Scalar arithmetic with a small immediate, R2 = R0 <op> imm, which saves
+     * loading the constant into a register of its own first. The immediate
+     * goes where R1 would be, so it's 4 bits in the 16-bit format and 8 in the
+     * wide one. The shifts only look at the low 6 bits of it.
+     */
+    ADDI,
+    SUBI,
+    MULI,
+    ANDI,
+    SHLI,
+    SHRI,
+    NUM_OPCODES
 } opcode;
 
+/*
+ * Opcodes are 4 bits in the 16-bit format, so there can only ever be 16 of
+ * them there: everything up to SUBI. The wide format has room for 256.
+ */
+#define MAX_OPCODES 16
+#define MAX_WIDE_OPCODES 256
+
 /*
  * Define possible exit statuses for our VM.
  */
@@ -64,8 +182,17 @@ typedef enum result {
     ERR_UNKNOWN_OPCODE
 } result;
 
+/*
+ * Every engine says when it gets to DONE, and reset_vm says it's resetting,
+ * unless the host sets vm_quiet because it runs programs too often to want a
+ * line each time.
+ */
+int vm_quiet;
+
 void reset_vm() {
-    printf("Resetting VM state\n");
+    if (!vm_quiet) {
+        printf("Resetting VM state\n");
+    }
     vm = (typeof(vm)) {NULL};
 }
 
@@ -90,23 +217,142 @@ void do_mul(uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2, uint8_t imm) {
     vm.regs[r2] = vm.regs[r0] * vm.regs[r1];
 }
 
-void do_div(uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2, uint8_t imm) {
+result do_div(uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2, uint8_t imm) {
     if (vm.regs[r1] == 0) {
-        printf("Cannot divide by zero\n");
-        exit(EXIT_FAILURE);
+        return ERR_DIV_ZERO;
     }
     vm.regs[r2] = vm.regs[r0] / vm.regs[r1];
+    return SUCCESS;
 }
 
 void do_mov_res(uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2, uint8_t imm) {
     vm.result = vm.regs[r0];
 }
 
+/*
+ * Lane-wise vector operations.
+ */
+
+void vec_broadcast(vreg *dst, uint64_t val) {
+#if defined(__AVX2__)
+    dst->ymm = _mm256_set1_epi64x((long long) val);
+#elif defined(__SSE2__)
+    dst->xmm[0] = dst->xmm[1] = _mm_set1_epi64x((long long) val);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = val;
+    }
+#endif
+}
+
+void vec_add(vreg *dst, vreg *a, vreg *b) {
+#if defined(__AVX2__)
+    dst->ymm = _mm256_add_epi64(a->ymm, b->ymm);
+#elif defined(__SSE2__)
+    dst->xmm[0] = _mm_add_epi64(a->xmm[0], b->xmm[0]);
+    dst->xmm[1] = _mm_add_epi64(a->xmm[1], b->xmm[1]);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = a->lanes[i] + b->lanes[i];
+    }
+#endif
+}
+
+void vec_sub(vreg *dst, vreg *a, vreg *b) {
+#if defined(__AVX2__)
+    dst->ymm = _mm256_sub_epi64(a->ymm, b->ymm);
+#elif defined(__SSE2__)
+    dst->xmm[0] = _mm_sub_epi64(a->xmm[0], b->xmm[0]);
+    dst->xmm[1] = _mm_sub_epi64(a->xmm[1], b->xmm[1]);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = a->lanes[i] - b->lanes[i];
+    }
+#endif
+}
+
+/*
+ * Neither AVX2 nor SSE2 can multiply 64-bit lanes, only the low 32 bits of
+ * each. Writing a = ah * 2^32 + al and the same for b, the low 64 bits of the
+ * product are al * bl + ((ah * bl + al * bh) << 32), which is three 32-bit
+ * multiplies.
+ */
+#if defined(__AVX2__)
+__m256i mul_epi64_256(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+#elif defined(__SSE2__)
+__m128i mul_epi64_128(__m128i a, __m128i b) {
+    __m128i low = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(low, _mm_slli_epi64(cross, 32));
+}
+#endif
+
+void vec_mul(vreg *dst, vreg *a, vreg *b) {
+#if defined(__AVX2__)
+    dst->ymm = mul_epi64_256(a->ymm, b->ymm);
+#elif defined(__SSE2__)
+    dst->xmm[0] = mul_epi64_128(a->xmm[0], b->xmm[0]);
+    dst->xmm[1] = mul_epi64_128(a->xmm[1], b->xmm[1]);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = a->lanes[i] * b->lanes[i];
+    }
+#endif
+}
+
+void vec_and(vreg *dst, vreg *a, vreg *b) {
+#if defined(__AVX2__)
+    dst->ymm = _mm256_and_si256(a->ymm, b->ymm);
+#elif defined(__SSE2__)
+    dst->xmm[0] = _mm_and_si128(a->xmm[0], b->xmm[0]);
+    dst->xmm[1] = _mm_and_si128(a->xmm[1], b->xmm[1]);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = a->lanes[i] & b->lanes[i];
+    }
+#endif
+}
+
+void vec_xor(vreg *dst, vreg *a, vreg *b) {
+#if defined(__AVX2__)
+    dst->ymm = _mm256_xor_si256(a->ymm, b->ymm);
+#elif defined(__SSE2__)
+    dst->xmm[0] = _mm_xor_si128(a->xmm[0], b->xmm[0]);
+    dst->xmm[1] = _mm_xor_si128(a->xmm[1], b->xmm[1]);
+#else
+    for (int i = 0; i < VEC_LANES; i++) {
+        dst->lanes[i] = a->lanes[i] ^ b->lanes[i];
+    }
+#endif
+}
+
+uint64_t vec_reduce(vreg *a) {
+#if defined(__AVX2__)
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(a->ymm), _mm256_extracti128_si256(a->ymm, 1));
+    return (uint64_t) _mm_cvtsi128_si64(_mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum)));
+#elif defined(__SSE2__)
+    __m128i sum = _mm_add_epi64(a->xmm[0], a->xmm[1]);
+    return (uint64_t) _mm_cvtsi128_si64(_mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum)));
+#else
+    uint64_t sum = 0;
+    for (int i = 0; i < VEC_LANES; i++) {
+        sum += a->lanes[i];
+    }
+    return sum;
+#endif
+}
+
 /*
  * Direct threading dispatch using computed GOTO statements.
  */
 result threaded_interpret(uint16_t *bytecode) {
-    printf("Inside threaded dispatch\n");
+    trace("Inside threaded dispatch\n");
 
     /*
      * Set the instruction pointer to the start of the code array.
@@ -115,31 +361,33 @@ result threaded_interpret(uint16_t *bytecode) {
 
     /*
      * This is our lookup table of GOTO labels for each instruction. We can use
-     * the opcode to index into this table.
+     * the opcode to index into this table. Opcodes are 4 bits, and all 16 of
+     * them are taken, so there's nothing unknown to jump to.
      */
-    void *table[] = {
+    void *table[MAX_OPCODES] = {
             &&load_imm_label,
             &&add_label,
             &&sub_label,
             &&mul_label,
             &&div_label,
-            &&mov_res_label
+            &&mov_res_label,
+            &&done_label,
+            &&vload_imm_label,
+            &&vadd_label,
+            &&vsub_label,
+            &&vmul_label,
+            &&vand_label,
+            &&vxor_label,
+            &&vreduce_label,
+            &&addi_label,
+            &&subi_label
     };
 
     /*
      * Define the pieces of our instructions.
      */
     uint8_t op, r0, r1, r2, imm;
-
-    /*
-     * Fetch the next instruction and decode its arguments.
-     */
-    uint16_t instruction = *vm.instruction_ptr;
-    op = DECODE_OP(instruction);
-    r0 = DECODE_R0(instruction);
-    r1 = DECODE_R1(instruction);
-    r2 = DECODE_R2(instruction);
-    imm = DECODE_IMM(instruction);
+    uint16_t instruction;
 
     /*
      * Get the ball rolling.
@@ -151,7 +399,7 @@ result threaded_interpret(uint16_t *bytecode) {
      */
 
     load_imm_label:
-    printf("Doing LOAD_IMM\n");
+    trace("Doing LOAD_IMM\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
@@ -162,7 +410,7 @@ result threaded_interpret(uint16_t *bytecode) {
     go_next;
 
     add_label:
-    printf("Doing ADD\n");
+    trace("Doing ADD\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
@@ -173,7 +421,7 @@ result threaded_interpret(uint16_t *bytecode) {
     go_next;
 
     sub_label:
-    printf("Doing SUB\n");
+    trace("Doing SUB\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
@@ -184,7 +432,7 @@ result threaded_interpret(uint16_t *bytecode) {
     go_next;
 
     mul_label:
-    printf("Doing MUL\n");
+    trace("Doing MUL\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
@@ -195,18 +443,20 @@ result threaded_interpret(uint16_t *bytecode) {
     go_next;
 
     div_label:
-    printf("Doing DIV\n");
+    trace("Doing DIV\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
     r1 = DECODE_R1(instruction);
     r2 = DECODE_R2(instruction);
     imm = DECODE_IMM(instruction);
-    do_div(op, r0, r1, r2, imm);
+    if (do_div(op, r0, r1, r2, imm) != SUCCESS) {
+        return ERR_DIV_ZERO;
+    }
     go_next;
 
     mov_res_label:
-    printf("Doing MOV_RES\n");
+    trace("Doing MOV_RES\n");
     instruction = *vm.instruction_ptr++;
     op = DECODE_OP(instruction);
     r0 = DECODE_R0(instruction);
@@ -216,8 +466,69 @@ result threaded_interpret(uint16_t *bytecode) {
     do_mov_res(op, r0, r1, r2, imm);
     go_next;
 
+    vload_imm_label:
+    trace("Doing VLOAD_IMM\n");
+    instruction = *vm.instruction_ptr++;
+    vec_broadcast(&vm.vregs[DECODE_V0(instruction)], DECODE_IMM(instruction));
+    go_next;
+
+    vadd_label:
+    trace("Doing VADD\n");
+    instruction = *vm.instruction_ptr++;
+    vec_add(&vm.vregs[DECODE_V2(instruction)], &vm.vregs[DECODE_V0(instruction)],
+            &vm.vregs[DECODE_V1(instruction)]);
+    go_next;
+
+    vsub_label:
+    trace("Doing VSUB\n");
+    instruction = *vm.instruction_ptr++;
+    vec_sub(&vm.vregs[DECODE_V2(instruction)], &vm.vregs[DECODE_V0(instruction)],
+            &vm.vregs[DECODE_V1(instruction)]);
+    go_next;
+
+    vmul_label:
+    trace("Doing VMUL\n");
+    instruction = *vm.instruction_ptr++;
+    vec_mul(&vm.vregs[DECODE_V2(instruction)], &vm.vregs[DECODE_V0(instruction)],
+            &vm.vregs[DECODE_V1(instruction)]);
+    go_next;
+
+    vand_label:
+    trace("Doing VAND\n");
+    instruction = *vm.instruction_ptr++;
+    vec_and(&vm.vregs[DECODE_V2(instruction)], &vm.vregs[DECODE_V0(instruction)],
+            &vm.vregs[DECODE_V1(instruction)]);
+    go_next;
+
+    vxor_label:
+    trace("Doing VXOR\n");
+    instruction = *vm.instruction_ptr++;
+    vec_xor(&vm.vregs[DECODE_V2(instruction)], &vm.vregs[DECODE_V0(instruction)],
+            &vm.vregs[DECODE_V1(instruction)]);
+    go_next;
+
+    vreduce_label:
+    trace("Doing VREDUCE\n");
+    instruction = *vm.instruction_ptr++;
+    vm.regs[DECODE_R2(instruction)] = vec_reduce(&vm.vregs[DECODE_V0(instruction)]);
+    go_next;
+
+    addi_label:
+    trace("Doing ADDI\n");
+    instruction = *vm.instruction_ptr++;
+    vm.regs[DECODE_R2(instruction)] = vm.regs[DECODE_R0(instruction)] + DECODE_IMM4(instruction);
+    go_next;
+
+    subi_label:
+    trace("Doing SUBI\n");
+    instruction = *vm.instruction_ptr++;
+    vm.regs[DECODE_R2(instruction)] = vm.regs[DECODE_R0(instruction)] - DECODE_IMM4(instruction);
+    go_next;
+
     done_label:
-    printf("Done!\n");
+    if (!vm_quiet) {
+        printf("Done!\n");
+    }
     return SUCCESS;
 }
 
@@ -253,35 +564,377 @@ result interpret(uint16_t *bytecode) {
          */
         switch (op) {
             case LOAD_IMM:
-                printf("LOAD_IMM %" PRIu8 "\n", imm);
+                trace("LOAD_IMM %" PRIu8 "\n", imm);
+                vm.regs[r0] = imm;
+                break;
+            case ADD:
+                trace("ADD\n");
+                vm.regs[r2] = vm.regs[r0] + vm.regs[r1];
+                break;
+            case SUB:
+                trace("SUB\n");
+                vm.regs[r2] = vm.regs[r0] - vm.regs[r1];
+                break;
+            case MUL:
+                trace("MUL\n");
+                vm.regs[r2] = vm.regs[r0] * vm.regs[r1];
+                break;
+            case DIV:
+                trace("DIV\n");
+                if (vm.regs[r1] == 0) {
+                    return ERR_DIV_ZERO;
+                }
+                vm.regs[r2] = vm.regs[r0] / vm.regs[r1];
+                break;
+            case MOV_RES:
+                trace("MOV_RES %" PRIu64 "\n", vm.regs[r0]);
+                vm.result = vm.regs[r0];
+                break;
+            case DONE:
+                if (!vm_quiet) {
+                    printf("DONE\n");
+                }
+                return SUCCESS;
+            case VLOAD_IMM:
+                trace("VLOAD_IMM %" PRIu8 "\n", imm);
+                vec_broadcast(&vm.vregs[r0 & (NUM_VREGS - 1)], imm);
+                break;
+            case VADD:
+                trace("VADD\n");
+                vec_add(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VSUB:
+                trace("VSUB\n");
+                vec_sub(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VMUL:
+                trace("VMUL\n");
+                vec_mul(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VAND:
+                trace("VAND\n");
+                vec_and(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VXOR:
+                trace("VXOR\n");
+                vec_xor(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VREDUCE:
+                trace("VREDUCE\n");
+                vm.regs[r2] = vec_reduce(&vm.vregs[r0 & (NUM_VREGS - 1)]);
+                break;
+            case ADDI:
+                trace("ADDI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] + r1;
+                break;
+            case SUBI:
+                trace("SUBI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] - r1;
+                break;
+            default:
+                fprintf(stderr, "Unknown opcode\n");
+                fflush(stderr);
+                return ERR_UNKNOWN_OPCODE;
+        }
+    }
+}
+
+/*
+ * The same two engines for the wide format. The wide instruction pointer is
+ * kept in a local, since vm.instruction_ptr points at 16-bit instructions.
+ */
+result threaded_interpret_wide(uint32_t *bytecode) {
+    trace("Inside wide threaded dispatch\n");
+    uint32_t *ip = bytecode;
+
+    /*
+     * Every opcode we don't know goes to unknown_label.
+     */
+    void *table[MAX_WIDE_OPCODES] = {
+            [0 ... MAX_WIDE_OPCODES - 1] = &&unknown_label,
+            [LOAD_IMM] = &&load_imm_label,
+            [ADD] = &&add_label,
+            [SUB] = &&sub_label,
+            [MUL] = &&mul_label,
+            [DIV] = &&div_label,
+            [MOV_RES] = &&mov_res_label,
+            [DONE] = &&done_label,
+            [VLOAD_IMM] = &&vload_imm_label,
+            [VADD] = &&vadd_label,
+            [VSUB] = &&vsub_label,
+            [VMUL] = &&vmul_label,
+            [VAND] = &&vand_label,
+            [VXOR] = &&vxor_label,
+            [VREDUCE] = &&vreduce_label,
+            [ADDI] = &&addi_label,
+            [SUBI] = &&subi_label,
+            [MULI] = &&muli_label,
+            [ANDI] = &&andi_label,
+            [SHLI] = &&shli_label,
+            [SHRI] = &&shri_label
+    };
+    uint32_t instruction;
+
+    /*
+     * Get the ball rolling.
+     */
+    wide_go_next;
+
+    load_imm_label:
+    trace("Doing LOAD_IMM\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R0(instruction)] = WIDE_DECODE_IMM16(instruction);
+    wide_go_next;
+
+    add_label:
+    trace("Doing ADD\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] +
+                                           vm.regs[WIDE_DECODE_R1(instruction)];
+    wide_go_next;
+
+    sub_label:
+    trace("Doing SUB\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] -
+                                           vm.regs[WIDE_DECODE_R1(instruction)];
+    wide_go_next;
+
+    mul_label:
+    trace("Doing MUL\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] *
+                                           vm.regs[WIDE_DECODE_R1(instruction)];
+    wide_go_next;
+
+    div_label:
+    trace("Doing DIV\n");
+    instruction = *ip++;
+    if (vm.regs[WIDE_DECODE_R1(instruction)] == 0) {
+        return ERR_DIV_ZERO;
+    }
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] /
+                                           vm.regs[WIDE_DECODE_R1(instruction)];
+    wide_go_next;
+
+    mov_res_label:
+    trace("Doing MOV_RES\n");
+    instruction = *ip++;
+    vm.result = vm.regs[WIDE_DECODE_R0(instruction)];
+    wide_go_next;
+
+    vload_imm_label:
+    trace("Doing VLOAD_IMM\n");
+    instruction = *ip++;
+    vec_broadcast(&vm.vregs[WIDE_DECODE_V0(instruction)], WIDE_DECODE_IMM16(instruction));
+    wide_go_next;
+
+    vadd_label:
+    trace("Doing VADD\n");
+    instruction = *ip++;
+    vec_add(&vm.vregs[WIDE_DECODE_V2(instruction)], &vm.vregs[WIDE_DECODE_V0(instruction)],
+            &vm.vregs[WIDE_DECODE_V1(instruction)]);
+    wide_go_next;
+
+    vsub_label:
+    trace("Doing VSUB\n");
+    instruction = *ip++;
+    vec_sub(&vm.vregs[WIDE_DECODE_V2(instruction)], &vm.vregs[WIDE_DECODE_V0(instruction)],
+            &vm.vregs[WIDE_DECODE_V1(instruction)]);
+    wide_go_next;
+
+    vmul_label:
+    trace("Doing VMUL\n");
+    instruction = *ip++;
+    vec_mul(&vm.vregs[WIDE_DECODE_V2(instruction)], &vm.vregs[WIDE_DECODE_V0(instruction)],
+            &vm.vregs[WIDE_DECODE_V1(instruction)]);
+    wide_go_next;
+
+    vand_label:
+    trace("Doing VAND\n");
+    instruction = *ip++;
+    vec_and(&vm.vregs[WIDE_DECODE_V2(instruction)], &vm.vregs[WIDE_DECODE_V0(instruction)],
+            &vm.vregs[WIDE_DECODE_V1(instruction)]);
+    wide_go_next;
+
+    vxor_label:
+    trace("Doing VXOR\n");
+    instruction = *ip++;
+    vec_xor(&vm.vregs[WIDE_DECODE_V2(instruction)], &vm.vregs[WIDE_DECODE_V0(instruction)],
+            &vm.vregs[WIDE_DECODE_V1(instruction)]);
+    wide_go_next;
+
+    vreduce_label:
+    trace("Doing VREDUCE\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vec_reduce(&vm.vregs[WIDE_DECODE_V0(instruction)]);
+    wide_go_next;
+
+    addi_label:
+    trace("Doing ADDI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] + WIDE_DECODE_IMM8(instruction);
+    wide_go_next;
+
+    subi_label:
+    trace("Doing SUBI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] - WIDE_DECODE_IMM8(instruction);
+    wide_go_next;
+
+    muli_label:
+    trace("Doing MULI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] * WIDE_DECODE_IMM8(instruction);
+    wide_go_next;
+
+    andi_label:
+    trace("Doing ANDI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] & WIDE_DECODE_IMM8(instruction);
+    wide_go_next;
+
+    shli_label:
+    trace("Doing SHLI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] <<
+                                           (WIDE_DECODE_IMM8(instruction) & 63);
+    wide_go_next;
+
+    shri_label:
+    trace("Doing SHRI\n");
+    instruction = *ip++;
+    vm.regs[WIDE_DECODE_R2(instruction)] = vm.regs[WIDE_DECODE_R0(instruction)] >>
+                                           (WIDE_DECODE_IMM8(instruction) & 63);
+    wide_go_next;
+
+    done_label:
+    if (!vm_quiet) {
+        printf("Done!\n");
+    }
+    return SUCCESS;
+
+    unknown_label:
+    fprintf(stderr, "Unknown opcode\n");
+    fflush(stderr);
+    return ERR_UNKNOWN_OPCODE;
+}
+
+result interpret_wide(uint32_t *bytecode) {
+    uint32_t *ip = bytecode;
+    uint8_t op;
+    uint8_t r0;
+    uint8_t r1;
+    uint8_t r2;
+    uint16_t imm;
+
+    for (;;) {
+
+        /*
+         * Fetch the next instruction and decode its arguments.
+         */
+        uint32_t instruction = *ip++;
+        op = WIDE_DECODE_OP(instruction);
+        r0 = WIDE_DECODE_R0(instruction);
+        r1 = WIDE_DECODE_R1(instruction);
+        r2 = WIDE_DECODE_R2(instruction);
+        imm = WIDE_DECODE_IMM16(instruction);
+
+        switch (op) {
+            case LOAD_IMM:
+                trace("LOAD_IMM %" PRIu16 "\n", imm);
                 vm.regs[r0] = imm;
                 break;
             case ADD:
-                printf("ADD\n");
+                trace("ADD\n");
                 vm.regs[r2] = vm.regs[r0] + vm.regs[r1];
                 break;
             case SUB:
-                printf("SUB\n");
+                trace("SUB\n");
                 vm.regs[r2] = vm.regs[r0] - vm.regs[r1];
                 break;
             case MUL:
-                printf("MUL\n");
+                trace("MUL\n");
                 vm.regs[r2] = vm.regs[r0] * vm.regs[r1];
                 break;
             case DIV:
-                printf("DIV\n");
+                trace("DIV\n");
                 if (vm.regs[r1] == 0) {
                     return ERR_DIV_ZERO;
                 }
                 vm.regs[r2] = vm.regs[r0] / vm.regs[r1];
                 break;
             case MOV_RES:
-                printf("MOV_RES %" PRIu64 "\n", vm.regs[r0]);
+                trace("MOV_RES %" PRIu64 "\n", vm.regs[r0]);
                 vm.result = vm.regs[r0];
                 break;
             case DONE:
-                printf("DONE\n");
+                if (!vm_quiet) {
+                    printf("DONE\n");
+                }
                 return SUCCESS;
+            case VLOAD_IMM:
+                trace("VLOAD_IMM %" PRIu16 "\n", imm);
+                vec_broadcast(&vm.vregs[r0 & (NUM_VREGS - 1)], imm);
+                break;
+            case VADD:
+                trace("VADD\n");
+                vec_add(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VSUB:
+                trace("VSUB\n");
+                vec_sub(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VMUL:
+                trace("VMUL\n");
+                vec_mul(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VAND:
+                trace("VAND\n");
+                vec_and(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VXOR:
+                trace("VXOR\n");
+                vec_xor(&vm.vregs[r2 & (NUM_VREGS - 1)], &vm.vregs[r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[r1 & (NUM_VREGS - 1)]);
+                break;
+            case VREDUCE:
+                trace("VREDUCE\n");
+                vm.regs[r2] = vec_reduce(&vm.vregs[r0 & (NUM_VREGS - 1)]);
+                break;
+            case ADDI:
+                trace("ADDI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] + r1;
+                break;
+            case SUBI:
+                trace("SUBI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] - r1;
+                break;
+            case MULI:
+                trace("MULI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] * r1;
+                break;
+            case ANDI:
+                trace("ANDI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] & r1;
+                break;
+            case SHLI:
+                trace("SHLI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] << (r1 & 63);
+                break;
+            case SHRI:
+                trace("SHRI %" PRIu8 "\n", r1);
+                vm.regs[r2] = vm.regs[r0] >> (r1 & 63);
+                break;
             default:
                 fprintf(stderr, "Unknown opcode\n");
                 fflush(stderr);
@@ -290,4 +943,353 @@ result interpret(uint16_t *bytecode) {
     }
 }
 
+/*
+ * Register pinning. Every other engine goes through vm.regs for every operand,
+ * so even ADD is two loads and a store. This one keeps the lowest PINNED_REGS
+ * VM registers in C locals for the whole run and only writes them back to
+ * vm.regs when it stops.
+ *
+ * Locals can't be indexed, so there's a separate handler for every way an
+ * instruction's operands can fall: each operand is either one of the pinned
+ * registers or "mem", meaning anything else. Before running, we translate the
+ * program into pinned_insns whose key says which handler to use, and the
+ * handlers are all spelled out by the PIN_ macros below.
+ *
+ * At -O0, GCC only keeps variables in registers if they're declared register,
+ * so the locals are.
+ */
+#ifndef PINNED_REGS
+#define PINNED_REGS 4
+#endif
+#if PINNED_REGS < 0 || PINNED_REGS > 4
+#error "PINNED_REGS has to be between 0 and 4"
+#endif
+
+/*
+ * Operand slots: one per pinned register, plus one for the rest.
+ */
+#define PINNED_SLOTS (PINNED_REGS + 1)
+#define PIN_SLOT(r) ((r) < PINNED_REGS ? (r) : PINNED_REGS)
+#define pinned_key(op, s0, s1, s2) ((((op) * PINNED_SLOTS + (s0)) * PINNED_SLOTS + (s1)) * PINNED_SLOTS + (s2))
+
+/*
+ * A translated instruction. Registers are kept even when they're pinned, since
+ * that's simpler than not, but the handlers only look at the ones that aren't.
+ */
+struct pinned_insn {
+    uint16_t key;
+    uint16_t imm;
+    uint8_t r0;
+    uint8_t r1;
+    uint8_t r2;
+};
+
+/*
+ * How to name the operand in each slot, and what key it contributes.
+ */
+#define PIN_0(r) p0
+#define PIN_1(r) p1
+#define PIN_2(r) p2
+#define PIN_3(r) p3
+#define PIN_mem(r) vm.regs[r]
+#define PIN_KEY_0 0
+#define PIN_KEY_1 1
+#define PIN_KEY_2 2
+#define PIN_KEY_3 3
+#define PIN_KEY_mem PINNED_REGS
+
+/*
+ * PIN_IFn(x) is x if register n is pinned, and nothing otherwise.
+ */
+#if PINNED_REGS > 0
+#define PIN_IF0(x) x
+#else
+#define PIN_IF0(x)
+#endif
+#if PINNED_REGS > 1
+#define PIN_IF1(x) x
+#else
+#define PIN_IF1(x)
+#endif
+#if PINNED_REGS > 2
+#define PIN_IF2(x) x
+#else
+#define PIN_IF2(x)
+#endif
+#if PINNED_REGS > 3
+#define PIN_IF3(x) x
+#else
+#define PIN_IF3(x)
+#endif
+
+/*
+ * Call F once per slot. The preprocessor won't expand a macro inside its own
+ * expansion, so we need one copy for each operand we iterate over.
+ */
+#define PIN_EACH_A(F, ...) PIN_IF0(F(0, __VA_ARGS__)) PIN_IF1(F(1, __VA_ARGS__)) \
+                           PIN_IF2(F(2, __VA_ARGS__)) PIN_IF3(F(3, __VA_ARGS__)) F(mem, __VA_ARGS__)
+#define PIN_EACH_B(F, ...) PIN_IF0(F(0, __VA_ARGS__)) PIN_IF1(F(1, __VA_ARGS__)) \
+                           PIN_IF2(F(2, __VA_ARGS__)) PIN_IF3(F(3, __VA_ARGS__)) F(mem, __VA_ARGS__)
+#define PIN_EACH_C(F, ...) PIN_IF0(F(0, __VA_ARGS__)) PIN_IF1(F(1, __VA_ARGS__)) \
+                           PIN_IF2(F(2, __VA_ARGS__)) PIN_IF3(F(3, __VA_ARGS__)) F(mem, __VA_ARGS__)
+
+/*
+ * R2 = R0 <sym> R1, for every combination of slots.
+ */
+#define PIN_BINARY_C(s2, op, sym, s0, s1)                                      \
+    case pinned_key(op, PIN_KEY_##s0, PIN_KEY_##s1, PIN_KEY_##s2):             \
+        PIN_##s2(ip->r2) = PIN_##s0(ip->r0) sym PIN_##s1(ip->r1);              \
+        break;
+#define PIN_BINARY_B(s1, op, sym, s0) PIN_EACH_C(PIN_BINARY_C, op, sym, s0, s1)
+#define PIN_BINARY_A(s0, op, sym) PIN_EACH_B(PIN_BINARY_B, op, sym, s0)
+#define PIN_BINARY_CASES(op, sym) PIN_EACH_A(PIN_BINARY_A, op, sym)
+
+/*
+ * R2 = R0 <sym> imm. The translation has already masked shift amounts.
+ */
+#define PIN_IMM_B(s2, op, sym, s0)                                             \
+    case pinned_key(op, PIN_KEY_##s0, 0, PIN_KEY_##s2):                        \
+        PIN_##s2(ip->r2) = PIN_##s0(ip->r0) sym ip->imm;                       \
+        break;
+#define PIN_IMM_A(s0, op, sym) PIN_EACH_B(PIN_IMM_B, op, sym, s0)
+#define PIN_IMM_CASES(op, sym) PIN_EACH_A(PIN_IMM_A, op, sym)
+
+/*
+ * Same for DIV, which has to check for zero first.
+ */
+#define PIN_DIV_C(s2, s0, s1)                                                  \
+    case pinned_key(DIV, PIN_KEY_##s0, PIN_KEY_##s1, PIN_KEY_##s2):            \
+        if (PIN_##s1(ip->r1) == 0) {                                           \
+            status = ERR_DIV_ZERO;                                             \
+            goto done;                                                         \
+        }                                                                      \
+        PIN_##s2(ip->r2) = PIN_##s0(ip->r0) / PIN_##s1(ip->r1);                \
+        break;
+#define PIN_DIV_B(s1, s0) PIN_EACH_C(PIN_DIV_C, s0, s1)
+#define PIN_DIV_A(s0, unused) PIN_EACH_B(PIN_DIV_B, s0)
+#define PIN_DIV_CASES PIN_EACH_A(PIN_DIV_A, unused)
+
+/*
+ * Instructions with a single scalar register operand.
+ */
+#define PIN_LOAD_IMM_CASE(s0, unused)                                          \
+    case pinned_key(LOAD_IMM, PIN_KEY_##s0, 0, 0):                             \
+        PIN_##s0(ip->r0) = ip->imm;                                            \
+        break;
+#define PIN_MOV_RES_CASE(s0, unused)                                           \
+    case pinned_key(MOV_RES, PIN_KEY_##s0, 0, 0):                              \
+        vm.result = PIN_##s0(ip->r0);                                          \
+        break;
+#define PIN_VREDUCE_CASE(s2, unused)                                           \
+    case pinned_key(VREDUCE, 0, 0, PIN_KEY_##s2):                              \
+        PIN_##s2(ip->r2) = vec_reduce(&vm.vregs[ip->r0 & (NUM_VREGS - 1)]);    \
+        break;
+
+/*
+ * Turn an opcode and its decoded operands into a pinned_insn. Operands an
+ * opcode doesn't have are left out of the key so that each instruction only
+ * has one handler.
+ */
+void translate_pinned_insn(struct pinned_insn *insn, uint8_t op, uint8_t r0, uint8_t r1, uint8_t r2,
+                           uint16_t imm) {
+    insn->imm = imm;
+    insn->r0 = r0;
+    insn->r1 = r1;
+    insn->r2 = r2;
+    switch (op) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            insn->key = pinned_key(op, PIN_SLOT(r0), PIN_SLOT(r1), PIN_SLOT(r2));
+            break;
+        case LOAD_IMM:
+        case MOV_RES:
+            insn->key = pinned_key(op, PIN_SLOT(r0), 0, 0);
+            break;
+        case VREDUCE:
+            insn->key = pinned_key(op, 0, 0, PIN_SLOT(r2));
+            break;
+        case SHLI:
+        case SHRI:
+            insn->imm = r1 & 63;
+            insn->key = pinned_key(op, PIN_SLOT(r0), 0, PIN_SLOT(r2));
+            break;
+        case ADDI:
+        case SUBI:
+        case MULI:
+        case ANDI:
+            insn->imm = r1;
+            insn->key = pinned_key(op, PIN_SLOT(r0), 0, PIN_SLOT(r2));
+            break;
+        case DONE:
+        case VLOAD_IMM:
+        case VADD:
+        case VSUB:
+        case VMUL:
+        case VAND:
+        case VXOR:
+            insn->key = pinned_key(op, 0, 0, 0);
+            break;
+        default:
+            insn->key = pinned_key(NUM_OPCODES, 0, 0, 0);
+            break;
+    }
+}
+
+/*
+ * The register VM has no jumps, so a program ends at its first DONE, or at the
+ * first opcode we don't know, which becomes an instruction that fails. Returns
+ * a malloc'd array the caller frees.
+ */
+struct pinned_insn *translate_pinned(uint16_t *narrow, uint32_t *wide) {
+    size_t len = 0;
+    for (;; len++) {
+        uint8_t op = narrow ? DECODE_OP(narrow[len]) : WIDE_DECODE_OP(wide[len]);
+        if (op == DONE || op >= NUM_OPCODES) {
+            len++;
+            break;
+        }
+    }
+    struct pinned_insn *code = malloc(len * sizeof(struct pinned_insn));
+    if (code == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (narrow) {
+            translate_pinned_insn(&code[i], DECODE_OP(narrow[i]), DECODE_R0(narrow[i]), DECODE_R1(narrow[i]),
+                                  DECODE_R2(narrow[i]), DECODE_IMM(narrow[i]));
+        } else {
+            translate_pinned_insn(&code[i], WIDE_DECODE_OP(wide[i]), WIDE_DECODE_R0(wide[i]),
+                                  WIDE_DECODE_R1(wide[i]), WIDE_DECODE_R2(wide[i]), WIDE_DECODE_IMM16(wide[i]));
+        }
+    }
+    return code;
+}
+
+result run_pinned(struct pinned_insn *code) {
+    PIN_IF0(register uint64_t p0 = vm.regs[0];)
+    PIN_IF1(register uint64_t p1 = vm.regs[1];)
+    PIN_IF2(register uint64_t p2 = vm.regs[2];)
+    PIN_IF3(register uint64_t p3 = vm.regs[3];)
+    result status;
+    for (struct pinned_insn *ip = code;; ip++) {
+        switch (ip->key) {
+            PIN_BINARY_CASES(ADD, +)
+            PIN_BINARY_CASES(SUB, -)
+            PIN_BINARY_CASES(MUL, *)
+            PIN_DIV_CASES
+            PIN_IMM_CASES(ADDI, +)
+            PIN_IMM_CASES(SUBI, -)
+            PIN_IMM_CASES(MULI, *)
+            PIN_IMM_CASES(ANDI, &)
+            PIN_IMM_CASES(SHLI, <<)
+            PIN_IMM_CASES(SHRI, >>)
+            PIN_EACH_A(PIN_LOAD_IMM_CASE, unused)
+            PIN_EACH_A(PIN_MOV_RES_CASE, unused)
+            PIN_EACH_A(PIN_VREDUCE_CASE, unused)
+            case pinned_key(VLOAD_IMM, 0, 0, 0):
+                vec_broadcast(&vm.vregs[ip->r0 & (NUM_VREGS - 1)], ip->imm);
+                break;
+            case pinned_key(VADD, 0, 0, 0):
+                vec_add(&vm.vregs[ip->r2 & (NUM_VREGS - 1)], &vm.vregs[ip->r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[ip->r1 & (NUM_VREGS - 1)]);
+                break;
+            case pinned_key(VSUB, 0, 0, 0):
+                vec_sub(&vm.vregs[ip->r2 & (NUM_VREGS - 1)], &vm.vregs[ip->r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[ip->r1 & (NUM_VREGS - 1)]);
+                break;
+            case pinned_key(VMUL, 0, 0, 0):
+                vec_mul(&vm.vregs[ip->r2 & (NUM_VREGS - 1)], &vm.vregs[ip->r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[ip->r1 & (NUM_VREGS - 1)]);
+                break;
+            case pinned_key(VAND, 0, 0, 0):
+                vec_and(&vm.vregs[ip->r2 & (NUM_VREGS - 1)], &vm.vregs[ip->r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[ip->r1 & (NUM_VREGS - 1)]);
+                break;
+            case pinned_key(VXOR, 0, 0, 0):
+                vec_xor(&vm.vregs[ip->r2 & (NUM_VREGS - 1)], &vm.vregs[ip->r0 & (NUM_VREGS - 1)],
+                        &vm.vregs[ip->r1 & (NUM_VREGS - 1)]);
+                break;
+            case pinned_key(DONE, 0, 0, 0):
+                if (!vm_quiet) {
+                    printf("Done!\n");
+                }
+                status = SUCCESS;
+                goto done;
+            default:
+                fprintf(stderr, "Unknown opcode\n");
+                fflush(stderr);
+                status = ERR_UNKNOWN_OPCODE;
+                goto done;
+        }
+    }
+
+    /*
+     * Write the pinned registers back so the VM looks the same as it would
+     * after any other engine.
+     */
+    done:
+    PIN_IF0(vm.regs[0] = p0;)
+    PIN_IF1(vm.regs[1] = p1;)
+    PIN_IF2(vm.regs[2] = p2;)
+    PIN_IF3(vm.regs[3] = p3;)
+    return status;
+}
+
+result pinned_interpret(uint16_t *bytecode) {
+    struct pinned_insn *code = translate_pinned(bytecode, NULL);
+    if (code == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    result r = run_pinned(code);
+    free(code);
+    return r;
+}
+
+result pinned_interpret_wide(uint32_t *bytecode) {
+    struct pinned_insn *code = translate_pinned(NULL, bytecode);
+    if (code == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    result r = run_pinned(code);
+    free(code);
+    return r;
+}
+
+/*
+ * Every engine runs both formats, so we keep them in a table and look them up
+ * by name, like the stack VM does.
+ */
+typedef result (*engine_fn)(uint16_t *bytecode);
+typedef result (*wide_engine_fn)(uint32_t *bytecode);
+
+struct engine {
+    const char *name;
+    engine_fn interpret;
+    wide_engine_fn interpret_wide;
+};
+
+struct engine engines[] = {
+        {"switch",   interpret,          interpret_wide},
+        {"threaded", threaded_interpret, threaded_interpret_wide},
+        {"pinned",   pinned_interpret,   pinned_interpret_wide}
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/*
+ * Returns NULL if we don't have an engine with the given name.
+ */
+struct engine *find_engine(const char *name) {
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            return &engines[i];
+        }
+    }
+    return NULL;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#!/usr/bin/env bash
+
+#
+# See how each engine copes as programs grow from a hundred bytes to many
+# megabytes. Prints nanoseconds per VM instruction for every engine at every
+# size. Extra arguments are passed on to stackgen, e.g. ./scale.sh -e 1 -d 2
+#
+
+make stckvm stackgen > /dev/null
+mkdir -p scale_output
+
+printf "%10s" "bytes"
+for engine in inline func threaded replicated call tail; do
+    printf " %10s" $engine
+done
+printf "\n"
+
+for size in 100 1000 10000 100000 1000000 10000000; do
+    ./stackgen -s $size -r 1 "$@" scale_output/gen_$size.stack scale_output/gen_$size > /dev/null
+    printf "%10s" $size
+    ./stckvm scale_output/gen_$size all --perf 2> /dev/null | awk '$1 == "ns" { printf " %10s", $3 }'
+    printf "\n"
+done
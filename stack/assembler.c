@@ -1,18 +1,35 @@
 /*
  * Take a human-readable source file and compile it down into bytecode. Output
  * the instructions into a file named <dest>.
+ *
+ * Generated sources run to hundreds of megabytes, so we cut the source into
+ * chunks at line boundaries and assemble each chunk on its own thread. A chunk
+ * doesn't know where its code will end up, so it keeps the names it defines
+ * and the names it refers to relative to its own start. Once every chunk is
+ * done, we lay them end to end and fill in the names in one last pass.
+ *
+ * The output is a container (see common/container.h) with a line map, and a
+ * stack bound if the program verifies. -r writes bare bytecode instead.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define BYTE_LEN 8
+#include "../common/container.h"
+#include "verify.h"
 
 /*
  * The pinnacle of UX design.
  */
-#define USAGE_STR       "Usage: ./stacka <source> <dest>\n"
+#define USAGE_STR       "Usage: ./stacka [-j threads] [-v] [-r] <source> <dest>\n"
 #define ERROR_STRING    "Assembler error\n"
 
 /*
@@ -24,63 +41,559 @@
  * It would also be nice to macro-ify the instruction strings themselves. I'd
  * like to avoid having any "magic literals" in my code if possible.
  */
-#define PUSH_IMM    "PUSH_IMM\n"
-#define ADD         "ADD\n"
-#define SUB         "SUB\n"
-#define MUL         "MUL\n"
-#define DIV         "DIV\n"
-#define AND         "AND\n"
-#define OR          "OR\n"
-#define XOR         "XOR\n"
-#define NOT         "NOT\n"
-#define LSHIFT      "LSHIFT\n"
-#define RSHIFT      "RSHIFT\n"
-#define JIF         "JIF\n"
-#define POP_RES     "POP_RES\n"
-#define DONE        "DONE\n"
+#define PUSH_IMM     "PUSH_IMM\n"
+#define ADD          "ADD\n"
+#define SUB          "SUB\n"
+#define MUL          "MUL\n"
+#define DIV          "DIV\n"
+#define AND          "AND\n"
+#define OR           "OR\n"
+#define XOR          "XOR\n"
+#define NOT          "NOT\n"
+#define LSHIFT       "LSHIFT\n"
+#define RSHIFT       "RSHIFT\n"
+#define JIF          "JIF\n"
+#define POP_RES      "POP_RES\n"
+#define DONE         "DONE\n"
+#define JIF_LONG     "JIF_LONG\n"
+#define LOAD         "LOAD\n"
+#define STORE        "STORE\n"
+#define CALL         "CALL\n"
+#define RET          "RET\n"
+#define LOOP         "LOOP\n"
+#define FADD         "FADD\n"
+#define FSUB         "FSUB\n"
+#define FMUL         "FMUL\n"
+#define FDIV         "FDIV\n"
+#define ITOF         "ITOF\n"
+#define FTOI         "FTOI\n"
+#define JMP          "JMP\n"
+#define JIZ          "JIZ\n"
+#define DIV_CONST    "DIV_CONST\n"
+#define LSHIFT_CONST "LSHIFT_CONST\n"
+#define RSHIFT_CONST "RSHIFT_CONST\n"
+#define DUP          "DUP\n"
+#define DROP         "DROP\n"
+#define SWAP         "SWAP\n"
+#define OVER         "OVER\n"
+#define ROT          "ROT\n"
+#define LOAD_LOCAL   "LOAD_LOCAL\n"
+#define STORE_LOCAL  "STORE_LOCAL\n"
+#define SPAWN        "SPAWN\n"
+#define JOIN         "JOIN\n"
+
+/*
+ * "PROC <name>" and "LABEL <name>" don't emit anything. They name the
+ * instruction after them so that a CALL or a jump can refer to it by name
+ * instead of by byte offset. The two mean the same thing and share one set of
+ * names.
+ */
+#define PROC         "PROC "
+#define LABEL        "LABEL "
 
 /*
  * Define binary strings corresponding to each opcode we support.
  */
-#define PUSH_IMM_STR    "00000000"
-#define ADD_STR         "00000001"
-#define SUB_STR         "00000010"
-#define MUL_STR         "00000011"
-#define DIV_STR         "00000100"
-#define AND_STR         "00000101"
-#define OR_STR          "00000110"
-#define XOR_STR         "00000111"
-#define NOT_STR         "00001000"
-#define LSHIFT_STR      "00001001"
-#define RSHIFT_STR      "00001010"
-#define JIF_STR         "00001011"
-#define POP_RES_STR     "00001100"
-#define DONE_STR        "00001101"
-
-/*
- * Define a helper function for converting immediate values into binary strings.
- */
-char *imm_bin_str(uint8_t imm) {
-    char *bin_str = (char *) malloc(BYTE_LEN + 1);
-    if (bin_str == NULL) {
+#define PUSH_IMM_STR     "00000000"
+#define ADD_STR          "00000001"
+#define SUB_STR          "00000010"
+#define MUL_STR          "00000011"
+#define DIV_STR          "00000100"
+#define AND_STR          "00000101"
+#define OR_STR           "00000110"
+#define XOR_STR          "00000111"
+#define NOT_STR          "00001000"
+#define LSHIFT_STR       "00001001"
+#define RSHIFT_STR       "00001010"
+#define JIF_STR          "00001011"
+#define POP_RES_STR      "00001100"
+#define DONE_STR         "00001101"
+#define JIF_LONG_STR     "00001110"
+#define LOAD_STR         "00001111"
+#define STORE_STR        "00010000"
+#define CALL_STR         "00010001"
+#define RET_STR          "00010010"
+#define LOOP_STR         "00010011"
+#define FADD_STR         "00010100"
+#define FSUB_STR         "00010101"
+#define FMUL_STR         "00010110"
+#define FDIV_STR         "00010111"
+#define ITOF_STR         "00011000"
+#define FTOI_STR         "00011001"
+#define JMP_STR          "00011010"
+#define JIZ_STR          "00011011"
+#define DIV_CONST_STR    "00011100"
+#define LSHIFT_CONST_STR "00011101"
+#define RSHIFT_CONST_STR "00011110"
+#define DUP_STR          "00011111"
+#define DROP_STR         "00100000"
+#define SWAP_STR         "00100001"
+#define OVER_STR         "00100010"
+#define ROT_STR          "00100011"
+#define LOAD_LOCAL_STR   "00100100"
+#define STORE_LOCAL_STR  "00100101"
+#define SPAWN_STR        "00100110"
+#define JOIN_STR         "00100111"
+
+/*
+ * Don't bother splitting sources into chunks smaller than this.
+ */
+#define MIN_CHUNK (1 << 20)
+
+/*
+ * What follows an instruction on the next lines. Targets are either a byte
+ * offset or a name. Short ones are a single byte holding the offset plus one,
+ * the way JIF wants it, and long ones are 4 bytes, little-endian. Locals are a
+ * single signed byte, from -128 to 127. SPAWN takes a long target and then
+ * how many values to copy.
+ */
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_IMM,
+    OPERAND_LOCAL,
+    OPERAND_SHORT_TARGET,
+    OPERAND_LONG_TARGET,
+    OPERAND_LOOP,
+    OPERAND_SPAWN
+} operand_kind;
+
+/*
+ * The length and opcode get filled in from the strings at startup.
+ */
+struct mnemonic {
+    const char *text;
+    const char *bits;
+    operand_kind operand;
+    size_t len;
+    unsigned char opcode;
+};
+
+struct mnemonic mnemonics[] = {
+        {PUSH_IMM,     PUSH_IMM_STR,     OPERAND_IMM},
+        {ADD,          ADD_STR,          OPERAND_NONE},
+        {SUB,          SUB_STR,          OPERAND_NONE},
+        {MUL,          MUL_STR,          OPERAND_NONE},
+        {DIV,          DIV_STR,          OPERAND_NONE},
+        {AND,          AND_STR,          OPERAND_NONE},
+        {OR,           OR_STR,           OPERAND_NONE},
+        {XOR,          XOR_STR,          OPERAND_NONE},
+        {NOT,          NOT_STR,          OPERAND_NONE},
+        {LSHIFT,       LSHIFT_STR,       OPERAND_NONE},
+        {RSHIFT,       RSHIFT_STR,       OPERAND_NONE},
+        {JIF,          JIF_STR,          OPERAND_SHORT_TARGET},
+        {POP_RES,      POP_RES_STR,      OPERAND_NONE},
+        {DONE,         DONE_STR,         OPERAND_NONE},
+        {JIF_LONG,     JIF_LONG_STR,     OPERAND_LONG_TARGET},
+        {LOAD,         LOAD_STR,         OPERAND_NONE},
+        {STORE,        STORE_STR,        OPERAND_NONE},
+        {CALL,         CALL_STR,         OPERAND_LONG_TARGET},
+        {RET,          RET_STR,          OPERAND_NONE},
+        {LOOP,         LOOP_STR,         OPERAND_LOOP},
+        {FADD,         FADD_STR,         OPERAND_NONE},
+        {FSUB,         FSUB_STR,         OPERAND_NONE},
+        {FMUL,         FMUL_STR,         OPERAND_NONE},
+        {FDIV,         FDIV_STR,         OPERAND_NONE},
+        {ITOF,         ITOF_STR,         OPERAND_NONE},
+        {FTOI,         FTOI_STR,         OPERAND_NONE},
+        {JMP,          JMP_STR,          OPERAND_LONG_TARGET},
+        {JIZ,          JIZ_STR,          OPERAND_LONG_TARGET},
+        {DIV_CONST,    DIV_CONST_STR,    OPERAND_IMM},
+        {LSHIFT_CONST, LSHIFT_CONST_STR, OPERAND_IMM},
+        {RSHIFT_CONST, RSHIFT_CONST_STR, OPERAND_IMM},
+        {DUP,          DUP_STR,          OPERAND_NONE},
+        {DROP,         DROP_STR,         OPERAND_NONE},
+        {SWAP,         SWAP_STR,         OPERAND_NONE},
+        {OVER,         OVER_STR,         OPERAND_NONE},
+        {ROT,          ROT_STR,          OPERAND_NONE},
+        {LOAD_LOCAL,   LOAD_LOCAL_STR,   OPERAND_LOCAL},
+        {STORE_LOCAL,  STORE_LOCAL_STR,  OPERAND_LOCAL},
+        {SPAWN,        SPAWN_STR,        OPERAND_SPAWN},
+        {JOIN,         JOIN_STR,         OPERAND_NONE}
+};
+
+#define NUM_MNEMONICS (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+/*
+ * A line of source, without its newline. Lines point straight into the mapped
+ * source file, so they aren't NUL-terminated.
+ */
+struct line {
+    const char *text;
+    size_t len;
+};
+
+/*
+ * A name defined at an offset, and a name used at an offset that we have to
+ * fill in later.
+ */
+struct symbol {
+    struct line name;
+    size_t offset;
+};
+
+struct fixup {
+    struct line name;
+    size_t offset;
+    operand_kind kind;
+};
+
+/*
+ * Everything one thread produces. Offsets are relative to the start of the
+ * chunk until we know where it goes.
+ */
+struct chunk {
+    const char *start;
+    const char *end;
+    unsigned char *code;
+    size_t len;
+    size_t cap;
+    size_t base;
+    struct symbol *symbols;
+    size_t num_symbols;
+    size_t cap_symbols;
+    struct fixup *fixups;
+    size_t num_fixups;
+    size_t cap_fixups;
+
+    /*
+     * Where each instruction came from. Lines are counted from the start of
+     * the chunk until we know how many lines come before it.
+     */
+    struct container_line *lines;
+    size_t num_lines;
+    size_t cap_lines;
+    uint32_t lines_read;
+
+    /*
+     * The first thing that went wrong, and where in the source.
+     */
+    const char *error;
+    const char *error_at;
+};
+
+void *grow(void *array, size_t *cap, size_t size) {
+    *cap = *cap ? *cap * 2 : 64;
+    array = realloc(array, *cap * size);
+    if (array == NULL) {
         fprintf(stderr, ERROR_STRING);
         fflush(stderr);
         exit(EXIT_FAILURE);
     }
-    for (int i = BYTE_LEN - 1; i >= 0; i--) {
-        bin_str[i] = (imm & 1) ? '1' : '0';
-        imm >>= 1;
+    return array;
+}
+
+void emit(struct chunk *c, unsigned char b) {
+    if (c->len == c->cap) {
+        c->code = grow(c->code, &c->cap, 1);
+    }
+    c->code[c->len++] = b;
+}
+
+/*
+ * Write a 4-byte little-endian operand.
+ */
+void emit_u32(struct chunk *c, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit(c, (v >> (8 * i)) & 0xFF);
+    }
+}
+
+void add_symbol(struct chunk *c, struct line name) {
+    if (c->num_symbols == c->cap_symbols) {
+        c->symbols = grow(c->symbols, &c->cap_symbols, sizeof(struct symbol));
+    }
+    c->symbols[c->num_symbols].name = name;
+    c->symbols[c->num_symbols].offset = c->len;
+    c->num_symbols++;
+}
+
+void add_fixup(struct chunk *c, struct line name, operand_kind kind) {
+    if (c->num_fixups == c->cap_fixups) {
+        c->fixups = grow(c->fixups, &c->cap_fixups, sizeof(struct fixup));
+    }
+    c->fixups[c->num_fixups].name = name;
+    c->fixups[c->num_fixups].offset = c->len;
+    c->fixups[c->num_fixups].kind = kind;
+    c->num_fixups++;
+}
+
+/*
+ * Read the line starting at *p, and move *p to the start of the next one.
+ */
+int next_line(const char **p, const char *end, struct line *line) {
+    if (*p >= end) {
+        return 0;
+    }
+    const char *nl = memchr(*p, '\n', end - *p);
+    line->text = *p;
+    line->len = (nl ? nl : end) - *p;
+    *p = nl ? nl + 1 : end;
+    return 1;
+}
+
+/*
+ * Same, counting the lines a chunk reads.
+ */
+int chunk_line(struct chunk *c, const char **p, struct line *line) {
+    if (!next_line(p, c->end, line)) {
+        return 0;
+    }
+    c->lines_read++;
+    return 1;
+}
+
+void add_line(struct chunk *c) {
+    if (c->num_lines == c->cap_lines) {
+        c->lines = grow(c->lines, &c->cap_lines, sizeof(struct container_line));
+    }
+    c->lines[c->num_lines].offset = (uint32_t) c->len;
+    c->lines[c->num_lines].line = c->lines_read;
+    c->num_lines++;
+}
+
+/*
+ * The line before the one starting at p, if there is one.
+ */
+int prev_line(const char *src, const char *p, struct line *line) {
+    if (p == src) {
+        return 0;
+    }
+    const char *end = p - 1;
+    const char *start = end;
+    while (start > src && start[-1] != '\n') {
+        start--;
+    }
+    line->text = start;
+    line->len = end - start;
+    return 1;
+}
+
+int line_is(struct line *line, const char *text, size_t len) {
+    return line->len == len && memcmp(line->text, text, len) == 0;
+}
+
+struct mnemonic *find_mnemonic(struct line *line) {
+    for (size_t i = 0; i < NUM_MNEMONICS; i++) {
+        if (line_is(line, mnemonics[i].text, mnemonics[i].len)) {
+            return &mnemonics[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Only locals can be negative, but a minus sign can't start a name either, so
+ * it's safe to count it here.
+ */
+int is_number(struct line *line) {
+    size_t sign = line->len > 1 && line->text[0] == '-';
+    return line->len > sign && line->text[sign] >= '0' && line->text[sign] <= '9';
+}
+
+uint64_t parse_number(struct line *line) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < line->len && line->text[i] >= '0' && line->text[i] <= '9'; i++) {
+        v = v * 10 + (line->text[i] - '0');
+    }
+    return v;
+}
+
+/*
+ * Is this a PROC or LABEL line?
+ */
+int is_directive(struct line *line) {
+    return (line->len > strlen(PROC) && memcmp(line->text, PROC, strlen(PROC)) == 0) ||
+           (line->len > strlen(LABEL) && memcmp(line->text, LABEL, strlen(LABEL)) == 0);
+}
+
+/*
+ * Chunks have to start on an instruction, not on an operand. Operands can be
+ * names, and a name can look just like a mnemonic, so we go by the two lines
+ * before: a number ends an instruction unless it's the first operand of a
+ * LOOP or a SPAWN, and an instruction without operands or a directive ends one unless it
+ * might be a name after something that takes one. Anything we're not sure
+ * about, we skip past.
+ */
+int starts_instruction(const char *src, const char *p) {
+    struct line prev;
+    struct line before;
+    if (!prev_line(src, p, &prev)) {
+        return 1;
+    }
+    struct mnemonic *m = prev_line(src, prev.text, &before) ? find_mnemonic(&before) : NULL;
+    if (is_number(&prev)) {
+        return m == NULL || (m->operand != OPERAND_LOOP && m->operand != OPERAND_SPAWN);
+    }
+    struct mnemonic *pm = find_mnemonic(&prev);
+    if ((pm != NULL && pm->operand == OPERAND_NONE) || is_directive(&prev)) {
+        return m == NULL || m->operand == OPERAND_NONE;
+    }
+    return 0;
+}
+
+/*
+ * Read an operand line. Targets that don't start with a digit are names, and
+ * get recorded as fixups.
+ */
+int read_operand(struct chunk *c, const char **p, operand_kind kind) {
+    struct line line;
+    if (!chunk_line(c, p, &line)) {
+        c->error = kind == OPERAND_IMM || kind == OPERAND_LOCAL ? "Could not read immediate value" : "Could not read jump target";
+        return 0;
+    }
+    if (kind == OPERAND_LOCAL) {
+        int negative = line.len > 0 && line.text[0] == '-';
+        struct line digits = {line.text + negative, line.len - negative};
+        uint64_t v = parse_number(&digits);
+        if (!is_number(&line) || v > 127u + negative) {
+            c->error = "Local must be a number from -128 to 127";
+            c->error_at = line.text;
+            return 0;
+        }
+        emit(c, (unsigned char) (negative ? -v : v));
+        return 1;
+    }
+    if (!is_number(&line) || line.text[0] == '-') {
+        if (kind == OPERAND_IMM) {
+            c->error = "Could not read immediate value";
+            c->error_at = line.text;
+            return 0;
+        }
+        add_fixup(c, line, kind);
+        if (kind == OPERAND_LONG_TARGET) {
+            emit_u32(c, 0);
+        } else {
+            emit(c, 0);
+        }
+        return 1;
+    }
+    uint64_t v = parse_number(&line);
+    if (kind == OPERAND_LONG_TARGET) {
+        emit_u32(c, (uint32_t) v);
+    } else {
+        emit(c, (unsigned char) v);
+    }
+    return 1;
+}
+
+/*
+ * Assemble one chunk. Runs on its own thread.
+ */
+void *assemble_chunk(void *arg) {
+    struct chunk *c = arg;
+    const char *p = c->start;
+    struct line line;
+    while (chunk_line(c, &p, &line)) {
+        struct mnemonic *m = find_mnemonic(&line);
+        if (m == NULL) {
+            if (is_directive(&line)) {
+                size_t skip = line.text[0] == 'P' ? strlen(PROC) : strlen(LABEL);
+                struct line name = {line.text + skip, line.len - skip};
+                add_symbol(c, name);
+                continue;
+            }
+            c->error = "Cannot parse line";
+            c->error_at = line.text;
+            return NULL;
+        }
+        add_line(c);
+        emit(c, m->opcode);
+        const char *operand_at = p;
+        int ok = 1;
+        switch (m->operand) {
+            case OPERAND_NONE:
+                break;
+            case OPERAND_LOOP:
+                ok = read_operand(c, &p, OPERAND_SHORT_TARGET) && read_operand(c, &p, OPERAND_IMM);
+                break;
+            case OPERAND_SPAWN:
+                ok = read_operand(c, &p, OPERAND_LONG_TARGET) && read_operand(c, &p, OPERAND_IMM);
+                break;
+            default:
+                ok = read_operand(c, &p, m->operand);
+                break;
+        }
+        if (!ok) {
+            if (c->error_at == NULL) {
+                c->error_at = operand_at;
+            }
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * All the names in the program, hashed. Generated programs can have a lot of
+ * procedures, so a list won't do.
+ */
+struct symbol_table {
+    struct symbol **slots;
+    size_t mask;
+};
+
+uint64_t hash_name(struct line *name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < name->len; i++) {
+        h = (h ^ (unsigned char) name->text[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+/*
+ * The slot holding a name, or the empty slot where it would go.
+ */
+struct symbol **lookup(struct symbol_table *t, struct line *name) {
+    size_t i = hash_name(name) & t->mask;
+    while (t->slots[i] != NULL && !line_is(&t->slots[i]->name, name->text, name->len)) {
+        i = (i + 1) & t->mask;
+    }
+    return &t->slots[i];
+}
+
+/*
+ * Report an error at a place in the source, by line number.
+ */
+void fail_at(const char *src, const char *at, const char *msg) {
+    size_t line_no = 1;
+    for (const char *p = src; p < at; p++) {
+        line_no += *p == '\n';
     }
-    bin_str[BYTE_LEN] = '\0';
-    return bin_str;
+    fprintf(stderr, "%s on line %zu\n", msg, line_no);
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
 }
 
 int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int verbose = 0;
+    int raw = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:vr")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atol(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'r':
+                raw = 1;
+                break;
+            default:
+                printf(USAGE_STR);
+                exit(EXIT_FAILURE);
+        }
+    }
 
     /*
      * Check for the correct number of arguments.
      */
-    if (argc != 3) {
+    if (argc - optind != 2 || threads < 1) {
         printf(USAGE_STR);
         exit(EXIT_FAILURE);
     }
@@ -88,17 +601,28 @@ int main(int argc, char *argv[]) {
     /*
      * Unpack our arguments.
      */
-    char *src = argv[1];
-    char *dest = argv[2];
+    char *src = argv[optind];
+    char *dest = argv[optind + 1];
 
     /*
-     * Try to open the source file and complain if we fail.
+     * Try to map the source file and complain if we fail.
      */
-    FILE *src_f = fopen(src, "rb");
-    if (src_f == NULL) {
+    int src_fd = open(src, O_RDONLY);
+    struct stat st;
+    if (src_fd < 0 || fstat(src_fd, &st) != 0) {
         fprintf(stderr, "Can't open %s\n", src);
         exit(EXIT_FAILURE);
     }
+    size_t size = st.st_size;
+    const char *text = "";
+    if (size > 0) {
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+        if (text == MAP_FAILED) {
+            fprintf(stderr, "Can't read %s\n", src);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(src_fd);
 
     /*
      * Same with the destination file.
@@ -109,115 +633,203 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    struct timespec t0;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < NUM_MNEMONICS; i++) {
+        mnemonics[i].len = strlen(mnemonics[i].text) - 1;
+        mnemonics[i].opcode = strtol(mnemonics[i].bits, NULL, 2);
+    }
+
     /*
-     * Read lines until we reach the end of the file. 100 characters is kind of
-     * overkill, but we're not really suffering because of it.
+     * Cut the source into roughly equal chunks, moving each cut forward to the
+     * next line that starts an instruction.
      */
-    char line[100];
-    while (fgets(line, sizeof(line), src_f) != NULL) {
-
-        /*
-         * Instructions in this language are 1 byte long.
-         */
-        unsigned char instruction;
-
-        /*
-         * "Parse" the source file.
-         */
-        if (strcmp(line, PUSH_IMM) == 0) {
-            printf(PUSH_IMM);
-
-            /*
-             * Write the PUSH_IMM instruction itself.
-             */
-            instruction = strtol(PUSH_IMM_STR, NULL, 2);
-            fwrite(&instruction, sizeof(instruction), 1, dest_f);
-
-            /*
-             * Get the immediate value from the next line.
-             */
-            if (fgets(line, sizeof(line), src_f) == NULL) {
-                fprintf(stderr, "Could not read immediate value\n");
+    if ((size_t) threads > size / MIN_CHUNK + 1) {
+        threads = size / MIN_CHUNK + 1;
+    }
+    struct chunk *chunks = calloc(threads, sizeof(struct chunk));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    if (chunks == NULL || tids == NULL) {
+        fprintf(stderr, ERROR_STRING);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    const char *end = text + size;
+    const char *cut = text;
+    for (long i = 0; i < threads; i++) {
+        chunks[i].start = cut;
+        cut = i == threads - 1 ? end : text + size / threads * (i + 1);
+        if (cut < chunks[i].start) {
+            cut = chunks[i].start;
+        }
+        while (cut < end && cut > text && cut[-1] != '\n') {
+            cut++;
+        }
+        while (cut < end && !starts_instruction(text, cut)) {
+            struct line skipped;
+            next_line(&cut, end, &skipped);
+        }
+        chunks[i].end = cut;
+    }
+
+    /*
+     * The first chunk runs on this thread.
+     */
+    for (long i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, assemble_chunk, &chunks[i]) != 0) {
+            fprintf(stderr, ERROR_STRING);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    assemble_chunk(&chunks[0]);
+    for (long i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (long i = 0; i < threads; i++) {
+        if (chunks[i].error != NULL) {
+            fail_at(text, chunks[i].error_at ? chunks[i].error_at : chunks[i].end, chunks[i].error);
+        }
+    }
+
+    /*
+     * Now we know where every chunk goes, and so where every name points.
+     */
+    size_t total = 0;
+    size_t num_symbols = 0;
+    size_t num_lines = 0;
+    for (long i = 0; i < threads; i++) {
+        chunks[i].base = total;
+        total += chunks[i].len;
+        num_symbols += chunks[i].num_symbols;
+        num_lines += chunks[i].num_lines;
+    }
+    struct symbol_table table;
+    size_t slots = 16;
+    while (slots < 2 * num_symbols) {
+        slots *= 2;
+    }
+    table.slots = calloc(slots, sizeof(struct symbol *));
+    table.mask = slots - 1;
+    if (table.slots == NULL) {
+        fprintf(stderr, ERROR_STRING);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < threads; i++) {
+        for (size_t j = 0; j < chunks[i].num_symbols; j++) {
+            struct symbol *s = &chunks[i].symbols[j];
+            struct symbol **slot = lookup(&table, &s->name);
+            if (*slot != NULL) {
+                fprintf(stderr, "%.*s is defined twice\n", (int) s->name.len, s->name.text);
                 fflush(stderr);
                 exit(EXIT_FAILURE);
             }
-            printf("%s", line);
-            char *imm_str = imm_bin_str(strtoul(line, NULL, 10));
-            instruction = strtol(imm_str, NULL, 2);
-            free(imm_str);
-        } else if (strcmp(line, ADD) == 0) {
-            printf(ADD);
-            instruction = strtol(ADD_STR, NULL, 2);
-        } else if (strcmp(line, SUB) == 0) {
-            printf(SUB);
-            instruction = strtol(SUB_STR, NULL, 2);
-        } else if (strcmp(line, MUL) == 0) {
-            printf(MUL);
-            instruction = strtol(MUL_STR, NULL, 2);
-        } else if (strcmp(line, DIV) == 0) {
-            printf(DIV);
-            instruction = strtol(DIV_STR, NULL, 2);
-        } else if (strcmp(line, AND) == 0) {
-            printf(AND);
-            instruction = strtol(AND_STR, NULL, 2);
-        } else if (strcmp(line, OR) == 0) {
-            printf(OR);
-            instruction = strtol(OR_STR, NULL, 2);
-        } else if (strcmp(line, XOR) == 0) {
-            printf(XOR);
-            instruction = strtol(XOR_STR, NULL, 2);
-        } else if (strcmp(line, NOT) == 0) {
-            printf(NOT);
-            instruction = strtol(NOT_STR, NULL, 2);
-        } else if (strcmp(line, LSHIFT) == 0) {
-            printf(LSHIFT);
-            instruction = strtol(LSHIFT_STR, NULL, 2);
-        } else if (strcmp(line, RSHIFT) == 0) {
-            printf(RSHIFT);
-            instruction = strtol(RSHIFT_STR, NULL, 2);
-        } else if (strcmp(line, JIF) == 0) {
-
-            /*
-             * We have to encode both the JIF instruction and the immediate
-             * value after it.
-             */
-            printf(JIF);
-            instruction = strtol(JIF_STR, NULL, 2);
-            fwrite(&instruction, sizeof(instruction), 1, dest_f);
-            if (fgets(line, sizeof(line), src_f) == NULL) {
-                fprintf(stderr, "Could not read immediate value\n");
+            s->offset += chunks[i].base;
+            *slot = s;
+        }
+    }
+
+    /*
+     * Fill in every use of a name.
+     */
+    for (long i = 0; i < threads; i++) {
+        for (size_t j = 0; j < chunks[i].num_fixups; j++) {
+            struct fixup *f = &chunks[i].fixups[j];
+            struct symbol *s = *lookup(&table, &f->name);
+            if (s == NULL) {
+                fprintf(stderr, "Unknown name %.*s\n", (int) f->name.len, f->name.text);
+                fflush(stderr);
+                exit(EXIT_FAILURE);
+            }
+            unsigned char *at = chunks[i].code + f->offset;
+            if (f->kind == OPERAND_LONG_TARGET) {
+                for (int b = 0; b < 4; b++) {
+                    at[b] = (s->offset >> (8 * b)) & 0xFF;
+                }
+            } else if (s->offset + 1 <= 0xFF) {
+                *at = (unsigned char) (s->offset + 1);
+            } else {
+                fprintf(stderr, "%.*s is out of reach of a JIF or LOOP\n", (int) f->name.len, f->name.text);
                 fflush(stderr);
                 exit(EXIT_FAILURE);
             }
-            printf("%s", line);
-            char *imm_str = imm_bin_str(strtoul(line, NULL, 10));
-            instruction = strtol(imm_str, NULL, 2);
-            free(imm_str);
-        } else if (strcmp(line, POP_RES) == 0) {
-            printf(POP_RES);
-            instruction = strtol(POP_RES_STR, NULL, 2);
-        } else if (strcmp(line, DONE) == 0) {
-            printf(DONE);
-            instruction = strtol(DONE_STR, NULL, 2);
-        } else {
-            fprintf(stderr, "Cannot parse line\n");
-            fflush(stderr);
-            exit(EXIT_FAILURE);
         }
+    }
 
-        /*
-         * Write the instruction into the destination file.
-         */
-        fwrite(&instruction, sizeof(instruction), 1, dest_f);
+    /*
+     * Lay the chunks out end to end, along with their line maps.
+     */
+    uint8_t *code = malloc(total > 0 ? total : 1);
+    struct container_line *lines = malloc((num_lines > 0 ? num_lines : 1) * sizeof(struct container_line));
+    if (code == NULL || lines == NULL) {
+        fprintf(stderr, ERROR_STRING);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    size_t line_at = 0;
+    uint32_t lines_before = 0;
+    for (long i = 0; i < threads; i++) {
+        memcpy(code + chunks[i].base, chunks[i].code, chunks[i].len);
+        for (size_t j = 0; j < chunks[i].num_lines; j++) {
+            lines[line_at].offset = chunks[i].lines[j].offset + (uint32_t) chunks[i].base;
+            lines[line_at].line = chunks[i].lines[j].line + lines_before;
+            line_at++;
+        }
+        lines_before += chunks[i].lines_read;
+        free(chunks[i].code);
+        free(chunks[i].symbols);
+        free(chunks[i].fixups);
+        free(chunks[i].lines);
     }
 
     /*
-     * Close the source file.
+     * Work out how deep the stack gets, so the loader doesn't have to. A
+     * program that doesn't verify still gets written, since it might be meant
+     * to fail.
      */
-    fclose(src_f);
+    struct container_info out;
+    memset(&out, 0, sizeof(out));
+    out.isa = CONTAINER_ISA_STACK;
+    out.max_stack = CONTAINER_UNVERIFIED;
+    out.code = code;
+    out.code_len = total;
+    out.lines = lines;
+    out.num_lines = num_lines;
+    struct verify_info verified;
+    verify_status v = verify_bytecode(code, total, &verified);
+    if (v == VERIFY_OK) {
+        out.max_stack = verified.max_depth;
+    }
+    int written = raw ? fwrite(code, 1, total, dest_f) == total : write_container(dest_f, &out);
+    if (!written || fclose(dest_f) != 0) {
+        fprintf(stderr, "Can't write %s\n", dest);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
 
     /*
-     * Close the destination file.
+     * Everything we parsed was a line of the source, so echoing the source is
+     * the same as echoing what we parsed.
      */
-    fclose(dest_f);
-}
\ No newline at end of file
+    if (verbose) {
+        fwrite(text, 1, size, stdout);
+    }
+    printf("Assembled %zu bytes of source into %zu bytes on %ld threads in %.3f s (%.1f MB/s)\n", size, total,
+           threads, elapsed_s(&t0, &t1), size / 1e6 / elapsed_s(&t0, &t1));
+    if (v == VERIFY_OK) {
+        printf("Verified: stack gets %u deep\n", verified.max_depth);
+    } else {
+        printf("Not verified: %s at byte %zu\n", verify_messages[v], verified.error_pc);
+    }
+    free(code);
+    free(lines);
+    free(table.slots);
+    free(chunks);
+    free(tids);
+    if (size > 0) {
+        munmap((void *) text, size);
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * Programs assembled by the C++ compiler and run through the unrolled
+ * interpreter in verse.hpp. The kernels are the calls and floats programs from
+ * programs/stack, plus a nested counted loop that adds to memory 65025 times.
+ * Each one runs REPS times and has to come up with the result written next to
+ * it here. Checking verse.hpp against the C engines is test-verse's job.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "verse.hpp"
+
+using namespace verse;
+
+#define REPS 1000
+
+/*
+ * The encoding has to come out the same as stacka's.
+ */
+static_assert("PUSH_IMM\n2\nPUSH_IMM\n3\nADD\nPOP_RES\nDONE"_stack ==
+              std::array<std::uint8_t, 7>{PUSH_IMM, 2, PUSH_IMM, 3, ADD, POP_RES, DONE});
+static_assert("LABEL top\nJIF_LONG\ntop\nLOOP\ntop\n1\nDONE"_stack ==
+              std::array<std::uint8_t, 9>{JIF_LONG, 0, 0, 0, 0, LOOP, 1, 1, DONE});
+
+constexpr auto calls = R"(
+    PUSH_IMM
+    0
+    PUSH_IMM
+    3
+    PUSH_IMM
+    4
+    CALL
+    mac
+    PUSH_IMM
+    5
+    PUSH_IMM
+    6
+    CALL
+    mac
+    PUSH_IMM
+    2
+    PUSH_IMM
+    2
+    CALL
+    mac_inc
+    POP_RES
+    DONE
+    PROC mac
+    MUL
+    ADD
+    RET
+    PROC inc
+    PUSH_IMM
+    1
+    ADD
+    RET
+    PROC mac_inc
+    CALL
+    mac
+    CALL
+    inc
+    RET
+)"_stack;
+
+constexpr auto floats = R"(
+    PUSH_IMM
+    22
+    ITOF
+    PUSH_IMM
+    7
+    FDIV
+    PUSH_IMM
+    100
+    FMUL
+    FTOI
+    POP_RES
+    DONE
+)"_stack;
+
+constexpr auto nested = R"(
+    PUSH_IMM
+    255
+    LABEL outer
+    PUSH_IMM
+    255
+    LABEL inner
+    PUSH_IMM
+    8
+    PUSH_IMM
+    8
+    LOAD
+    PUSH_IMM
+    3
+    ADD
+    STORE
+    LOOP
+    inner
+    1
+    POP_RES
+    LOOP
+    outer
+    1
+    POP_RES
+    PUSH_IMM
+    8
+    LOAD
+    POP_RES
+    DONE
+)"_stack;
+
+template <auto Code>
+void bench(const char *name, std::uint64_t expected) {
+    std::vector<std::uint8_t> memory(64);
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        machine m;
+        std::fill(memory.begin(), memory.end(), 0);
+        m.memory = memory.data();
+        m.memory_size = memory.size();
+        auto start = std::chrono::steady_clock::now();
+        result r = run<Code>(m);
+        auto end = std::chrono::steady_clock::now();
+        if (r != SUCCESS || m.result != expected) {
+            std::fprintf(stderr, "%s came up with %" PRIu64 " (%s) instead of %" PRIu64 "\n", name, m.result,
+                         result_messages[r], expected);
+            std::fflush(stderr);
+            std::exit(EXIT_FAILURE);
+        }
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (rep == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    std::printf("%-8s %6zu bytes %12.1f ns\n", name, Code.size(), best);
+}
+
+int main() {
+    std::printf("%-8s %12s %15s\n", "kernel", "size", "fastest run");
+    bench<calls>("calls", 47);
+    bench<floats>("floats", 314);
+    bench<nested>("nested", 255 * 255 * 3);
+}
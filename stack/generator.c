@@ -0,0 +1,532 @@
+/*
+ * Generate synthetic stack programs for scaling studies. We write both a
+ * human-readable source file and the matching bytecode, so the output can be
+ * inspected, reassembled with stacka, or run with stckvm directly.
+ *
+ * Every program is valid by construction: straight-line code is made of
+ * expressions that are popped into the result register, so it leaves the stack
+ * the way it found it, loops count down a counter that sits on the stack, and
+ * we evaluate every expression as we generate it so that we never divide by
+ * zero or shift by more than 63.
+ *
+ * Guarded branches decide at runtime, from a xorshift generator whose state
+ * lives in the first 8 bytes of linear memory, so each one goes a different way
+ * from one execution to the next. We can't know which way without running the
+ * program, so where branches are involved the dynamic instruction count we
+ * report is what to expect on average.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+#define USAGE_STR \
+    "Usage: ./stackgen [-s size] [-d depth] [-t trips] [-k body] [-m mix]\n" \
+    "                  [-b branch%%] [-e entropy] [-r seed] <source> <dest>\n"
+
+/*
+ * Expressions never get deeper than this, which keeps each one well within the
+ * 256 slots of the runtime stack.
+ */
+#define MAX_EXPR_DEPTH 5
+
+/*
+ * Where the branch generator keeps its state, and how many of its top bits
+ * decide a branch. 16 bits lets an entropy as low as 0.001 still mean the odd
+ * taken branch.
+ */
+#define BRANCH_STATE   0
+#define BRANCH_BITS    16
+
+struct gen_options {
+
+    /*
+     * Approximate size of the program in bytes of bytecode.
+     */
+    size_t size;
+
+    /*
+     * How deeply loops nest, and how many times each loop runs.
+     */
+    int depth;
+    int trips;
+
+    /*
+     * Bytes of straight-line code in the innermost loop body.
+     */
+    size_t body;
+
+    /*
+     * Relative weight of each opcode in expressions.
+     */
+    unsigned weights[NUM_OPCODES];
+
+    /*
+     * Percentage of straight-line units that are guarded by a forward branch,
+     * and the entropy in bits of whether each of those branches is taken.
+     */
+    int branch_pct;
+    double entropy;
+
+    uint64_t seed;
+};
+
+/*
+ * Everything we know about the program as we build it.
+ */
+struct generator {
+    struct gen_options opts;
+    uint64_t rng;
+
+    /*
+     * A branch is taken when the top BRANCH_BITS of the branch generator's
+     * state are below the threshold, which happens this often.
+     */
+    uint32_t branch_threshold;
+    double taken_probability;
+    unsigned total_weight;
+
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+
+    /*
+     * How many times the code we're currently emitting will run. This lets us
+     * report the dynamic instruction count without running the program.
+     */
+    uint64_t multiplier;
+    uint64_t static_instructions;
+    uint64_t dynamic_instructions;
+    uint64_t branches;
+    uint64_t loops;
+};
+
+/*
+ * xorshift64*. We use our own generator rather than rand() so that a seed
+ * produces the same program everywhere.
+ */
+uint64_t next_random(struct generator *g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * A uniformly random double in [0, 1).
+ */
+double next_unit(struct generator *g) {
+    return (next_random(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void emit_byte(struct generator *g, uint8_t b) {
+    if (g->len == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 4096;
+        g->code = realloc(g->code, g->cap);
+        if (g->code == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g->code[g->len++] = b;
+}
+
+void emit_op(struct generator *g, uint8_t op) {
+    emit_byte(g, op);
+    g->static_instructions++;
+    g->dynamic_instructions += g->multiplier;
+}
+
+void emit_push(struct generator *g, uint8_t imm) {
+    emit_op(g, PUSH_IMM);
+    emit_byte(g, imm);
+}
+
+/*
+ * Emit a JIF_LONG and return the offset of its operand, so that forward jumps
+ * can be patched once we know where they land.
+ */
+size_t emit_jif_long(struct generator *g, uint32_t target) {
+    emit_op(g, JIF_LONG);
+    size_t operand = g->len;
+    for (int i = 0; i < 4; i++) {
+        emit_byte(g, (target >> (8 * i)) & 0xFF);
+    }
+    return operand;
+}
+
+void patch_u32(struct generator *g, size_t at, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        g->code[at + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+/*
+ * Pick an expression operator according to the opcode mix.
+ */
+uint8_t pick_operator(struct generator *g) {
+    unsigned r = next_random(g) % g->total_weight;
+    for (uint8_t op = 0; op < NUM_OPCODES; op++) {
+        if (r < g->opts.weights[op]) {
+            return op;
+        }
+        r -= g->opts.weights[op];
+    }
+    return ADD;
+}
+
+/*
+ * Emit code that leaves one new value on the stack, and return that value.
+ */
+uint64_t gen_expr(struct generator *g, int depth) {
+    if (depth == 0 || next_random(g) % 4 == 0) {
+        uint8_t imm = next_random(g) & 0xFF;
+        emit_push(g, imm);
+        return imm;
+    }
+    uint8_t op = pick_operator(g);
+    uint64_t op1 = gen_expr(g, depth - 1);
+    if (op == NOT) {
+        emit_op(g, NOT);
+        return ~op1;
+    }
+    uint64_t op2 = gen_expr(g, depth - 1);
+
+    /*
+     * Patch up operands that would make the program invalid. These cost an
+     * extra instruction but keep the mix close to what was asked for.
+     */
+    if (op == DIV && op2 == 0) {
+        emit_push(g, 1);
+        emit_op(g, OR);
+        op2 = 1;
+    } else if ((op == LSHIFT || op == RSHIFT) && op2 > 63) {
+        emit_push(g, 63);
+        emit_op(g, AND);
+        op2 &= 63;
+    }
+    emit_op(g, op);
+    switch (op) {
+        case ADD:
+            return op1 + op2;
+        case SUB:
+            return op1 - op2;
+        case MUL:
+            return op1 * op2;
+        case DIV:
+            return op1 / op2;
+        case AND:
+            return op1 & op2;
+        case OR:
+            return op1 | op2;
+        case XOR:
+            return op1 ^ op2;
+        case LSHIFT:
+            return op1 << op2;
+        default:
+            return op1 >> op2;
+    }
+}
+
+/*
+ * A stack-neutral unit of straight-line code: compute something and pop it.
+ */
+void gen_unit(struct generator *g) {
+    gen_expr(g, 1 + next_random(g) % MAX_EXPR_DEPTH);
+    emit_op(g, POP_RES);
+}
+
+/*
+ * Push a value of up to 16 bits, which takes more than one PUSH_IMM once it
+ * doesn't fit in a byte.
+ */
+void emit_push16(struct generator *g, uint16_t value) {
+    if (value <= 0xFF) {
+        emit_push(g, (uint8_t) value);
+        return;
+    }
+    emit_push(g, value >> 8);
+    emit_push(g, 8);
+    emit_op(g, LSHIFT);
+    emit_push(g, value & 0xFF);
+    emit_op(g, OR);
+}
+
+/*
+ * Step the branch generator and leave 1 on the stack if the branch should be
+ * taken this time, 0 if not:
+ *
+ *   PUSH_IMM state; LOAD
+ *   DUP; PUSH_IMM 13; LSHIFT; XOR
+ *   DUP; PUSH_IMM 7; RSHIFT; XOR
+ *   DUP; PUSH_IMM 17; LSHIFT; XOR
+ *   PUSH_IMM state; OVER; STORE
+ *   PUSH_IMM 48; RSHIFT; <threshold>; SUB; PUSH_IMM 63; RSHIFT
+ *
+ * There's no comparison, so the last line borrows one: the top bits minus the
+ * threshold only goes negative when they're below it.
+ */
+void gen_condition(struct generator *g) {
+    static const uint8_t shifts[3][2] = {{LSHIFT, 13}, {RSHIFT, 7}, {LSHIFT, 17}};
+    emit_push(g, BRANCH_STATE);
+    emit_op(g, LOAD);
+    for (int i = 0; i < 3; i++) {
+        emit_op(g, DUP);
+        emit_push(g, shifts[i][1]);
+        emit_op(g, shifts[i][0]);
+        emit_op(g, XOR);
+    }
+    emit_push(g, BRANCH_STATE);
+    emit_op(g, OVER);
+    emit_op(g, STORE);
+    emit_push(g, 64 - BRANCH_BITS);
+    emit_op(g, RSHIFT);
+    emit_push16(g, (uint16_t) g->branch_threshold);
+    emit_op(g, SUB);
+    emit_push(g, 63);
+    emit_op(g, RSHIFT);
+}
+
+/*
+ * Emit roughly the given number of bytes of straight-line code. Some units are
+ * guarded by a forward branch over them:
+ *
+ *   <condition>; JIF_LONG skip; <unit>; skip: POP_RES
+ *
+ * Both paths pop the condition, so the stack is the same either way. The unit
+ * only runs when the branch isn't taken, so it counts for that share of the
+ * executions.
+ */
+void gen_straight_line(struct generator *g, size_t bytes) {
+    size_t end = g->len + bytes;
+    while (g->len < end) {
+        if ((int) (next_random(g) % 100) >= g->opts.branch_pct) {
+            gen_unit(g);
+            continue;
+        }
+        gen_condition(g);
+        size_t operand = emit_jif_long(g, 0);
+        uint64_t before = g->dynamic_instructions;
+        gen_unit(g);
+        uint64_t unit = g->dynamic_instructions - before;
+        g->dynamic_instructions -= (uint64_t) llround(unit * g->taken_probability);
+        patch_u32(g, operand, (uint32_t) g->len);
+        emit_op(g, POP_RES);
+        g->branches++;
+    }
+}
+
+/*
+ * Emit a counted loop nest, starting at the given level:
+ *
+ *   PUSH_IMM trips
+ *   head: <body>
+ *         PUSH_IMM 1; SUB; JIF_LONG head
+ *   POP_RES
+ *
+ * Inner levels get a bit of straight-line code on either side of the nested
+ * loop, and the innermost level gets the full body.
+ */
+void gen_loop(struct generator *g, int level) {
+    emit_push(g, (uint8_t) g->opts.trips);
+    size_t head = g->len;
+    g->multiplier *= g->opts.trips;
+    if (level < g->opts.depth) {
+        gen_straight_line(g, g->opts.body / 4);
+        gen_loop(g, level + 1);
+        gen_straight_line(g, g->opts.body / 4);
+    } else {
+        gen_straight_line(g, g->opts.body);
+    }
+    emit_push(g, 1);
+    emit_op(g, SUB);
+    emit_jif_long(g, (uint32_t) head);
+    g->multiplier /= g->opts.trips;
+    emit_op(g, POP_RES);
+    g->loops++;
+}
+
+/*
+ * Turn an entropy in bits into the probability of a branch being taken, by
+ * bisecting the binary entropy function on [0, 0.5].
+ */
+double taken_probability(double entropy) {
+    double lo = 0.0;
+    double hi = 0.5;
+    for (int i = 0; i < 60; i++) {
+        double p = (lo + hi) / 2;
+        double h = -p * log2(p) - (1 - p) * log2(1 - p);
+        if (h < entropy) {
+            lo = p;
+        } else {
+            hi = p;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+/*
+ * Parse an opcode mix like "ADD=4,MUL=1,DIV=1". Anything not mentioned gets a
+ * weight of zero.
+ */
+void parse_mix(struct gen_options *opts, char *mix) {
+    memset(opts->weights, 0, sizeof(opts->weights));
+    for (char *tok = strtok(mix, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "Bad opcode mix entry %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        *eq = '\0';
+        int found = 0;
+        for (uint8_t op = ADD; op <= RSHIFT; op++) {
+            if (strcmp(tok, opcode_names[op]) == 0) {
+                opts->weights[op] = (unsigned) strtoul(eq + 1, NULL, 10);
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s can't appear in the opcode mix\n", tok);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct generator g;
+    memset(&g, 0, sizeof(g));
+    g.opts.size = 1000;
+    g.opts.depth = 1;
+    g.opts.trips = 10;
+    g.opts.body = 256;
+    g.opts.branch_pct = 10;
+    g.opts.entropy = 0.0;
+    g.opts.seed = 1;
+    for (uint8_t op = ADD; op <= RSHIFT; op++) {
+        g.opts.weights[op] = 1;
+    }
+
+    int c;
+    while ((c = getopt(argc, argv, "s:d:t:k:m:b:e:r:")) != -1) {
+        switch (c) {
+            case 's':
+                g.opts.size = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                g.opts.depth = atoi(optarg);
+                break;
+            case 't':
+                g.opts.trips = atoi(optarg);
+                break;
+            case 'k':
+                g.opts.body = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                parse_mix(&g.opts, optarg);
+                break;
+            case 'b':
+                g.opts.branch_pct = atoi(optarg);
+                break;
+            case 'e':
+                g.opts.entropy = atof(optarg);
+                break;
+            case 'r':
+                g.opts.seed = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, USAGE_STR);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Trip counts go through PUSH_IMM, so they have to fit in a byte.
+     */
+    if (g.opts.trips < 1 || g.opts.trips > 255) {
+        fprintf(stderr, "Trip count must be between 1 and 255\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g.opts.depth < 0 || g.opts.depth > 8) {
+        fprintf(stderr, "Loop depth must be between 0 and 8\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g.opts.entropy < 0.0 || g.opts.entropy > 1.0) {
+        fprintf(stderr, "Branch entropy must be between 0 and 1 bits\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint8_t op = 0; op < NUM_OPCODES; op++) {
+        g.total_weight += g.opts.weights[op];
+    }
+    if (g.total_weight == 0) {
+        fprintf(stderr, "Opcode mix is empty\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * A zero seed would leave xorshift stuck at zero forever.
+     */
+    g.rng = g.opts.seed ? g.opts.seed : 0x9E3779B97F4A7C15ull;
+    if (g.opts.entropy > 0) {
+        g.branch_threshold = (uint32_t) lround(taken_probability(g.opts.entropy) * (1 << BRANCH_BITS));
+    }
+    g.taken_probability = (double) g.branch_threshold / (1 << BRANCH_BITS);
+    g.multiplier = 1;
+
+    /*
+     * Seed the branch generator. Memory starts out zeroed, and xorshift never
+     * gets anywhere from zero.
+     */
+    if (g.opts.branch_pct > 0) {
+        emit_push(&g, BRANCH_STATE);
+        emit_push(&g, (uint8_t) (next_random(&g) | 1));
+        emit_op(&g, STORE);
+    }
+
+    /*
+     * Keep adding loop nests until we're big enough, then compute a final
+     * result so the program has something to show for itself.
+     */
+    while (g.len < g.opts.size) {
+        if (g.opts.depth > 0) {
+            gen_loop(&g, 1);
+        } else {
+            gen_straight_line(&g, g.opts.size - g.len);
+        }
+    }
+    gen_unit(&g);
+    emit_op(&g, DONE);
+
+    FILE *src_f = fopen(argv[optind], "w");
+    if (src_f == NULL) {
+        fprintf(stderr, "Can't open %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    disassemble(src_f, g.code, g.len);
+    fclose(src_f);
+
+    FILE *dest_f = fopen(argv[optind + 1], "wb");
+    if (dest_f == NULL) {
+        fprintf(stderr, "Can't open %s\n", argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(g.code, sizeof(uint8_t), g.len, dest_f);
+    fclose(dest_f);
+
+    printf("Bytes: %zu\n", g.len);
+    printf("Static instructions: %" PRIu64 "\n", g.static_instructions);
+    printf("Dynamic instructions: %" PRIu64 "\n", g.dynamic_instructions);
+    printf("Loops: %" PRIu64 "\n", g.loops);
+    printf("Branches: %" PRIu64 " (taken with p = %.3f)\n", g.branches, g.taken_probability);
+    free(g.code);
+}
@@ -0,0 +1,567 @@
+#ifndef VERSE_STACK_ISA_H_
+#define VERSE_STACK_ISA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The stack ISA: opcodes, how they're encoded, what values mean and how a run
+ * can end. The C engines in vm.h and the C++ ones in verse.hpp both build on
+ * this, so it has to stay valid C and C++. Everything here is static so that
+ * any number of C++ translation units can include it, and what the C++
+ * assembler needs at compile time is constexpr there.
+ */
+#ifdef __cplusplus
+#define ISA_CONSTEXPR constexpr
+#define ISA_TABLE     constexpr const
+#else
+#define ISA_CONSTEXPR static inline
+#define ISA_TABLE     static const
+#endif
+
+/*
+ * Our runtime stack has 256 slots.
+ */
+#define STACK_MAX 256
+
+/*
+ * Return addresses live on their own stack rather than in among the operands,
+ * so that a callee finds its arguments right on top of the operand stack
+ * where the caller left them. Nothing gets copied on a call: the caller's top
+ * slots simply become the bottom of the callee's frame, and whatever the
+ * callee leaves there when it returns is the caller's result.
+ */
+#define RETURN_STACK_MAX 64
+
+/*
+ * The most values a SPAWN can copy into its task.
+ */
+#define SPAWN_ARGS_MAX 8
+
+/*
+ * How many tasks a thread can have spawned and not yet joined or finished
+ * with. Past that a SPAWN fails with ERR_TOO_MANY_TASKS.
+ */
+#define SPAWN_TASKS 4096
+
+/*
+ * Every task handle has its top bit set, so that no small number names a task.
+ * What the rest of it means is up to whoever runs the tasks.
+ */
+#define HANDLE_TAG (1ull << 63)
+
+/*
+ * Define all the opcodes we recognize.
+ */
+typedef enum {
+    PUSH_IMM,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    AND,
+    OR,
+    XOR,
+    NOT,
+    LSHIFT,
+    RSHIFT,
+    JIF,
+    POP_RES,
+    DONE,
+
+    /*
+     * JIF can only reach the first 256 bytes of a program. JIF_LONG takes a
+     * 4-byte little-endian operand instead, and jumps to exactly that offset.
+     */
+    JIF_LONG,
+
+    /*
+     * LOAD replaces an address on top of the stack with the 8 bytes of memory
+     * at that address. STORE pops a value and then an address, and writes the
+     * value there.
+     */
+    LOAD,
+    STORE,
+
+    /*
+     * CALL takes a 4-byte little-endian offset like JIF_LONG, pushes the
+     * address of the next instruction onto the return stack and jumps. RET
+     * pops it and jumps back.
+     */
+    CALL,
+    RET,
+
+    /*
+     * LOOP is the tail of a counted loop, PUSH_IMM step; SUB; JIF target, as
+     * a single instruction. It takes the target in the same form as JIF and
+     * then the step, subtracts the step from the top of the stack and jumps
+     * if what's left isn't zero.
+     */
+    LOOP,
+
+    /*
+     * Floating point. These are the only opcodes that care what kind of value
+     * they're given: see VALUE_DOUBLE_OFFSET. The arithmetic takes integers and
+     * doubles alike and always produces a double. ITOF turns an integer into a
+     * double and FTOI goes the other way, rounding toward zero.
+     */
+    FADD,
+    FSUB,
+    FMUL,
+    FDIV,
+    ITOF,
+    FTOI,
+
+    /*
+     * JMP always jumps and JIZ jumps if the top of the stack is zero, which
+     * is the other way round from JIF. Both take a 4-byte target like JIF_LONG
+     * and leave the stack alone. They let a pass lay blocks out in any order,
+     * since whatever ends up after a JIF can be either of its successors.
+     */
+    JMP,
+    JIZ,
+
+    /*
+     * Division and multiplication by a constant, the way a compiler does them.
+     * DIV_CONST divides the top of the stack by its operand with a multiply
+     * and shifts (see div_magic), so it can't fail: the verifier rejects
+     * operands below 2. LSHIFT_CONST and RSHIFT_CONST shift the top of the
+     * stack by their operand, which has to be below 64, and are what a MUL
+     * or DIV by a power of two turns into.
+     */
+    DIV_CONST,
+    LSHIFT_CONST,
+    RSHIFT_CONST,
+
+    /*
+     * Stack shuffling, as in Forth: DUP (a -- a a), DROP (a --), SWAP
+     * (a b -- b a), OVER (a b -- a b a) and ROT (a b c -- b c a).
+     */
+    DUP,
+    DROP,
+    SWAP,
+    OVER,
+    ROT,
+
+    /*
+     * LOAD_LOCAL pushes a copy of a slot in the current frame and STORE_LOCAL
+     * pops into one. The operand is a signed byte counted from the frame
+     * base, which is where the stack top was when the procedure was called,
+     * or the bottom of the stack in the main program. So 0 is the first value
+     * a procedure pushed and -1 is the last argument its caller left it.
+     */
+    LOAD_LOCAL,
+    STORE_LOCAL,
+
+    /*
+     * Fork and join. SPAWN takes a 4-byte procedure offset like CALL and then
+     * a count k, copies the top k values into a fresh stack and hands the
+     * procedure to the task pool to run on it. The caller keeps its k values
+     * and gets a handle pushed on top of them. JOIN pops a handle, waits for
+     * the task if it has to, and pushes the value the procedure left on top
+     * of its stack. Only the code that spawned a task can join it, and only
+     * once; a task nobody joins still runs, and its result is dropped. The
+     * code that spawned it doesn't finish until it has, though, and if it
+     * failed, that code fails the same way.
+     */
+    SPAWN,
+    JOIN,
+    NUM_OPCODES
+} opcode;
+
+/*
+ * Mnemonics for each opcode, as they appear in source files.
+ */
+ISA_TABLE char *const opcode_names[NUM_OPCODES] = {
+        "PUSH_IMM",
+        "ADD",
+        "SUB",
+        "MUL",
+        "DIV",
+        "AND",
+        "OR",
+        "XOR",
+        "NOT",
+        "LSHIFT",
+        "RSHIFT",
+        "JIF",
+        "POP_RES",
+        "DONE",
+        "JIF_LONG",
+        "LOAD",
+        "STORE",
+        "CALL",
+        "RET",
+        "LOOP",
+        "FADD",
+        "FSUB",
+        "FMUL",
+        "FDIV",
+        "ITOF",
+        "FTOI",
+        "JMP",
+        "JIZ",
+        "DIV_CONST",
+        "LSHIFT_CONST",
+        "RSHIFT_CONST",
+        "DUP",
+        "DROP",
+        "SWAP",
+        "OVER",
+        "ROT",
+        "LOAD_LOCAL",
+        "STORE_LOCAL",
+        "SPAWN",
+        "JOIN"
+};
+
+/*
+ * Define possible termination statuses for our VM.
+ */
+typedef enum result {
+    SUCCESS,
+    ERR_DIV_ZERO,
+    ERR_UNKNOWN_OPCODE,
+    ERR_INVALID_JUMP,
+    ERR_MEM_OUT_OF_BOUNDS,
+    ERR_CALL_OVERFLOW,
+    ERR_RET_UNDERFLOW,
+    ERR_SPAWN_ARGS,
+    ERR_TOO_MANY_TASKS,
+    ERR_BAD_HANDLE,
+    ERR_STACK_OVERFLOW
+} result;
+
+ISA_TABLE char *const result_messages[] = {
+        "OK",
+        "division by zero",
+        "unknown opcode",
+        "jump out of the code",
+        "memory access out of bounds",
+        "calls nest deeper than the return stack",
+        "RET with nothing to return to",
+        "SPAWN copies more values than a task can take",
+        "too many tasks spawned and not joined",
+        "JOIN on something that isn't a live handle of ours",
+        "stack deeper than the bound it was sized for"
+};
+
+/*
+ * Read the 4-byte little-endian operand of a JIF_LONG.
+ */
+ISA_CONSTEXPR uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/*
+ * How many operand bytes follow an opcode in the bytecode.
+ */
+ISA_CONSTEXPR size_t operand_bytes(uint8_t op) {
+    switch (op) {
+        case PUSH_IMM:
+        case JIF:
+        case DIV_CONST:
+        case LSHIFT_CONST:
+        case RSHIFT_CONST:
+        case LOAD_LOCAL:
+        case STORE_LOCAL:
+            return 1;
+        case LOOP:
+            return 2;
+        case JIF_LONG:
+        case CALL:
+        case JMP:
+        case JIZ:
+            return 4;
+        case SPAWN:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Where the jump at pc goes, or SIZE_MAX if the instruction there isn't a jump
+ * or can't go anywhere. Remember that JIF and LOOP jump to one byte before
+ * their operand. A SPAWN counts as a jump to its procedure, like a CALL.
+ */
+ISA_CONSTEXPR size_t jump_target(const uint8_t *bytecode, size_t pc) {
+    if (bytecode[pc] == JIF || bytecode[pc] == LOOP) {
+        return bytecode[pc + 1] == 0 ? SIZE_MAX : (size_t) bytecode[pc + 1] - 1;
+    }
+    if (operand_bytes(bytecode[pc]) == 4 || bytecode[pc] == SPAWN) {
+        return read_u32(bytecode + pc + 1);
+    }
+    return SIZE_MAX;
+}
+
+/*
+ * Unsigned division by a constant d as a multiply-high and shifts, after
+ * libdivide. Work out the magic number once, and then
+ *
+ *   q = (n * multiplier) >> 64
+ *   n / d = q >> shift                      without add
+ *         = (((n - q) >> 1) + q) >> shift   with add
+ *
+ * The second form is for divisors whose exact multiplier would need 65 bits.
+ * Powers of two use it with a multiplier of 1, which comes out as a plain
+ * shift. There's nothing that works for 0 or 1, so they get all zeros.
+ */
+struct div_magic {
+    uint64_t multiplier;
+    uint8_t shift;
+    uint8_t add;
+};
+
+ISA_CONSTEXPR struct div_magic div_magic(uint64_t d) {
+    struct div_magic m = {0, 0, 0};
+    if (d < 2) {
+        return m;
+    }
+    int log = 63 - __builtin_clzll(d);
+    if ((d & (d - 1)) == 0) {
+        m.multiplier = 1;
+        m.shift = (uint8_t) (log - 1);
+        m.add = 1;
+        return m;
+    }
+
+    /*
+     * 2^(64 + log) / d fits in 64 bits because d is more than 2^log.
+     */
+    unsigned __int128 numerator = (unsigned __int128) 1 << (64 + log);
+    uint64_t proposed = (uint64_t) (numerator / d);
+    uint64_t rem = (uint64_t) (numerator % d);
+    m.shift = (uint8_t) log;
+    if (d - rem >= (uint64_t) 1 << log) {
+        proposed += proposed;
+        uint64_t twice_rem = rem + rem;
+        if (twice_rem >= d || twice_rem < rem) {
+            proposed++;
+        }
+        m.add = 1;
+    }
+    m.multiplier = proposed + 1;
+    return m;
+}
+
+/*
+ * The engines are built without optimization, and this has to beat a hardware
+ * divide, so it gets inlined regardless.
+ */
+__attribute__((always_inline)) ISA_CONSTEXPR uint64_t div_by_magic(uint64_t n, struct div_magic m) {
+    uint64_t q = (uint64_t) (((unsigned __int128) n * m.multiplier) >> 64);
+    if (m.add) {
+        q += (n - q) >> 1;
+    }
+    return q >> m.shift;
+}
+
+/*
+ * Values. The integer opcodes treat every cell as a raw 64-bit integer and
+ * never look at what's in it, and that stays their fast path. Doubles are
+ * NaN-boxed around those integers: an integer is any cell whose top 16 bits
+ * are all zeros or all ones, which covers every sign-extended 49-bit number,
+ * and a double is stored as its bit pattern plus VALUE_DOUBLE_OFFSET. That
+ * moves every double out of the integer band except negative NaNs with their
+ * top mantissa bits set, and we never store those because every NaN is
+ * canonicalized first.
+ *
+ * Only the float opcodes check which kind of value they have. An integer that
+ * integer arithmetic has pushed past 49 bits reads as a double to them, and
+ * JIF still tests the raw cell, so 0.0 counts as true.
+ */
+#define VALUE_DOUBLE_OFFSET (1ull << 48)
+#define VALUE_INT_MAX       ((int64_t) VALUE_DOUBLE_OFFSET - 1)
+#define VALUE_INT_MIN       (-(int64_t) VALUE_DOUBLE_OFFSET)
+#define VALUE_CANONICAL_NAN 0x7FF8000000000000ull
+
+static inline int value_is_int(uint64_t v) {
+    return ((v + VALUE_DOUBLE_OFFSET) >> 49) == 0;
+}
+
+static inline uint64_t box_double(double d) {
+    uint64_t bits = VALUE_CANONICAL_NAN;
+    if (d == d) {
+        memcpy(&bits, &d, sizeof(bits));
+    }
+    return bits + VALUE_DOUBLE_OFFSET;
+}
+
+/*
+ * Integers get promoted, so this works on either kind of value.
+ */
+static inline double value_to_double(uint64_t v) {
+    if (value_is_int(v)) {
+        return (double) (int64_t) v;
+    }
+    v -= VALUE_DOUBLE_OFFSET;
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline uint64_t value_fadd(uint64_t a, uint64_t b) {
+    return box_double(value_to_double(a) + value_to_double(b));
+}
+
+static inline uint64_t value_fsub(uint64_t a, uint64_t b) {
+    return box_double(value_to_double(a) - value_to_double(b));
+}
+
+static inline uint64_t value_fmul(uint64_t a, uint64_t b) {
+    return box_double(value_to_double(a) * value_to_double(b));
+}
+
+/*
+ * Unlike DIV, this can't fail: dividing by zero gives an infinity or a NaN.
+ */
+static inline uint64_t value_fdiv(uint64_t a, uint64_t b) {
+    return box_double(value_to_double(a) / value_to_double(b));
+}
+
+static inline uint64_t value_itof(uint64_t v) {
+    return value_is_int(v) ? box_double((double) (int64_t) v) : v;
+}
+
+/*
+ * Doubles past the integer range clamp to its ends, and NaN becomes 0.
+ */
+static inline uint64_t value_ftoi(uint64_t v) {
+    if (value_is_int(v)) {
+        return v;
+    }
+    double d = value_to_double(v);
+    if (d != d) {
+        return 0;
+    }
+    if (d >= (double) VALUE_INT_MAX) {
+        return (uint64_t) VALUE_INT_MAX;
+    }
+    if (d <= (double) VALUE_INT_MIN) {
+        return (uint64_t) VALUE_INT_MIN;
+    }
+    return (uint64_t) (int64_t) d;
+}
+
+/*
+ * Tasks for engines that run each one as a call, right where it's spawned:
+ * libverse, verse.hpp and the profiling run in perf.h. When a task returns,
+ * they keep its value here and push a handle in its place, and JOIN trades
+ * the handle back for the value. That way a JOIN fails where it would on
+ * stckvm's pool, with ERR_BAD_HANDLE, if the handle isn't one the code
+ * running now was given and hasn't joined yet. A task that fails ends the
+ * whole run right there, which is how the pool ends up too.
+ *
+ * Tasks nest, and whatever a task spawned is done with once it returns, so
+ * the table works as a stack. A SPAWN takes the next entry, a task's return
+ * frees everything above its own, and a JOIN frees its entry if that's the
+ * top one, so that a loop that spawns and joins doesn't fill the table up.
+ */
+#define SERIAL_MAIN UINT32_MAX
+
+enum serial_state {
+    SERIAL_RUNNING,
+    SERIAL_DONE,
+    SERIAL_JOINED
+};
+
+struct serial_task {
+    uint64_t value;
+
+    /*
+     * The entry of the task that spawned this one, or SERIAL_MAIN.
+     */
+    uint32_t owner;
+
+    /*
+     * Bumped every time the entry is freed, so an old handle to it stops
+     * working. It stays below HANDLE_TAG.
+     */
+    uint32_t gen;
+    uint8_t state;
+};
+
+struct serial_tasks {
+    struct serial_task tasks[SPAWN_TASKS];
+    uint32_t top;
+
+    /*
+     * The entry of the task running now, or SERIAL_MAIN.
+     */
+    uint32_t current;
+};
+
+static inline void serial_reset(struct serial_tasks *s) {
+    s->top = 0;
+    s->current = SERIAL_MAIN;
+}
+
+static inline uint64_t serial_handle(const struct serial_tasks *s, uint32_t index) {
+    return HANDLE_TAG | (uint64_t) s->tasks[index].gen << 32 | index;
+}
+
+/*
+ * Where the entries of the running code's own tasks start. Everything from
+ * there up is one of them, since its tasks' tasks are gone by now.
+ */
+static inline uint32_t serial_base(const struct serial_tasks *s) {
+    return s->current == SERIAL_MAIN ? 0 : s->current + 1;
+}
+
+static inline void serial_free_to(struct serial_tasks *s, uint32_t top) {
+    while (s->top > top) {
+        struct serial_task *t = &s->tasks[--s->top];
+        t->gen = (t->gen + 1) & 0x7FFFFFFF;
+    }
+}
+
+/*
+ * A SPAWN is about to call its procedure. Until serial_return, the code
+ * running is that task.
+ */
+static inline result serial_spawn(struct serial_tasks *s) {
+    if (s->top == SPAWN_TASKS) {
+        return ERR_TOO_MANY_TASKS;
+    }
+    struct serial_task *t = &s->tasks[s->top];
+    t->owner = s->current;
+    t->state = SERIAL_RUNNING;
+    s->current = s->top++;
+    return SUCCESS;
+}
+
+/*
+ * The running task returned value. Back in the code that spawned it, returns
+ * the handle to push.
+ */
+static inline uint64_t serial_return(struct serial_tasks *s, uint64_t value) {
+    uint32_t index = s->current;
+    struct serial_task *t = &s->tasks[index];
+    serial_free_to(s, index + 1);
+    t->value = value;
+    t->state = SERIAL_DONE;
+    s->current = t->owner;
+    return serial_handle(s, index);
+}
+
+/*
+ * JOIN the handle in slot, leaving the task's value there instead. Leaves
+ * everything alone if it fails.
+ */
+static inline result serial_join(struct serial_tasks *s, uint64_t *slot) {
+    uint32_t index = (uint32_t) *slot;
+    if (index < serial_base(s) || index >= s->top || *slot != serial_handle(s, index) ||
+        s->tasks[index].state != SERIAL_DONE) {
+        return ERR_BAD_HANDLE;
+    }
+    *slot = s->tasks[index].value;
+    s->tasks[index].state = SERIAL_JOINED;
+    while (s->top > serial_base(s) && s->tasks[s->top - 1].state == SERIAL_JOINED) {
+        serial_free_to(s, s->top - 1);
+    }
+    return SUCCESS;
+}
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef VERSE_STACK_LAYOUT_H_
+#define VERSE_STACK_LAYOUT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perf.h"
+#include "vm.h"
+
+/*
+ * Profile-guided block layout. stacka lays code out in source order, so a loop
+ * whose body skips over a rarely run block jumps on every trip, and the cold
+ * block sits in the middle of the hot ones. Given how often each branch went
+ * each way in a profiling run, we cut the program into basic blocks and chain
+ * them up along the hottest edges first, the way Pettis and Hansen do it. Every
+ * edge inside a chain becomes a fall-through. The chain with the entry block
+ * goes first, then the others from hottest to coldest, so the hot loops end up
+ * contiguous and the code that never ran ends up at the end.
+ *
+ * Then every branch gets rewritten to fit its new neighbors. A JIF whose taken
+ * side now comes next turns into a JIZ to the other side, and a branch with
+ * neither side next gets a JMP after it. A JMP to the block right after it
+ * goes away. Edges that never ran keep their source order where they can, so
+ * without a profile the layout stays the same.
+ */
+
+struct layout_block {
+    size_t start;
+    size_t end;
+
+    /*
+     * Where the jump that ends the block is, or end if it doesn't end in one.
+     */
+    size_t branch;
+    uint8_t op;
+
+    /*
+     * The blocks the jump goes to and control falls into, or -1.
+     */
+    int taken;
+    int fall;
+    uint64_t weight;
+    uint64_t taken_count;
+
+    /*
+     * Chains are kept as a union-find forest, and the root of each tree is
+     * the block the chain starts with.
+     */
+    int chain;
+    int chain_next;
+    int placed_next;
+    int is_long;
+    size_t new_start;
+};
+
+struct layout_edge {
+    int from;
+    int to;
+    int is_fall;
+    uint64_t weight;
+};
+
+struct layout_report {
+    size_t num_blocks;
+    size_t num_chains;
+    size_t inverted;
+    size_t jumps_added;
+    size_t jumps_removed;
+};
+
+int compare_edges(const void *x, const void *y) {
+    const struct layout_edge *a = x;
+    const struct layout_edge *b = y;
+    if (a->weight != b->weight) {
+        return a->weight > b->weight ? -1 : 1;
+    }
+    if (a->is_fall != b->is_fall) {
+        return a->is_fall ? -1 : 1;
+    }
+    return a->from - b->from;
+}
+
+/*
+ * Chains are named after the block they start with. The one that starts with
+ * the entry goes first, and the others hottest first. Ties keep source order.
+ */
+uint64_t *sort_heat;
+
+int compare_chains(const void *x, const void *y) {
+    int a = *(const int *) x;
+    int b = *(const int *) y;
+    if (a == 0 || b == 0) {
+        return a == 0 ? -1 : 1;
+    }
+    if (sort_heat[a] != sort_heat[b]) {
+        return sort_heat[a] > sort_heat[b] ? -1 : 1;
+    }
+    return a - b;
+}
+
+int find_chain(struct layout_block *blocks, int b) {
+    while (blocks[b].chain != b) {
+        blocks[b].chain = blocks[blocks[b].chain].chain;
+        b = blocks[b].chain;
+    }
+    return b;
+}
+
+int is_jump(uint8_t op) {
+    return op == JIF || op == JIF_LONG || op == JIZ || op == LOOP || op == JMP;
+}
+
+/*
+ * How many bytes the end of a block comes out to, given what's placed after
+ * it. Also counts what we had to do there, if asked to.
+ */
+size_t layout_tail(struct layout_block *b, struct layout_report *report) {
+    int next = b->placed_next;
+    size_t size = 0;
+    switch (b->op) {
+        case JIF:
+        case JIF_LONG:
+        case JIZ:
+            if (next == b->taken && next != b->fall) {
+                if (report != NULL) {
+                    report->inverted++;
+                }
+                return b->op == JIZ && !b->is_long ? 2 : 5;
+            }
+            size = b->op == JIZ || b->is_long ? 5 : 2;
+            break;
+        case LOOP:
+            size = b->is_long ? 8 : 3;
+            break;
+        case JMP:
+            if (next == b->taken) {
+                if (report != NULL) {
+                    report->jumps_removed++;
+                }
+                return 0;
+            }
+            return 5;
+        default:
+            break;
+    }
+    if (b->fall >= 0 && next != b->fall) {
+        if (report != NULL) {
+            report->jumps_added++;
+        }
+        size += 5;
+    }
+    return size;
+}
+
+void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+/*
+ * Write a short or long conditional jump to a block. is_zero picks JIZ, which
+ * only comes in the long form.
+ */
+size_t emit_branch(uint8_t *out, size_t at, int is_zero, int is_long, size_t target) {
+    if (is_zero || is_long) {
+        out[at] = is_zero ? JIZ : JIF_LONG;
+        put_u32(out + at + 1, (uint32_t) target);
+        return at + 5;
+    }
+    out[at] = JIF;
+    out[at + 1] = (uint8_t) (target + 1);
+    return at + 2;
+}
+
+/*
+ * Lay a program out again according to a profile of it. Returns a malloc'd
+ * copy of the code, which is just the original if we couldn't make sense of
+ * it, and stores its length in new_len.
+ */
+uint8_t *layout_blocks(uint8_t *code, size_t len, struct branch_profile *profile, size_t *new_len,
+                       struct layout_report *report) {
+    memset(report, 0, sizeof(*report));
+    uint8_t *out = malloc(16 * len + 16);
+    uint8_t *is_start = calloc(len + 1, 1);
+    uint8_t *is_leader = calloc(len + 1, 1);
+    int *block_of = malloc((len + 1) * sizeof(int));
+    struct layout_block *blocks = calloc(len + 1, sizeof(struct layout_block));
+    struct layout_edge *edges = malloc(2 * (len + 1) * sizeof(struct layout_edge));
+    uint64_t *heat = calloc(len + 1, sizeof(uint64_t));
+    if (out == NULL || is_start == NULL || is_leader == NULL || block_of == NULL || blocks == NULL ||
+        edges == NULL || heat == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(out, code, len);
+    *new_len = len;
+
+    /*
+     * Find the instructions, and the ones that start a block: the entry,
+     * anything a jump or call lands on, and anything right after a jump, DONE
+     * or RET. Code we can't decode, or that runs off the end, we leave alone.
+     */
+    is_leader[0] = 1;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        uint8_t op = code[pc];
+        if (op >= NUM_OPCODES || pc + operand_bytes(op) >= len) {
+            goto done;
+        }
+        is_start[pc] = 1;
+        if (is_jump(op) || op == DONE || op == RET) {
+            is_leader[pc + 1 + operand_bytes(op)] = 1;
+        }
+    }
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        size_t target = jump_target(code, pc);
+        if (is_jump(code[pc]) || code[pc] == CALL || code[pc] == SPAWN) {
+            if (target >= len || !is_start[target]) {
+                goto done;
+            }
+            is_leader[target] = 1;
+        }
+    }
+
+    int n = 0;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        if (is_leader[pc]) {
+            if (n > 0) {
+                blocks[n - 1].end = pc;
+            }
+            blocks[n].start = pc;
+            n++;
+        }
+        block_of[pc] = n - 1;
+        blocks[n - 1].branch = SIZE_MAX;
+        blocks[n - 1].op = code[pc];
+        if (is_jump(code[pc])) {
+            blocks[n - 1].branch = pc;
+        }
+    }
+    blocks[n - 1].end = len;
+
+    /*
+     * Work out where each block goes and how often it went there.
+     */
+    int num_edges = 0;
+    for (int i = 0; i < n; i++) {
+        struct layout_block *b = &blocks[i];
+        size_t last = b->branch;
+        if (last == SIZE_MAX) {
+            for (last = b->start; last + 1 + operand_bytes(code[last]) < b->end;) {
+                last += 1 + operand_bytes(code[last]);
+            }
+            b->branch = b->end;
+        }
+        b->weight = profile->executed[b->start];
+        b->taken_count = profile->taken[last];
+        b->taken = is_jump(b->op) ? block_of[jump_target(code, last)] : -1;
+        b->fall = b->op == JMP || b->op == DONE || b->op == RET ? -1 : i + 1;
+        b->chain = i;
+        b->chain_next = -1;
+        b->placed_next = -1;
+        heat[i] = b->weight;
+        if (b->fall == n) {
+            goto done;
+        }
+        uint64_t ran = profile->executed[last];
+        if (b->taken >= 0 && b->op != LOOP) {
+            edges[num_edges++] = (struct layout_edge) {i, b->taken, 0, b->taken_count};
+        }
+        if (b->fall >= 0) {
+            edges[num_edges++] = (struct layout_edge) {i, b->fall, 1, ran - b->taken_count};
+        }
+    }
+    report->num_blocks = n;
+
+    /*
+     * Chain blocks up along the hottest edges we can. An edge joins two chains
+     * if it leaves the end of one and enters the start of another, and never
+     * enters the entry, which has to stay at the start of the program.
+     */
+    qsort(edges, num_edges, sizeof(struct layout_edge), compare_edges);
+    for (int e = 0; e < num_edges; e++) {
+        struct layout_edge *edge = &edges[e];
+        if ((edge->weight == 0 && !edge->is_fall) || edge->to == 0 || blocks[edge->from].chain_next >= 0 ||
+            blocks[edge->to].chain != edge->to) {
+            continue;
+        }
+        int chain = find_chain(blocks, edge->from);
+        if (chain == edge->to) {
+            continue;
+        }
+        blocks[edge->from].chain_next = edge->to;
+        blocks[edge->to].chain = chain;
+        if (heat[edge->to] > heat[chain]) {
+            heat[chain] = heat[edge->to];
+        }
+    }
+
+    /*
+     * Put the chains in order and the blocks after each other.
+     */
+    int num_chains = 0;
+    int *chains = malloc(n * sizeof(int));
+    if (chains == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        if (blocks[i].chain == i) {
+            chains[num_chains++] = i;
+        }
+    }
+    report->num_chains = num_chains;
+    sort_heat = heat;
+    qsort(chains, num_chains, sizeof(int), compare_chains);
+    int placed = 0;
+    int prev = -1;
+    int *placement = malloc(n * sizeof(int));
+    if (placement == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int c = 0; c < num_chains; c++) {
+        for (int b = chains[c]; b >= 0; b = blocks[b].chain_next) {
+            if (prev >= 0) {
+                blocks[prev].placed_next = b;
+            }
+            placement[placed++] = b;
+            prev = b;
+        }
+    }
+    free(chains);
+
+    /*
+     * Short JIFs and LOOPs can only reach the first 256 bytes. Lay everything
+     * out assuming they all still reach, and make the ones that don't long
+     * until nothing changes. A jump only ever gets longer, so this stops.
+     */
+    int changed = 1;
+    size_t at = 0;
+    while (changed) {
+        changed = 0;
+        at = 0;
+        for (int i = 0; i < placed; i++) {
+            struct layout_block *b = &blocks[placement[i]];
+            b->new_start = at;
+            at += b->branch - b->start + layout_tail(b, NULL);
+        }
+        for (int i = 0; i < placed; i++) {
+            struct layout_block *b = &blocks[placement[i]];
+            int target = b->placed_next == b->taken && b->op != LOOP ? b->fall : b->taken;
+            if ((b->op == JIF || b->op == JIF_LONG || b->op == JIZ || b->op == LOOP) && !b->is_long &&
+                blocks[target].new_start + 1 > 0xFF) {
+                b->is_long = 1;
+                changed = 1;
+            }
+        }
+    }
+
+    /*
+     * Write the blocks out, with the calls pointing at where their
+     * procedures went and the jumps rewritten for their new neighbors.
+     */
+    at = 0;
+    for (int i = 0; i < placed; i++) {
+        struct layout_block *b = &blocks[placement[i]];
+        for (size_t pc = b->start; pc < b->branch; pc += 1 + operand_bytes(code[pc])) {
+            out[at] = code[pc];
+            memcpy(out + at + 1, code + pc + 1, operand_bytes(code[pc]));
+            if (code[pc] == CALL || code[pc] == SPAWN) {
+                put_u32(out + at + 1, (uint32_t) blocks[block_of[jump_target(code, pc)]].new_start);
+            }
+            at += 1 + operand_bytes(code[pc]);
+        }
+        layout_tail(b, report);
+        size_t taken = b->taken >= 0 ? blocks[b->taken].new_start : 0;
+        size_t fall = b->fall >= 0 ? blocks[b->fall].new_start : 0;
+        int fall_next = b->placed_next == b->fall;
+        switch (b->op) {
+            case JIF:
+            case JIF_LONG:
+            case JIZ:
+                if (b->placed_next == b->taken && !fall_next) {
+                    at = emit_branch(out, at, b->op != JIZ, b->is_long, fall);
+                    fall_next = 1;
+                } else {
+                    at = emit_branch(out, at, b->op == JIZ, b->is_long, taken);
+                }
+                break;
+            case LOOP:
+                if (b->is_long) {
+                    out[at++] = PUSH_IMM;
+                    out[at++] = code[b->branch + 2];
+                    out[at++] = SUB;
+                    at = emit_branch(out, at, 0, 1, taken);
+                } else {
+                    out[at++] = LOOP;
+                    out[at++] = (uint8_t) (taken + 1);
+                    out[at++] = code[b->branch + 2];
+                }
+                break;
+            case JMP:
+                if (b->placed_next != b->taken) {
+                    out[at] = JMP;
+                    put_u32(out + at + 1, (uint32_t) taken);
+                    at += 5;
+                }
+                break;
+            default:
+                break;
+        }
+        if (b->fall >= 0 && !fall_next) {
+            out[at] = JMP;
+            put_u32(out + at + 1, (uint32_t) fall);
+            at += 5;
+        }
+    }
+    *new_len = at;
+    free(placement);
+
+    done:
+    free(is_start);
+    free(is_leader);
+    free(block_of);
+    free(blocks);
+    free(edges);
+    free(heat);
+    return out;
+}
+
+void print_layout_report(FILE *f, struct layout_report *report, size_t len, size_t new_len) {
+    fprintf(f, "%zu blocks in %zu chains, %zu branches inverted, %zu jumps added, %zu removed\n",
+            report->num_blocks, report->num_chains, report->inverted, report->jumps_added, report->jumps_removed);
+    fprintf(f, "%zu bytes -> %zu bytes\n", len, new_len);
+}
+
+#endif
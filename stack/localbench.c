@@ -0,0 +1,318 @@
+/*
+ * Measure what stack shuffling and locals buy on real loops. Before DUP, SWAP
+ * and friends, a value could only be used once and only from the top of the
+ * stack, so anything a loop needed every iteration had to live in memory and
+ * come back with PUSH_IMM addr; LOAD. Each kernel comes in two versions that
+ * compute the same thing:
+ *
+ *   memory  the way the examples in programs/stack are written, with loop
+ *           state in memory cells
+ *   stack   the same loop with its state on the stack, reached with the new
+ *           opcodes
+ *
+ * The kernels are
+ *
+ *   counted  add 3 to an accumulator every iteration, as in counted.stack
+ *   sum      add up an array, as in memsum.stack
+ *   fib      step the Fibonacci recurrence (a, b) -> (b, a + b)
+ *
+ * and each runs ITERATIONS iterations. We count dispatches with the profiling
+ * interpreter, then time every engine on both versions.
+ */
+
+#include <time.h>
+
+#include "perf.h"
+#include "verify.h"
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./stcklocalbench [dispatch type]\n"
+
+/*
+ * Loops count down from 255 * 255, built with a MUL since PUSH_IMM only takes
+ * a byte. The array for sum fits in MEM_SIZE at 8 bytes a cell.
+ */
+#define ITERATIONS (255 * 255)
+#define REPS 20
+
+#define PROGRAM_MAX 128
+
+enum variant {
+    MEMORY,
+    STACK,
+    NUM_VARIANTS
+};
+
+const char *variant_names[NUM_VARIANTS] = {"memory", "stack"};
+
+enum kernel {
+    COUNTED,
+    SUM,
+    FIB,
+    NUM_KERNELS
+};
+
+const char *kernel_names[NUM_KERNELS] = {"counted", "sum", "fib"};
+
+struct program {
+    uint8_t code[PROGRAM_MAX];
+    size_t len;
+    uint64_t dispatches;
+};
+
+void emit_bytes(struct program *p, const uint8_t *bytes, size_t n) {
+    memcpy(p->code + p->len, bytes, n);
+    p->len += n;
+}
+
+#define emit(p, ...) emit_bytes((p), (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+/*
+ * Push the trip count.
+ */
+void emit_iterations(struct program *p) {
+    emit(p, PUSH_IMM, 255, PUSH_IMM, 255, MUL);
+}
+
+/*
+ * Close a loop that counts down on top of the stack. JIF jumps to one byte
+ * before its operand.
+ */
+void emit_loop_tail(struct program *p, size_t head) {
+    emit(p, PUSH_IMM, 1, SUB, JIF, (uint8_t) (head + 1));
+}
+
+void build_counted(struct program *p, enum variant v) {
+    if (v == MEMORY) {
+
+        /*
+         * Cell 0 holds the accumulator, under the counter on the stack.
+         */
+        emit_iterations(p);
+        size_t head = p->len;
+        emit(p, PUSH_IMM, 0, PUSH_IMM, 0, LOAD, PUSH_IMM, 3, ADD, STORE);
+        emit_loop_tail(p, head);
+        emit(p, POP_RES, PUSH_IMM, 0, LOAD, POP_RES);
+    } else {
+
+        /*
+         * Local 0 is the accumulator, under the counter.
+         */
+        emit(p, PUSH_IMM, 0);
+        emit_iterations(p);
+        size_t head = p->len;
+        emit(p, LOAD_LOCAL, 0, PUSH_IMM, 3, ADD, STORE_LOCAL, 0);
+        emit_loop_tail(p, head);
+        emit(p, DROP, POP_RES);
+    }
+    emit(p, DONE);
+}
+
+void build_sum(struct program *p, enum variant v) {
+    if (v == MEMORY) {
+
+        /*
+         * The counter lives in cell 0, since we need it twice: for the address
+         * and for the loop test. Testing it leaves a copy behind, which the
+         * next iteration pops.
+         */
+        emit(p, PUSH_IMM, 0, PUSH_IMM, 0);
+        emit_iterations(p);
+        emit(p, STORE, PUSH_IMM, 0);
+        size_t head = p->len;
+        emit(p, POP_RES, PUSH_IMM, 0, LOAD, PUSH_IMM, 8, MUL, LOAD, ADD);
+        emit(p, PUSH_IMM, 0, PUSH_IMM, 0, LOAD, PUSH_IMM, 1, SUB, STORE);
+        emit(p, PUSH_IMM, 0, LOAD, JIF, (uint8_t) (head + 1));
+        emit(p, POP_RES, POP_RES);
+    } else {
+
+        /*
+         * ( total i -- total' i ) with DUP for the address and ROT and SWAP to
+         * get the total back under the counter.
+         */
+        emit(p, PUSH_IMM, 0);
+        emit_iterations(p);
+        size_t head = p->len;
+        emit(p, DUP, PUSH_IMM, 8, MUL, LOAD, ROT, ADD, SWAP);
+        emit_loop_tail(p, head);
+        emit(p, DROP, POP_RES);
+    }
+    emit(p, DONE);
+}
+
+void build_fib(struct program *p, enum variant v) {
+    if (v == MEMORY) {
+
+        /*
+         * a in cell 0 and b in cell 8. Both STOREs go at the end, so the new
+         * a is read before b is overwritten.
+         */
+        emit(p, PUSH_IMM, 8, PUSH_IMM, 1, STORE);
+        emit_iterations(p);
+        size_t head = p->len;
+        emit(p, PUSH_IMM, 0, PUSH_IMM, 8, LOAD, PUSH_IMM, 8, PUSH_IMM, 0, LOAD, PUSH_IMM, 8, LOAD, ADD);
+        emit(p, STORE, STORE);
+        emit_loop_tail(p, head);
+        emit(p, POP_RES, PUSH_IMM, 8, LOAD, POP_RES);
+    } else {
+
+        /*
+         * Locals 0 and 1 are a and b, under the counter.
+         */
+        emit(p, PUSH_IMM, 0, PUSH_IMM, 1);
+        emit_iterations(p);
+        size_t head = p->len;
+        emit(p, LOAD_LOCAL, 1, LOAD_LOCAL, 0, LOAD_LOCAL, 1, ADD, STORE_LOCAL, 1, STORE_LOCAL, 0);
+        emit_loop_tail(p, head);
+        emit(p, DROP, POP_RES, DROP);
+    }
+    emit(p, DONE);
+}
+
+void build(struct program *p, enum kernel k, enum variant v) {
+    p->len = 0;
+    switch (k) {
+        case COUNTED:
+            build_counted(p, v);
+            break;
+        case SUM:
+            build_sum(p, v);
+            break;
+        case FIB:
+            build_fib(p, v);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * The array sum adds up cell i = i * i for i from 1 up. The memory kernels keep
+ * their state in cells 0 and 8, the first of which is also the array's, so
+ * this goes before every run.
+ */
+void fill_memory() {
+    mem_cell(0) = 0;
+    for (uint64_t i = 1; i <= ITERATIONS; i++) {
+        mem_cell(8 * i) = i * i;
+    }
+}
+
+uint64_t expected_result(enum kernel k) {
+    uint64_t total = 0;
+    uint64_t a = 0;
+    uint64_t b = 1;
+    switch (k) {
+        case COUNTED:
+            return 3 * (uint64_t) ITERATIONS;
+        case SUM:
+            for (uint64_t i = 1; i <= ITERATIONS; i++) {
+                total += i * i;
+            }
+            return total;
+        default:
+            for (int i = 0; i < ITERATIONS; i++) {
+                uint64_t next = a + b;
+                a = b;
+                b = next;
+            }
+            return b;
+    }
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Run a program REPS times and keep the fastest run.
+ */
+double measure(struct engine *e, struct program *p, uint64_t expected) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec t0, t1;
+        vm.stack_top = vm.stack;
+        vm.return_top = vm.return_stack;
+        fill_memory();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        result r = run_engine(e, p->code);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (r != SUCCESS || vm.result != expected) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (rep == 0 || elapsed_ns(&t0, &t1) < best) {
+            best = elapsed_ns(&t0, &t1);
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    vm_quiet = 1;
+
+    /*
+     * Every version has to verify. Counting runs on zeroed memory, which
+     * doesn't change how many instructions any of these take.
+     */
+    static struct program programs[NUM_KERNELS][NUM_VARIANTS];
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        for (int v = 0; v < NUM_VARIANTS; v++) {
+            struct verify_info info;
+            build(&programs[k][v], k, v);
+            verify_status status = verify_bytecode(programs[k][v].code, programs[k][v].len, &info);
+            if (status != VERIFY_OK) {
+                fprintf(stderr, "%s/%s doesn't verify: %s\n", kernel_names[k], variant_names[v],
+                        verify_messages[status]);
+                fflush(stderr);
+                exit(EXIT_FAILURE);
+            }
+            programs[k][v].dispatches = count_dispatches(programs[k][v].code);
+        }
+    }
+    double times[NUM_ENGINES][NUM_KERNELS][NUM_VARIANTS];
+    for (struct engine *e = first; e < last; e++) {
+        for (int k = 0; k < NUM_KERNELS; k++) {
+            for (int v = 0; v < NUM_VARIANTS; v++) {
+                times[e - engines][k][v] = measure(e, &programs[k][v], expected_result(k));
+            }
+        }
+    }
+
+    printf("%d iterations per kernel\n", ITERATIONS);
+    printf("%-8s %-7s %6s %11s %10s\n", "kernel", "variant", "bytes", "dispatches", "per iter");
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        for (int v = 0; v < NUM_VARIANTS; v++) {
+            struct program *p = &programs[k][v];
+            printf("%-8s %-7s %6zu %11" PRIu64 " %10.2f\n", kernel_names[k], variant_names[v], p->len,
+                   p->dispatches, (double) p->dispatches / ITERATIONS);
+        }
+    }
+    printf("\n%-10s %-8s %-7s %10s %10s\n", "engine", "kernel", "variant", "ns/iter", "vs memory");
+    for (struct engine *e = first; e < last; e++) {
+        for (int k = 0; k < NUM_KERNELS; k++) {
+            for (int v = 0; v < NUM_VARIANTS; v++) {
+                double ns = times[e - engines][k][v];
+                printf("%-10s %-8s %-7s %10.3f %9.2fx\n", e->name, kernel_names[k], variant_names[v],
+                       ns / ITERATIONS, times[e - engines][k][MEMORY] / ns);
+            }
+        }
+    }
+}
@@ -0,0 +1,347 @@
+#ifndef VERSE_STACK_LOOPS_H_
+#define VERSE_STACK_LOOPS_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+/*
+ * Counted loop recognition. The loops we care about are a head the back edge
+ * jumps to, a body, and a JIF, JIF_LONG or LOOP back to the head:
+ *
+ *   head: <body>; JIF head
+ *
+ * The JIF peeks at the top of the stack, so the loop keeps going until the body
+ * leaves a zero there. If the body doesn't touch anything but the top of the
+ * stack, and all it does to it is add a constant c, the loop runs until
+ * x + k * c wraps around to zero. That always happens when c is odd, and then
+ * the only thing the loop leaves behind is the zero, so we can replace the
+ * whole thing with PUSH_IMM 0; AND.
+ *
+ * A body that does anything else has to keep running, but if it ends in the
+ * usual PUSH_IMM step; SUB; JIF head, those three instructions still become a
+ * single LOOP.
+ *
+ * Both rewrites shrink the code, so afterwards we lay the program out again
+ * and fix up every jump and call.
+ */
+
+typedef enum {
+    LOOP_CLOSED_FORM,
+    LOOP_FUSED
+} loop_rewrite;
+
+/*
+ * One loop we rewrote. head and end are byte offsets in the original program,
+ * and the rewrite covers everything from start up to end.
+ */
+struct loop_transform {
+    loop_rewrite kind;
+    size_t head;
+    size_t start;
+    size_t end;
+    uint64_t step;
+};
+
+struct loop_report {
+    struct loop_transform *loops;
+    size_t num_loops;
+};
+
+/*
+ * A value on the stack while we run a loop body symbolically: either a
+ * constant, or x + v where x is whatever was on top of the stack at the head.
+ */
+struct sym_value {
+    int is_x;
+    uint64_t v;
+};
+
+/*
+ * Run the instructions from head up to the back edge at tail on a stack that
+ * only holds x, and work out what they add to it. Returns 0 if the body does
+ * anything but constant arithmetic, reaches below x, or leaves anything but
+ * x + c behind.
+ */
+int loop_step(uint8_t *code, size_t head, size_t tail, uint64_t *step) {
+    struct sym_value stack[STACK_MAX];
+    size_t depth = 1;
+    stack[0].is_x = 1;
+    stack[0].v = 0;
+    for (size_t pc = head; pc <= tail; pc += 1 + operand_bytes(code[pc])) {
+        uint8_t op = code[pc];
+        if (pc == tail) {
+            if (op == LOOP) {
+                stack[0].v -= code[pc + 2];
+            }
+            break;
+        }
+        if (op == PUSH_IMM) {
+            if (depth == STACK_MAX) {
+                return 0;
+            }
+            stack[depth].is_x = 0;
+            stack[depth].v = code[pc + 1];
+            depth++;
+            continue;
+        }
+        if (op == NOT) {
+            if (depth == 0 || stack[depth - 1].is_x) {
+                return 0;
+            }
+            stack[depth - 1].v = ~stack[depth - 1].v;
+            continue;
+        }
+        if (depth < 2) {
+            return 0;
+        }
+        struct sym_value a = stack[depth - 2];
+        struct sym_value b = stack[depth - 1];
+        struct sym_value *r = &stack[depth - 2];
+        depth--;
+        if (op == ADD && !(a.is_x && b.is_x)) {
+            r->is_x = a.is_x || b.is_x;
+            r->v = a.v + b.v;
+            continue;
+        }
+        if (op == SUB && (a.is_x || !b.is_x)) {
+            r->is_x = a.is_x && !b.is_x;
+            r->v = a.v - b.v;
+            continue;
+        }
+        if (a.is_x || b.is_x) {
+            return 0;
+        }
+        switch (op) {
+            case MUL:
+                r->v = a.v * b.v;
+                break;
+            case DIV:
+                if (b.v == 0) {
+                    return 0;
+                }
+                r->v = a.v / b.v;
+                break;
+            case AND:
+                r->v = a.v & b.v;
+                break;
+            case OR:
+                r->v = a.v | b.v;
+                break;
+            case XOR:
+                r->v = a.v ^ b.v;
+                break;
+            case LSHIFT:
+            case RSHIFT:
+
+                /*
+                 * Shifting by 64 or more is up to the host, so leave it to
+                 * the interpreter.
+                 */
+                if (b.v >= 64) {
+                    return 0;
+                }
+                r->v = op == LSHIFT ? a.v << b.v : a.v >> b.v;
+                break;
+            default:
+                return 0;
+        }
+    }
+    if (depth != 1 || !stack[0].is_x) {
+        return 0;
+    }
+    *step = stack[0].v;
+    return 1;
+}
+
+/*
+ * Does any jump land strictly between start and end?
+ */
+int jumped_into(uint8_t *is_target, size_t start, size_t end) {
+    for (size_t pc = start + 1; pc < end; pc++) {
+        if (is_target[pc]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Find the loops we can rewrite and produce the rewritten program. Returns
+ * a malloc'd copy of the code, which is just the original if there was
+ * nothing to do or we couldn't make sense of the jumps, and stores its length
+ * in new_len. The caller frees both the code and report->loops.
+ */
+uint8_t *optimize_loops(uint8_t *code, size_t len, size_t *new_len, struct loop_report *report) {
+    report->loops = NULL;
+    report->num_loops = 0;
+    uint8_t *out = malloc(len);
+    uint8_t *is_start = calloc(len + 1, 1);
+    uint8_t *is_target = calloc(len + 1, 1);
+    size_t *new_pc = malloc((len + 1) * sizeof(size_t));
+    struct loop_transform *loops = malloc(len * sizeof(struct loop_transform));
+    if (out == NULL || is_start == NULL || is_target == NULL || new_pc == NULL || loops == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(out, code, len);
+    *new_len = len;
+
+    /*
+     * We need to know every place control can land. If the code doesn't decode
+     * cleanly or something jumps where there's no instruction, leave it alone
+     * and let the interpreter report it.
+     */
+    size_t n = 0;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        if (pc + operand_bytes(code[pc]) >= len) {
+            goto done;
+        }
+        is_start[pc] = 1;
+    }
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        size_t target = jump_target(code, pc);
+        if (target == SIZE_MAX && (code[pc] == JIF || code[pc] == LOOP)) {
+            goto done;
+        }
+        if (target != SIZE_MAX) {
+            if (target >= len || !is_start[target]) {
+                goto done;
+            }
+            is_target[target] = 1;
+        }
+    }
+
+    /*
+     * Look at every backward jump. The rewrites never overlap: a closed-form
+     * body has no jumps in it, and a fused tail is just its own jump and the
+     * two instructions before it.
+     */
+    size_t prev[2] = {SIZE_MAX, SIZE_MAX};
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        uint8_t op = code[pc];
+        size_t head = jump_target(code, pc);
+        size_t end = pc + 1 + operand_bytes(op);
+        uint64_t step;
+        if ((op == JIF || op == JIF_LONG || op == LOOP) && head <= pc) {
+            if (loop_step(code, head, pc, &step) && (step & 1) && !jumped_into(is_target, head, end) &&
+                (n == 0 || loops[n - 1].end <= head)) {
+                loops[n].kind = LOOP_CLOSED_FORM;
+                loops[n].head = head;
+                loops[n].start = head;
+                loops[n].end = end;
+                loops[n].step = step;
+                n++;
+            } else if (op != LOOP && head + 1 <= 0xFF && prev[1] != SIZE_MAX && code[prev[1]] == PUSH_IMM &&
+                       code[prev[0]] == SUB && !jumped_into(is_target, prev[1], end) &&
+                       (n == 0 || loops[n - 1].end <= prev[1])) {
+                loops[n].kind = LOOP_FUSED;
+                loops[n].head = head;
+                loops[n].start = prev[1];
+                loops[n].end = end;
+                loops[n].step = code[prev[1] + 1];
+                n++;
+            }
+        }
+        prev[1] = prev[0];
+        prev[0] = pc;
+    }
+    if (n == 0) {
+        goto done;
+    }
+
+    /*
+     * Work out where everything ends up, then copy the code over with the
+     * rewrites in place. Nothing jumps into the middle of a rewrite, so the
+     * only offsets we have to map are the ones outside them and their starts.
+ * Both rewrites come out 3 bytes long.
+     */
+    size_t pc = 0;
+    size_t at = 0;
+    for (size_t i = 0; i <= n; i++) {
+        size_t stop = i < n ? loops[i].start : len;
+        for (; pc < stop; pc += 1 + operand_bytes(code[pc])) {
+            new_pc[pc] = at;
+            at += 1 + operand_bytes(code[pc]);
+        }
+        if (i < n) {
+            new_pc[pc] = at;
+            at += 3;
+            pc = loops[i].end;
+        }
+    }
+    new_pc[len] = at;
+
+    pc = 0;
+    at = 0;
+    for (size_t i = 0; i <= n; i++) {
+        size_t stop = i < n ? loops[i].start : len;
+        for (; pc < stop; pc += 1 + operand_bytes(code[pc])) {
+            uint8_t op = code[pc];
+            size_t target = jump_target(code, pc);
+            out[at++] = op;
+            if (op == JIF || op == LOOP) {
+                out[at++] = (uint8_t) (new_pc[target] + 1);
+                if (op == LOOP) {
+                    out[at++] = code[pc + 2];
+                }
+            } else if (operand_bytes(op) >= 4) {
+                for (int b = 0; b < 4; b++) {
+                    out[at++] = (new_pc[target] >> (8 * b)) & 0xFF;
+                }
+                if (op == SPAWN) {
+                    out[at++] = code[pc + 5];
+                }
+            } else if (operand_bytes(op) == 1) {
+                out[at++] = code[pc + 1];
+            }
+        }
+        if (i == n) {
+            break;
+        }
+        if (loops[i].kind == LOOP_CLOSED_FORM) {
+            out[at++] = PUSH_IMM;
+            out[at++] = 0;
+            out[at++] = AND;
+        } else {
+            out[at++] = LOOP;
+            out[at++] = (uint8_t) (new_pc[loops[i].head] + 1);
+            out[at++] = (uint8_t) loops[i].step;
+        }
+        pc = loops[i].end;
+    }
+    *new_len = at;
+    report->loops = loops;
+    report->num_loops = n;
+    loops = NULL;
+
+    done:
+    free(is_start);
+    free(is_target);
+    free(new_pc);
+    free(loops);
+    return out;
+}
+
+/*
+ * Say which loops we rewrote and into what.
+ */
+void print_loop_report(FILE *f, struct loop_report *report, size_t len, size_t new_len) {
+    for (size_t i = 0; i < report->num_loops; i++) {
+        struct loop_transform *l = &report->loops[i];
+        if (l->kind == LOOP_CLOSED_FORM) {
+            fprintf(f, "Loop at bytes %zu-%zu: adds %" PRId64 " per trip, replaced with its result (0)\n", l->head,
+                    l->end - 1, (int64_t) l->step);
+        } else {
+            fprintf(f, "Loop at bytes %zu-%zu: tail at %zu fused into LOOP with step %" PRIu64 "\n", l->head,
+                    l->end - 1, l->start, l->step);
+        }
+    }
+    fprintf(f, "%zu loops rewritten, %zu bytes -> %zu bytes\n", report->num_loops, len, new_len);
+}
+
+#endif
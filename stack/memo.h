@@ -0,0 +1,428 @@
+#ifndef VERSE_STACK_MEMO_H_
+#define VERSE_STACK_MEMO_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "verify.h"
+#include "vm.h"
+
+/*
+ * Result memoization. Our programs can't do I/O, so a run is a function of its
+ * bytecode and the values it starts with on the stack: memory starts out
+ * zeroed, and dividing by zero or going out of bounds fails the same way every
+ * time. That's only true of programs that stay inside the stack, though, which
+ * is what the verifier proves, and in stream mode memory carries over from one
+ * record to the next, so there a program also mustn't STORE anything. Nor
+ * may a program that SPAWNs, since its tasks run in whatever order they like
+ * and one could see another's stores or not. A program that passes these
+ * checks we call pure.
+ *
+ * For a pure program we hash the bytecode once, then hash that together with
+ * the inputs of every run to get a 128-bit key, and look the key up before
+ * running anything. Hits come from a direct-mapped table in memory, and then
+ * from a cache directory that holds one file per key, named after it, so that
+ * separate runs of stckvm can share results. Only successful runs get stored.
+ *
+ * The hash isn't cryptographic. It's there to tell programs apart, not to
+ * stand up to someone who can write to the cache directory.
+ */
+#define MEMO_SLOTS   4096
+#define MEMO_VERSION 1
+
+typedef enum {
+    MEMO_PURE,
+    MEMO_UNVERIFIED,
+    MEMO_KEEPS_STATE,
+    MEMO_RACES
+} memo_purity;
+
+const char *memo_purity_messages[] = {
+        "pure",
+        "the verifier can't bound its stack",
+        "it stores to memory, which outlives the run",
+        "its tasks store to memory, so the result can depend on timing"
+};
+
+struct memo_key {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+struct memo_entry {
+    struct memo_key key;
+    int used;
+    uint64_t result;
+    uint32_t depth;
+    uint64_t *stack;
+
+    /*
+     * How long the run we got this from took. Every hit saves about that much.
+     */
+    uint64_t nanos;
+};
+
+struct memo_stats {
+    uint64_t lookups;
+    uint64_t memory_hits;
+    uint64_t disk_hits;
+    uint64_t stores;
+    uint64_t saved_nanos;
+    uint64_t lookup_nanos;
+};
+
+struct memo_cache {
+    struct memo_entry *slots;
+
+    /*
+     * The cache directory, or NULL to only cache in memory.
+     */
+    const char *dir;
+    struct memo_key code_key;
+    struct memo_stats stats;
+};
+
+/*
+ * Is code pure when it starts with inputs values on the stack? keeps_memory
+ * says whether memory survives from one run to the next.
+ */
+memo_purity memo_check(uint8_t *code, size_t len, uint32_t inputs, int keeps_memory) {
+    struct verify_info info;
+    if (verify_with_inputs(code, len, inputs, &info) != VERIFY_OK) {
+        return MEMO_UNVERIFIED;
+    }
+    int stores = 0;
+    int spawns = 0;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        stores |= code[pc] == STORE;
+        spawns |= code[pc] == SPAWN;
+    }
+    if (keeps_memory && stores) {
+        return MEMO_KEEPS_STATE;
+    }
+    return spawns && stores ? MEMO_RACES : MEMO_PURE;
+}
+
+uint64_t memo_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * The finalizer from SplitMix64, so every input bit reaches every output bit.
+ */
+uint64_t memo_avalanche(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Hash len bytes, starting from seed. Two 64-bit lanes take every 8-byte word
+ * with different multipliers and rotations, and each one gets the other
+ * folded in at the end.
+ */
+struct memo_key memo_hash(struct memo_key seed, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint64_t a = seed.lo ^ 0x9E3779B97F4A7C15ull;
+    uint64_t b = seed.hi ^ 0xC2B2AE3D27D4EB4Full;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, bytes + i, 8);
+        a = memo_rotl(a ^ (w * 0x87C37B91114253D5ull), 31) * 0x4CF5AD432745937Full;
+        b = memo_rotl(b ^ (w * 0x165667B19E3779F9ull), 27) * 0x9E3779B185EBCA87ull;
+    }
+    uint64_t w = 0;
+    if (len > i) {
+        memcpy(&w, bytes + i, len - i);
+    }
+    a ^= w * 0x87C37B91114253D5ull;
+    b ^= w * 0x165667B19E3779F9ull;
+    a ^= len;
+    b ^= len;
+    a += b;
+    b += a;
+    struct memo_key key = {memo_avalanche(a), memo_avalanche(b)};
+    key.hi += key.lo;
+    return key;
+}
+
+/*
+ * Start a cache for code. dir is where to keep results between runs, or NULL.
+ * Returns 0 if we ran out of memory or can't use dir.
+ */
+int memo_init(struct memo_cache *cache, uint8_t *code, size_t len, const char *dir) {
+    memset(cache, 0, sizeof(*cache));
+    if (dir != NULL && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return 0;
+    }
+    cache->slots = calloc(MEMO_SLOTS, sizeof(struct memo_entry));
+    if (cache->slots == NULL) {
+        return 0;
+    }
+    cache->dir = dir;
+    struct memo_key version = {MEMO_VERSION, NUM_OPCODES};
+    cache->code_key = memo_hash(version, code, len);
+    return 1;
+}
+
+void memo_free(struct memo_cache *cache) {
+    for (size_t i = 0; i < MEMO_SLOTS; i++) {
+        free(cache->slots[i].stack);
+    }
+    free(cache->slots);
+}
+
+struct memo_key memo_key_for(struct memo_cache *cache, uint64_t *inputs, uint32_t n) {
+    return memo_hash(cache->code_key, inputs, n * sizeof(uint64_t));
+}
+
+/*
+ * A cache file is this header followed by the depth values on the stack.
+ */
+struct memo_file_header {
+    char magic[8];
+    struct memo_key key;
+    uint64_t result;
+    uint64_t nanos;
+    uint32_t depth;
+    uint32_t version;
+};
+
+void memo_path(struct memo_cache *cache, struct memo_key key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016" PRIx64 "%016" PRIx64, cache->dir, key.hi, key.lo);
+}
+
+int memo_keys_equal(struct memo_key a, struct memo_key b) {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+/*
+ * Put a result in the in-memory table, in place of whatever was in its slot.
+ * Returns the entry, or NULL if we couldn't copy the stack.
+ */
+struct memo_entry *memo_remember(struct memo_cache *cache, struct memo_key key, uint64_t result, uint64_t *stack,
+                                 uint32_t depth, uint64_t nanos) {
+    struct memo_entry *entry = &cache->slots[key.lo & (MEMO_SLOTS - 1)];
+    uint64_t *copy = malloc(depth > 0 ? depth * sizeof(uint64_t) : 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, stack, depth * sizeof(uint64_t));
+    free(entry->stack);
+    entry->key = key;
+    entry->used = 1;
+    entry->result = result;
+    entry->depth = depth;
+    entry->stack = copy;
+    entry->nanos = nanos;
+    return entry;
+}
+
+/*
+ * Read the cache file for key, if there's a good one, into the in-memory
+ * table. Anything short, for another key or from another version of the
+ * format counts as a miss.
+ */
+struct memo_entry *memo_read_file(struct memo_cache *cache, struct memo_key key) {
+    char path[4096];
+    memo_path(cache, key, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    struct memo_file_header header;
+    uint64_t stack[STACK_MAX];
+    struct memo_entry *entry = NULL;
+    if (fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, "VERSEMEM", 8) == 0 &&
+        header.version == MEMO_VERSION && memo_keys_equal(header.key, key) && header.depth <= STACK_MAX &&
+        fread(stack, sizeof(uint64_t), header.depth, f) == header.depth) {
+        entry = memo_remember(cache, key, header.result, stack, header.depth, header.nanos);
+    }
+    fclose(f);
+    return entry;
+}
+
+/*
+ * Write the cache file for an entry. It goes to a temporary file first and
+ * gets renamed into place, so another stckvm reading the same key sees either
+ * nothing or the whole thing. Failing to write just means a miss next time.
+ */
+void memo_write_file(struct memo_cache *cache, struct memo_entry *entry) {
+    char path[4096];
+    char temp[4200];
+    memo_path(cache, entry->key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long) getpid());
+    FILE *f = fopen(temp, "wb");
+    if (f == NULL) {
+        return;
+    }
+    struct memo_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "VERSEMEM", 8);
+    header.key = entry->key;
+    header.result = entry->result;
+    header.nanos = entry->nanos;
+    header.depth = entry->depth;
+    header.version = MEMO_VERSION;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(entry->stack, sizeof(uint64_t), entry->depth, f) == entry->depth;
+    if (fclose(f) != 0 || !ok || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+uint64_t memo_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/*
+ * Look up a run. Returns the entry on a hit and NULL on a miss.
+ */
+struct memo_entry *memo_lookup(struct memo_cache *cache, struct memo_key key) {
+    uint64_t start = memo_now();
+    cache->stats.lookups++;
+    struct memo_entry *entry = &cache->slots[key.lo & (MEMO_SLOTS - 1)];
+    if (entry->used && memo_keys_equal(entry->key, key)) {
+        cache->stats.memory_hits++;
+    } else if (cache->dir != NULL && (entry = memo_read_file(cache, key)) != NULL) {
+        cache->stats.disk_hits++;
+    } else {
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        cache->stats.saved_nanos += entry->nanos;
+    }
+    cache->stats.lookup_nanos += memo_now() - start;
+    return entry;
+}
+
+/*
+ * Remember how a run we just did came out. Returns the entry, or NULL if we
+ * couldn't keep it.
+ */
+struct memo_entry *memo_store(struct memo_cache *cache, struct memo_key key, uint64_t result, uint64_t *stack, uint32_t depth,
+                uint64_t nanos) {
+    struct memo_entry *entry = memo_remember(cache, key, result, stack, depth, nanos);
+    if (entry == NULL) {
+        return NULL;
+    }
+    cache->stats.stores++;
+    if (cache->dir != NULL) {
+        memo_write_file(cache, entry);
+    }
+    return entry;
+}
+
+void print_memo_report(FILE *f, struct memo_stats *stats) {
+    uint64_t hits = stats->memory_hits + stats->disk_hits;
+    fprintf(f, "Memo: %" PRIu64 " lookups, %" PRIu64 " hits (%" PRIu64 " in memory, %" PRIu64 " on disk), "
+               "%.1f%% hit rate, %" PRIu64 " stored\n", stats->lookups, hits, stats->memory_hits, stats->disk_hits,
+            stats->lookups > 0 ? 100.0 * hits / stats->lookups : 0.0, stats->stores);
+    fprintf(f, "Memo: saved %.6f s of execution for %.6f s of lookups\n", stats->saved_nanos / 1e9,
+            stats->lookup_nanos / 1e9);
+}
+
+/*
+ * The totals we keep in the cache directory's metrics file, in the text format
+ * Prometheus scrapes, so a node exporter's textfile collector can pick them
+ * up. Every stckvm adds its own numbers under a lock on metrics.lock. The
+ * collector doesn't take that lock, so the new totals go to a temporary file
+ * that gets renamed over the old one, as in memo_write_file, and it never
+ * reads a file we're halfway through.
+ */
+#define NUM_MEMO_METRICS 6
+
+const char *memo_metric_names[NUM_MEMO_METRICS] = {
+        "verse_memo_lookups_total",
+        "verse_memo_memory_hits_total",
+        "verse_memo_disk_hits_total",
+        "verse_memo_stores_total",
+        "verse_memo_saved_seconds_total",
+        "verse_memo_lookup_seconds_total"
+};
+
+/*
+ * Add the totals in the metrics file at path, if there is one, to totals.
+ */
+void memo_read_metrics(const char *path, double *totals) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[128];
+        double value;
+        if (line[0] == '#' || sscanf(line, "%127s %lf", name, &value) != 2) {
+            continue;
+        }
+        for (int m = 0; m < NUM_MEMO_METRICS; m++) {
+            if (strcmp(name, memo_metric_names[m]) == 0) {
+                totals[m] += value;
+            }
+        }
+    }
+    fclose(f);
+}
+
+/*
+ * Returns 0 if we couldn't update the file.
+ */
+int memo_export(struct memo_cache *cache) {
+    if (cache->dir == NULL) {
+        return 1;
+    }
+    char path[4096];
+    char lock[4096];
+    char temp[4200];
+    snprintf(path, sizeof(path), "%s/metrics", cache->dir);
+    snprintf(lock, sizeof(lock), "%s/metrics.lock", cache->dir);
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long) getpid());
+    int fd = open(lock, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return 0;
+    }
+    double totals[NUM_MEMO_METRICS] = {
+            cache->stats.lookups,
+            cache->stats.memory_hits,
+            cache->stats.disk_hits,
+            cache->stats.stores,
+            cache->stats.saved_nanos / 1e9,
+            cache->stats.lookup_nanos / 1e9
+    };
+    memo_read_metrics(path, totals);
+    FILE *f = fopen(temp, "w");
+    int ok = f != NULL;
+    for (int m = 0; m < NUM_MEMO_METRICS && ok; m++) {
+        ok = fprintf(f, "# TYPE %s counter\n%s %.15g\n", memo_metric_names[m], memo_metric_names[m], totals[m]) > 0;
+    }
+    if (f != NULL && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (ok && rename(temp, path) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(temp);
+    }
+    close(fd);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ * Per-opcode microbenchmark. For every opcode we generate a small looping
+ * program whose body repeats that opcode, run it on each engine, and work out
+ * how many cycles a single execution of the handler costs.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perf.h"
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./stckbench [dispatch type]\n"
+
+/*
+ * The loop nest runs OUTER_TRIPS * INNER_TRIPS iterations of the body. Both are
+ * limited to 255 because PUSH_IMM only takes an 8-bit immediate.
+ */
+#define OUTER_TRIPS 255
+#define INNER_TRIPS 255
+
+/*
+ * Number of times the body repeats the unit under test. We measure the loop
+ * with UNROLL and 2 * UNROLL copies and take the difference, which cancels out
+ * the loop overhead.
+ */
+#define UNROLL 16
+
+/*
+ * Run each program this many times and keep the fastest run.
+ */
+#define REPS 5
+
+/*
+ * JIF targets are a single byte, so our programs have to fit in 256 bytes.
+ */
+#define PROGRAM_MAX 256
+
+/*
+ * Every unit we repeat has to leave the stack exactly as it found it so that
+ * the loop counter is back on top when we reach the JIF. Binary operators need
+ * a PUSH_IMM to feed them, and PUSH_IMM needs a POP_RES to balance it. Memory
+ * starts out zeroed, so a chain of LOADs keeps reading address 0. Calls go to
+ * a procedure that just returns, so CALL+RET is the whole cost of a call.
+ *
+ * The float operators run on the same counter as the integer ones. It turns
+ * into a double after the first one while the immediate stays an integer, so
+ * every execution checks and converts both kinds of value, and comparing them
+ * with ADD and friends gives the cost of the tagged representation. A
+ * conversion is measured as an ITOF and FTOI round trip, since either one on
+ * its own would only convert on the first copy.
+ *
+ * Binary operators are fed a 1 unless the bench says otherwise. The
+ * instructions strength reduction produces take their operand inline, so they
+ * need nothing to feed them. Dividing by 7 over and over would soon leave
+ * nothing but zeros to divide, which some hardware divides faster, so those
+ * benches NOT the counter before every division to keep it 64 bits wide, and
+ * we take the cost of the NOT back out.
+ *
+ * Shuffles and locals come in pairs that undo each other, like PUSH_IMM and
+ * POP_RES. SWAP undoes itself, and we always run an even number of them. A
+ * local pair reads and writes back slot 0, which is the outer loop counter.
+ */
+typedef enum {
+    UNIT_BINARY,
+    UNIT_UNARY,
+    UNIT_JIF_NOT_TAKEN,
+    UNIT_PUSH_POP,
+    UNIT_CALL_RET,
+    UNIT_CONVERT,
+    UNIT_IMMEDIATE,
+    UNIT_PAIR
+} unit_kind;
+
+struct op_bench {
+    const char *name;
+    unit_kind kind;
+    uint8_t op;
+    uint8_t operand;
+
+    /*
+     * What undoes op in a UNIT_PAIR. It takes the same operand, if any.
+     */
+    uint8_t pair;
+};
+
+struct op_bench benches[] = {
+        {"PUSH_IMM+POP_RES", UNIT_PUSH_POP,      PUSH_IMM},
+        {"ADD",              UNIT_BINARY,        ADD},
+        {"SUB",              UNIT_BINARY,        SUB},
+        {"MUL",              UNIT_BINARY,        MUL},
+        {"DIV",              UNIT_BINARY,        DIV},
+        {"AND",              UNIT_BINARY,        AND},
+        {"OR",               UNIT_BINARY,        OR},
+        {"XOR",              UNIT_BINARY,        XOR},
+        {"NOT",              UNIT_UNARY,         NOT},
+        {"LSHIFT",           UNIT_BINARY,        LSHIFT},
+        {"RSHIFT",           UNIT_BINARY,        RSHIFT},
+        {"JIF (not taken)",  UNIT_JIF_NOT_TAKEN, JIF},
+        {"LOAD",             UNIT_UNARY,         LOAD},
+        {"CALL+RET",         UNIT_CALL_RET,      CALL},
+        {"FADD",             UNIT_BINARY,        FADD},
+        {"FSUB",             UNIT_BINARY,        FSUB},
+        {"FMUL",             UNIT_BINARY,        FMUL},
+        {"FDIV",             UNIT_BINARY,        FDIV},
+        {"ITOF+FTOI",        UNIT_CONVERT,       ITOF},
+        {"DIV by 7",         UNIT_BINARY,        DIV,          7},
+        {"DIV_CONST 7",      UNIT_IMMEDIATE,     DIV_CONST,    7},
+        {"LSHIFT_CONST 3",   UNIT_IMMEDIATE,     LSHIFT_CONST, 3},
+        {"RSHIFT_CONST 3",   UNIT_IMMEDIATE,     RSHIFT_CONST, 3},
+        {"DUP+DROP",         UNIT_PAIR,          DUP,          0, DROP},
+        {"OVER+DROP",        UNIT_PAIR,          OVER,         0, DROP},
+        {"SWAP",             UNIT_UNARY,         SWAP},
+        {"LOAD+STORE_LOCAL", UNIT_PAIR,          LOAD_LOCAL,   0, STORE_LOCAL}
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+int refills(struct op_bench *b) {
+    return (b->op == DIV || b->op == DIV_CONST) && b->operand != 0;
+}
+
+size_t find_bench(uint8_t op, uint8_t operand) {
+    for (size_t i = 0; i < NUM_BENCHES; i++) {
+        if (benches[i].op == op && benches[i].operand == operand) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lay out the loop nest:
+ *
+ *   PUSH_IMM OUTER_TRIPS
+ *   outer: PUSH_IMM INNER_TRIPS
+ *   inner: <prologue> <unit> * copies <epilogue>
+ *          PUSH_IMM 1; SUB; JIF inner
+ *          POP_RES
+ *          PUSH_IMM 1; SUB; JIF outer
+ *   POP_RES
+ *   DONE
+ *   [RET]
+ *
+ * Remember that JIF jumps to one byte before its operand.
+ */
+size_t build_program(uint8_t *code, struct op_bench *b, int copies) {
+    size_t call_sites[2 * UNROLL];
+    int num_calls = 0;
+    size_t n = 0;
+    code[n++] = PUSH_IMM;
+    code[n++] = OUTER_TRIPS;
+    size_t outer = n;
+    code[n++] = PUSH_IMM;
+    code[n++] = INNER_TRIPS;
+    size_t inner = n;
+
+    if (b->kind == UNIT_BINARY || b->kind == UNIT_UNARY || b->kind == UNIT_CONVERT || b->kind == UNIT_IMMEDIATE ||
+        b->kind == UNIT_PAIR) {
+        code[n++] = PUSH_IMM;
+        code[n++] = 200;
+    } else if (b->kind == UNIT_JIF_NOT_TAKEN) {
+        code[n++] = PUSH_IMM;
+        code[n++] = 0;
+    }
+    for (int i = 0; i < copies; i++) {
+        if (refills(b)) {
+            code[n++] = NOT;
+        }
+        switch (b->kind) {
+            case UNIT_BINARY:
+                code[n++] = PUSH_IMM;
+                code[n++] = b->operand ? b->operand : 1;
+                code[n++] = b->op;
+                break;
+            case UNIT_IMMEDIATE:
+                code[n++] = b->op;
+                code[n++] = b->operand;
+                break;
+            case UNIT_UNARY:
+                code[n++] = b->op;
+                break;
+            case UNIT_CONVERT:
+                code[n++] = ITOF;
+                code[n++] = FTOI;
+                break;
+            case UNIT_JIF_NOT_TAKEN:
+                code[n++] = JIF;
+                code[n++] = 1;
+                break;
+            case UNIT_PUSH_POP:
+                code[n++] = PUSH_IMM;
+                code[n++] = 1;
+                code[n++] = POP_RES;
+                break;
+            case UNIT_PAIR:
+                code[n++] = b->op;
+                if (operand_bytes(b->op) > 0) {
+                    code[n++] = b->operand;
+                }
+                code[n++] = b->pair;
+                if (operand_bytes(b->pair) > 0) {
+                    code[n++] = b->operand;
+                }
+                break;
+            case UNIT_CALL_RET:
+                code[n++] = CALL;
+                call_sites[num_calls++] = n;
+                n += 4;
+                break;
+        }
+    }
+    if (b->kind != UNIT_PUSH_POP && b->kind != UNIT_CALL_RET) {
+        code[n++] = POP_RES;
+    }
+
+    code[n++] = PUSH_IMM;
+    code[n++] = 1;
+    code[n++] = SUB;
+    code[n++] = JIF;
+    code[n++] = (uint8_t) (inner + 1);
+    code[n++] = POP_RES;
+    code[n++] = PUSH_IMM;
+    code[n++] = 1;
+    code[n++] = SUB;
+    code[n++] = JIF;
+    code[n++] = (uint8_t) (outer + 1);
+    code[n++] = POP_RES;
+    code[n++] = DONE;
+
+    /*
+     * The procedure we call, if any, goes after the DONE.
+     */
+    if (num_calls > 0) {
+        for (int i = 0; i < num_calls; i++) {
+            for (int j = 0; j < 4; j++) {
+                code[call_sites[i] + j] = (uint8_t) (n >> (8 * j));
+            }
+        }
+        code[n++] = RET;
+    }
+    return n;
+}
+
+/*
+ * Run a program REPS times and return the best cycle count, or the best time
+ * in nanoseconds if we couldn't get a cycle counter.
+ */
+uint64_t measure(struct engine *e, uint8_t *code, struct perf_counters *pc, int have_cycles) {
+    uint64_t best = UINT64_MAX;
+    for (int rep = 0; rep < REPS; rep++) {
+        vm.stack_top = vm.stack;
+        perf_start(pc);
+        result r = run_engine(e, code);
+        perf_stop(pc);
+        if (r != SUCCESS) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        uint64_t v = have_cycles ? pc->values[PERF_CYCLES] : pc->nanos;
+        if (v < best) {
+            best = v;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    struct perf_counters pc;
+    perf_open(&pc);
+    int have_cycles = pc.fds[PERF_CYCLES] >= 0;
+
+    vm_quiet = 1;
+    reset_vm();
+    double costs[NUM_ENGINES][NUM_BENCHES];
+    uint8_t single[PROGRAM_MAX];
+    uint8_t doubled[PROGRAM_MAX];
+    double units = (double) UNROLL * OUTER_TRIPS * INNER_TRIPS;
+    for (struct engine *e = first; e < last; e++) {
+        for (size_t i = 0; i < NUM_BENCHES; i++) {
+            build_program(single, &benches[i], UNROLL);
+            build_program(doubled, &benches[i], 2 * UNROLL);
+            uint64_t t1 = measure(e, single, &pc, have_cycles);
+            uint64_t t2 = measure(e, doubled, &pc, have_cycles);
+            costs[e - engines][i] = t2 > t1 ? (double) (t2 - t1) / units : 0.0;
+        }
+    }
+    perf_close(&pc);
+
+    /*
+     * We can't run PUSH_IMM or POP_RES on their own without unbalancing the
+     * stack, so we report the pair and charge half of it to the PUSH_IMM that
+     * feeds each binary operator.
+     */
+    printf("%s per op (%s)\n", have_cycles ? "Cycles" : "Nanoseconds",
+           have_cycles ? "cycle counter" : "no cycle counter, wall clock");
+    printf("%-18s", "opcode");
+    for (struct engine *e = first; e < last; e++) {
+        printf(" %10s", e->name);
+    }
+    printf("\n");
+    for (size_t i = 0; i < NUM_BENCHES; i++) {
+        printf("%-18s", benches[i].name);
+        for (struct engine *e = first; e < last; e++) {
+            double c = costs[e - engines][i];
+            if (benches[i].kind == UNIT_BINARY) {
+                c -= costs[e - engines][0] / 2;
+            }
+            if (refills(&benches[i])) {
+                c -= costs[e - engines][find_bench(NOT, 0)];
+            }
+            printf(" %10.2f", c);
+        }
+        printf("\n");
+    }
+
+    /*
+     * What the tag checks and boxing cost on top of plain integer arithmetic.
+     */
+    printf("%-18s", "FADD / ADD");
+    for (struct engine *e = first; e < last; e++) {
+        double *c = costs[e - engines];
+        double add = c[find_bench(ADD, 0)] - c[0] / 2;
+        double fadd = c[find_bench(FADD, 0)] - c[0] / 2;
+        if (add > 0) {
+            printf(" %9.2fx", fadd / add);
+        } else {
+            printf(" %10s", "-");
+        }
+    }
+    printf("\n");
+
+    /*
+     * What strength reduction saves: the PUSH_IMM and DIV it replaces against
+     * the DIV_CONST it replaces them with.
+     */
+    printf("%-18s", "PUSH+DIV / DIV_C");
+    for (struct engine *e = first; e < last; e++) {
+        double *c = costs[e - engines];
+        double div = c[find_bench(DIV, 7)] - c[find_bench(NOT, 0)];
+        double div_const = c[find_bench(DIV_CONST, 7)] - c[find_bench(NOT, 0)];
+        if (div_const > 0) {
+            printf(" %9.2fx", div / div_const);
+        } else {
+            printf(" %10s", "-");
+        }
+    }
+    printf("\n");
+}
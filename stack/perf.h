@@ -0,0 +1,442 @@
+#ifndef VERSE_STACK_PERF_H_
+#define VERSE_STACK_PERF_H_
+
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+/*
+ * Hardware counters we wrap each interpreter run with. Dispatch performance is
+ * mostly a story about branch prediction and the instruction cache, so that's
+ * what we count.
+ */
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1I_MISSES,
+    PERF_INDIRECT_BRANCHES,
+    NUM_PERF_EVENTS
+} perf_event;
+
+const char *perf_event_names[NUM_PERF_EVENTS] = {
+        "cycles",
+        "instructions",
+        "branch-misses",
+        "L1i-misses",
+        "indirect-branches"
+};
+
+/*
+ * There's no generic perf event for retired indirect branches, so we have to
+ * use a raw, vendor-specific one. AMD calls it "Retired Indirect Branch
+ * Instructions" (PMCx0CA). Intel has BR_INST_RETIRED.INDIRECT (event 0xC4,
+ * umask 0x80) from Ice Lake onwards. Anything else can be supplied through the
+ * VERSE_PERF_INDIRECT environment variable as a raw config value.
+ */
+#define RAW_INDIRECT_AMD    0x00CA
+#define RAW_INDIRECT_INTEL  0x80C4
+
+/*
+ * One run's worth of counter state. A file descriptor of -1 means the kernel
+ * wouldn't give us that counter, which is normal inside VMs and containers.
+ */
+struct perf_counters {
+    int fds[NUM_PERF_EVENTS];
+    uint64_t values[NUM_PERF_EVENTS];
+    struct timespec start;
+    uint64_t nanos;
+};
+
+/*
+ * Figure out which raw event counts retired indirect branches on this CPU.
+ */
+uint64_t perf_indirect_config() {
+    char *env = getenv("VERSE_PERF_INDIRECT");
+    if (env != NULL) {
+        return strtoull(env, NULL, 0);
+    }
+    char vendor[13] = {0};
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t eax = 0, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+#endif
+    if (strcmp(vendor, "AuthenticAMD") == 0) {
+        return RAW_INDIRECT_AMD;
+    }
+    return RAW_INDIRECT_INTEL;
+}
+
+int perf_open_event(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+
+    /*
+     * We only care about what the interpreter does, and this also lets us run
+     * with the default perf_event_paranoid setting.
+     */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Open every counter we can. Returns the number of counters we got.
+ */
+int perf_open(struct perf_counters *pc) {
+    pc->fds[PERF_CYCLES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    pc->fds[PERF_INSTRUCTIONS] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    pc->fds[PERF_BRANCH_MISSES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    pc->fds[PERF_L1I_MISSES] = perf_open_event(
+            PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1I |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    );
+    pc->fds[PERF_INDIRECT_BRANCHES] = perf_open_event(PERF_TYPE_RAW, perf_indirect_config());
+
+    int opened = 0;
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        pc->values[i] = 0;
+        if (pc->fds[i] >= 0) {
+            opened++;
+        }
+    }
+    pc->nanos = 0;
+    return opened;
+}
+
+void perf_start(struct perf_counters *pc) {
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pc->start);
+}
+
+void perf_stop(struct perf_counters *pc) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    pc->nanos = (uint64_t) (end.tv_sec - pc->start.tv_sec) * 1000000000ull +
+                (uint64_t) (end.tv_nsec - pc->start.tv_nsec);
+
+    /*
+     * If the kernel had to multiplex our counters, scale the raw count up to
+     * cover the whole time the counter was enabled.
+     */
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        uint64_t data[3];
+        if (pc->fds[i] < 0 || read(pc->fds[i], data, sizeof(data)) != sizeof(data)) {
+            pc->values[i] = 0;
+            continue;
+        }
+        if (data[2] != 0 && data[2] < data[1]) {
+            pc->values[i] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+        } else {
+            pc->values[i] = data[0];
+        }
+    }
+}
+
+void perf_close(struct perf_counters *pc) {
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            close(pc->fds[i]);
+            pc->fds[i] = -1;
+        }
+    }
+}
+
+/*
+ * What a profiling run saw, per byte offset into the program: how many times
+ * the instruction there ran, and how many times it jumped. Both arrays have
+ * len entries.
+ */
+struct branch_profile {
+    uint64_t *executed;
+    uint64_t *taken;
+    size_t len;
+};
+
+int profile_alloc(struct branch_profile *profile, size_t len) {
+    profile->executed = calloc(len, sizeof(uint64_t));
+    profile->taken = calloc(len, sizeof(uint64_t));
+    profile->len = len;
+    return profile->executed != NULL && profile->taken != NULL;
+}
+
+void profile_free(struct branch_profile *profile) {
+    free(profile->executed);
+    free(profile->taken);
+    profile->executed = profile->taken = NULL;
+}
+
+/*
+ * Run a program on a plain switch loop. Returns how many VM instructions it
+ * dispatched, and fills in the profile if there is one.
+ *
+ * Tasks run right where they're spawned, as calls, so that their instructions
+ * get counted too and every run counts the same. A SPAWN pushes its copies
+ * and calls the procedure on them, and when that returns we replace the
+ * copies and whatever it left with a handle for its result, as libverse does.
+ */
+uint64_t profile_run(uint8_t *bytecode, struct branch_profile *profile) {
+    reset_vm();
+    vm.instruction_ptr = bytecode;
+    vm.frame = vm.stack;
+    volatile uint64_t count = 0;
+
+    /*
+     * One more than how many values each active SPAWN copied, at the index of
+     * its return address, and 0 for a CALL.
+     */
+    uint8_t spawned[RETURN_STACK_MAX] = {0};
+    static struct serial_tasks tasks;
+    serial_reset(&tasks);
+
+    /*
+     * An out-of-bounds access ends the program, same as in run_engine.
+     */
+    if (sigsetjmp(vm_fault_jmp, 1) != 0) {
+        return count;
+    }
+    vm_guard_active = 1;
+    for (;;) {
+        uint8_t *at = vm.instruction_ptr;
+        uint8_t instruction = *vm.instruction_ptr++;
+        count++;
+        size_t pc = at - bytecode;
+        if (profile != NULL && pc < profile->len) {
+            profile->executed[pc]++;
+        }
+        switch (instruction) {
+            case PUSH_IMM:
+                do_push_imm();
+                break;
+            case ADD:
+                do_add();
+                break;
+            case SUB:
+                do_sub();
+                break;
+            case MUL:
+                do_mul();
+                break;
+            case DIV:
+                if (do_div() != SUCCESS) {
+                    vm_guard_active = 0;
+                    return count;
+                }
+                break;
+            case AND:
+                do_and();
+                break;
+            case OR:
+                do_or();
+                break;
+            case XOR:
+                do_xor();
+                break;
+            case NOT:
+                do_not();
+                break;
+            case LSHIFT:
+                do_lshift();
+                break;
+            case RSHIFT:
+                do_rshift();
+                break;
+            case JIF:
+                do_jif(bytecode);
+                break;
+            case POP_RES:
+                do_pop_res();
+                break;
+            case JIF_LONG:
+                do_jif_long(bytecode);
+                break;
+            case LOAD:
+                do_load();
+                break;
+            case STORE:
+                do_store();
+                break;
+            case CALL:
+                if (do_call(bytecode) != SUCCESS) {
+                    vm_guard_active = 0;
+                    return count;
+                }
+                break;
+            case RET: {
+                size_t depth = vm.return_top - vm.return_stack;
+                uint8_t copied = depth > 0 ? spawned[depth - 1] : 0;
+                uint64_t *handle = vm.frame - (copied > 0 ? copied - 1 : 0);
+                uint64_t value = *(vm.stack_top - 1);
+                if (do_ret() != SUCCESS) {
+                    vm_guard_active = 0;
+                    return count;
+                }
+                if (copied > 0) {
+                    spawned[depth - 1] = 0;
+                    vm.stack_top = handle;
+                    stack_push(serial_return(&tasks, value));
+                }
+                break;
+            }
+            case LOOP:
+                do_loop(bytecode);
+                break;
+            case FADD:
+                do_fadd();
+                break;
+            case FSUB:
+                do_fsub();
+                break;
+            case FMUL:
+                do_fmul();
+                break;
+            case FDIV:
+                do_fdiv();
+                break;
+            case ITOF:
+                do_itof();
+                break;
+            case FTOI:
+                do_ftoi();
+                break;
+            case JMP:
+                do_jmp(bytecode);
+                break;
+            case JIZ:
+                do_jiz(bytecode);
+                break;
+            case DIV_CONST:
+                do_div_const();
+                break;
+            case LSHIFT_CONST:
+                do_lshift_const();
+                break;
+            case RSHIFT_CONST:
+                do_rshift_const();
+                break;
+            case DUP:
+                do_dup();
+                break;
+            case DROP:
+                do_drop();
+                break;
+            case SWAP:
+                do_swap();
+                break;
+            case OVER:
+                do_over();
+                break;
+            case ROT:
+                do_rot();
+                break;
+            case LOAD_LOCAL:
+                do_load_local();
+                break;
+            case STORE_LOCAL:
+                do_store_local();
+                break;
+            case SPAWN: {
+                uint8_t argc = vm.instruction_ptr[4];
+                if (argc > SPAWN_ARGS_MAX || vm.return_top == vm.return_stack + RETURN_STACK_MAX ||
+                    serial_spawn(&tasks) != SUCCESS) {
+                    vm_guard_active = 0;
+                    return count;
+                }
+                memmove(vm.stack_top, vm.stack_top - argc, argc * sizeof(uint64_t));
+                vm.stack_top += argc;
+                enter_frame(vm.stack_top);
+                spawned[vm.return_top - vm.return_stack] = argc + 1;
+                *vm.return_top++ = vm.instruction_ptr + 5;
+                vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+                break;
+            }
+            case JOIN:
+                if (serial_join(&tasks, vm.stack_top - 1) != SUCCESS) {
+                    vm_guard_active = 0;
+                    return count;
+                }
+                break;
+            default:
+                vm_guard_active = 0;
+                return count;
+        }
+        if (profile != NULL && pc < profile->len &&
+            vm.instruction_ptr != at + 1 + operand_bytes(instruction) && instruction != CALL && instruction != RET &&
+            instruction != SPAWN) {
+            profile->taken[pc]++;
+        }
+    }
+}
+
+/*
+ * Count how many VM instructions a program dispatches so that we can turn raw
+ * counter values into per-instruction ratios. We do this in a separate run so
+ * the measured engines don't pay for a counter.
+ */
+uint64_t count_dispatches(uint8_t *bytecode) {
+    return profile_run(bytecode, NULL);
+}
+
+/*
+ * How many jumps a profiled run took, counting JMPs.
+ */
+uint64_t taken_branches(struct branch_profile *profile) {
+    uint64_t total = 0;
+    for (size_t pc = 0; pc < profile->len; pc++) {
+        total += profile->taken[pc];
+    }
+    return total;
+}
+
+/*
+ * Print one engine's counters, both raw and divided by the number of VM
+ * instructions it dispatched.
+ */
+void perf_report(const char *engine_name, struct perf_counters *pc, uint64_t dispatches) {
+    printf("%-18s %20s %16s\n", engine_name, "total", "per VM instr");
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+        if (pc->fds[i] < 0) {
+            printf("%-18s %20s %16s\n", perf_event_names[i], "<not supported>", "-");
+            continue;
+        }
+        printf("%-18s %20" PRIu64 " %16.3f\n", perf_event_names[i], pc->values[i],
+               dispatches ? (double) pc->values[i] / dispatches : 0.0);
+    }
+    printf("%-18s %20" PRIu64 " %16.3f\n", "ns", pc->nanos,
+           dispatches ? (double) pc->nanos / dispatches : 0.0);
+    if (pc->fds[PERF_CYCLES] >= 0 && pc->fds[PERF_INSTRUCTIONS] >= 0 && pc->values[PERF_CYCLES] != 0) {
+        printf("%-18s %20.3f\n", "IPC", (double) pc->values[PERF_INSTRUCTIONS] / pc->values[PERF_CYCLES]);
+    }
+    printf("%-18s %20" PRIu64 "\n", "VM instrs", dispatches);
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef VERSE_STACK_POOL_H_
+#define VERSE_STACK_POOL_H_
+
+#include <stddef.h>
+
+#include "vm.h"
+
+/*
+ * Pooled VM contexts, for keeping a great many small programs resident at
+ * once. A context is what one instance keeps between runs: its operand stack,
+ * where the top of that is, and its last result. The return stack, the
+ * instruction pointer and linear memory only matter while a program runs, so
+ * they stay in the one global vm and every context shares them.
+ *
+ * The global vm holds a stack for the deepest program there is. A context only
+ * holds as many slots as the verifier says its program can use, right after a
+ * small header, rounded up to whole cache lines. A program that never gets
+ * more than three deep fits in a single line, where a full stack takes 33 of
+ * them.
+ */
+#define CACHE_LINE 64
+
+/*
+ * Contexts come out of slabs mapped straight from the kernel, one size class
+ * per slab. Slabs are the size of a huge page so that the kernel can back them
+ * with one if it likes. The first line of each slab links it to the next one
+ * of its class.
+ */
+#define POOL_SLAB_SIZE (1 << 21)
+
+/*
+ * Size class c holds contexts of 1 << c lines, except for the last one, which
+ * is exactly big enough for a full stack.
+ */
+#define POOL_CLASSES 7
+
+struct vm_context {
+
+    /*
+     * First free slot of the stack, as in the vm.
+     */
+    uint64_t *stack_top;
+
+    /*
+     * Result of the last run.
+     */
+    uint64_t result;
+
+    /*
+     * Next free context of the same class, while this one is free.
+     */
+    struct vm_context *next_free;
+
+    /*
+     * Which class this context came from, and how its last run ended.
+     */
+    uint8_t size_class;
+    uint8_t status;
+
+    /*
+     * How many values the stack has room for, not counting the floor slot.
+     */
+    uint32_t capacity;
+
+    /*
+     * The floor slot and then the stack proper. See the stack in the vm.
+     */
+    uint64_t slots[];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct pool_class {
+
+    /*
+     * Contexts that were destroyed and can be handed out again.
+     */
+    struct vm_context *free;
+
+    /*
+     * The part of the newest slab we haven't carved up yet.
+     */
+    uint8_t *next;
+    uint8_t *end;
+
+    /*
+     * Every slab of this class, newest first.
+     */
+    void *slabs;
+
+    /*
+     * Size of each context, and how many are in use.
+     */
+    size_t size;
+    size_t live;
+};
+
+struct vm_pool {
+    struct pool_class classes[POOL_CLASSES];
+};
+
+/*
+ * Number of cache lines a context for a stack of the given depth takes up.
+ */
+size_t context_lines(uint32_t depth) {
+    size_t bytes = offsetof(struct vm_context, slots) + ((size_t) depth + 1) * sizeof(uint64_t);
+    return (bytes + CACHE_LINE - 1) / CACHE_LINE;
+}
+
+size_t class_lines(int c) {
+    return c == POOL_CLASSES - 1 ? context_lines(STACK_MAX) : (size_t) 1 << c;
+}
+
+/*
+ * The smallest class that fits a stack of the given depth, or -1 if it's
+ * deeper than the vm's own stack.
+ */
+int pool_class(uint32_t depth) {
+    if (depth > STACK_MAX) {
+        return -1;
+    }
+    size_t lines = context_lines(depth);
+    int c = 0;
+    while (class_lines(c) < lines) {
+        c++;
+    }
+    return c;
+}
+
+/*
+ * The deepest stack a context of class c has room for. Rounding up to whole
+ * lines usually leaves it a little more than was asked for.
+ */
+uint32_t class_capacity(int c) {
+    size_t bytes = class_lines(c) * CACHE_LINE - offsetof(struct vm_context, slots);
+    return (uint32_t) (bytes / sizeof(uint64_t) - 1);
+}
+
+void pool_init(struct vm_pool *pool) {
+    memset(pool, 0, sizeof(*pool));
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pool->classes[c].size = class_lines(c) * CACHE_LINE;
+    }
+}
+
+/*
+ * Set a context up as if it had never run.
+ */
+void context_clear(struct vm_context *ctx) {
+    ctx->stack_top = ctx->slots + 1;
+    ctx->result = 0;
+    ctx->status = SUCCESS;
+}
+
+/*
+ * Make n contexts with room for a stack of the given depth and put them in
+ * out. Destroyed contexts get used again first, and after that they're carved
+ * out of the newest slab one after the other. Nothing but the header is
+ * written, so slab pages the stacks land on aren't touched until something
+ * runs. Returns how many we made, which is less than n if the depth is too
+ * big or we ran out of memory.
+ */
+size_t pool_create(struct vm_pool *pool, uint32_t depth, struct vm_context **out, size_t n) {
+    int c = pool_class(depth);
+    if (c < 0) {
+        return 0;
+    }
+    struct pool_class *cls = &pool->classes[c];
+    size_t made = 0;
+    while (made < n && cls->free != NULL) {
+        struct vm_context *ctx = cls->free;
+        cls->free = ctx->next_free;
+        context_clear(ctx);
+        out[made++] = ctx;
+    }
+    while (made < n) {
+        if (cls->next + cls->size > cls->end) {
+            uint8_t *slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) {
+                break;
+            }
+            *(void **) slab = cls->slabs;
+            cls->slabs = slab;
+            cls->next = slab + CACHE_LINE;
+            cls->end = slab + POOL_SLAB_SIZE;
+        }
+        struct vm_context *ctx = (struct vm_context *) cls->next;
+        cls->next += cls->size;
+        ctx->size_class = c;
+        ctx->capacity = class_capacity(c);
+        context_clear(ctx);
+        out[made++] = ctx;
+    }
+    cls->live += made;
+    return made;
+}
+
+/*
+ * Empty the stacks of n contexts and forget their results.
+ */
+void pool_reset(struct vm_context **contexts, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        context_clear(contexts[i]);
+    }
+}
+
+/*
+ * Give n contexts back to the pool they came from. Their memory stays mapped
+ * for the next pool_create.
+ */
+void pool_destroy(struct vm_pool *pool, struct vm_context **contexts, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        struct pool_class *cls = &pool->classes[contexts[i]->size_class];
+        contexts[i]->next_free = cls->free;
+        cls->free = contexts[i];
+        cls->live--;
+    }
+}
+
+/*
+ * How much memory the pool has mapped, including what isn't in use yet.
+ */
+size_t pool_mapped(struct vm_pool *pool) {
+    size_t bytes = 0;
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        for (void *slab = pool->classes[c].slabs; slab != NULL; slab = *(void **) slab) {
+            bytes += POOL_SLAB_SIZE;
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Unmap every slab, which destroys every context at once.
+ */
+void pool_free(struct vm_pool *pool) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        void *slab = pool->classes[c].slabs;
+        while (slab != NULL) {
+            void *next = *(void **) slab;
+            munmap(slab, POOL_SLAB_SIZE);
+            slab = next;
+        }
+    }
+    pool_init(pool);
+}
+
+/*
+ * Run a program on a context's stack, carrying on from whatever the last run
+ * left there. depth is the most the verifier says the program pushes over
+ * where it starts. Contexts sit right next to each other in their slab with
+ * no guard page between them, so if what an earlier run left behind plus that
+ * wouldn't fit, we don't run at all and return ERR_STACK_OVERFLOW. Memory
+ * isn't reset between runs, and the vm's own stack is put back afterwards.
+ */
+result context_run(struct vm_context *ctx, struct engine *e, uint8_t *bytecode, uint32_t depth) {
+    if ((size_t) (ctx->stack_top - ctx->slots - 1) + depth > ctx->capacity) {
+        return ERR_STACK_OVERFLOW;
+    }
+    if (vm.memory == NULL) {
+        memory_init();
+    }
+    uint64_t *stack = vm.stack;
+    uint64_t *stack_top = vm.stack_top;
+    vm.stack = ctx->slots + 1;
+    vm.stack_top = ctx->stack_top;
+    vm.return_top = vm.return_stack;
+    result r = run_engine(e, bytecode);
+    ctx->stack_top = vm.stack_top;
+    ctx->result = vm.result;
+    ctx->status = r;
+    vm.stack = stack;
+    vm.stack_top = stack_top;
+    return r;
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Keep a million instances of one program resident in pooled contexts, and
+ * see what they cost compared to giving each of them a whole vm. We time
+ * making them, running every one of them, resetting them all, and destroying
+ * them and making them again out of the free lists.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "../common/container.h"
+#include "pool.h"
+#include "verify.h"
+
+#define USAGE_STR "Usage: ./stckpoolbench <bytecode file> [dispatch type]\n"
+
+#define INSTANCES (1 << 20)
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *e = engines;
+    if (argc == 3) {
+        e = find_engine(argv[2]);
+        if (e == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct container_info info;
+    container_status status = container_map(argv[1], &info);
+    if (status != CONTAINER_OK) {
+        fprintf(stderr, "Error loading %s: %s\n", argv[1], container_messages[status]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    if ((info.is_container && info.isa != CONTAINER_ISA_STACK) || info.entry != 0) {
+        fprintf(stderr, "%s doesn't hold a stack program starting at offset 0\n", argv[1]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Contexts only get the stack the verifier says the program needs, so
+     * there's nothing to pool for a program it can't bound.
+     */
+    struct verify_info verified;
+    verify_status v = verify_bytecode(info.code, info.code_len, &verified);
+    if (v != VERIFY_OK) {
+        fprintf(stderr, "Not verified: %s at byte %zu\n", verify_messages[v], verified.error_pc);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    struct vm_context **contexts = malloc(INSTANCES * sizeof(*contexts));
+    if (contexts == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    struct vm_pool pool;
+    pool_init(&pool);
+
+    vm_quiet = 1;
+
+    struct timespec t[6];
+    clock_gettime(CLOCK_MONOTONIC, &t[0]);
+    size_t made = pool_create(&pool, verified.max_depth, contexts, INSTANCES);
+    clock_gettime(CLOCK_MONOTONIC, &t[1]);
+    int failed = made < INSTANCES;
+    for (size_t i = 0; i < made && !failed; i++) {
+        failed = context_run(contexts[i], e, info.code, verified.max_depth) != SUCCESS;
+    }
+    uint64_t first_result = made > 0 ? contexts[0]->result : 0;
+    clock_gettime(CLOCK_MONOTONIC, &t[2]);
+    pool_reset(contexts, made);
+    clock_gettime(CLOCK_MONOTONIC, &t[3]);
+    pool_destroy(&pool, contexts, made);
+    clock_gettime(CLOCK_MONOTONIC, &t[4]);
+    size_t remade = pool_create(&pool, verified.max_depth, contexts, made);
+    clock_gettime(CLOCK_MONOTONIC, &t[5]);
+
+    if (failed || remade != made) {
+        fprintf(stderr, "Couldn't make and run %d instances\n", INSTANCES);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    int c = pool_class(verified.max_depth);
+    size_t mapped = pool_mapped(&pool);
+    printf("Stack depth %u, size class %d: %zu bytes per context, %zu with slab overhead\n", verified.max_depth, c,
+           pool.classes[c].size, mapped / made);
+    printf("A whole vm is %zu bytes with its stack, %.1fx as much\n", sizeof(vm) + sizeof(default_stack),
+           (double) (sizeof(vm) + sizeof(default_stack)) / pool.classes[c].size);
+
+    /*
+     * Instances share linear memory, so a program that keeps state there can
+     * come up with something different every time. The first one ran on fresh
+     * memory.
+     */
+    printf("%d instances, first result %" PRIu64 "\n\n", INSTANCES, first_result);
+    const char *steps[] = {"create", "run", "reset", "destroy", "recreate"};
+    printf("%-10s %12s %12s\n", "step", "total ms", "ns each");
+    for (int s = 0; s < 5; s++) {
+        double ns = elapsed_ns(&t[s], &t[s + 1]);
+        printf("%-10s %12.3f %12.2f\n", steps[s], ns / 1e6, ns / made);
+    }
+
+    pool_free(&pool);
+    free(contexts);
+    container_unmap(&info);
+}
@@ -0,0 +1,414 @@
+#ifndef VERSE_STACK_SAMPLE_H_
+#define VERSE_STACK_SAMPLE_H_
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "../common/container.h"
+#include "vm.h"
+
+/*
+ * A sampling profiler, cheap enough to leave on. Counting every dispatch the
+ * way profile_run does changes the loop it measures. Instead, a timer
+ * interrupts the running engine SAMPLE_HZ times a second with SIGPROF, and the
+ * handler works out which instruction it was on and which procedures it was
+ * in, and counts that.
+ *
+ * Where the engine is depends on the engine. The switch engines and direct
+ * threading keep vm.instruction_ptr up to date, and call threading keeps its
+ * cell in call_threaded_ip. Tail-call threading only has its cell in a
+ * register. The interrupted PC tells us which handler was running, and we
+ * look through the registers the signal saved for a pointer to a cell of that
+ * handler. Some handlers, RET's for one, don't keep their cell in any
+ * register, and for those we can only tell the opcode. Cells map back to
+ * offsets through threaded_map. The call chain
+ * comes from the return stack: each entry points just past a CALL, whose
+ * operand is the procedure we're in. A task a JOIN is running while it waits
+ * has its own return stack, and its chain starts at the procedure it was
+ * spawned with. Only the thread that started the sampler gets interrupted, so
+ * tasks running on the other workers aren't seen.
+ *
+ * The handler can't allocate, so the distinct chains go into a fixed table and
+ * we count the samples that don't fit. It also times itself, so the report can
+ * say what sampling cost.
+ */
+#define SAMPLE_HZ     997
+#define SAMPLE_STACKS 1024
+#define SAMPLE_FRAMES (RETURN_STACK_MAX + 2)
+#define SAMPLE_TOP    10
+
+/*
+ * The leaf frame for a sample we couldn't place, and for one we only know the
+ * opcode of.
+ */
+#define SAMPLE_UNKNOWN    UINT32_MAX
+#define SAMPLE_OPCODE(op) (SAMPLE_UNKNOWN - 1 - (op))
+
+/*
+ * How far past the start of a tail-call handler we still count a PC as inside
+ * it. They're all much shorter than this.
+ */
+#define SAMPLE_HANDLER_MAX 4096
+
+/*
+ * glibc only names these with _GNU_SOURCE. RIP is the 17th saved register.
+ */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#if defined(__x86_64__) && !defined(REG_RIP)
+#define REG_RIP 16
+#endif
+
+/*
+ * One call chain and how many samples landed on it. frames[0] is the entry of
+ * the outermost procedure we were in, and frames[depth - 1] is the instruction
+ * we were on.
+ */
+struct sample_stack {
+    uint64_t count;
+    uint32_t hash;
+    uint32_t depth;
+    uint32_t frames[SAMPLE_FRAMES];
+};
+
+struct sampler {
+    const char *engine;
+    uint8_t *bytecode;
+    size_t len;
+
+    /*
+     * Does the engine fetch the opcode with *vm.instruction_ptr++, so that the
+     * pointer has already moved past it by the time the instruction runs?
+     */
+    int ip_ahead;
+
+    /*
+     * The start of the instruction each byte belongs to, and how many samples
+     * landed on each instruction.
+     */
+    uint32_t *start_of;
+    uint64_t *hits;
+
+    /*
+     * Where each opcode's handler is in the threaded code we last looked at.
+     */
+    const thread_cell *handlers_of;
+    uintptr_t handlers[NUM_OPCODES];
+
+    uint64_t samples;
+    uint64_t unknown;
+    uint64_t dropped;
+    uint64_t handler_nanos;
+    struct timespec start;
+    uint64_t run_nanos;
+
+    struct sample_stack stacks[SAMPLE_STACKS];
+    timer_t timer;
+};
+
+struct sampler *volatile active_sampler;
+
+/*
+ * Returns 0 if we ran out of memory.
+ */
+int sampler_init(struct sampler *s, uint8_t *bytecode, size_t len) {
+    memset(s, 0, sizeof(*s));
+    s->bytecode = bytecode;
+    s->len = len;
+    s->start_of = malloc((len > 0 ? len : 1) * sizeof(uint32_t));
+    s->hits = calloc(len > 0 ? len : 1, sizeof(uint64_t));
+    if (s->start_of == NULL || s->hits == NULL) {
+        free(s->start_of);
+        free(s->hits);
+        return 0;
+    }
+    size_t pc = 0;
+    while (pc < len) {
+        size_t next = pc + 1 + operand_bytes(bytecode[pc]);
+        for (size_t i = pc; i < next && i < len; i++) {
+            s->start_of[i] = pc;
+        }
+        pc = next;
+    }
+    return 1;
+}
+
+void sampler_free(struct sampler *s) {
+    free(s->start_of);
+    free(s->hits);
+}
+
+/*
+ * Which instruction a pointer into the bytecode or the threaded code belongs
+ * to, after backing up back bytes or cells. SAMPLE_UNKNOWN if it's neither.
+ */
+uint32_t sample_locate(struct sampler *s, const void *p, size_t back) {
+    const uint8_t *byte = p;
+    if (byte >= s->bytecode + back && byte < s->bytecode + s->len + back) {
+        return s->start_of[byte - back - s->bytecode];
+    }
+    size_t cells = threaded_map.cells;
+    const thread_cell *cell = p;
+    if (cells > 0 && cell >= threaded_map.code + back && cell < threaded_map.code + cells + back) {
+        return threaded_map.offsets[cell - back - threaded_map.code];
+    }
+    return SAMPLE_UNKNOWN;
+}
+
+/*
+ * Find the tail-call engine's cell among the interrupted registers. First we
+ * work out which handler the PC is in. The first time we see a translation,
+ * that means finding its handlers.
+ */
+uint32_t sample_registers(struct sampler *s, ucontext_t *uc) {
+    uintptr_t pc;
+    uintptr_t *regs;
+    size_t num_regs;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    regs = (uintptr_t *) uc->uc_mcontext.gregs;
+    num_regs = NGREG;
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    regs = (uintptr_t *) uc->uc_mcontext.regs;
+    num_regs = 31;
+#else
+    return SAMPLE_UNKNOWN;
+#endif
+    size_t cells = threaded_map.cells;
+    if (cells == 0) {
+        return SAMPLE_UNKNOWN;
+    }
+    if (s->handlers_of != threaded_map.code) {
+        memset(s->handlers, 0, sizeof(s->handlers));
+        for (size_t i = 0; i < cells; i++) {
+            uint32_t at = threaded_map.offsets[i];
+            if ((i == 0 || threaded_map.offsets[i - 1] != at) && s->bytecode[at] < NUM_OPCODES) {
+                s->handlers[s->bytecode[at]] = (uintptr_t) threaded_map.code[i].handler;
+            }
+        }
+        s->handlers_of = threaded_map.code;
+    }
+    int running = -1;
+    for (int op = 0; op < NUM_OPCODES; op++) {
+        uintptr_t handler = s->handlers[op];
+        if (handler != 0 && handler <= pc && pc - handler < SAMPLE_HANDLER_MAX &&
+            (running < 0 || handler > s->handlers[running])) {
+            running = op;
+        }
+    }
+    if (running < 0) {
+        return SAMPLE_UNKNOWN;
+    }
+
+    /*
+     * Then look for a register pointing at a cell with that handler.
+     */
+    for (size_t r = 0; r < num_regs; r++) {
+        const thread_cell *cell = (const thread_cell *) regs[r];
+        if (cell < threaded_map.code || cell >= threaded_map.code + cells ||
+            ((uintptr_t) cell - (uintptr_t) threaded_map.code) % sizeof(thread_cell) != 0) {
+            continue;
+        }
+        uint32_t at = threaded_map.offsets[cell - threaded_map.code];
+        if (s->bytecode[at] < NUM_OPCODES && s->handlers[s->bytecode[at]] == s->handlers[running]) {
+            return at;
+        }
+    }
+    return SAMPLE_OPCODE(running);
+}
+
+void sample_handler(int sig, siginfo_t *info, void *context) {
+    struct sampler *s = active_sampler;
+    if (s == NULL) {
+        return;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    uint32_t frames[SAMPLE_FRAMES];
+    uint32_t depth = 0;
+    if (vm.entry != NULL) {
+        uint32_t entry = sample_locate(s, vm.entry, 0);
+        if (entry != SAMPLE_UNKNOWN) {
+            frames[depth++] = entry;
+        }
+    }
+    void **top = vm.return_top;
+    for (void **r = vm.return_stack; r < top && r < vm.return_stack + RETURN_STACK_MAX; r++) {
+        uint32_t site = sample_locate(s, *r, 1);
+        if (site != SAMPLE_UNKNOWN && s->bytecode[site] == CALL && site + 4 < s->len) {
+            frames[depth++] = read_u32(s->bytecode + site + 1);
+        }
+    }
+    uint32_t at;
+    if (threaded_map.cells == 0) {
+        at = sample_locate(s, vm.instruction_ptr, s->ip_ahead);
+    } else if (call_threaded_ip != NULL) {
+        at = sample_locate(s, call_threaded_ip, 0);
+    } else {
+        at = sample_registers(s, context);
+    }
+    frames[depth++] = at;
+
+    s->samples++;
+    if (at > SAMPLE_OPCODE(NUM_OPCODES)) {
+        s->unknown++;
+    } else {
+        s->hits[at]++;
+    }
+
+    /*
+     * Count the chain in the table, probing linearly from its hash.
+     */
+    uint32_t hash = container_hash(2166136261u, frames, depth * sizeof(uint32_t));
+    struct sample_stack *slot = NULL;
+    for (uint32_t probe = 0; probe < SAMPLE_STACKS; probe++) {
+        struct sample_stack *candidate = &s->stacks[(hash + probe) % SAMPLE_STACKS];
+        if (candidate->count == 0) {
+            candidate->hash = hash;
+            candidate->depth = depth;
+            memcpy(candidate->frames, frames, depth * sizeof(uint32_t));
+            slot = candidate;
+            break;
+        }
+        if (candidate->hash == hash && candidate->depth == depth &&
+            memcmp(candidate->frames, frames, depth * sizeof(uint32_t)) == 0) {
+            slot = candidate;
+            break;
+        }
+    }
+    if (slot != NULL) {
+        slot->count++;
+    } else {
+        s->dropped++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    s->handler_nanos += (uint64_t) (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+}
+
+/*
+ * Start sampling a run of an engine. The timer signals this thread, so stream
+ * mode's writer thread is left alone. It runs on wall-clock time: timers on
+ * CPU time only fire on the scheduler tick, a few hundred times a second at
+ * best, and an engine run is all CPU anyway. The rate can be changed with
+ * VERSE_SAMPLE_HZ. Returns 0 if we couldn't get a timer.
+ */
+int sampler_start(struct sampler *s, const char *engine) {
+    s->engine = engine;
+    s->ip_ahead = strcmp(engine, "threaded") != 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sample_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        return 0;
+    }
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &s->timer) != 0) {
+        return 0;
+    }
+    long hz = SAMPLE_HZ;
+    char *env = getenv("VERSE_SAMPLE_HZ");
+    if (env != NULL && strtol(env, NULL, 10) > 0) {
+        hz = strtol(env, NULL, 10);
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = hz == 1 ? 1 : 0;
+    spec.it_interval.tv_nsec = hz == 1 ? 0 : 1000000000L / hz;
+    spec.it_value = spec.it_interval;
+    active_sampler = s;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    if (timer_settime(s->timer, 0, &spec, NULL) != 0) {
+        active_sampler = NULL;
+        timer_delete(s->timer);
+        return 0;
+    }
+    return 1;
+}
+
+void sampler_stop(struct sampler *s) {
+    timer_delete(s->timer);
+    active_sampler = NULL;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    s->run_nanos += (uint64_t) (end.tv_sec - s->start.tv_sec) * 1000000000ull + (end.tv_nsec - s->start.tv_nsec);
+}
+
+/*
+ * The hottest SAMPLE_TOP instructions, and what the sampling cost.
+ */
+void print_sample_report(FILE *f, struct sampler *s) {
+    uint64_t placed = s->samples - s->unknown;
+    fprintf(f, "%s: %" PRIu64 " samples, %" PRIu64 " unplaced, %" PRIu64 " chains dropped\n", s->engine, s->samples,
+            s->unknown, s->dropped);
+    fprintf(f, "%8s %-14s %10s %7s\n", "offset", "instruction", "samples", "share");
+    uint8_t *shown = calloc(s->len > 0 ? s->len : 1, 1);
+    for (int n = 0; n < SAMPLE_TOP && shown != NULL; n++) {
+        size_t best = SIZE_MAX;
+        for (size_t pc = 0; pc < s->len; pc++) {
+            if (s->hits[pc] > 0 && !shown[pc] && (best == SIZE_MAX || s->hits[pc] > s->hits[best])) {
+                best = pc;
+            }
+        }
+        if (best == SIZE_MAX) {
+            break;
+        }
+        shown[best] = 1;
+        uint8_t op = s->bytecode[best];
+        fprintf(f, "%8zu %-14s %10" PRIu64 " %6.1f%%\n", best, op < NUM_OPCODES ? opcode_names[op] : "?",
+                s->hits[best], placed > 0 ? 100.0 * s->hits[best] / placed : 0.0);
+    }
+    free(shown);
+    fprintf(f, "Sampling took %.6f s of %.6f s, %.3f%%\n", s->handler_nanos / 1e9, s->run_nanos / 1e9,
+            s->run_nanos > 0 ? 100.0 * s->handler_nanos / s->run_nanos : 0.0);
+}
+
+/*
+ * Write the chains in the folded format flamegraph.pl and speedscope read:
+ * one line per chain, frames separated by semicolons from the root, then the
+ * count. The root is the engine, so runs of several engines can share a file.
+ */
+void write_folded(FILE *f, struct sampler *s) {
+    for (size_t i = 0; i < SAMPLE_STACKS; i++) {
+        struct sample_stack *stack = &s->stacks[i];
+        if (stack->count == 0) {
+            continue;
+        }
+        fprintf(f, "%s;main", s->engine);
+        for (uint32_t d = 0; d + 1 < stack->depth; d++) {
+            fprintf(f, ";proc@%" PRIu32, stack->frames[d]);
+        }
+        uint32_t at = stack->frames[stack->depth - 1];
+        if (at == SAMPLE_UNKNOWN) {
+            fprintf(f, ";[unknown]");
+        } else if (at > SAMPLE_OPCODE(NUM_OPCODES)) {
+            fprintf(f, ";%s@?", opcode_names[SAMPLE_OPCODE(0) - at]);
+        } else {
+            uint8_t op = s->bytecode[at];
+            fprintf(f, ";%s@%" PRIu32, op < NUM_OPCODES ? opcode_names[op] : "?", at);
+        }
+        fprintf(f, " %" PRIu64 "\n", stack->count);
+    }
+    if (s->dropped > 0) {
+        fprintf(f, "%s;[dropped] %" PRIu64 "\n", s->engine, s->dropped);
+    }
+}
+
+#endif
@@ -0,0 +1,518 @@
+#ifndef VERSE_STACK_SPAWN_H_
+#define VERSE_STACK_SPAWN_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isa.h"
+
+/*
+ * The task pool behind SPAWN and JOIN. Every thread that runs tasks is a
+ * worker with its own deque, after Chase and Lev: the worker pushes and pops
+ * its own tasks at the bottom, and idle workers steal from the top of
+ * somebody else's. The thread that starts the pool is worker 0 and only runs
+ * tasks while it waits in a JOIN or at the end of a run, so a pool of n
+ * workers keeps n cores busy.
+ *
+ * Each worker also owns a slice of SPAWN_TASKS task slots, which is where the
+ * tasks it spawns live until they're joined. Only the owner allocates and
+ * frees its slots, so none of that needs locking, and a deque never holds
+ * more tasks than its owner has slots.
+ *
+ * A JOIN whose task isn't done yet doesn't block. It runs whatever it can
+ * find, its own deque first, the same way an idle worker does, so a task that
+ * nobody stole gets run by the code waiting for it.
+ *
+ * Handles belong to the code that spawned them: the main program, or one run
+ * of a task. Only that code can join them, and it doesn't finish until every
+ * task it spawned has, joined or not, so no handle outlives its spawner and
+ * whether a JOIN works never depends on which worker ran what. If any of
+ * those tasks failed, the spawner fails the way the first of them to be
+ * spawned did, since that's where running each task as a call, the way
+ * libverse does, would have stopped.
+ */
+
+/*
+ * How many tasks a JOIN may have running under it on one thread before it
+ * just waits. Each one takes a stack and a copy of the VM state on the C stack.
+ */
+#define SPAWN_HELP_DEPTH 32
+
+/*
+ * How many times an idle worker comes up empty before it goes to sleep, and
+ * how long it sleeps at most before it looks again.
+ */
+#define SPAWN_IDLE_ROUNDS 64
+#define SPAWN_SLEEP_NS    1000000
+
+#define SPAWN_NONE UINT32_MAX
+
+/*
+ * Every dispatch engine has the same signature, and a task runs on the engine
+ * that spawned it.
+ */
+typedef result (*engine_fn)(uint8_t *bytecode);
+
+enum spawn_state {
+    SPAWN_FREE,
+    SPAWN_QUEUED,
+    SPAWN_DONE
+};
+
+struct spawn_task {
+    atomic_uint state;
+
+    /*
+     * Bumped every time the slot is freed, so that a handle to a task that's
+     * been joined doesn't match whatever gets the slot next.
+     */
+    uint32_t gen;
+
+    /*
+     * What to run and where: entry points into the bytecode or at a cell of
+     * the threaded code, like a return address, and cells is that threaded
+     * code, if any.
+     */
+    engine_fn engine;
+    uint8_t *bytecode;
+    uint8_t *memory;
+    void *entry;
+    void *cells;
+    uint8_t argc;
+    uint64_t args[SPAWN_ARGS_MAX];
+
+    /*
+     * How the procedure returned, and the value it left on top.
+     */
+    result status;
+    uint64_t value;
+
+    /*
+     * The task whose run spawned this one, or NULL for the main program, and
+     * the slots of its tasks spawned just before and after this one, in the
+     * list spawn_reap goes through.
+     */
+    struct spawn_task *owner;
+    uint32_t older;
+    uint32_t newer;
+};
+
+struct spawn_worker {
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    atomic_uint ring[SPAWN_TASKS];
+
+    struct spawn_task tasks[SPAWN_TASKS];
+    uint32_t free[SPAWN_TASKS];
+    uint32_t free_count;
+
+    /*
+     * For picking victims.
+     */
+    uint64_t rng;
+
+    /*
+     * Tasks this worker ran, and how many of those it stole.
+     */
+    uint64_t ran;
+    uint64_t stolen;
+
+    pthread_t thread;
+};
+
+struct {
+    struct spawn_worker *workers;
+    int count;
+    atomic_int stop;
+
+    /*
+     * Tasks spawned and not finished yet.
+     */
+    atomic_long live;
+
+    /*
+     * Idle workers sleep on wake, and count themselves in sleepers so that a
+     * SPAWN only takes the lock when there's someone to wake.
+     */
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} spawn_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Which worker this thread is, and how many tasks it's running one inside
+ * another.
+ */
+__thread int spawn_self;
+__thread int spawn_depth;
+
+/*
+ * The task this thread is running, or NULL for the main program, and the slot
+ * of the last task that code spawned and hasn't joined or reaped. run_task
+ * sets both aside while it runs a task.
+ */
+__thread struct spawn_task *spawn_current;
+__thread uint32_t spawn_children = SPAWN_NONE;
+
+/*
+ * Runs a task on this thread and leaves its result in value. This is the
+ * VM's business, so vm.h defines it.
+ */
+result run_task(struct spawn_task *task, uint64_t *value);
+
+struct spawn_task *spawn_task_of(uint32_t id) {
+    return &spawn_pool.workers[id / SPAWN_TASKS].tasks[id % SPAWN_TASKS];
+}
+
+/*
+ * A handle is HANDLE_TAG, the slot's generation and which slot it is.
+ */
+uint64_t spawn_handle(uint32_t id, struct spawn_task *t) {
+    return HANDLE_TAG | (uint64_t) t->gen << 32 | id;
+}
+
+void spawn_push(struct spawn_worker *w, uint32_t id) {
+    long long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    atomic_store_explicit(&w->ring[b % SPAWN_TASKS], id, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+}
+
+/*
+ * Take the task pushed last off our own deque. The only race is with a thief
+ * over the very last task, and the CAS on top settles it.
+ */
+uint32_t spawn_take(struct spawn_worker *w) {
+    long long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long t = atomic_load_explicit(&w->top, memory_order_relaxed);
+    uint32_t id = SPAWN_NONE;
+    if (t <= b) {
+        id = atomic_load_explicit(&w->ring[b % SPAWN_TASKS], memory_order_relaxed);
+        if (t == b) {
+            if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                id = SPAWN_NONE;
+            }
+            atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    }
+    return id;
+}
+
+/*
+ * Take the oldest task off somebody else's deque. Losing a race to another
+ * thief or the owner just counts as finding nothing.
+ */
+uint32_t spawn_steal(struct spawn_worker *w) {
+    long long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (t >= b) {
+        return SPAWN_NONE;
+    }
+    uint32_t id = atomic_load_explicit(&w->ring[t % SPAWN_TASKS], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return SPAWN_NONE;
+    }
+    return id;
+}
+
+/*
+ * Our own newest task, or else one stolen from a victim picked at random.
+ */
+uint32_t spawn_find() {
+    struct spawn_worker *self = &spawn_pool.workers[spawn_self];
+    uint32_t id = spawn_take(self);
+    if (id != SPAWN_NONE || spawn_pool.count == 1) {
+        return id;
+    }
+    self->rng = self->rng * 6364136223846793005ull + 1442695040888963407ull;
+    int first = (int) ((self->rng >> 33) % (uint64_t) spawn_pool.count);
+    for (int i = 0; i < spawn_pool.count; i++) {
+        int victim = (first + i) % spawn_pool.count;
+        if (victim == spawn_self) {
+            continue;
+        }
+        id = spawn_steal(&spawn_pool.workers[victim]);
+        if (id != SPAWN_NONE) {
+            self->stolen++;
+            return id;
+        }
+    }
+    return SPAWN_NONE;
+}
+
+void spawn_execute(uint32_t id) {
+    struct spawn_task *t = spawn_task_of(id);
+    uint64_t value = 0;
+    spawn_depth++;
+    result status = run_task(t, &value);
+    spawn_depth--;
+    t->status = status;
+    t->value = value;
+    spawn_pool.workers[spawn_self].ran++;
+    atomic_store_explicit(&t->state, SPAWN_DONE, memory_order_release);
+    atomic_fetch_sub_explicit(&spawn_pool.live, 1, memory_order_acq_rel);
+}
+
+int spawn_work_visible() {
+    for (int i = 0; i < spawn_pool.count; i++) {
+        struct spawn_worker *w = &spawn_pool.workers[i];
+        if (atomic_load(&w->top) < atomic_load(&w->bottom)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void spawn_sleep() {
+    pthread_mutex_lock(&spawn_pool.lock);
+    atomic_fetch_add(&spawn_pool.sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!spawn_work_visible() && !atomic_load(&spawn_pool.stop)) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += SPAWN_SLEEP_NS;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&spawn_pool.wake, &spawn_pool.lock, &until);
+    }
+    atomic_fetch_sub(&spawn_pool.sleepers, 1);
+    pthread_mutex_unlock(&spawn_pool.lock);
+}
+
+void *spawn_worker_main(void *arg) {
+    spawn_self = (int) (intptr_t) arg;
+    int idle = 0;
+    while (!atomic_load_explicit(&spawn_pool.stop, memory_order_relaxed)) {
+        uint32_t id = spawn_find();
+        if (id != SPAWN_NONE) {
+            spawn_execute(id);
+            idle = 0;
+        } else if (++idle < SPAWN_IDLE_ROUNDS) {
+            sched_yield();
+        } else {
+            spawn_sleep();
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * How many workers to start when a program first spawns: VERSE_THREADS if
+ * it's set, or one per online CPU.
+ */
+int spawn_threads() {
+    const char *env = getenv("VERSE_THREADS");
+    long n = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > 1024 ? 1024 : (int) n;
+}
+
+/*
+ * Start a pool of n workers, counting the calling thread, which becomes
+ * worker 0. Returns 0 if we couldn't.
+ */
+int spawn_pool_start(int n) {
+    size_t size = (size_t) n * sizeof(struct spawn_worker);
+    struct spawn_worker *workers = aligned_alloc(_Alignof(struct spawn_worker), size);
+    if (workers == NULL) {
+        return 0;
+    }
+    memset(workers, 0, size);
+    for (int i = 0; i < n; i++) {
+        for (uint32_t s = 0; s < SPAWN_TASKS; s++) {
+            workers[i].free[s] = SPAWN_TASKS - 1 - s;
+        }
+        workers[i].free_count = SPAWN_TASKS;
+        workers[i].rng = (uint64_t) i + 1;
+    }
+    spawn_pool.workers = workers;
+    spawn_pool.count = n;
+    atomic_store(&spawn_pool.stop, 0);
+    spawn_self = 0;
+    for (int i = 1; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, spawn_worker_main, (void *) (intptr_t) i) != 0) {
+
+            /*
+             * The workers we did start may already be looking at the ones we
+             * didn't, so run with what we have.
+             */
+            spawn_pool.count = i;
+            break;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Stop the workers and free the pool. Only call this with every task done.
+ */
+void spawn_pool_stop() {
+    if (spawn_pool.count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&spawn_pool.lock);
+    atomic_store(&spawn_pool.stop, 1);
+    pthread_cond_broadcast(&spawn_pool.wake);
+    pthread_mutex_unlock(&spawn_pool.lock);
+    for (int i = 1; i < spawn_pool.count; i++) {
+        pthread_join(spawn_pool.workers[i].thread, NULL);
+    }
+    free(spawn_pool.workers);
+    spawn_pool.workers = NULL;
+    spawn_pool.count = 0;
+}
+
+/*
+ * Get a free slot of ours for a new task, and the handle that names it.
+ * Starts the pool if nothing has spawned yet. Returns NULL if we're out of
+ * slots.
+ */
+struct spawn_task *spawn_alloc(uint64_t *handle) {
+    if (spawn_pool.count == 0 && !spawn_pool_start(spawn_threads())) {
+        return NULL;
+    }
+    struct spawn_worker *self = &spawn_pool.workers[spawn_self];
+    if (self->free_count == 0) {
+        return NULL;
+    }
+    uint32_t index = self->free[--self->free_count];
+    struct spawn_task *t = &self->tasks[index];
+    t->owner = spawn_current;
+    t->older = spawn_children;
+    t->newer = SPAWN_NONE;
+    if (spawn_children != SPAWN_NONE) {
+        self->tasks[spawn_children].newer = index;
+    }
+    spawn_children = index;
+    *handle = spawn_handle((uint32_t) spawn_self * SPAWN_TASKS + index, t);
+    return t;
+}
+
+void spawn_submit(struct spawn_task *t) {
+    struct spawn_worker *self = &spawn_pool.workers[spawn_self];
+    atomic_store_explicit(&t->state, SPAWN_QUEUED, memory_order_relaxed);
+    atomic_fetch_add_explicit(&spawn_pool.live, 1, memory_order_relaxed);
+    spawn_push(self, (uint32_t) spawn_self * SPAWN_TASKS + (uint32_t) (t - self->tasks));
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&spawn_pool.sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&spawn_pool.lock);
+        pthread_cond_signal(&spawn_pool.wake);
+        pthread_mutex_unlock(&spawn_pool.lock);
+    }
+}
+
+/*
+ * Take a task out of its spawner's list and free its slot. The generation
+ * stays below HANDLE_TAG.
+ */
+void spawn_release(struct spawn_worker *w, struct spawn_task *t) {
+    if (t->newer != SPAWN_NONE) {
+        w->tasks[t->newer].older = t->older;
+    } else {
+        spawn_children = t->older;
+    }
+    if (t->older != SPAWN_NONE) {
+        w->tasks[t->older].newer = t->newer;
+    }
+    t->gen = (t->gen + 1) & 0x7FFFFFFF;
+    atomic_store_explicit(&t->state, SPAWN_FREE, memory_order_relaxed);
+    w->free[w->free_count++] = (uint32_t) (t - w->tasks);
+}
+
+/*
+ * Wait for a task to finish, running other tasks meanwhile.
+ */
+void spawn_await(struct spawn_task *t) {
+    while (atomic_load_explicit(&t->state, memory_order_acquire) != SPAWN_DONE) {
+        uint32_t other = spawn_depth < SPAWN_HELP_DEPTH ? spawn_find() : SPAWN_NONE;
+        if (other != SPAWN_NONE) {
+            spawn_execute(other);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Wait for the task a handle names and free its slot. The handle has to be
+ * one the code running now got from a SPAWN and hasn't joined yet. A task
+ * that failed keeps its slot, so that spawn_reap can tell whether it was the
+ * first to fail.
+ */
+result spawn_wait(uint64_t handle, uint64_t *value) {
+    uint32_t id = (uint32_t) handle;
+    if (spawn_pool.count == 0 || id / SPAWN_TASKS != (uint32_t) spawn_self) {
+        return ERR_BAD_HANDLE;
+    }
+    struct spawn_worker *self = &spawn_pool.workers[spawn_self];
+    struct spawn_task *t = spawn_task_of(id);
+    if (atomic_load_explicit(&t->state, memory_order_relaxed) == SPAWN_FREE || handle != spawn_handle(id, t) ||
+        t->owner != spawn_current) {
+        return ERR_BAD_HANDLE;
+    }
+    spawn_await(t);
+    result status = t->status;
+    if (status == SUCCESS) {
+        *value = t->value;
+        spawn_release(self, t);
+    }
+    return status;
+}
+
+/*
+ * Wait for every task the code running now spawned and didn't join, and free
+ * their slots. Returns how the first of its tasks to fail failed, joined or
+ * not, or else status, which is how the code itself ended.
+ */
+result spawn_reap(result status) {
+    if (spawn_children == SPAWN_NONE) {
+        return status;
+    }
+    struct spawn_worker *self = &spawn_pool.workers[spawn_self];
+    result failed = SUCCESS;
+    while (spawn_children != SPAWN_NONE) {
+        struct spawn_task *t = &self->tasks[spawn_children];
+        spawn_await(t);
+        if (t->status != SUCCESS) {
+            failed = t->status;
+        }
+        spawn_release(self, t);
+    }
+    return failed != SUCCESS ? failed : status;
+}
+
+/*
+ * Wait until every task spawned so far has finished, running them if need be.
+ * Only the thread that started the pool calls this, at the end of a run, when
+ * no task may go on using the run's threaded code.
+ */
+void spawn_sync() {
+    if (spawn_pool.count == 0) {
+        return;
+    }
+    while (atomic_load_explicit(&spawn_pool.live, memory_order_acquire) > 0) {
+        uint32_t id = spawn_find();
+        if (id != SPAWN_NONE) {
+            spawn_execute(id);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+#endif
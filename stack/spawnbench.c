@@ -0,0 +1,256 @@
+/*
+ * Measure what SPAWN and JOIN cost and what they buy. Two programs:
+ *
+ *   overhead   spawn a task that does nothing and join it straight away, over
+ *              and over, next to the same loop with a CALL. The difference is
+ *              what the pool adds on top of a call: taking a slot, copying
+ *              the arguments, the deque, and running the task on a stack of
+ *              its own.
+ *   reduce     add up i * i over CHUNKS * CHUNK_SIZE values, one task per
+ *              chunk, with all the tasks spawned before the first JOIN. The
+ *              serial version CALLs each chunk instead.
+ *
+ * The reduction runs on pools of 1, 2, 4, ... workers up to what the VM would
+ * start on its own (VERSE_THREADS, or one per online CPU), and we report the
+ * speedup over a pool of one.
+ */
+
+#include <time.h>
+
+#include "verify.h"
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./stckspawnbench [dispatch type]\n"
+
+/*
+ * The overhead loop runs 255 * SPAWN_ROUNDS times. Each chunk is 100 * 100
+ * values, built with a MUL since PUSH_IMM only takes a byte. The main program
+ * holds every handle on the stack at once, so CHUNKS has to stay well under
+ * STACK_MAX.
+ */
+#define SPAWN_ROUNDS 40
+#define ITERATIONS   (255 * SPAWN_ROUNDS)
+#define CHUNK_SIZE   (100 * 100)
+#define CHUNKS       16
+#define REPS         5
+
+#define PROGRAM_MAX 512
+#define MAX_POOLS   16
+
+struct program {
+    uint8_t code[PROGRAM_MAX];
+    size_t len;
+};
+
+void emit_bytes(struct program *p, const uint8_t *bytes, size_t n) {
+    memcpy(p->code + p->len, bytes, n);
+    p->len += n;
+}
+
+#define emit(p, ...) emit_bytes((p), (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+void emit_u32(struct program *p, uint32_t v) {
+    emit(p, v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24);
+}
+
+void patch_u32(struct program *p, size_t at, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p->code[at + i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+/*
+ * for ITERATIONS times: SPAWN nop 0; JOIN; POP_RES, or CALL nop; POP_RES.
+ * JIF jumps to one byte before its operand.
+ */
+void build_overhead(struct program *p, int spawn) {
+    p->len = 0;
+    emit(p, PUSH_IMM, 255, PUSH_IMM, SPAWN_ROUNDS, MUL);
+    size_t head = p->len;
+    size_t call = p->len + 1;
+    if (spawn) {
+        emit(p, SPAWN, 0, 0, 0, 0, 0, JOIN);
+    } else {
+        emit(p, CALL, 0, 0, 0, 0);
+    }
+    emit(p, POP_RES, PUSH_IMM, 1, SUB, JIF, (uint8_t) (head + 1), POP_RES, DONE);
+    patch_u32(p, call, (uint32_t) p->len);
+    emit(p, PUSH_IMM, 0, RET);
+}
+
+/*
+ * The main program passes each chunk its index, which stays under the handle
+ * or the result, so SWAP; DROP gets rid of it. Spawned, the handles then come
+ * off one JOIN at a time. Called, the results just get added up as we go.
+ *
+ * The chunk is the one in programs/stack/spawn.stack: locals 0, 1 and 2 are
+ * the total, the first value and the countdown.
+ */
+void build_reduce(struct program *p, int spawn) {
+    size_t calls[CHUNKS];
+    p->len = 0;
+    for (int c = 0; c < CHUNKS; c++) {
+        emit(p, PUSH_IMM, (uint8_t) c);
+        calls[c] = p->len + 1;
+        if (spawn) {
+            emit(p, SPAWN, 0, 0, 0, 0, 1, SWAP, DROP);
+        } else {
+            emit(p, CALL, 0, 0, 0, 0, SWAP, DROP);
+            if (c > 0) {
+                emit(p, ADD);
+            }
+        }
+    }
+    if (spawn) {
+        emit(p, JOIN);
+        for (int c = 1; c < CHUNKS; c++) {
+            emit(p, SWAP, JOIN, ADD);
+        }
+    }
+    emit(p, POP_RES, DONE);
+    for (int c = 0; c < CHUNKS; c++) {
+        patch_u32(p, calls[c], (uint32_t) p->len);
+    }
+    emit(p, PUSH_IMM, 0, LOAD_LOCAL, (uint8_t) -1, PUSH_IMM, 100, PUSH_IMM, 100, MUL, MUL);
+    emit(p, PUSH_IMM, 100, PUSH_IMM, 100, MUL);
+    size_t head = p->len;
+    emit(p, LOAD_LOCAL, 1, LOAD_LOCAL, 2, ADD, DUP, MUL, LOAD_LOCAL, 0, ADD, STORE_LOCAL, 0);
+    emit(p, PUSH_IMM, 1, SUB, JIF_LONG);
+    emit_u32(p, (uint32_t) head);
+    emit(p, DROP, DROP, RET);
+}
+
+uint64_t expected_reduce() {
+    uint64_t total = 0;
+    for (uint64_t i = 1; i <= (uint64_t) CHUNKS * CHUNK_SIZE; i++) {
+        total += i * i;
+    }
+    return total;
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Run a program REPS times and keep the fastest run.
+ */
+double measure(struct engine *e, struct program *p, uint64_t expected) {
+    double best = 0;
+    for (int rep = 0; rep < REPS; rep++) {
+        struct timespec t0, t1;
+        reset_vm();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        result r = run_engine(e, p->code);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (r != SUCCESS || vm.result != expected) {
+            fprintf(stderr, "Benchmark program failed on %s\n", e->name);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (rep == 0 || elapsed_ns(&t0, &t1) < best) {
+            best = elapsed_ns(&t0, &t1);
+        }
+    }
+    return best;
+}
+
+/*
+ * Swap in a pool of n workers for the runs that follow.
+ */
+void use_pool(int n) {
+    spawn_pool_stop();
+    if (!spawn_pool_start(n)) {
+        fprintf(stderr, "Couldn't start %d workers\n", n);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void check(struct program *p, const char *name) {
+    struct verify_info info;
+    verify_status status = verify_bytecode(p->code, p->len, &info);
+    if (status != VERIFY_OK) {
+        fprintf(stderr, "%s doesn't verify: %s\n", name, verify_messages[status]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        printf(USAGE_STR);
+        exit(EXIT_FAILURE);
+    }
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (argc == 2) {
+        first = find_engine(argv[1]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    static struct program overhead[2];
+    static struct program reduce[2];
+    for (int spawn = 0; spawn < 2; spawn++) {
+        build_overhead(&overhead[spawn], spawn);
+        check(&overhead[spawn], "overhead");
+        build_reduce(&reduce[spawn], spawn);
+        check(&reduce[spawn], "reduce");
+    }
+
+    int pools[MAX_POOLS];
+    int num_pools = 0;
+    int max_workers = spawn_threads();
+    for (int n = 1; n < max_workers && num_pools < MAX_POOLS - 1; n *= 2) {
+        pools[num_pools++] = n;
+    }
+    pools[num_pools++] = max_workers;
+
+    vm_quiet = 1;
+
+    /*
+     * Overhead is measured on a pool of one, where every task runs on the
+     * thread that joins it, so nothing else is timed along with it.
+     */
+    double call_ns[NUM_ENGINES];
+    double spawn_ns[NUM_ENGINES];
+    double serial_ns[NUM_ENGINES];
+    double reduce_ns[NUM_ENGINES][MAX_POOLS];
+    use_pool(1);
+    for (struct engine *e = first; e < last; e++) {
+        call_ns[e - engines] = measure(e, &overhead[0], 0);
+        spawn_ns[e - engines] = measure(e, &overhead[1], 0);
+        serial_ns[e - engines] = measure(e, &reduce[0], expected_reduce());
+    }
+    for (int i = 0; i < num_pools; i++) {
+        use_pool(pools[i]);
+        for (struct engine *e = first; e < last; e++) {
+            reduce_ns[e - engines][i] = measure(e, &reduce[1], expected_reduce());
+        }
+    }
+    spawn_pool_stop();
+
+    printf("%d spawns, %d chunks of %d values\n", ITERATIONS, CHUNKS, CHUNK_SIZE);
+    printf("%-10s %10s %10s %10s\n", "engine", "call ns", "spawn ns", "extra ns");
+    for (struct engine *e = first; e < last; e++) {
+        double call = call_ns[e - engines] / ITERATIONS;
+        double spawn = spawn_ns[e - engines] / ITERATIONS;
+        printf("%-10s %10.1f %10.1f %10.1f\n", e->name, call, spawn, spawn - call);
+    }
+    printf("\n%-10s %8s %10s %10s %10s\n", "engine", "workers", "ms", "vs 1", "vs serial");
+    for (struct engine *e = first; e < last; e++) {
+        double serial = serial_ns[e - engines];
+        printf("%-10s %8s %10.2f %9.2fx %9.2fx\n", e->name, "serial", serial / 1e6,
+               reduce_ns[e - engines][0] / serial, 1.0);
+        for (int i = 0; i < num_pools; i++) {
+            double ns = reduce_ns[e - engines][i];
+            printf("%-10s %8d %10.2f %9.2fx %9.2fx\n", e->name, pools[i], ns / 1e6,
+                   reduce_ns[e - engines][0] / ns, serial / ns);
+        }
+    }
+}
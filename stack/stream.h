@@ -0,0 +1,303 @@
+#ifndef VERSE_STACK_STREAM_H_
+#define VERSE_STACK_STREAM_H_
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memo.h"
+#include "vm.h"
+
+/*
+ * Stream mode runs a program once for every record of a binary file. A record
+ * is a fixed number of 64-bit little-endian fields, and they go on the stack
+ * in order before the program starts, so the last field is on top. Whatever
+ * the program leaves on the stack when it gets to DONE is its output for that
+ * record, bottom first, so it can transform a record, turn it into several
+ * values or drop it by leaving nothing. The stack is emptied between records
+ * but memory isn't, so a program can keep running totals there. Records and
+ * outputs are copied as they are, which is only little-endian because we
+ * refuse to build on anything else.
+ *
+ * The input is mapped and read front to back, and we ask the kernel to read
+ * ahead a chunk at a time while we compute. Outputs go into one of two
+ * buffers. When it fills up a writer thread takes it and we carry on filling
+ * the other, so writing overlaps computing too.
+ *
+ * The engine runs quietly, without a line for every DONE, and a threaded
+ * engine translates the program once for the whole stream rather than once a
+ * record.
+ *
+ * With a memo cache, a record we've seen before gets the output it got then
+ * without running anything. Whoever passes one has to have checked the
+ * program doesn't STORE, since otherwise an output can depend on the records
+ * before it.
+ */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Stream records are little-endian and copied straight onto the stack, so the host has to be too"
+#endif
+
+#define STREAM_CHUNK  (1 << 24)
+#define STREAM_BUFFER (1 << 20)
+
+typedef enum {
+    STREAM_OK,
+    STREAM_CANT_READ,
+    STREAM_PARTIAL_RECORD,
+    STREAM_CANT_WRITE,
+    STREAM_RUN_FAILED,
+    STREAM_NO_WRITER
+} stream_status;
+
+const char *stream_messages[] = {
+        "OK",
+        "can't read the input",
+        "input isn't a whole number of records",
+        "can't write the output",
+        "program failed on a record",
+        "can't start the writer thread"
+};
+
+struct stream_report {
+    uint64_t records;
+    uint64_t values_out;
+    double seconds;
+
+    /*
+     * How the failing record ended, if one did.
+     */
+    result status;
+    uint64_t failed_record;
+};
+
+/*
+ * The two output buffers and the writer thread that drains them. full is the
+ * buffer waiting to be written, or -1 if the writer is free.
+ */
+struct stream_writer {
+    int fd;
+    uint8_t *buffers[2];
+    int full;
+    size_t full_len;
+    int finished;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+};
+
+int write_all(int fd, uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+void *stream_write_loop(void *arg) {
+    struct stream_writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->full < 0 && !w->finished) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        if (w->full < 0) {
+            break;
+        }
+        uint8_t *data = w->buffers[w->full];
+        size_t len = w->full_len;
+        pthread_mutex_unlock(&w->lock);
+        int ok = write_all(w->fd, data, len);
+        pthread_mutex_lock(&w->lock);
+        if (!ok) {
+            w->failed = 1;
+        }
+        w->full = -1;
+        pthread_cond_broadcast(&w->changed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * Hand a buffer to the writer, once it's done with the last one.
+ */
+void stream_hand_off(struct stream_writer *w, int buffer, size_t len) {
+    pthread_mutex_lock(&w->lock);
+    while (w->full >= 0) {
+        pthread_cond_wait(&w->changed, &w->lock);
+    }
+    w->full = buffer;
+    w->full_len = len;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Run the program over every record of the input. The stack has to be big
+ * enough for the program with fields inputs, which is up to the caller. memo
+ * can be NULL.
+ */
+stream_status run_stream(struct engine *e, uint8_t *bytecode, uint32_t fields, const char *input, const char *output,
+                         struct memo_cache *memo, struct stream_report *report) {
+    memset(report, 0, sizeof(*report));
+    size_t record_size = (size_t) fields * sizeof(uint64_t);
+    int in = open(input, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) {
+            close(in);
+        }
+        return STREAM_CANT_READ;
+    }
+    size_t size = st.st_size;
+    if (record_size == 0 ? size != 0 : size % record_size != 0) {
+        close(in);
+        return STREAM_PARTIAL_RECORD;
+    }
+    uint8_t *records = NULL;
+    if (size > 0) {
+        records = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+        if (records == MAP_FAILED) {
+            close(in);
+            return STREAM_CANT_READ;
+        }
+        madvise(records, size, MADV_SEQUENTIAL);
+        madvise(records, size < STREAM_CHUNK ? size : STREAM_CHUNK, MADV_WILLNEED);
+    }
+    close(in);
+    uint64_t num_records = record_size == 0 ? 0 : size / record_size;
+
+    struct stream_writer w;
+    memset(&w, 0, sizeof(w));
+    w.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    w.buffers[0] = malloc(STREAM_BUFFER);
+    w.buffers[1] = malloc(STREAM_BUFFER);
+    w.full = -1;
+    if (w.fd < 0 || w.buffers[0] == NULL || w.buffers[1] == NULL) {
+        if (w.fd >= 0) {
+            close(w.fd);
+        }
+        free(w.buffers[0]);
+        free(w.buffers[1]);
+        if (records != NULL) {
+            munmap(records, size);
+        }
+        return STREAM_CANT_WRITE;
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.changed, NULL);
+    if (pthread_create(&w.thread, NULL, stream_write_loop, &w) != 0) {
+        pthread_mutex_destroy(&w.lock);
+        pthread_cond_destroy(&w.changed);
+        close(w.fd);
+        free(w.buffers[0]);
+        free(w.buffers[1]);
+        if (records != NULL) {
+            munmap(records, size);
+        }
+        return STREAM_NO_WRITER;
+    }
+
+    int was_quiet = vm_quiet;
+    vm_quiet = 1;
+    keep_threaded_code();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stream_status status = STREAM_OK;
+    int current = 0;
+    size_t used = 0;
+    size_t next_chunk = STREAM_CHUNK;
+    for (uint64_t i = 0; i < num_records; i++) {
+        size_t offset = i * record_size;
+        if (offset >= next_chunk) {
+            if (next_chunk + STREAM_CHUNK < size) {
+                size_t ahead = size - next_chunk - STREAM_CHUNK;
+                madvise(records + next_chunk + STREAM_CHUNK, ahead < STREAM_CHUNK ? ahead : STREAM_CHUNK,
+                        MADV_WILLNEED);
+            }
+            next_chunk += STREAM_CHUNK;
+        }
+
+        memcpy(vm.stack, records + offset, record_size);
+        struct memo_key key;
+        struct memo_entry *hit = NULL;
+        if (memo != NULL) {
+            key = memo_key_for(memo, vm.stack, fields);
+            hit = memo_lookup(memo, key);
+        }
+        uint64_t *out = vm.stack;
+        size_t depth;
+        if (hit != NULL) {
+            out = hit->stack;
+            depth = hit->depth;
+        } else {
+            uint64_t run_start = memo != NULL ? memo_now() : 0;
+            vm.stack_top = vm.stack + fields;
+            vm.return_top = vm.return_stack;
+            result r = run_engine(e, bytecode);
+            if (r != SUCCESS) {
+                report->status = r;
+                report->failed_record = i;
+                status = STREAM_RUN_FAILED;
+                break;
+            }
+            depth = vm.stack_top - vm.stack;
+            if (memo != NULL) {
+                memo_store(memo, key, vm.result, vm.stack, depth, memo_now() - run_start);
+            }
+        }
+
+        size_t out_len = depth * sizeof(uint64_t);
+        if (used + out_len > STREAM_BUFFER) {
+            stream_hand_off(&w, current, used);
+            current ^= 1;
+            used = 0;
+        }
+        memcpy(w.buffers[current] + used, out, out_len);
+        used += out_len;
+        report->records++;
+        report->values_out += depth;
+    }
+    if (used > 0) {
+        stream_hand_off(&w, current, used);
+    }
+    pthread_mutex_lock(&w.lock);
+    w.finished = 1;
+    pthread_cond_broadcast(&w.changed);
+    pthread_mutex_unlock(&w.lock);
+    pthread_join(w.thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    drop_threaded_code();
+    vm_quiet = was_quiet;
+
+    if (close(w.fd) != 0 || w.failed) {
+        status = status == STREAM_OK ? STREAM_CANT_WRITE : status;
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.changed);
+    free(w.buffers[0]);
+    free(w.buffers[1]);
+    if (records != NULL) {
+        munmap(records, size);
+    }
+    return status;
+}
+
+void print_stream_report(FILE *out, struct stream_report *report, uint32_t fields) {
+    double seconds = report->seconds > 0 ? report->seconds : 1e-9;
+    fprintf(out, "%" PRIu64 " records in, %" PRIu64 " values out in %.3f s\n", report->records, report->values_out,
+            report->seconds);
+    fprintf(out, "%.0f records/s, %.1f MB/s in\n", report->records / seconds,
+            report->records * fields * sizeof(uint64_t) / seconds / 1e6);
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef VERSE_STACK_STRENGTH_H_
+#define VERSE_STACK_STRENGTH_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+/*
+ * Strength reduction for multiplying and dividing by immediates. DIV is the
+ * slowest thing an engine does, a hardware divide plus a check for zero, and
+ * most of our divisions are by a PUSH_IMM right before them:
+ *
+ *   PUSH_IMM c; DIV   ->  DIV_CONST c          c not a power of two
+ *   PUSH_IMM c; DIV   ->  RSHIFT_CONST log2 c  c a power of two
+ *   PUSH_IMM c; MUL   ->  LSHIFT_CONST log2 c  c a power of two
+ *
+ * The divisor is known here, so the check for zero happens now rather than on
+ * every run: we leave a PUSH_IMM 0; DIV alone for the interpreter to fail on.
+ * Each rewrite saves a byte and a dispatch, so afterwards we lay the program
+ * out again and fix up every jump and call, as in optimize_loops.
+ *
+ * This only includes isa.h and doesn't exit when it runs out of memory, so
+ * libverse can use it too.
+ */
+
+struct strength_report {
+    size_t divides;
+    size_t shifts;
+};
+
+/*
+ * Can the PUSH_IMM at pc and the instruction after it become one instruction?
+ * If so, say which one and with what operand. Nothing may jump to the second
+ * of the two, since it won't be there any more.
+ */
+int reducible(uint8_t *code, size_t len, uint8_t *is_target, size_t pc, uint8_t *op, uint8_t *operand) {
+    if (code[pc] != PUSH_IMM || pc + 2 >= len || is_target[pc + 2]) {
+        return 0;
+    }
+    uint8_t c = code[pc + 1];
+    uint8_t next = code[pc + 2];
+    if ((next != MUL && next != DIV) || c == 0) {
+        return 0;
+    }
+    if ((c & (c - 1)) == 0) {
+        *op = next == MUL ? LSHIFT_CONST : RSHIFT_CONST;
+        *operand = (uint8_t) __builtin_ctz(c);
+        return 1;
+    }
+    if (next == DIV) {
+        *op = DIV_CONST;
+        *operand = c;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Produce the rewritten program. Returns a malloc'd copy of the code, which is
+ * just the original if there was nothing to do or we couldn't make sense of
+ * the jumps, and stores its length in new_len. Returns NULL if we ran out of
+ * memory.
+ */
+uint8_t *reduce_strength(uint8_t *code, size_t len, size_t *new_len, struct strength_report *report) {
+    memset(report, 0, sizeof(*report));
+    uint8_t *out = malloc(len > 0 ? len : 1);
+    uint8_t *is_start = calloc(len + 1, 1);
+    uint8_t *is_target = calloc(len + 1, 1);
+    size_t *new_pc = malloc((len + 1) * sizeof(size_t));
+    if (out == NULL || is_start == NULL || is_target == NULL || new_pc == NULL) {
+        free(out);
+        out = NULL;
+        goto done;
+    }
+    memcpy(out, code, len);
+    *new_len = len;
+
+    /*
+     * As with loops, leave code we can't decode or whose jumps land in the
+     * middle of an instruction for the interpreter to report.
+     */
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        if (pc + operand_bytes(code[pc]) >= len) {
+            goto done;
+        }
+        is_start[pc] = 1;
+    }
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        size_t target = jump_target(code, pc);
+        if (target == SIZE_MAX && (code[pc] == JIF || code[pc] == LOOP)) {
+            goto done;
+        }
+        if (target != SIZE_MAX) {
+            if (target >= len || !is_start[target]) {
+                goto done;
+            }
+            is_target[target] = 1;
+        }
+    }
+
+    /*
+     * Work out where everything ends up. Every rewrite comes out 2 bytes long
+     * in place of 3.
+     */
+    uint8_t op;
+    uint8_t operand;
+    size_t at = 0;
+    size_t pc = 0;
+    while (pc < len) {
+        new_pc[pc] = at;
+        if (reducible(code, len, is_target, pc, &op, &operand)) {
+            at += 2;
+            pc += 3;
+        } else {
+            at += 1 + operand_bytes(code[pc]);
+            pc += 1 + operand_bytes(code[pc]);
+        }
+    }
+    if (at == len) {
+        goto done;
+    }
+
+    at = 0;
+    pc = 0;
+    while (pc < len) {
+        if (reducible(code, len, is_target, pc, &op, &operand)) {
+            out[at++] = op;
+            out[at++] = operand;
+            if (op == DIV_CONST) {
+                report->divides++;
+            } else {
+                report->shifts++;
+            }
+            pc += 3;
+            continue;
+        }
+        op = code[pc];
+        size_t target = jump_target(code, pc);
+        out[at++] = op;
+        if (op == JIF || op == LOOP) {
+            out[at++] = (uint8_t) (new_pc[target] + 1);
+            if (op == LOOP) {
+                out[at++] = code[pc + 2];
+            }
+        } else if (operand_bytes(op) >= 4) {
+            for (int b = 0; b < 4; b++) {
+                out[at++] = (new_pc[target] >> (8 * b)) & 0xFF;
+            }
+            if (op == SPAWN) {
+                out[at++] = code[pc + 5];
+            }
+        } else if (operand_bytes(op) == 1) {
+            out[at++] = code[pc + 1];
+        }
+        pc += 1 + operand_bytes(op);
+    }
+    *new_len = at;
+
+    done:
+    free(is_start);
+    free(is_target);
+    free(new_pc);
+    return out;
+}
+
+void print_strength_report(FILE *f, struct strength_report *report, size_t len, size_t new_len) {
+    fprintf(f, "%zu divisions by constants fused, %zu multiplies and divides turned into shifts, %zu bytes -> %zu bytes\n",
+            report->divides, report->shifts, len, new_len);
+}
+
+#endif
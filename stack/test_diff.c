@@ -0,0 +1,1132 @@
+/*
+ * Differential testing for the stack VM engines. We run every program on every
+ * engine and check that they all agree with the inline interpreter on the
+ * status they return, the result register and the final contents of the stack.
+ * Programs come from the command line (bytecode files, bare or in a container)
+ * and from a random generator. We also rewrite each program's counted loops,
+ * strength-reduce its multiplies and divides by immediates, and lay its
+ * blocks out again for a profile of it, and check that the result still does
+ * the same thing on the inline interpreter. When engines disagree,
+ * we shrink the program down to a minimal reproducer and write it out as
+ * source.
+ *
+ * Each run happens in a child process with a timeout, so an engine that
+ * crashes or hangs is reported as a mismatch rather than taking us down with
+ * it.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../common/container.h"
+#include "layout.h"
+#include "loops.h"
+#include "strength.h"
+#include "verify.h"
+#include "vm.h"
+
+#define USAGE_STR "Usage: ./test-diff [-n programs] [-r seed] [-t timeout ms] [-o dir] [bytecode files]\n"
+
+/*
+ * Bounds on the shape of random programs. They're kept small so that a run
+ * takes microseconds and a shrunk program is easy to read.
+ */
+#define MAX_STATEMENTS  8
+#define MAX_NESTING     3
+#define MAX_EXPR_DEPTH  4
+#define MAX_TRIPS       4
+#define MAX_LEFTOVERS   4
+#define MAX_PROCS       3
+#define MAX_ARGS        3
+
+/*
+ * The reference engine runs tasks on a pool of one, where each one runs on
+ * the thread that joins it, and the others on a pool of this many, so that
+ * anything that depends on which worker ran what shows up as a mismatch, even
+ * on a machine with one CPU.
+ */
+#define POOL_WORKERS 4
+
+typedef enum {
+    OUTCOME_FINISHED,
+    OUTCOME_EXITED,
+    OUTCOME_CRASHED,
+    OUTCOME_TIMED_OUT
+} outcome_kind;
+
+/*
+ * Everything we compare between engines after a run.
+ */
+struct outcome {
+    outcome_kind kind;
+
+    /*
+     * The signal that killed the run, or the exit code if it exited on its
+     * own.
+     */
+    int signal;
+    result status;
+    uint64_t result;
+    uint32_t depth;
+    uint64_t stack[STACK_MAX];
+};
+
+/*
+ * A growable piece of bytecode.
+ */
+struct program {
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Bytecode decoded into instructions, with jump targets as instruction indices
+ * rather than byte offsets. This is what we shrink, since it lets us delete
+ * instructions without breaking the jumps around them.
+ */
+struct insn {
+    uint8_t op;
+    uint32_t operand;
+    size_t target;
+};
+
+int timeout_ms = 1000;
+uint64_t rng;
+
+/*
+ * Procedures in the program we're generating. Each one takes proc_args values
+ * and returns one. To keep the call graph acyclic, procedure i only calls
+ * procedures after it, and the main program counts as procedure -1.
+ *
+ * Pure procedures never touch memory and only call other pure ones, so they
+ * can be SPAWNed: a task that loads or stores would race with its spawner, and
+ * then the engines could disagree for reasons that have nothing to do with
+ * them.
+ */
+int num_procs;
+int current_proc;
+uint8_t proc_args[MAX_PROCS];
+uint8_t proc_pure[MAX_PROCS];
+
+/*
+ * CALLs whose target we'll fill in once the procedures are laid out.
+ */
+struct call_site {
+    size_t at;
+    int proc;
+};
+
+struct call_site *call_sites;
+size_t num_call_sites;
+
+/*
+ * How deep the stack is where we're generating, counted from the frame base
+ * the way the verifier does, and the lowest slot LOAD_LOCAL can reach: a
+ * procedure's first argument, or the bottom of the stack in the main program.
+ */
+int live;
+int frame_floor;
+
+/*
+ * Where our own output goes. We point stdout at /dev/null because the engines
+ * print as they run.
+ */
+FILE *out;
+
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1Dull;
+}
+
+void emit(struct program *p, uint8_t b) {
+    if (p->len == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 256;
+        p->code = realloc(p->code, p->cap);
+        if (p->code == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p->code[p->len++] = b;
+}
+
+void emit_u32(struct program *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit(p, (v >> (8 * i)) & 0xFF);
+    }
+}
+
+void patch_u32(struct program *p, size_t at, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p->code[at + i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+/*
+ * Mostly small immediates, with plenty of zeros so that DIV and JIF see them.
+ */
+uint8_t random_imm() {
+    switch (next_random() % 4) {
+        case 0:
+            return 0;
+        case 1:
+            return 1 + next_random() % 4;
+        default:
+            return next_random() & 0xFF;
+    }
+}
+
+/*
+ * Push one value. Division by zero is fair game since every engine has to
+ * report it the same way, but shift amounts are masked because shifting a
+ * 64-bit value by 64 or more is undefined in C. Some values go through the float
+ * opcodes, so doubles end up everywhere integers do.
+ */
+void gen_expr(struct program *p, int depth);
+void gen_shuffle(struct program *p, int depth);
+
+/*
+ * Push an address. Most of them are masked so that they land in the first few
+ * hundred bytes of memory, where the stores go, but now and then we let one
+ * through unmasked so that it can run into the guard region.
+ */
+void gen_address(struct program *p, int depth) {
+    gen_expr(p, depth);
+    if (next_random() % 16 != 0) {
+        emit(p, PUSH_IMM);
+        emit(p, 0xFF);
+        emit(p, AND);
+    }
+}
+
+/*
+ * Push several values and shuffle them down to one, or read a local. The only
+ * local we ever store to is the one right under the value being stored, which
+ * belongs to this expression: anything further down could be a loop counter.
+ */
+void gen_shuffle(struct program *p, int depth) {
+    uint8_t op = ADD + next_random() % (XOR - ADD + 1);
+    uint64_t kind = next_random() % 7;
+    int values = kind == 0 || kind == 6 ? 1 : kind == 3 ? 3 : 2;
+    if (kind == 6) {
+        if (live > frame_floor) {
+            emit(p, LOAD_LOCAL);
+            emit(p, (uint8_t) (frame_floor + (int) (next_random() % (live - frame_floor))));
+            return;
+        }
+        values = 1;
+        kind = 0;
+    }
+    for (int i = 0; i < values; i++) {
+        gen_expr(p, depth - 1);
+        live++;
+    }
+    live -= values;
+    switch (kind) {
+        case 0:
+            emit(p, DUP);
+            emit(p, op);
+            break;
+        case 1:
+            emit(p, SWAP);
+            emit(p, op);
+            break;
+        case 2:
+            emit(p, OVER);
+            emit(p, op);
+            emit(p, op);
+            break;
+        case 3:
+            emit(p, ROT);
+            emit(p, op);
+            emit(p, op);
+            break;
+        case 4:
+            emit(p, DROP);
+            break;
+        default:
+            emit(p, STORE_LOCAL);
+            emit(p, (uint8_t) live);
+            break;
+    }
+}
+
+/*
+ * Spawn a task for a pure procedure whose arguments are already on the stack,
+ * do some work of our own, then join and fold everything into one value:
+ *
+ *   SPAWN proc k; <expr>; SWAP; JOIN; <op>; <op> k times
+ *
+ * The handle depends on which worker ran the spawner, so the expression in
+ * between mustn't read it with LOAD_LOCAL.
+ */
+void gen_spawn(struct program *p, int depth, int callee) {
+    int saved_floor = frame_floor;
+    emit(p, SPAWN);
+    call_sites = realloc(call_sites, (num_call_sites + 1) * sizeof(struct call_site));
+    if (call_sites == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    call_sites[num_call_sites].at = p->len;
+    call_sites[num_call_sites].proc = callee;
+    num_call_sites++;
+    emit_u32(p, 0);
+    emit(p, proc_args[callee]);
+    live += proc_args[callee] + 1;
+    frame_floor = live;
+    gen_expr(p, depth - 1);
+    frame_floor = saved_floor;
+    live -= proc_args[callee] + 1;
+    emit(p, SWAP);
+    emit(p, JOIN);
+    for (int i = 0; i <= proc_args[callee]; i++) {
+        emit(p, ADD + next_random() % (XOR - ADD + 1));
+    }
+}
+
+void gen_expr(struct program *p, int depth) {
+    if (depth == 0 || next_random() % 3 == 0) {
+        emit(p, PUSH_IMM);
+        emit(p, random_imm());
+        return;
+    }
+    int pure = current_proc >= 0 && proc_pure[current_proc];
+    if (!pure && next_random() % 8 == 0) {
+        gen_address(p, depth - 1);
+        emit(p, LOAD);
+        return;
+    }
+    if (current_proc + 1 < num_procs && next_random() % 6 == 0) {
+        int callee = current_proc + 1 + next_random() % (num_procs - current_proc - 1);
+        if (pure && !proc_pure[callee]) {
+            emit(p, PUSH_IMM);
+            emit(p, random_imm());
+            return;
+        }
+        for (int i = 0; i < proc_args[callee]; i++) {
+            gen_expr(p, depth - 1);
+            live++;
+        }
+        live -= proc_args[callee];
+        if (proc_pure[callee] && next_random() % 2 == 0) {
+            gen_spawn(p, depth, callee);
+            return;
+        }
+        emit(p, CALL);
+        call_sites = realloc(call_sites, (num_call_sites + 1) * sizeof(struct call_site));
+        if (call_sites == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        call_sites[num_call_sites].at = p->len;
+        call_sites[num_call_sites].proc = callee;
+        num_call_sites++;
+        emit_u32(p, 0);
+        return;
+    }
+    if (next_random() % 8 == 0) {
+        gen_shuffle(p, depth);
+        return;
+    }
+    uint8_t op = ADD + next_random() % (RSHIFT - ADD + 1);
+    if (next_random() % 6 == 0) {
+        op = FADD + next_random() % (FTOI - FADD + 1);
+    }
+    gen_expr(p, depth - 1);
+    if (op == NOT || op == ITOF || op == FTOI) {
+        emit(p, op);
+        return;
+    }
+
+    /*
+     * Sometimes divide or shift by a constant the way strength reduction
+     * would, with the operands the verifier allows.
+     */
+    if ((op == DIV || op == LSHIFT || op == RSHIFT) && next_random() % 4 == 0) {
+        emit(p, op == DIV ? DIV_CONST : op == LSHIFT ? LSHIFT_CONST : RSHIFT_CONST);
+        emit(p, op == DIV ? 2 + next_random() % 254 : next_random() % 64);
+        return;
+    }
+    live++;
+    gen_expr(p, depth - 1);
+    live--;
+    if (op == LSHIFT || op == RSHIFT) {
+        emit(p, PUSH_IMM);
+        emit(p, 63);
+        emit(p, AND);
+    }
+    emit(p, op);
+}
+
+void gen_block(struct program *p, int nesting, int statements);
+
+/*
+ * Emit a backward or forward jump, using the short form when the target fits
+ * and a coin flip says so.
+ */
+void gen_jump(struct program *p, size_t target, int allow_short) {
+    if (allow_short && target + 1 <= 0xFF && next_random() % 2 == 0) {
+        emit(p, JIF);
+        emit(p, (uint8_t) (target + 1));
+    } else {
+        emit(p, JIF_LONG);
+        emit_u32(p, (uint32_t) target);
+    }
+}
+
+/*
+ * Counted loop: PUSH_IMM n; head: <body>; PUSH_IMM 1; SUB; JIF head; POP_RES
+ *
+ * The tail is sometimes a LOOP head 1 instead, which does the same thing.
+ */
+void gen_loop(struct program *p, int nesting) {
+    emit(p, PUSH_IMM);
+    emit(p, 1 + next_random() % MAX_TRIPS);
+    size_t head = p->len;
+    live++;
+    gen_block(p, nesting + 1, 1 + next_random() % 3);
+    live--;
+    if (head + 1 <= 0xFF && next_random() % 3 == 0) {
+        emit(p, LOOP);
+        emit(p, (uint8_t) (head + 1));
+        emit(p, 1);
+    } else {
+        emit(p, PUSH_IMM);
+        emit(p, 1);
+        emit(p, SUB);
+        gen_jump(p, head, 1);
+    }
+    emit(p, POP_RES);
+}
+
+/*
+ * Data-dependent forward branch: <expr>; JIF skip; <body>; skip: POP_RES
+ *
+ * We don't know where skip is until we've generated the body, so for a short
+ * JIF we generate optimistically and, if the target turns out to be out of
+ * reach, rewind and generate the same body again with a JIF_LONG. The long
+ * form is sometimes a JIZ instead, or an if/else:
+ *
+ *   <expr>; JIZ else; <body>; JMP skip; else: <body>; skip: POP_RES
+ */
+void gen_branch(struct program *p, int nesting) {
+    gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+    live++;
+    size_t start = p->len;
+    uint64_t saved_rng = rng;
+    size_t saved_call_sites = num_call_sites;
+    if (next_random() % 2 == 0 && start + 2 < 0xFF) {
+        emit(p, JIF);
+        emit(p, 0);
+        gen_block(p, nesting + 1, 1 + next_random() % 2);
+        if (p->len + 1 <= 0xFF) {
+            p->code[start + 1] = (uint8_t) (p->len + 1);
+            emit(p, POP_RES);
+            live--;
+            return;
+        }
+        p->len = start;
+        rng = saved_rng;
+        num_call_sites = saved_call_sites;
+        next_random();
+    }
+    uint32_t form = next_random() % 3;
+    emit(p, form == 0 ? JIF_LONG : JIZ);
+    emit_u32(p, 0);
+    gen_block(p, nesting + 1, 1 + next_random() % 2);
+    if (form == 2) {
+        size_t jump = p->len;
+        emit(p, JMP);
+        emit_u32(p, 0);
+        patch_u32(p, start + 1, (uint32_t) p->len);
+        gen_block(p, nesting + 1, 1 + next_random() % 2);
+        start = jump;
+    }
+    patch_u32(p, start + 1, (uint32_t) p->len);
+    emit(p, POP_RES);
+    live--;
+}
+
+/*
+ * A sequence of statements that leaves the stack as it found it.
+ */
+void gen_block(struct program *p, int nesting, int statements) {
+    for (int i = 0; i < statements; i++) {
+        uint64_t kind = next_random() % 10;
+        if (kind < 2 && nesting < MAX_NESTING) {
+            gen_loop(p, nesting);
+        } else if (kind < 4 && nesting < MAX_NESTING) {
+            gen_branch(p, nesting);
+        } else if (kind < 6 && !(current_proc >= 0 && proc_pure[current_proc])) {
+            gen_address(p, 1 + next_random() % MAX_EXPR_DEPTH);
+            live++;
+            gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+            live--;
+            emit(p, STORE);
+        } else {
+            gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+            emit(p, POP_RES);
+        }
+    }
+}
+
+/*
+ * A whole program. Leave a few values on the stack at the end so that we
+ * compare more than just the result register.
+ */
+void gen_program(struct program *p) {
+    p->len = 0;
+    num_call_sites = 0;
+    num_procs = next_random() % (MAX_PROCS + 1);
+    for (int i = 0; i < num_procs; i++) {
+        proc_args[i] = next_random() % (MAX_ARGS + 1);
+        proc_pure[i] = next_random() % 2;
+    }
+    current_proc = -1;
+    live = 0;
+    frame_floor = 0;
+    gen_block(p, 0, 1 + next_random() % MAX_STATEMENTS);
+    int leftovers = next_random() % (MAX_LEFTOVERS + 1);
+    for (int i = 0; i < leftovers; i++) {
+        gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+        live++;
+    }
+    emit(p, DONE);
+
+    /*
+     * Procedures go after the main program. Each one folds its arguments into
+     * a single value with some statements mixed in, and returns it.
+     */
+    size_t proc_start[MAX_PROCS];
+    for (int i = 0; i < num_procs; i++) {
+        current_proc = i;
+        proc_start[i] = p->len;
+        live = 0;
+        frame_floor = -proc_args[i];
+        if (proc_args[i] == 0) {
+            gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+            live++;
+        }
+        for (int j = 1; j < proc_args[i]; j++) {
+            emit(p, ADD + next_random() % (XOR - ADD + 1));
+            live--;
+        }
+        gen_block(p, 1, next_random() % 3);
+        if (next_random() % 2 == 0) {
+            gen_expr(p, 1 + next_random() % MAX_EXPR_DEPTH);
+            emit(p, ADD + next_random() % (XOR - ADD + 1));
+        }
+        emit(p, RET);
+    }
+    for (size_t i = 0; i < num_call_sites; i++) {
+        uint32_t target = (uint32_t) proc_start[call_sites[i].proc];
+        for (int j = 0; j < 4; j++) {
+            p->code[call_sites[i].at + j] = (target >> (8 * j)) & 0xFF;
+        }
+    }
+}
+
+/*
+ * Run a program on one engine in a child process and collect what it left
+ * behind.
+ */
+void run_isolated(struct engine *e, uint8_t *code, struct outcome *o) {
+    memset(o, 0, sizeof(*o));
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fflush(out);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        struct itimerval timer = {{0, 0}, {timeout_ms / 1000, (timeout_ms % 1000) * 1000}};
+        setitimer(ITIMER_REAL, &timer, NULL);
+        if (!spawn_pool_start(e == engines ? 1 : POOL_WORKERS)) {
+            _exit(EXIT_FAILURE);
+        }
+        reset_vm();
+        vm.result = 0;
+        o->status = run_engine(e, code);
+        o->result = vm.result;
+        o->depth = (uint32_t) (vm.stack_top - vm.stack);
+        if (o->depth <= STACK_MAX) {
+            memcpy(o->stack, vm.stack, o->depth * sizeof(uint64_t));
+        }
+        ssize_t written = write(fds[1], o, sizeof(*o));
+        _exit(written == sizeof(*o) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    while (got < sizeof(*o)) {
+        ssize_t n = read(fds[0], (char *) o + got, sizeof(*o) - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fds[0]);
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFSIGNALED(wstatus)) {
+        o->kind = WTERMSIG(wstatus) == SIGALRM ? OUTCOME_TIMED_OUT : OUTCOME_CRASHED;
+        o->signal = WTERMSIG(wstatus);
+    } else if (got != sizeof(*o)) {
+        o->kind = OUTCOME_EXITED;
+        o->signal = WEXITSTATUS(wstatus);
+    } else {
+        o->kind = OUTCOME_FINISHED;
+    }
+}
+
+int same_outcome(struct outcome *a, struct outcome *b) {
+    if (a->kind != b->kind) {
+        return 0;
+    }
+    if (a->kind != OUTCOME_FINISHED) {
+        return a->signal == b->signal;
+    }
+
+    /*
+     * Engines that cache the stack in registers lose it when a memory access
+     * faults, so all we can compare is the error. A bad handle is still on
+     * the stack when JOIN fails, and a real one says which worker spawned it.
+     */
+    if (a->status == ERR_MEM_OUT_OF_BOUNDS || b->status == ERR_MEM_OUT_OF_BOUNDS ||
+        a->status == ERR_BAD_HANDLE || b->status == ERR_BAD_HANDLE) {
+        return a->status == b->status && a->result == b->result;
+    }
+    return a->status == b->status &&
+           a->result == b->result &&
+           a->depth == b->depth &&
+           (a->depth > STACK_MAX || memcmp(a->stack, b->stack, a->depth * sizeof(uint64_t)) == 0);
+}
+
+/*
+ * Run the program everywhere. Returns the index of the first engine that
+ * disagrees with the reference engine, or -1 if they all agree. The outcomes
+ * array gets one entry per engine.
+ */
+int find_mismatch(uint8_t *code, struct outcome *outcomes) {
+    int first = -1;
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        run_isolated(&engines[i], code, &outcomes[i]);
+        if (i > 0 && first < 0 && !same_outcome(&outcomes[0], &outcomes[i])) {
+            first = (int) i;
+        }
+    }
+    return first;
+}
+
+/*
+ * Decode bytecode into instructions. Fails if a jump doesn't land on an
+ * instruction. A LOOP's operand is its step and a SPAWN's is its argument
+ * count, since the target is kept separately.
+ */
+int decode(uint8_t *code, size_t len, struct insn *insns, size_t *n) {
+    size_t *index_of = malloc(len * sizeof(size_t));
+    for (size_t pc = 0; pc < len; pc++) {
+        index_of[pc] = SIZE_MAX;
+    }
+    *n = 0;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        index_of[pc] = *n;
+        insns[*n].op = code[pc];
+        insns[*n].target = 0;
+        insns[*n].operand = code[pc] == SPAWN ? code[pc + 5] :
+                            operand_bytes(code[pc]) == 4 ? read_u32(code + pc + 1) :
+                            operand_bytes(code[pc]) == 2 ? code[pc + 2] :
+                            operand_bytes(code[pc]) == 1 ? code[pc + 1] : 0;
+        (*n)++;
+    }
+    int ok = 1;
+    for (size_t i = 0, pc = 0; i < *n; pc += 1 + operand_bytes(insns[i].op), i++) {
+        if (operand_bytes(insns[i].op) != 4 && insns[i].op != JIF && insns[i].op != LOOP &&
+            insns[i].op != SPAWN) {
+            continue;
+        }
+        size_t target = jump_target(code, pc);
+        if (target >= len || index_of[target] == SIZE_MAX) {
+            ok = 0;
+            break;
+        }
+        insns[i].target = index_of[target];
+    }
+    free(index_of);
+    return ok;
+}
+
+/*
+ * Lay instructions back out as bytecode. Fails if a short JIF can't reach its
+ * target any more.
+ */
+int encode(struct insn *insns, size_t n, struct program *p) {
+    size_t *offset = malloc((n + 1) * sizeof(size_t));
+    size_t pc = 0;
+    for (size_t i = 0; i < n; i++) {
+        offset[i] = pc;
+        pc += 1 + operand_bytes(insns[i].op);
+    }
+    offset[n] = pc;
+    p->len = 0;
+    int ok = 1;
+    for (size_t i = 0; i < n && ok; i++) {
+        emit(p, insns[i].op);
+        switch (insns[i].op) {
+            case PUSH_IMM:
+            case DIV_CONST:
+            case LSHIFT_CONST:
+            case RSHIFT_CONST:
+            case LOAD_LOCAL:
+            case STORE_LOCAL:
+                emit(p, (uint8_t) insns[i].operand);
+                break;
+            case JIF:
+            case LOOP:
+                if (offset[insns[i].target] + 1 > 0xFF) {
+                    ok = 0;
+                }
+                emit(p, (uint8_t) (offset[insns[i].target] + 1));
+                if (insns[i].op == LOOP) {
+                    emit(p, (uint8_t) insns[i].operand);
+                }
+                break;
+            case JIF_LONG:
+            case CALL:
+            case JMP:
+            case JIZ:
+                emit_u32(p, (uint32_t) offset[insns[i].target]);
+                break;
+            case SPAWN:
+                emit_u32(p, (uint32_t) offset[insns[i].target]);
+                emit(p, (uint8_t) insns[i].operand);
+                break;
+        }
+    }
+    free(offset);
+    return ok;
+}
+
+/*
+ * Is this candidate still a valid program that makes the same engine disagree
+ * with the reference?
+ */
+int still_fails(struct insn *insns, size_t n, int engine, struct program *scratch) {
+    struct verify_info info;
+    struct outcome outcomes[NUM_ENGINES];
+    if (!encode(insns, n, scratch) ||
+        verify_bytecode(scratch->code, scratch->len, &info) != VERIFY_OK) {
+        return 0;
+    }
+    run_isolated(&engines[0], scratch->code, &outcomes[0]);
+    if (outcomes[0].kind != OUTCOME_FINISHED) {
+        return 0;
+    }
+    run_isolated(&engines[engine], scratch->code, &outcomes[engine]);
+    return !same_outcome(&outcomes[0], &outcomes[engine]);
+}
+
+/*
+ * Delete instructions [from, from + count), pointing jumps into the deleted
+ * range at whatever comes after it.
+ */
+size_t delete_range(struct insn *src, size_t n, size_t from, size_t count, struct insn *dst) {
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i >= from && i < from + count) {
+            continue;
+        }
+        dst[m] = src[i];
+        if (dst[m].target >= from + count) {
+            dst[m].target -= count;
+        } else if (dst[m].target >= from) {
+            dst[m].target = from;
+        }
+        m++;
+    }
+    return m;
+}
+
+/*
+ * Shrink a failing program in place. We try deleting ever smaller chunks of
+ * instructions, then simplifying immediates, and go around again until nothing
+ * helps.
+ */
+void shrink(struct program *p, int engine) {
+    size_t n;
+    struct insn *insns = malloc(p->len * sizeof(struct insn));
+    struct insn *candidate = malloc(p->len * sizeof(struct insn));
+    struct program scratch = {NULL, 0, 0};
+    if (!decode(p->code, p->len, insns, &n)) {
+        fprintf(out, "  (can't shrink: a jump doesn't land on an instruction)\n");
+        free(insns);
+        free(candidate);
+        return;
+    }
+
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (size_t chunk = n / 2 ? n / 2 : 1; chunk >= 1; chunk /= 2) {
+            for (size_t from = 0; from + chunk <= n;) {
+                size_t m = delete_range(insns, n, from, chunk, candidate);
+                if (still_fails(candidate, m, engine, &scratch)) {
+                    memcpy(insns, candidate, m * sizeof(struct insn));
+                    n = m;
+                    progress = 1;
+                } else {
+                    from++;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (insns[i].op != PUSH_IMM) {
+                continue;
+            }
+            uint32_t simpler[] = {0, 1, insns[i].operand / 2};
+            for (size_t k = 0; k < 3; k++) {
+                if (simpler[k] >= insns[i].operand) {
+                    continue;
+                }
+                memcpy(candidate, insns, n * sizeof(struct insn));
+                candidate[i].operand = simpler[k];
+                if (still_fails(candidate, n, engine, &scratch)) {
+                    insns[i].operand = simpler[k];
+                    progress = 1;
+                    break;
+                }
+            }
+        }
+    }
+    encode(insns, n, p);
+    free(insns);
+    free(candidate);
+    free(scratch.code);
+}
+
+void print_outcome(struct engine *e, struct outcome *o) {
+    fprintf(out, "  %-12s", e->name);
+    switch (o->kind) {
+        case OUTCOME_EXITED:
+            fprintf(out, "exited with status %d\n", o->signal);
+            return;
+        case OUTCOME_CRASHED:
+            fprintf(out, "crashed (signal %d)\n", o->signal);
+            return;
+        case OUTCOME_TIMED_OUT:
+            fprintf(out, "timed out\n");
+            return;
+        case OUTCOME_FINISHED:
+            break;
+    }
+    fprintf(out, "status %d, result %" PRIu64 ", stack [", o->status, o->result);
+    for (uint32_t i = 0; i < o->depth && i < STACK_MAX; i++) {
+        if (i == 16) {
+            fprintf(out, " ... %" PRIu32 " values", o->depth);
+            break;
+        }
+        fprintf(out, i ? " %" PRIu64 : "%" PRIu64, o->stack[i]);
+    }
+    fprintf(out, "]\n");
+}
+
+/*
+ * Rewrite a program's loops and make sure that doesn't change its outcome on
+ * the reference engine. There's nothing to shrink against here, so we just
+ * print both versions. Returns 1 if the outcomes differ.
+ */
+int check_loops(const char *name, struct program *p, struct outcome *expected, int *failures) {
+    struct loop_report report;
+    size_t len;
+    uint8_t *optimized = optimize_loops(p->code, p->len, &len, &report);
+    struct outcome o;
+    int differs = 0;
+    if (report.num_loops > 0) {
+        run_isolated(&engines[0], optimized, &o);
+        differs = !same_outcome(expected, &o);
+    }
+    if (differs) {
+        fprintf(out, "MISMATCH in %s: rewriting its loops changes the outcome\n", name);
+        print_outcome(&engines[0], expected);
+        print_outcome(&engines[0], &o);
+        print_loop_report(out, &report, p->len, len);
+        disassemble(out, p->code, p->len);
+        fprintf(out, "Rewritten:\n");
+        disassemble(out, optimized, len);
+        (*failures)++;
+    }
+    free(report.loops);
+    free(optimized);
+    return differs;
+}
+
+/*
+ * Strength-reduce a program and make sure it still verifies and does the same
+ * thing on the reference engine. Returns 1 if anything's off.
+ */
+int check_strength(const char *name, struct program *p, struct outcome *expected, int *failures) {
+    struct strength_report report;
+    size_t len;
+    uint8_t *reduced = reduce_strength(p->code, p->len, &len, &report);
+    if (reduced == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (len == p->len) {
+        free(reduced);
+        return 0;
+    }
+    struct verify_info info;
+    struct outcome o;
+    verify_status v = verify_bytecode(reduced, len, &info);
+    run_isolated(&engines[0], reduced, &o);
+    int differs = v != VERIFY_OK || !same_outcome(expected, &o);
+    if (differs) {
+        fprintf(out, "MISMATCH in %s: strength reduction changes the outcome\n", name);
+        if (v != VERIFY_OK) {
+            fprintf(out, "  %s at byte %zu\n", verify_messages[v], info.error_pc);
+        }
+        print_outcome(&engines[0], expected);
+        print_outcome(&engines[0], &o);
+        print_strength_report(out, &report, p->len, len);
+        disassemble(out, p->code, p->len);
+        fprintf(out, "Rewritten:\n");
+        disassemble(out, reduced, len);
+        (*failures)++;
+    }
+    free(reduced);
+    return differs;
+}
+
+/*
+ * Profile a program, lay it out again for that profile and make sure the new
+ * layout still verifies and does the same thing on the reference engine. Only
+ * programs that finished get profiled, since the profiling run isn't isolated.
+ * Returns 1 if anything's off.
+ */
+int check_layout(const char *name, struct program *p, struct outcome *expected, int *failures) {
+    if (expected->kind != OUTCOME_FINISHED) {
+        return 0;
+    }
+    struct branch_profile profile;
+    if (!profile_alloc(&profile, p->len)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    profile_run(p->code, &profile);
+    struct layout_report report;
+    size_t len;
+    uint8_t *laid_out = layout_blocks(p->code, p->len, &profile, &len, &report);
+    struct verify_info info;
+    struct outcome o;
+    verify_status v = verify_bytecode(laid_out, len, &info);
+    run_isolated(&engines[0], laid_out, &o);
+    int differs = v != VERIFY_OK || !same_outcome(expected, &o);
+    if (differs) {
+        fprintf(out, "MISMATCH in %s: laying out its blocks changes the outcome\n", name);
+        if (v != VERIFY_OK) {
+            fprintf(out, "  %s at byte %zu\n", verify_messages[v], info.error_pc);
+        }
+        print_outcome(&engines[0], expected);
+        print_outcome(&engines[0], &o);
+        print_layout_report(out, &report, p->len, len);
+        disassemble(out, p->code, p->len);
+        fprintf(out, "Laid out:\n");
+        disassemble(out, laid_out, len);
+        (*failures)++;
+    }
+    profile_free(&profile);
+    free(laid_out);
+    return differs;
+}
+
+/*
+ * Programs the verifier has to turn down, since they let a handle out of the
+ * procedure that spawned it. Whether a JOIN of it works would depend on which
+ * worker ran the procedure.
+ */
+struct rejected {
+    const char *name;
+    uint8_t code[32];
+    size_t len;
+    verify_status status;
+};
+
+struct rejected must_reject[] = {
+        {"task returns a handle", {
+                SPAWN, 10, 0, 0, 0, 0, JOIN, JOIN, POP_RES, DONE,
+                SPAWN, 17, 0, 0, 0, 0, RET,
+                PUSH_IMM, 6, RET
+        }, 20, VERIFY_HANDLE_ESCAPES},
+        {"handle passed to a task", {
+                SPAWN, 16, 0, 0, 0, 0, SPAWN, 19, 0, 0, 0, 1, JOIN, POP_RES, DROP, DONE,
+                PUSH_IMM, 1, RET,
+                LOAD_LOCAL, (uint8_t) -1, JOIN, RET
+        }, 23, VERIFY_HANDLE_ESCAPES},
+        {"handle left under a result", {
+                CALL, 6, 0, 0, 0, DONE,
+                SPAWN, 13, 0, 0, 0, 0, RET,
+                PUSH_IMM, 1, RET
+        }, 16, VERIFY_HANDLE_ESCAPES}
+};
+
+void check_rejected(int *failures) {
+    for (size_t i = 0; i < sizeof(must_reject) / sizeof(must_reject[0]); i++) {
+        struct rejected *r = &must_reject[i];
+        struct verify_info info;
+        verify_status v = verify_bytecode(r->code, r->len, &info);
+        if (v != r->status) {
+            fprintf(out, "VERIFIER %s: got \"%s\", expected \"%s\"\n", r->name, verify_messages[v],
+                    verify_messages[r->status]);
+            (*failures)++;
+        }
+    }
+}
+
+/*
+ * Check one program. Returns 1 if the engines disagreed, or if rewriting its
+ * loops, strength-reducing it or laying out its blocks made a difference.
+ */
+int check(const char *name, struct program *p, const char *out_dir, int *failures) {
+
+    /*
+     * Engines are free to do anything at all with a program that pops an
+     * empty stack or jumps into the middle of an instruction, so comparing
+     * them there would only turn up noise.
+     */
+    struct verify_info info;
+    verify_status v = verify_bytecode(p->code, p->len, &info);
+    if (v != VERIFY_OK) {
+        fprintf(out, "INVALID %s: %s at byte %zu\n", name, verify_messages[v], info.error_pc);
+        (*failures)++;
+        return 1;
+    }
+
+    struct outcome outcomes[NUM_ENGINES];
+    int engine = find_mismatch(p->code, outcomes);
+    if (engine < 0) {
+        int differs = check_loops(name, p, &outcomes[0], failures);
+        differs = check_strength(name, p, &outcomes[0], failures) || differs;
+        return check_layout(name, p, &outcomes[0], failures) || differs;
+    }
+    fprintf(out, "MISMATCH in %s: %s disagrees with %s\n", name, engines[engine].name, engines[0].name);
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        print_outcome(&engines[i], &outcomes[i]);
+    }
+    shrink(p, engine);
+    find_mismatch(p->code, outcomes);
+    fprintf(out, "Shrunk to %zu bytes:\n", p->len);
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        print_outcome(&engines[i], &outcomes[i]);
+    }
+    disassemble(out, p->code, p->len);
+
+    char path[4096];
+    mkdir(out_dir, 0755);
+    snprintf(path, sizeof(path), "%s/mismatch_%d.stack", out_dir, *failures);
+    FILE *f = fopen(path, "w");
+    if (f != NULL) {
+        disassemble(f, p->code, p->len);
+        fclose(f);
+        fprintf(out, "Reproducer written to %s\n", path);
+    }
+    (*failures)++;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 1000;
+    uint64_t seed = 1;
+    const char *out_dir = "difftest_output";
+    int c;
+    while ((c = getopt(argc, argv, "n:r:t:o:")) != -1) {
+        switch (c) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                timeout_ms = atoi(optarg);
+                break;
+            case 'o':
+                out_dir = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE_STR);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /*
+     * Keep our own copy of stdout and send the engines' chatter to /dev/null.
+     */
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    FILE *dev_null = freopen("/dev/null", "w", stdout);
+    if (out == NULL || dev_null == NULL) {
+        fprintf(stderr, "Can't redirect output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int failures = 0;
+    int programs = 0;
+    struct program p = {NULL, 0, 0};
+    check_rejected(&failures);
+    for (int i = optind; i < argc; i++) {
+        struct container_info info;
+        container_status status = container_map(argv[i], &info);
+        if (status != CONTAINER_OK || (info.is_container && info.isa != CONTAINER_ISA_STACK)) {
+            fprintf(stderr, "Can't load %s: %s\n", argv[i],
+                    status != CONTAINER_OK ? container_messages[status] : "not stack bytecode");
+            exit(EXIT_FAILURE);
+        }
+        p.len = 0;
+        for (size_t j = 0; j < info.code_len; j++) {
+            emit(&p, info.code[j]);
+        }
+        container_unmap(&info);
+        check(argv[i], &p, out_dir, &failures);
+        programs++;
+    }
+
+    rng = seed ? seed : 0x9E3779B97F4A7C15ull;
+    char name[64];
+    for (int i = 0; i < count; i++) {
+        gen_program(&p);
+        snprintf(name, sizeof(name), "random program %d (seed %" PRIu64 ")", i, seed);
+        check(name, &p, out_dir, &failures);
+        programs++;
+    }
+    free(p.code);
+
+    fprintf(out, "%d programs, %d engines, %d mismatches\n", programs, (int) NUM_ENGINES, failures);
+    if (failures == 0) {
+        fprintf(out, "All tests passed\n");
+    }
+    fflush(out);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,72 @@
+/*
+ * Tests for verse.hpp. Every program has to come out of verse::run the way it
+ * comes out of the inline interpreter in vm.h: same status, same result and,
+ * if it finished, the same stack.
+ *
+ * verse.hpp only assembles while the C++ compiles, so the programs can't come
+ * from the command line. The Makefile pastes the source of every program in
+ * programs/stack, plus a few from stackgen, into corpus.inc as string
+ * literals, and each one becomes a run<> of its own here.
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "verse.hpp"
+
+extern "C" {
+extern const std::size_t reference_memory_size;
+result reference_run(const std::uint8_t *code, std::uint64_t *result, std::uint64_t *stack, std::uint32_t *depth);
+}
+
+using namespace verse;
+
+int num_programs;
+int failures;
+
+template <auto Code>
+void check(const char *name) {
+    static constexpr auto code = Code;
+    std::uint64_t expected_result;
+    std::uint64_t expected_stack[STACK_MAX];
+    std::uint32_t expected_depth;
+    result expected = reference_run(code.data(), &expected_result, expected_stack, &expected_depth);
+
+    std::vector<std::uint8_t> memory(reference_memory_size);
+    machine m;
+    m.memory = memory.data();
+    m.memory_size = memory.size();
+    result r = run<Code>(m);
+    std::uint32_t depth = m.stack_top - m.stack;
+
+    num_programs++;
+    const char *wrong = nullptr;
+    if (r != expected) {
+        wrong = "status";
+    } else if (m.result != expected_result) {
+        wrong = "result";
+    } else if (r == SUCCESS && (depth != expected_depth ||
+                                std::memcmp(m.stack, expected_stack, depth * sizeof(std::uint64_t)) != 0)) {
+        wrong = "stack";
+    }
+    if (wrong != nullptr) {
+        std::printf("FAIL %s: %s differs (inline: %s, result %" PRIu64 ", %u deep; verse.hpp: %s, result %" PRIu64
+                    ", %u deep)\n",
+                    name, wrong, result_messages[expected], expected_result, expected_depth, result_messages[r],
+                    m.result, depth);
+        failures++;
+    }
+}
+
+#define VERSE_PROGRAM(name, text) check<assemble<text>()>(name);
+
+int main() {
+#include "corpus.inc"
+    std::printf("%d programs through verse.hpp, %d failures\n", num_programs, failures);
+    if (failures > 0) {
+        return EXIT_FAILURE;
+    }
+    std::printf("All tests passed\n");
+}
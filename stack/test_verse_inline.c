@@ -0,0 +1,25 @@
+/*
+ * The inline interpreter behind a plain C interface, for test-verse. That's
+ * C++, and vm.h isn't, so this gets compiled on its own and linked in.
+ */
+
+#include "vm.h"
+
+const size_t reference_memory_size = MEM_SIZE;
+
+/*
+ * Run code from a clean VM and hand back what it left: the status, the result
+ * register and the stack, bottom first.
+ */
+result reference_run(const uint8_t *code, uint64_t *result_out, uint64_t *stack, uint32_t *depth) {
+    vm_quiet = 1;
+    reset_vm();
+    vm.result = 0;
+    result r = run_engine(&engines[0], (uint8_t *) code);
+    *result_out = vm.result;
+    *depth = vm.stack_top - vm.stack;
+    if (r == SUCCESS) {
+        memcpy(stack, vm.stack, *depth * sizeof(uint64_t));
+    }
+    return r;
+}
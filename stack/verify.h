@@ -0,0 +1,650 @@
+#ifndef VERSE_STACK_VERIFY_H_
+#define VERSE_STACK_VERIFY_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+/*
+ * Static checks on a piece of bytecode. A program that passes can't pop an
+ * empty stack, overflow the stack or the return stack, jump into the middle of
+ * an instruction, run off the end of the code, hit an opcode we don't know or
+ * give DIV_CONST or a constant shift an operand it can't take, and its locals
+ * stay within the live part of the stack.
+ * It can still divide by zero, access memory out of bounds or loop forever.
+ *
+ * To give those guarantees with calls in the picture, we check every
+ * procedure (the code at a CALL target) on its own and summarize how it uses
+ * the stack, then apply the summary at each call site. That only works if the
+ * call graph has no cycles, so recursion is rejected.
+ *
+ * A SPAWN is checked as if it were a CALL of its procedure on top of the k
+ * values it copies, since that's how a task runs when nobody steals it and
+ * how the embeddable interpreter runs every task. The procedure can't reach
+ * below those k values and has to leave something to join.
+ *
+ * A handle is only good in the code that spawned it, so we track which slots
+ * might hold one and make sure none can get out of its procedure: there
+ * mustn't be any among the values a CALL or SPAWN hands over, or anywhere on
+ * the stack at a RET. A JOIN of something that isn't a handle is left to fail
+ * at run time, with ERR_BAD_HANDLE on every engine.
+ */
+
+typedef enum {
+    VERIFY_OK,
+    VERIFY_BAD_OPCODE,
+    VERIFY_TRUNCATED,
+    VERIFY_BAD_JUMP,
+    VERIFY_UNDERFLOW,
+    VERIFY_OVERFLOW,
+    VERIFY_DEPTH_MISMATCH,
+    VERIFY_FALLS_OFF_END,
+    VERIFY_BAD_RETURN,
+    VERIFY_RECURSION,
+    VERIFY_CALLS_TOO_DEEP,
+    VERIFY_OUT_OF_MEMORY,
+    VERIFY_BAD_OPERAND,
+    VERIFY_BAD_LOCAL,
+    VERIFY_BAD_SPAWN,
+    VERIFY_HANDLE_ESCAPES
+} verify_status;
+
+const char *verify_messages[] = {
+        "OK",
+        "unknown opcode",
+        "instruction runs past the end of the code",
+        "jump into the middle of an instruction or out of the code",
+        "pops an empty stack",
+        "overflows the stack",
+        "stack depth differs between paths into an instruction",
+        "runs off the end of the code without a DONE",
+        "RET outside of a procedure",
+        "procedure calls itself, directly or indirectly",
+        "calls nest deeper than the return stack",
+        "out of memory",
+        "DIV_CONST by less than 2, or a constant shift by 64 or more",
+        "local outside the live part of the stack",
+        "SPAWN of a procedure that needs more than it's given or leaves nothing",
+        "task handle passed to a procedure or left on the stack at a RET"
+};
+
+struct verify_info {
+
+    /*
+     * Deepest the stack can get, counting from an empty stack.
+     */
+    uint32_t max_depth;
+
+    /*
+     * Deepest the return stack can get.
+     */
+    uint32_t max_calls;
+
+    /*
+     * Where things went wrong, if they did.
+     */
+    size_t error_pc;
+};
+
+/*
+ * How many values an instruction pops and pushes. JIFs only peek at the top of
+ * the stack, so they need one value but don't change the depth, and neither
+ * does LOOP, which updates it in place. CALL, SPAWN and RET depend on the
+ * procedure, and how deep LOAD_LOCAL and STORE_LOCAL reach depends on their
+ * operand, so the verifier deals with those itself.
+ */
+void stack_effect(uint8_t op, uint32_t *needs, int32_t *delta) {
+    switch (op) {
+        case PUSH_IMM:
+        case LOAD_LOCAL:
+            *needs = 0;
+            *delta = 1;
+            break;
+        case DUP:
+            *needs = 1;
+            *delta = 1;
+            break;
+        case OVER:
+            *needs = 2;
+            *delta = 1;
+            break;
+        case SWAP:
+            *needs = 2;
+            *delta = 0;
+            break;
+        case ROT:
+            *needs = 3;
+            *delta = 0;
+            break;
+        case NOT:
+        case JIF:
+        case JIF_LONG:
+        case JIZ:
+        case LOOP:
+        case LOAD:
+        case ITOF:
+        case FTOI:
+        case DIV_CONST:
+        case LSHIFT_CONST:
+        case RSHIFT_CONST:
+        case JOIN:
+            *needs = 1;
+            *delta = 0;
+            break;
+        case POP_RES:
+        case DROP:
+        case STORE_LOCAL:
+            *needs = 1;
+            *delta = -1;
+            break;
+        case STORE:
+            *needs = 2;
+            *delta = -2;
+            break;
+        case DONE:
+        case CALL:
+        case SPAWN:
+        case RET:
+        case JMP:
+            *needs = 0;
+            *delta = 0;
+            break;
+        default:
+            *needs = 2;
+            *delta = -1;
+            break;
+    }
+}
+
+/*
+ * The slots that might hold a task handle at some point in a procedure, one
+ * bit each, from STACK_MAX below the frame base to STACK_MAX above it.
+ */
+#define HANDLE_WORDS (2 * STACK_MAX / 64)
+
+struct handle_set {
+    uint64_t bits[HANDLE_WORDS];
+};
+
+int handle_at(struct handle_set *h, int32_t slot) {
+    uint32_t bit = (uint32_t) (slot + STACK_MAX);
+    return bit < 2 * STACK_MAX && (h->bits[bit / 64] >> (bit % 64) & 1);
+}
+
+void set_handle(struct handle_set *h, int32_t slot, int is_handle) {
+    uint32_t bit = (uint32_t) (slot + STACK_MAX);
+    if (bit >= 2 * STACK_MAX) {
+        return;
+    }
+    if (is_handle) {
+        h->bits[bit / 64] |= 1ull << (bit % 64);
+    } else {
+        h->bits[bit / 64] &= ~(1ull << (bit % 64));
+    }
+}
+
+int handles_between(struct handle_set *h, int32_t from, int32_t to) {
+    for (int32_t slot = from; slot < to; slot++) {
+        if (handle_at(h, slot)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Carry h across the instruction at pc, which finds the stack d deep and
+ * reaches needs values into it. CALLs and SPAWNs come with their procedure's
+ * needs and delta. Returns 0 if a handle would get out of the procedure.
+ */
+int move_handles(uint8_t *code, size_t pc, int32_t d, uint32_t needs, int32_t delta, struct handle_set *h) {
+    int32_t slot = (int8_t) code[pc + 1];
+    int ok = 1;
+    switch (code[pc]) {
+        case DUP:
+            set_handle(h, d, handle_at(h, d - 1));
+            break;
+        case OVER:
+            set_handle(h, d, handle_at(h, d - 2));
+            break;
+        case SWAP: {
+            int a = handle_at(h, d - 2);
+            set_handle(h, d - 2, handle_at(h, d - 1));
+            set_handle(h, d - 1, a);
+            break;
+        }
+        case ROT: {
+            int a = handle_at(h, d - 3);
+            set_handle(h, d - 3, handle_at(h, d - 2));
+            set_handle(h, d - 2, handle_at(h, d - 1));
+            set_handle(h, d - 1, a);
+            break;
+        }
+        case LOAD_LOCAL:
+            set_handle(h, d, handle_at(h, slot));
+            break;
+        case STORE_LOCAL:
+            set_handle(h, slot, handle_at(h, d - 1));
+            break;
+        case JIF:
+        case JIF_LONG:
+        case JIZ:
+        case JMP:
+        case DONE:
+            break;
+        case RET:
+            ok = !handles_between(h, -STACK_MAX, d);
+            break;
+        case SPAWN:
+            ok = !handles_between(h, d - (int32_t) needs, d);
+            set_handle(h, d, 1);
+            break;
+        default:
+
+            /*
+             * Whatever else an instruction leaves is a plain number, a CALL
+             * included, since its procedure can't return a handle either.
+             */
+            ok = code[pc] != CALL || !handles_between(h, d - (int32_t) needs, d);
+            for (int32_t i = d - (int32_t) needs; i < d + delta; i++) {
+                set_handle(h, i, 0);
+            }
+            break;
+    }
+    for (int32_t i = d + delta; i < STACK_MAX; i++) {
+        set_handle(h, i, 0);
+    }
+    return ok;
+}
+
+/*
+ * What a procedure does to the stack of whoever calls it: how many of the
+ * caller's values it reaches into, how far above the caller's top it pushes,
+ * and how much it changes the depth by when it returns.
+ */
+struct proc_summary {
+    enum {
+        PROC_UNVISITED,
+        PROC_VISITING,
+        PROC_DONE
+    } state;
+    int returns;
+    uint32_t needs;
+    int32_t peak;
+    int32_t delta;
+    uint32_t calls;
+};
+
+/*
+ * What a walk through one procedure keeps per instruction. Only a walk that
+ * has to stop for a callee it hasn't seen yet has another one start above it,
+ * so there's a set for each level of that, allocated the first time something
+ * gets that deep and sized to the whole program. A walk only ever touches the
+ * entries it reaches, and it lists them in reached so it can put them back to
+ * zero for the next procedure at its level.
+ */
+struct verify_walk {
+    uint32_t *depth;
+    size_t *worklist;
+    size_t *reached;
+    struct handle_set *handles;
+    uint8_t *queued;
+};
+
+struct verifier {
+    uint8_t *code;
+    size_t len;
+    uint8_t *is_start;
+
+    /*
+     * Indexed by the offset of the procedure's first instruction.
+     */
+    struct proc_summary *procs;
+    struct verify_info *info;
+
+    /*
+     * How many values the host puts on the stack before the program starts.
+     */
+    uint32_t inputs;
+
+    /*
+     * Whether the code has a SPAWN, and so any handles to track.
+     */
+    int spawns;
+
+    /*
+     * How many walks are under way, and their state. A walk further up than
+     * RETURN_STACK_MAX would mean calls nesting deeper than the return stack.
+     */
+    int nesting;
+    struct verify_walk walks[RETURN_STACK_MAX + 1];
+};
+
+/*
+ * The state for the walk at the current level, or NULL if there isn't memory
+ * for it.
+ */
+struct verify_walk *walk_state(struct verifier *v) {
+    struct verify_walk *w = &v->walks[v->nesting];
+    if (w->depth == NULL) {
+        w->depth = calloc(v->len, sizeof(uint32_t));
+        w->worklist = malloc(v->len * sizeof(size_t));
+        w->reached = malloc(v->len * sizeof(size_t));
+        if (v->spawns) {
+            w->handles = calloc(v->len, sizeof(struct handle_set));
+            w->queued = calloc(v->len, 1);
+        }
+    }
+    if (w->depth == NULL || w->worklist == NULL || w->reached == NULL ||
+        (v->spawns && (w->handles == NULL || w->queued == NULL))) {
+        return NULL;
+    }
+    return w;
+}
+
+void free_walks(struct verifier *v) {
+    for (int i = 0; i <= RETURN_STACK_MAX; i++) {
+        free(v->walks[i].depth);
+        free(v->walks[i].worklist);
+        free(v->walks[i].reached);
+        free(v->walks[i].handles);
+        free(v->walks[i].queued);
+    }
+}
+
+/*
+ * Walk every path through one procedure, tracking the stack depth at each
+ * instruction relative to the depth on entry. Depths are stored off by one so
+ * that zero means "not reached yet", and biased by STACK_MAX so that a
+ * procedure can reach below its entry depth into its arguments. The program
+ * itself is the procedure at offset 0, which starts on a stack holding just its
+ * inputs and ends with DONE instead of RET.
+ */
+verify_status verify_procedure(struct verifier *v, size_t entry) {
+    struct proc_summary *proc = &v->procs[entry];
+    int is_main = entry == 0;
+    struct verify_walk *w = walk_state(v);
+    if (w == NULL) {
+        return VERIFY_OUT_OF_MEMORY;
+    }
+    uint32_t *depth = w->depth;
+    size_t *worklist = w->worklist;
+    size_t num_reached = 0;
+
+    /*
+     * Where there are handles, an instruction goes back on the worklist
+     * whenever another path brings it one more slot that might hold a handle,
+     * and queued keeps it from being on there twice.
+     */
+    struct handle_set *handles = w->handles;
+    uint8_t *queued = w->queued;
+    verify_status status = VERIFY_OK;
+    proc->state = PROC_VISITING;
+    int32_t lowest = 0;
+    int32_t start = is_main ? (int32_t) v->inputs : 0;
+    proc->peak = start;
+
+    size_t pending = 0;
+    depth[entry] = (uint32_t) (start + STACK_MAX + 1);
+    w->reached[num_reached++] = entry;
+    worklist[pending++] = entry;
+    while (pending > 0) {
+        size_t pc = worklist[--pending];
+        uint8_t op = v->code[pc];
+        struct handle_set h;
+        if (v->spawns) {
+            queued[pc] = 0;
+            h = handles[pc];
+        }
+        int32_t d = (int32_t) depth[pc] - 1 - STACK_MAX;
+        uint32_t needs;
+        int32_t delta;
+        int32_t peak;
+        int falls_through = op != DONE && op != RET && op != JMP;
+        stack_effect(op, &needs, &delta);
+        peak = d + delta;
+
+        if (op == CALL || op == SPAWN) {
+            size_t target = jump_target(v->code, pc);
+            if (target >= v->len || !v->is_start[target]) {
+                v->info->error_pc = pc;
+                status = VERIFY_BAD_JUMP;
+                goto done;
+            }
+            struct proc_summary *callee = &v->procs[target];
+            if (callee->state == PROC_VISITING) {
+                v->info->error_pc = pc;
+                status = VERIFY_RECURSION;
+                goto done;
+            }
+            if (callee->state == PROC_UNVISITED) {
+                if (v->nesting == RETURN_STACK_MAX) {
+                    v->info->error_pc = pc;
+                    status = VERIFY_CALLS_TOO_DEEP;
+                    goto done;
+                }
+                v->nesting++;
+                status = verify_procedure(v, target);
+                v->nesting--;
+                if (status != VERIFY_OK) {
+                    goto done;
+                }
+            }
+            if (callee->calls + 1 > RETURN_STACK_MAX) {
+                v->info->error_pc = pc;
+                status = VERIFY_CALLS_TOO_DEEP;
+                goto done;
+            }
+            if (callee->calls + 1 > proc->calls) {
+                proc->calls = callee->calls + 1;
+            }
+            if (op == CALL) {
+                needs = callee->needs;
+                delta = callee->delta;
+                peak = d + callee->peak;
+                falls_through = callee->returns;
+            } else {
+                uint32_t k = v->code[pc + 5];
+                if (k > SPAWN_ARGS_MAX || callee->needs > k || !callee->returns ||
+                    (int32_t) k + callee->delta < 1) {
+                    v->info->error_pc = pc;
+                    status = VERIFY_BAD_SPAWN;
+                    goto done;
+                }
+                needs = k;
+                delta = 1;
+                peak = d + (int32_t) k + callee->peak;
+                if (peak < d + 1) {
+                    peak = d + 1;
+                }
+            }
+        }
+
+        /*
+         * A local is reached through the frame base, which sits at depth 0
+         * here, so slot s is d - s values down. It has to be live: below the
+         * top for a load, and below what the store pops off for a store. Only
+         * a procedure has anything under its frame, namely its arguments.
+         */
+        if (op == LOAD_LOCAL || op == STORE_LOCAL) {
+            int32_t slot = (int8_t) v->code[pc + 1];
+            if (slot >= d - (op == STORE_LOCAL) || (is_main && slot < 0)) {
+                v->info->error_pc = pc;
+                status = VERIFY_BAD_LOCAL;
+                goto done;
+            }
+            if (d - slot > (int32_t) needs) {
+                needs = (uint32_t) (d - slot);
+            }
+        }
+
+        if (d - (int32_t) needs < lowest) {
+            lowest = d - (int32_t) needs;
+            if (is_main && lowest < 0) {
+                v->info->error_pc = pc;
+                status = VERIFY_UNDERFLOW;
+                goto done;
+            }
+        }
+        if (peak > proc->peak) {
+            proc->peak = peak;
+        }
+        if (proc->peak - lowest > STACK_MAX) {
+            v->info->error_pc = pc;
+            status = VERIFY_OVERFLOW;
+            goto done;
+        }
+        if (v->spawns && !move_handles(v->code, pc, d, needs, delta, &h)) {
+            v->info->error_pc = pc;
+            status = VERIFY_HANDLE_ESCAPES;
+            goto done;
+        }
+        d += delta;
+
+        if (op == RET) {
+            if (is_main) {
+                v->info->error_pc = pc;
+                status = VERIFY_BAD_RETURN;
+                goto done;
+            }
+            if (proc->returns && proc->delta != d) {
+                v->info->error_pc = pc;
+                status = VERIFY_DEPTH_MISMATCH;
+                goto done;
+            }
+            proc->returns = 1;
+            proc->delta = d;
+        }
+        if (!falls_through && op != JMP) {
+            continue;
+        }
+
+        /*
+         * Queue up every successor: the next instruction, and the jump target
+         * if this is a jump.
+         */
+        size_t successors[2];
+        int num_successors = 0;
+        if (falls_through) {
+            size_t next = pc + 1 + operand_bytes(op);
+            if (next >= v->len) {
+                v->info->error_pc = pc;
+                status = VERIFY_FALLS_OFF_END;
+                goto done;
+            }
+            successors[num_successors++] = next;
+        }
+        if (op == JIF || op == JIF_LONG || op == JIZ || op == JMP || op == LOOP) {
+            size_t target = jump_target(v->code, pc);
+            if (target >= v->len || !v->is_start[target]) {
+                v->info->error_pc = pc;
+                status = VERIFY_BAD_JUMP;
+                goto done;
+            }
+            successors[num_successors++] = target;
+        }
+        for (int i = 0; i < num_successors; i++) {
+            size_t s = successors[i];
+            uint32_t stored = (uint32_t) (d + STACK_MAX + 1);
+            int changed = 0;
+            if (depth[s] == 0) {
+                depth[s] = stored;
+                w->reached[num_reached++] = s;
+                changed = 1;
+            } else if (depth[s] != stored) {
+                v->info->error_pc = s;
+                status = VERIFY_DEPTH_MISMATCH;
+                goto done;
+            }
+            if (v->spawns) {
+                for (int word = 0; word < HANDLE_WORDS; word++) {
+                    changed |= (h.bits[word] & ~handles[s].bits[word]) != 0;
+                    handles[s].bits[word] |= h.bits[word];
+                }
+                changed &= !queued[s];
+                if (changed) {
+                    queued[s] = 1;
+                }
+            }
+            if (changed) {
+                worklist[pending++] = s;
+            }
+        }
+    }
+    proc->needs = (uint32_t) -lowest;
+    proc->state = PROC_DONE;
+
+    done:
+    for (size_t i = 0; i < num_reached; i++) {
+        size_t pc = w->reached[i];
+        depth[pc] = 0;
+        if (v->spawns) {
+            memset(&handles[pc], 0, sizeof(handles[pc]));
+            queued[pc] = 0;
+        }
+    }
+    return status;
+}
+
+/*
+ * Verify a program that starts with inputs values already on the stack. The
+ * depths in info count them.
+ */
+verify_status verify_with_inputs(uint8_t *code, size_t len, uint32_t inputs, struct verify_info *info) {
+    memset(info, 0, sizeof(*info));
+    if (inputs > STACK_MAX) {
+        return VERIFY_OVERFLOW;
+    }
+    if (len == 0) {
+        return VERIFY_FALLS_OFF_END;
+    }
+
+    /*
+     * First make sure we can decode the whole thing and remember where the
+     * instructions start.
+     */
+    struct verifier v = {code, len, calloc(len, 1), calloc(len, sizeof(struct proc_summary)), info, inputs};
+    verify_status status = VERIFY_OK;
+    if (v.is_start == NULL || v.procs == NULL) {
+        status = VERIFY_OUT_OF_MEMORY;
+        goto done;
+    }
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(code[pc])) {
+        if (code[pc] >= NUM_OPCODES) {
+            info->error_pc = pc;
+            status = VERIFY_BAD_OPCODE;
+            goto done;
+        }
+        if (pc + operand_bytes(code[pc]) >= len) {
+            info->error_pc = pc;
+            status = VERIFY_TRUNCATED;
+            goto done;
+        }
+        if ((code[pc] == DIV_CONST && code[pc + 1] < 2) ||
+            ((code[pc] == LSHIFT_CONST || code[pc] == RSHIFT_CONST) && code[pc + 1] >= 64)) {
+            info->error_pc = pc;
+            status = VERIFY_BAD_OPERAND;
+            goto done;
+        }
+        v.is_start[pc] = 1;
+        v.spawns |= code[pc] == SPAWN;
+    }
+
+    status = verify_procedure(&v, 0);
+    info->max_depth = (uint32_t) v.procs[0].peak;
+    info->max_calls = v.procs[0].calls;
+
+    done:
+    free_walks(&v);
+    free(v.is_start);
+    free(v.procs);
+    return status;
+}
+
+verify_status verify_bytecode(uint8_t *code, size_t len, struct verify_info *info) {
+    return verify_with_inputs(code, len, 0, info);
+}
+
+#endif
@@ -0,0 +1,603 @@
+#ifndef VERSE_STACK_VERSE_HPP_
+#define VERSE_STACK_VERSE_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#include "isa.h"
+
+/*
+ * Stack programs built into C++. A program written as a string literal in the
+ * same syntax stacka reads is assembled while the C++ compiles:
+ *
+ *   constexpr auto code = verse::assemble<"PUSH_IMM\n2\nPUSH_IMM\n3\nADD\nPOP_RES\nDONE">();
+ *
+ * or with the literal, "..."_stack. Either gives a std::array of bytecode the
+ * C engines run just the same. A mistake in the source stops the build, at the
+ * throw that says what was wrong.
+ *
+ * verse::run<code>(m) interprets it with the dispatch unrolled over the
+ * program. Every instruction gets its own instantiation that knows its opcode,
+ * its operands and where it goes next, and each basic block runs as one
+ * straight line of them. What's left once the compiler is done is a function
+ * per block and a table of them indexed by where each block starts, rather
+ * than a loop that decodes bytes. A program of only a few blocks compares
+ * against where each one starts instead, which lets them all inline.
+ *
+ * Opcodes, their encoding, values and results all come from isa.h, same as
+ * for vm.h. Blank lines and spaces around a line are ignored here, since
+ * literals tend to have them.
+ *
+ * There are no threads here: SPAWN runs its task right away as a call, and
+ * when that returns, keeps its result in the machine under the handle it
+ * pushes, for JOIN to take back. libverse does the same, and the ways that
+ * can fail are the same as on stckvm's pool.
+ */
+namespace verse {
+
+/*
+ * A string literal we can pass as a template argument.
+ */
+template <std::size_t N>
+struct source {
+    char text[N];
+
+    constexpr source(const char (&s)[N]) {
+        for (std::size_t i = 0; i < N; i++) {
+            text[i] = s[i];
+        }
+    }
+
+    constexpr std::string_view view() const {
+        return {text, N - 1};
+    }
+};
+
+/*
+ * Hands out the lines of a source one at a time, trimmed, skipping blank ones.
+ */
+struct line_reader {
+    std::string_view rest;
+
+    constexpr bool next(std::string_view &line) {
+        while (!rest.empty()) {
+            std::size_t nl = rest.find('\n');
+            line = rest.substr(0, nl);
+            rest = nl == std::string_view::npos ? std::string_view() : rest.substr(nl + 1);
+            while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+                line.remove_prefix(1);
+            }
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\t' || line.back() == '\r')) {
+                line.remove_suffix(1);
+            }
+            if (!line.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+constexpr bool is_number(std::string_view line) {
+    return !line.empty() && line[0] >= '0' && line[0] <= '9';
+}
+
+constexpr std::uint64_t parse_number(std::string_view line) {
+    std::uint64_t v = 0;
+    for (char c : line) {
+        if (c < '0' || c > '9') {
+            throw "operand isn't a number";
+        }
+        v = v * 10 + (c - '0');
+    }
+    return v;
+}
+
+/*
+ * Locals are the only operands that can be negative.
+ */
+constexpr int parse_local(std::string_view line) {
+    bool negative = !line.empty() && line[0] == '-';
+    if (negative) {
+        line.remove_prefix(1);
+    }
+    if (line.empty()) {
+        throw "operand isn't a number";
+    }
+    std::uint64_t v = parse_number(line);
+    if (v > 127u + negative) {
+        throw "local outside -128 to 127";
+    }
+    return negative ? -static_cast<int>(v) : static_cast<int>(v);
+}
+
+constexpr int find_opcode(std::string_view line) {
+    for (int op = 0; op < NUM_OPCODES; op++) {
+        if (line == opcode_names[op]) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The name a PROC or LABEL line defines, or nothing if it isn't one.
+ */
+constexpr std::string_view directive_name(std::string_view line) {
+    for (std::string_view d : {std::string_view("PROC "), std::string_view("LABEL ")}) {
+        if (line.size() > d.size() && line.substr(0, d.size()) == d) {
+            return line.substr(d.size());
+        }
+    }
+    return {};
+}
+
+/*
+ * How many lines of operands follow an instruction.
+ */
+constexpr int operand_lines(int op) {
+    return op == LOOP || op == SPAWN ? 2 : operand_bytes(op) > 0 ? 1 : 0;
+}
+
+/*
+ * Where a name is defined. Programs we assemble at compile time are small, so
+ * we just walk the source again instead of keeping a table.
+ */
+constexpr std::size_t find_label(std::string_view src, std::string_view name) {
+    line_reader r{src};
+    std::string_view line;
+    std::size_t offset = 0;
+    while (r.next(line)) {
+        if (!name.empty() && directive_name(line) == name) {
+            return offset;
+        }
+        int op = find_opcode(line);
+        if (op < 0) {
+            continue;
+        }
+        offset += 1 + operand_bytes(op);
+        for (int i = 0; i < operand_lines(op); i++) {
+            r.next(line);
+        }
+    }
+    throw "jump or call to a name that isn't defined";
+}
+
+/*
+ * Assemble src into code, or just work out how long it is if code is null.
+ */
+constexpr std::size_t assemble_into(std::string_view src, std::uint8_t *code) {
+    line_reader r{src};
+    std::string_view line;
+    std::size_t len = 0;
+    auto emit = [&](std::uint64_t b) {
+        if (code != nullptr) {
+            code[len] = static_cast<std::uint8_t>(b);
+        }
+        len++;
+    };
+    while (r.next(line)) {
+        if (!directive_name(line).empty()) {
+            continue;
+        }
+        int op = find_opcode(line);
+        if (op < 0) {
+            throw "cannot parse line";
+        }
+        emit(op);
+        for (int i = 0; i < operand_lines(op); i++) {
+            if (!r.next(line)) {
+                throw "missing operand";
+            }
+            if (op == LOAD_LOCAL || op == STORE_LOCAL) {
+                emit(static_cast<std::uint8_t>(parse_local(line)));
+                continue;
+            }
+            int is_long = operand_bytes(op) == 4 || (op == SPAWN && i == 0);
+            int is_target = i == 0 && (op == JIF || op == LOOP || is_long);
+            std::uint64_t v = is_number(line) || !is_target ? parse_number(line) : find_label(src, line);
+            if (is_long) {
+                for (int b = 0; b < 4; b++) {
+                    emit(v >> (8 * b));
+                }
+            } else if (is_target && !is_number(line)) {
+                if (v > 254) {
+                    throw "short jump to a name past byte 254";
+                }
+                emit(v + 1);
+            } else {
+                emit(v);
+            }
+        }
+    }
+    return len;
+}
+
+template <source Src>
+constexpr auto assemble() {
+    constexpr std::size_t len = assemble_into(Src.view(), nullptr);
+    std::array<std::uint8_t, len> code{};
+    assemble_into(Src.view(), code.data());
+    return code;
+}
+
+template <source Src>
+constexpr auto operator""_stack() {
+    return assemble<Src>();
+}
+
+/*
+ * Where a run keeps its state. Memory is whatever the caller hands us, and a
+ * LOAD or STORE that doesn't fit inside it ends the run with
+ * ERR_MEM_OUT_OF_BOUNDS. Frames work as in vm.h: each CALL saves the caller's
+ * base at the same index as its return address. A SPAWN does the same, and
+ * also notes how many values it copied, plus one, where a CALL notes 0. Each
+ * run starts its task table over.
+ */
+struct machine {
+    std::uint64_t stack[STACK_MAX];
+    std::uint64_t *stack_top = stack;
+    std::size_t return_stack[RETURN_STACK_MAX];
+    std::size_t *return_top = return_stack;
+    std::uint64_t *frame = stack;
+    std::uint64_t *frame_stack[RETURN_STACK_MAX];
+    std::uint8_t spawned[RETURN_STACK_MAX];
+    serial_tasks tasks;
+    std::uint64_t result = 0;
+    std::uint8_t *memory = nullptr;
+    std::size_t memory_size = 0;
+};
+
+/*
+ * Whether an instruction ends a basic block: it can go somewhere other than
+ * the next instruction, or nowhere at all.
+ */
+constexpr bool ends_block(std::uint8_t op) {
+    return op == JIF || op == JIF_LONG || op == JIZ || op == JMP || op == LOOP || op == CALL || op == RET ||
+           op == DONE || op == SPAWN;
+}
+
+/*
+ * Where a program's basic blocks start: at the beginning, at every jump and
+ * call target, and after every instruction that ends a block, which covers
+ * where calls return to. These are the only places control can arrive at
+ * other than by falling through.
+ */
+template <auto Code>
+constexpr std::array<bool, Code.size() + 1> find_leaders() {
+    std::array<bool, Code.size() + 1> leader{};
+    leader[0] = true;
+    for (std::size_t pc = 0; pc < Code.size(); pc += 1 + operand_bytes(Code[pc])) {
+        std::uint8_t op = Code[pc];
+        if (op >= NUM_OPCODES || pc + operand_bytes(op) >= Code.size()) {
+            throw "bytecode has an unknown opcode or a truncated instruction";
+        }
+        if (!ends_block(op)) {
+            continue;
+        }
+        leader[pc + 1 + operand_bytes(op)] = true;
+        if (op == JIF || op == LOOP) {
+            if (Code[pc + 1] != 0 && Code[pc + 1] - 1u < Code.size()) {
+                leader[Code[pc + 1] - 1] = true;
+            }
+        } else if ((operand_bytes(op) == 4 || op == SPAWN) && read_u32(Code.data() + pc + 1) < Code.size()) {
+            leader[read_u32(Code.data() + pc + 1)] = true;
+        }
+    }
+    return leader;
+}
+
+template <auto Code>
+constexpr std::size_t count_leaders() {
+    constexpr auto leader = find_leaders<Code>();
+    std::size_t n = 0;
+    for (std::size_t pc = 0; pc < Code.size(); pc += 1 + operand_bytes(Code[pc])) {
+        n += leader[pc];
+    }
+    return n;
+}
+
+template <auto Code>
+constexpr auto leader_offsets() {
+    constexpr auto leader = find_leaders<Code>();
+    std::array<std::size_t, count_leaders<Code>()> offsets{};
+    std::size_t n = 0;
+    for (std::size_t pc = 0; pc < Code.size(); pc += 1 + operand_bytes(Code[pc])) {
+        if (leader[pc]) {
+            offsets[n++] = pc;
+        }
+    }
+    return offsets;
+}
+
+/*
+ * Where the jump at pc goes, or Code.size() if it can't go anywhere. Same as
+ * jump_target in vm.h.
+ */
+template <auto Code, std::size_t PC>
+constexpr std::size_t target() {
+    if constexpr (Code[PC] == JIF || Code[PC] == LOOP) {
+        return Code[PC + 1] == 0 ? Code.size() : Code[PC + 1] - 1;
+    } else {
+        return read_u32(Code.data() + PC + 1);
+    }
+}
+
+/*
+ * Returned in place of a pc once the run is over.
+ */
+constexpr std::size_t STOP = SIZE_MAX;
+
+/*
+ * Run the instruction at PC and say where to go next. Everything that depends
+ * on the program is a constant here.
+ */
+template <auto Code, std::size_t PC>
+inline std::size_t step(machine &m, std::uint64_t *&sp, result &r) {
+    constexpr std::uint8_t op = Code[PC];
+    constexpr std::size_t next = PC + 1 + operand_bytes(op);
+    if constexpr (op == PUSH_IMM) {
+        *sp++ = Code[PC + 1];
+    } else if constexpr (op == ADD || op == SUB || op == MUL || op == AND || op == OR || op == XOR ||
+                         op == LSHIFT || op == RSHIFT || op == FADD || op == FSUB || op == FMUL || op == FDIV) {
+        std::uint64_t b = *--sp;
+        std::uint64_t a = sp[-1];
+        if constexpr (op == ADD) {
+            sp[-1] = a + b;
+        } else if constexpr (op == SUB) {
+            sp[-1] = a - b;
+        } else if constexpr (op == MUL) {
+            sp[-1] = a * b;
+        } else if constexpr (op == AND) {
+            sp[-1] = a & b;
+        } else if constexpr (op == OR) {
+            sp[-1] = a | b;
+        } else if constexpr (op == XOR) {
+            sp[-1] = a ^ b;
+        } else if constexpr (op == LSHIFT) {
+            sp[-1] = a << (b & 63);
+        } else if constexpr (op == RSHIFT) {
+            sp[-1] = a >> (b & 63);
+        } else if constexpr (op == FADD) {
+            sp[-1] = value_fadd(a, b);
+        } else if constexpr (op == FSUB) {
+            sp[-1] = value_fsub(a, b);
+        } else if constexpr (op == FMUL) {
+            sp[-1] = value_fmul(a, b);
+        } else {
+            sp[-1] = value_fdiv(a, b);
+        }
+    } else if constexpr (op == DIV) {
+        std::uint64_t b = *--sp;
+        if (b == 0) {
+            r = ERR_DIV_ZERO;
+            return STOP;
+        }
+        sp[-1] /= b;
+    } else if constexpr (op == DIV_CONST) {
+        static_assert(Code[PC + 1] >= 2, "DIV_CONST by less than 2");
+        sp[-1] /= Code[PC + 1];
+    } else if constexpr (op == LSHIFT_CONST) {
+        static_assert(Code[PC + 1] < 64, "LSHIFT_CONST by 64 or more");
+        sp[-1] <<= Code[PC + 1];
+    } else if constexpr (op == RSHIFT_CONST) {
+        static_assert(Code[PC + 1] < 64, "RSHIFT_CONST by 64 or more");
+        sp[-1] >>= Code[PC + 1];
+    } else if constexpr (op == DUP) {
+        *sp = sp[-1];
+        sp++;
+    } else if constexpr (op == DROP) {
+        sp--;
+    } else if constexpr (op == SWAP) {
+        std::swap(sp[-1], sp[-2]);
+    } else if constexpr (op == OVER) {
+        *sp = sp[-2];
+        sp++;
+    } else if constexpr (op == ROT) {
+        std::uint64_t a = sp[-3];
+        sp[-3] = sp[-2];
+        sp[-2] = sp[-1];
+        sp[-1] = a;
+    } else if constexpr (op == LOAD_LOCAL) {
+        *sp++ = m.frame[static_cast<std::int8_t>(Code[PC + 1])];
+    } else if constexpr (op == STORE_LOCAL) {
+        m.frame[static_cast<std::int8_t>(Code[PC + 1])] = *--sp;
+    } else if constexpr (op == NOT) {
+        sp[-1] = ~sp[-1];
+    } else if constexpr (op == ITOF) {
+        sp[-1] = value_itof(sp[-1]);
+    } else if constexpr (op == FTOI) {
+        sp[-1] = value_ftoi(sp[-1]);
+    } else if constexpr (op == JIF || op == JIF_LONG) {
+        return sp[-1] != 0 ? target<Code, PC>() : next;
+    } else if constexpr (op == JIZ) {
+        return sp[-1] == 0 ? target<Code, PC>() : next;
+    } else if constexpr (op == JMP) {
+        return target<Code, PC>();
+    } else if constexpr (op == LOOP) {
+        sp[-1] -= Code[PC + 2];
+        return sp[-1] != 0 ? target<Code, PC>() : next;
+    } else if constexpr (op == POP_RES) {
+        m.result = *--sp;
+    } else if constexpr (op == DONE) {
+        return STOP;
+    } else if constexpr (op == LOAD || op == STORE) {
+        std::uint64_t value = op == STORE ? *--sp : 0;
+        std::uint32_t addr = static_cast<std::uint32_t>(op == STORE ? *--sp : sp[-1]);
+        if (addr + sizeof(std::uint64_t) > m.memory_size) {
+            r = ERR_MEM_OUT_OF_BOUNDS;
+            return STOP;
+        }
+        if constexpr (op == LOAD) {
+            std::memcpy(&sp[-1], m.memory + addr, sizeof(std::uint64_t));
+        } else {
+            std::memcpy(m.memory + addr, &value, sizeof(std::uint64_t));
+        }
+    } else if constexpr (op == CALL) {
+        if (m.return_top == m.return_stack + RETURN_STACK_MAX) {
+            r = ERR_CALL_OVERFLOW;
+            return STOP;
+        }
+        m.frame_stack[m.return_top - m.return_stack] = m.frame;
+        m.frame = sp;
+        m.spawned[m.return_top - m.return_stack] = 0;
+        *m.return_top++ = next;
+        return target<Code, PC>();
+    } else if constexpr (op == SPAWN) {
+        constexpr std::uint8_t argc = Code[PC + 5];
+        static_assert(argc <= SPAWN_ARGS_MAX, "SPAWN copies more than SPAWN_ARGS_MAX values");
+        if (m.return_top == m.return_stack + RETURN_STACK_MAX) {
+            r = ERR_CALL_OVERFLOW;
+            return STOP;
+        }
+        if (result spawned = serial_spawn(&m.tasks); spawned != SUCCESS) {
+            r = spawned;
+            return STOP;
+        }
+        std::memcpy(sp, sp - argc, argc * sizeof(std::uint64_t));
+        sp += argc;
+        m.frame_stack[m.return_top - m.return_stack] = m.frame;
+        m.frame = sp;
+        m.spawned[m.return_top - m.return_stack] = argc + 1;
+        *m.return_top++ = next;
+        return target<Code, PC>();
+    } else if constexpr (op == RET) {
+        if (m.return_top == m.return_stack) {
+            r = ERR_RET_UNDERFLOW;
+            return STOP;
+        }
+        m.return_top--;
+        std::uint8_t copied = m.spawned[m.return_top - m.return_stack];
+        if (copied != 0) {
+            std::uint64_t value = sp[-1];
+            sp = m.frame - (copied - 1);
+            *sp++ = serial_return(&m.tasks, value);
+        }
+        m.frame = m.frame_stack[m.return_top - m.return_stack];
+        return *m.return_top;
+    } else if constexpr (op == JOIN) {
+        if (serial_join(&m.tasks, &sp[-1]) != SUCCESS) {
+            r = ERR_BAD_HANDLE;
+            return STOP;
+        }
+    }
+    return next;
+}
+
+/*
+ * Run the basic block that starts at PC, one instruction after the other with
+ * nothing in between, and say where to go after it.
+ */
+template <auto Code, std::size_t PC>
+inline std::size_t run_block(machine &m, std::uint64_t *&sp, result &r) {
+    std::size_t next = step<Code, PC>(m, sp, r);
+    constexpr std::size_t after = PC + 1 + operand_bytes(Code[PC]);
+    if constexpr (ends_block(Code[PC]) || after >= Code.size()) {
+        return next;
+    } else {
+        return next == STOP ? STOP : run_block<Code, after>(m, sp, r);
+    }
+}
+
+/*
+ * A block as the table holds it. The stack pointer goes in and comes back out
+ * by value, so that it stays in a register through the block rather than
+ * living in memory for the sake of the indirect call.
+ */
+struct block_exit {
+    std::size_t pc;
+    std::uint64_t *sp;
+};
+
+using block_fn = block_exit (*)(machine &, std::uint64_t *, result &);
+
+template <auto Code, std::size_t PC>
+block_exit enter_block(machine &m, std::uint64_t *sp, result &r) {
+    std::size_t next = run_block<Code, PC>(m, sp, r);
+    return {next, sp};
+}
+
+/*
+ * Every block's function at the offset where the block starts, and null
+ * everywhere else, which is where no jump should land.
+ */
+template <auto Code, std::size_t... I>
+constexpr std::array<block_fn, Code.size()> block_table(std::index_sequence<I...>) {
+    constexpr auto starts = leader_offsets<Code>();
+    std::array<block_fn, Code.size()> table{};
+    ((table[starts[I]] = &enter_block<Code, starts[I]>), ...);
+    return table;
+}
+
+/*
+ * Up to this many blocks, a chain of compares against where they start beats
+ * the table: each block inlines into the loop, and the stack pointer never
+ * leaves its register. The chain gets longer with every block, though, and
+ * the table doesn't.
+ */
+constexpr std::size_t COMPARE_BLOCKS_MAX = 16;
+
+template <auto Code, std::size_t... I>
+inline result compare_dispatch(machine &m, std::index_sequence<I...>) {
+    constexpr auto starts = leader_offsets<Code>();
+    result r = SUCCESS;
+    std::uint64_t *sp = m.stack_top;
+    std::size_t pc = 0;
+    m.frame = m.stack;
+    serial_reset(&m.tasks);
+    while (pc != STOP) {
+        bool found = ((pc == starts[I] && ((pc = run_block<Code, starts[I]>(m, sp, r)), true)) || ...);
+        if (!found) {
+            r = ERR_INVALID_JUMP;
+            break;
+        }
+    }
+    m.stack_top = sp;
+    return r;
+}
+
+template <auto Code, std::size_t... I>
+inline result table_dispatch(machine &m, std::index_sequence<I...> blocks) {
+    static constexpr auto table = block_table<Code>(blocks);
+    result r = SUCCESS;
+    std::uint64_t *sp = m.stack_top;
+    std::size_t pc = 0;
+    m.frame = m.stack;
+    serial_reset(&m.tasks);
+    while (pc != STOP) {
+        if (pc >= Code.size() || table[pc] == nullptr) {
+            r = ERR_INVALID_JUMP;
+            break;
+        }
+        block_exit exit = table[pc](m, sp, r);
+        pc = exit.pc;
+        sp = exit.sp;
+    }
+    m.stack_top = sp;
+    return r;
+}
+
+/*
+ * Run a program from the start on m. The only dispatch left is from the end of
+ * one block to the start of the next: one load and an indirect call through
+ * the table, or the compares for a small program. Like the C engines, nothing
+ * checks the operand stack, so it's up to the verifier to say the program
+ * stays inside it.
+ */
+template <auto Code>
+result run(machine &m) {
+    constexpr auto blocks = std::make_index_sequence<count_leaders<Code>()>();
+    if constexpr (count_leaders<Code>() <= COMPARE_BLOCKS_MAX) {
+        return compare_dispatch<Code>(m, blocks);
+    } else {
+        return table_dispatch<Code>(m, blocks);
+    }
+}
+
+}
+
+#endif
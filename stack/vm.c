@@ -1,17 +1,57 @@
-#include <assert.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "../common/container.h"
+#include "layout.h"
+#include "loops.h"
+#include "memo.h"
+#include "perf.h"
+#include "sample.h"
+#include "stream.h"
+#include "strength.h"
+#include "verify.h"
 #include "vm.h"
 
 /*
- * Right now, we don't support source files larger than 100 bytes.
+ * Only dump this many bytes of the program before running it. Generated
+ * programs can be megabytes long.
  */
-#define MAX_SIZE 100
+#define DUMP_MAX 100
 
-#define USAGE_STR "Usage: ./stckvm <bytecode file> <dispatch type>\n"
+#define USAGE_STR "Usage: ./stckvm <bytecode file> <dispatch type|all> [--perf] [--loops] [--strength] [--layout]\n" \
+                  "                [--memo] [--memo-dir <dir>] [--sample <folded file>]\n" \
+                  "       ./stckvm <bytecode file> <dispatch type> [--loops] [--strength] [--memo] " \
+                  "[--sample <folded file>]\n" \
+                  "                --stream <fields> <input> <output>\n"
+
+void print_result(uint64_t result) {
+    if (value_is_int(result)) {
+        printf("Result: %" PRIu64 "\n", result);
+    } else {
+        printf("Result: %" PRIu64 " (%g)\n", result, value_to_double(result));
+    }
+}
+
+void start_sampling(struct sampler *s, uint8_t *code, size_t len, struct engine *e) {
+    if (!sampler_init(s, code, len)) {
+        fprintf(stderr, "Out of memory\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (!sampler_start(s, e->name)) {
+        fprintf(stderr, "Couldn't start the sampling timer\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void finish_sampling(struct sampler *s, FILE *folded) {
+    print_sample_report(stdout, s);
+    write_folded(folded, s);
+    sampler_free(s);
+}
 
 int main(int argc, char *argv[]) {
 
@@ -23,64 +63,373 @@ int main(int argc, char *argv[]) {
     /*
      * Check for the correct number of arguments.
      */
-    if (argc != 3) {
+    if (argc < 3) {
         printf(USAGE_STR);
         exit(EXIT_FAILURE);
     }
+    int use_perf = 0;
+    int use_loops = 0;
+    int use_strength = 0;
+    int use_layout = 0;
+    int use_memo = 0;
+    char *memo_dir = NULL;
+    char *sample_path = NULL;
+    char **stream = NULL;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            use_perf = 1;
+        } else if (strcmp(argv[i], "--loops") == 0) {
+            use_loops = 1;
+        } else if (strcmp(argv[i], "--strength") == 0) {
+            use_strength = 1;
+        } else if (strcmp(argv[i], "--layout") == 0) {
+            use_layout = 1;
+        } else if (strcmp(argv[i], "--memo") == 0) {
+            use_memo = 1;
+        } else if (strcmp(argv[i], "--memo-dir") == 0 && i + 1 < argc) {
+            use_memo = 1;
+            memo_dir = argv[++i];
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample_path = argv[++i];
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 3 < argc) {
+            stream = argv + i + 1;
+            i += 3;
+        } else {
+            printf(USAGE_STR);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     /*
-     * Try opening the input file.
+     * Profiling a run we skip doesn't mean anything, so --perf and --memo
+     * don't go together.
      */
-    FILE *file = fopen(argv[1], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening source file\n");
-        fflush(stderr);
+    if (use_perf && use_memo) {
+        printf(USAGE_STR);
         exit(EXIT_FAILURE);
     }
 
     /*
-     * Read the source file into memory.
+     * Stream mode runs one engine once per record, so profiling a run or
+     * running every engine doesn't mean anything there. It can produce far
+     * more results than we'd want files for, so it only memoizes in memory.
+     */
+    uint32_t fields = 0;
+    if (stream != NULL) {
+        char *end;
+        unsigned long n = strtoul(stream[0], &end, 10);
+        if (*end != '\0' || end == stream[0] || n > STACK_MAX || use_perf || use_layout || memo_dir != NULL ||
+            strcmp(argv[2], "all") == 0) {
+            printf(USAGE_STR);
+            exit(EXIT_FAILURE);
+        }
+        fields = n;
+    }
+
+    /*
+     * Map the program. Containers tell us what they hold, bare bytecode we
+     * just have to take on trust.
      */
-    uint8_t code[MAX_SIZE];
-    size_t size_read = fread(code, sizeof(uint8_t), MAX_SIZE, file);
-    if (size_read == 0) {
-        fprintf(stderr, "Error reading source file\n");
+    struct container_info info;
+    container_status status = container_map(argv[1], &info);
+    if (status != CONTAINER_OK) {
+        fprintf(stderr, "Error loading %s: %s\n", argv[1], container_messages[status]);
         fflush(stderr);
         exit(EXIT_FAILURE);
     }
+    if (info.is_container && info.isa != CONTAINER_ISA_STACK) {
+        fprintf(stderr, "%s holds %s bytecode, not stack bytecode\n", argv[1], isa_names[info.isa]);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (info.entry != 0) {
+        fprintf(stderr, "Programs have to start at offset 0\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *code = info.code;
+    size_t size_read = info.code_len;
 
     /*
      * Print out what we read.
      */
-    for (size_t i = 0; i < size_read; i++) {
+    for (size_t i = 0; i < size_read && i < DUMP_MAX; i++) {
         printf("%zu:\t%02X\n", i, code[i]);
     }
+    if (size_read > DUMP_MAX) {
+        printf("... (%zu bytes total)\n", size_read);
+    }
 
     /*
-     * Invoke the interpreter depending on what the user specifies.
+     * With --loops, rewrite the counted loops we recognize before running
+     * anything, and say which ones those were.
      */
-    reset_vm();
-    result r;
-    if (strcmp(argv[2], "inline") == 0) {
-        printf("Invoking inline interpreter\n");
-        fflush(stdout);
-        r = interpret_inline(code);
-    } else if (strcmp(argv[2], "func") == 0) {
-        printf("Invoking function dispatch interpreter\n");
+    if (use_loops) {
+        struct loop_report report;
+        size_t optimized_len;
+        uint8_t *optimized = optimize_loops(code, size_read, &optimized_len, &report);
+        print_loop_report(stdout, &report, size_read, optimized_len);
+        free(report.loops);
+        code = optimized;
+        size_read = optimized_len;
+        info.max_stack = CONTAINER_UNVERIFIED;
+    }
+
+    /*
+     * With --strength, turn multiplies and divides by immediates into
+     * DIV_CONST and shifts.
+     */
+    if (use_strength) {
+        struct strength_report report;
+        size_t reduced_len;
+        uint8_t *reduced = reduce_strength(code, size_read, &reduced_len, &report);
+        if (reduced == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        print_strength_report(stdout, &report, size_read, reduced_len);
+        code = reduced;
+        size_read = reduced_len;
+        info.max_stack = CONTAINER_UNVERIFIED;
+    }
+
+    /*
+     * With --layout, profile a run of the program, lay its blocks out again
+     * for that profile, and profile the result to see how many jumps we saved.
+     */
+    if (use_layout) {
+        struct branch_profile before;
+        struct branch_profile after;
+        struct layout_report report;
+        size_t laid_out_len;
+        if (!profile_alloc(&before, size_read)) {
+            fprintf(stderr, "Out of memory\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        profile_run(code, &before);
+        uint8_t *laid_out = layout_blocks(code, size_read, &before, &laid_out_len, &report);
+        print_layout_report(stdout, &report, size_read, laid_out_len);
+        if (!profile_alloc(&after, laid_out_len)) {
+            fprintf(stderr, "Out of memory\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        profile_run(laid_out, &after);
+        printf("Taken jumps: %" PRIu64 " -> %" PRIu64 "\n", taken_branches(&before), taken_branches(&after));
+        profile_free(&before);
+        profile_free(&after);
+        code = laid_out;
+        size_read = laid_out_len;
+        info.max_stack = CONTAINER_UNVERIFIED;
+    }
+
+    /*
+     * Size the stack to fit the program. A container the assembler verified
+     * already tells us how deep it gets. Anything else we verify here, and if
+     * that fails we fall back to a full-size stack and let the program run
+     * into whatever it runs into. The container's bound is for a program that
+     * starts on an empty stack, so in stream mode we verify again with the
+     * fields on it.
+     */
+    if (stream != NULL) {
+        info.max_stack = CONTAINER_UNVERIFIED;
+    }
+    uint32_t max_stack = info.max_stack;
+    if (max_stack == CONTAINER_UNVERIFIED) {
+        struct verify_info verified;
+        verify_status v = verify_with_inputs(code, size_read, fields, &verified);
+        if (v == VERIFY_OK) {
+            max_stack = verified.max_depth;
+        } else {
+            printf("Not verified: %s at byte %zu\n", verify_messages[v], verified.error_pc);
+        }
+    }
+    if (max_stack != CONTAINER_UNVERIFIED) {
+        printf("Stack: %u slots%s\n", max_stack, info.max_stack == max_stack ? " (from container)" : "");
+        if (!use_stack(max_stack)) {
+            fprintf(stderr, "Error allocating the stack\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /*
+     * Figure out which engines to run. "all" runs every engine we have one
+     * after the other, which is mostly useful together with --perf.
+     */
+    struct engine *first = engines;
+    struct engine *last = engines + NUM_ENGINES;
+    if (strcmp(argv[2], "all") != 0) {
+        first = find_engine(argv[2]);
+        if (first == NULL) {
+            fprintf(stderr, "Unrecognized dispatch type\n");
+            fprintf(stderr, "Quitting...\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        last = first + 1;
+    }
+
+    /*
+     * With --memo, check the program is pure and hash it. If it isn't, we
+     * just run it.
+     */
+    struct memo_cache memo;
+    struct memo_cache *cache = NULL;
+    if (use_memo) {
+        memo_purity purity = memo_check(code, size_read, fields, stream != NULL);
+        if (purity != MEMO_PURE) {
+            printf("Not memoizing: %s\n", memo_purity_messages[purity]);
+        } else if (!memo_init(&memo, code, size_read, memo_dir)) {
+            fprintf(stderr, "Error setting up the memo cache%s%s\n", memo_dir != NULL ? " in " : "",
+                    memo_dir != NULL ? memo_dir : "");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        } else {
+            cache = &memo;
+        }
+    }
+
+    /*
+     * With --sample, every engine run gets sampled, and the call chains of all
+     * of them go into one folded file.
+     */
+    static struct sampler sampler;
+    FILE *folded = NULL;
+    if (sample_path != NULL) {
+        folded = fopen(sample_path, "w");
+        if (folded == NULL) {
+            fprintf(stderr, "Error opening %s\n", sample_path);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /*
+     * Stream mode. run_stream keeps the engine quiet, since a line for every
+     * record would be the bulk of what we print.
+     */
+    if (stream != NULL) {
+        reset_vm();
+        printf("Streaming %s through the %s\n", stream[1], first->description);
         fflush(stdout);
-        r = interpret_function_dispatch(code);
-    } else if (strcmp(argv[2], "threaded") == 0) {
-        printf("Invoking direct threaded interpreter\n");
+        struct stream_report report;
+        if (folded != NULL) {
+            start_sampling(&sampler, code, size_read, first);
+        }
+        stream_status s = run_stream(first, code, fields, stream[1], stream[2], cache, &report);
+        if (folded != NULL) {
+            sampler_stop(&sampler);
+        }
+        if (s == STREAM_RUN_FAILED) {
+            fprintf(stderr, "Record %" PRIu64 " failed: %s\n", report.failed_record, result_messages[report.status]);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        if (s != STREAM_OK) {
+            fprintf(stderr, "Error streaming %s to %s: %s\n", stream[1], stream[2], stream_messages[s]);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        print_stream_report(stdout, &report, fields);
+        if (folded != NULL) {
+            finish_sampling(&sampler, folded);
+            fclose(folded);
+        }
+        if (cache != NULL) {
+            print_memo_report(stdout, &cache->stats);
+            memo_free(cache);
+        }
+        container_unmap(&info);
+        return 0;
+    }
+
+    /*
+     * In perf mode we wrap each run with hardware performance counters and
+     * report them per engine and per VM instruction.
+     */
+    struct perf_counters pc;
+    uint64_t dispatches = 0;
+    if (use_perf) {
+        if (perf_open(&pc) == 0) {
+            fprintf(stderr, "No performance counters available, reporting time only\n");
+            fflush(stderr);
+        }
+        dispatches = count_dispatches(code);
+    }
+
+    /*
+     * Invoke the interpreter depending on what the user specifies. Every
+     * engine gets the same answer, so with --memo only the first of them
+     * actually runs, unless an earlier run already did. That's one lookup
+     * however many engines we go through: the others skipping the run isn't
+     * the cache at work, and shouldn't count as hits.
+     */
+    struct memo_key key;
+    struct memo_entry *known = NULL;
+    if (cache != NULL) {
+        key = memo_key_for(cache, NULL, 0);
+        known = memo_lookup(cache, key);
+    }
+    for (struct engine *e = first; e < last; e++) {
+        if (known != NULL) {
+            printf("Memoized, skipping the %s\n", e->description);
+            print_result(known->result);
+            continue;
+        }
+        reset_vm();
+        printf("Invoking %s\n", e->description);
         fflush(stdout);
-        r = interpret_threaded_dispatch(code);
-    } else {
-        fprintf(stderr, "Unrecognized dispatch type\n");
-        fprintf(stderr, "Quitting...\n");
+        if (folded != NULL) {
+            start_sampling(&sampler, code, size_read, e);
+        }
+        result r;
+        if (use_perf) {
+            perf_start(&pc);
+            r = run_engine(e, code);
+            perf_stop(&pc);
+        } else if (cache != NULL) {
+            uint64_t start = memo_now();
+            r = run_engine(e, code);
+            if (r == SUCCESS) {
+                known = memo_store(cache, key, vm.result, vm.stack, vm.stack_top - vm.stack, memo_now() - start);
+            }
+        } else {
+            r = run_engine(e, code);
+        }
+        if (folded != NULL) {
+            sampler_stop(&sampler);
+        }
+        if (r != SUCCESS) {
+            fprintf(stderr, "The %s failed: %s\n", e->description, result_messages[r]);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        print_result(vm.result);
+        if (folded != NULL) {
+            finish_sampling(&sampler, folded);
+        }
+        if (use_perf) {
+            perf_report(e->name, &pc, dispatches);
+        }
+    }
+    if (use_perf) {
+        perf_close(&pc);
+    }
+    if (folded != NULL && fclose(folded) != 0) {
+        fprintf(stderr, "Error writing %s\n", sample_path);
         fflush(stderr);
-        exit(EXIT_FAILURE);
     }
-    assert(r == SUCCESS);
-    printf("Result: %" PRIu64 "\n", vm.result);
+    if (cache != NULL) {
+        print_memo_report(stdout, &cache->stats);
+        if (!memo_export(cache)) {
+            fprintf(stderr, "Couldn't update the metrics in %s\n", memo_dir);
+            fflush(stderr);
+        }
+        memo_free(cache);
+    }
 
     /*
      * Stop the clock.
@@ -88,4 +437,5 @@ int main(int argc, char *argv[]) {
     clock_t end = clock();
     double time_spent = (double) (end - begin) / CLOCKS_PER_SEC;
     printf("Execution took %lf seconds\n", time_spent);
+    container_unmap(&info);
 }
\ No newline at end of file
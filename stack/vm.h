@@ -1,14 +1,29 @@
 #ifndef VERSE_STACK_VM_H_
 #define VERSE_STACK_VM_H_
 
+#include <setjmp.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "spawn.h"
 
 /*
- * Our runtime stack has 256 slots.
+ * Linear memory, the way WebAssembly runtimes do it. LOAD and STORE take 32-bit
+ * byte addresses (the upper half of the address is ignored), so every access
+ * lands somewhere in the first 4 GiB past the base plus the 8 bytes we read.
+ * We reserve that whole range up front with no access rights, and only make
+ * the first MEM_SIZE bytes readable and writable. An out-of-bounds access
+ * faults on a guard page instead of being checked, and the fault handler turns
+ * it into an error.
  */
-#define STACK_MAX 256
+#define MEM_SIZE    (1 << 20)
+#define MEM_RESERVE ((1ull << 32) + (1 << 16))
 
 /*
  * We'll use this macro for direct threading dispatch. Bump the instruction
@@ -22,9 +37,10 @@
  */
 
 /*
- * This struct encapsulates the state of our virtual machine.
+ * This struct encapsulates the state of our virtual machine. Every thread
+ * gets its own, so that tasks can run on the same engines as everything else.
  */
-struct {
+__thread struct {
 
     /*
      * Pointer to the instruction we're currently executing.
@@ -32,9 +48,12 @@ struct {
     uint8_t *instruction_ptr;
 
     /*
-     * Define our runtime stack.
+     * Define our runtime stack. Engines that keep the top of the stack in a
+     * register spill it into the slot below it on every push, so when the
+     * stack is empty they write to stack[-1]. Whatever we point this at needs
+     * that one extra slot at the bottom.
      */
-    uint64_t stack[STACK_MAX];
+    uint64_t *stack;
 
     /*
      * This points to the first free slot of the runtime stack.
@@ -45,43 +64,207 @@ struct {
      * This variable will hold the result of our execution.
      */
     uint64_t result;
+
+    /*
+     * Base of our linear memory. See MEM_RESERVE.
+     */
+    uint8_t *memory;
+
+    /*
+     * Where each active CALL returns to. What the entries point at depends on
+     * the engine: bytecode for the ones that run it directly, cells for the
+     * threaded ones.
+     */
+    void *return_stack[RETURN_STACK_MAX];
+
+    /*
+     * This points to the first free slot of the return stack.
+     */
+    void **return_top;
+
+    /*
+     * The base of the current frame, which LOAD_LOCAL and STORE_LOCAL count
+     * from: the bottom of the stack in the main program, and the stack top as
+     * of the CALL in a procedure. Each CALL saves its caller's base next to
+     * its return address, at the same index, and RET puts it back.
+     */
+    uint64_t *frame;
+    uint64_t *frame_stack[RETURN_STACK_MAX];
+
+    /*
+     * Where the engine starts: the beginning of the program when this is
+     * NULL, or a task's procedure, as a return address would point at it.
+     */
+    void *entry;
+
+    /*
+     * The engine and program we're running, and the threaded code it was
+     * translated to, if it was. A SPAWN hands all three to its task.
+     */
+    engine_fn engine;
+    uint8_t *code;
+    void *cells;
+
+    /*
+     * Set by keep_threaded_code, so that the call and tail engines hang on to
+     * cells from one run to the next instead of translating every time.
+     */
+    int keep_cells;
 } vm;
 
 /*
- * Define all the opcodes we recognize.
+ * The stack we run on unless use_stack gives us one that fits the program.
+ * Slot 0 is the floor.
+ */
+uint64_t default_stack[STACK_MAX + 1];
+
+/*
+ * The mapping behind a stack from use_stack, and the PROT_NONE page right
+ * after its last slot.
+ */
+uint8_t *stack_map;
+size_t stack_map_size;
+uint8_t *stack_guard;
+size_t stack_guard_size;
+
+/*
+ * Memory accesses don't have to be aligned.
+ */
+typedef uint64_t unaligned_u64 __attribute__((aligned(1), may_alias));
+
+#define mem_cell(addr) (*(unaligned_u64 *) (vm.memory + (uint32_t) (addr)))
+
+/*
+ * Magic numbers for DIV_CONST, one for every divisor it can take.
+ */
+struct div_magic div_magics[256];
+
+/*
+ * Where to go when a memory access hits a guard page. This is only valid while
+ * run_engine is running an engine, which is what vm_guard_active tracks.
+ */
+__thread sigjmp_buf vm_fault_jmp;
+__thread volatile sig_atomic_t vm_guard_active;
+
+/*
+ * What the last fault the guard caught was: ERR_MEM_OUT_OF_BOUNDS or
+ * ERR_STACK_OVERFLOW.
+ */
+__thread volatile sig_atomic_t vm_fault_status;
+
+/*
+ * Faults inside our memory reservation during a run are out-of-bounds
+ * accesses, and faults on the page after a use_stack stack are pushes past
+ * its bound. vm_fault_status says which it was. Anything else is a real crash, so put
+ * the default handler back and let the faulting instruction run again to get
+ * it.
+ */
+void memory_fault_handler(int sig, siginfo_t *info, void *context) {
+    uint8_t *addr = info->si_addr;
+    if (vm_guard_active && addr >= vm.memory && addr < vm.memory + MEM_RESERVE) {
+        vm_guard_active = 0;
+        vm_fault_status = ERR_MEM_OUT_OF_BOUNDS;
+        siglongjmp(vm_fault_jmp, 1);
+    }
+    if (vm_guard_active && stack_guard != NULL && addr >= stack_guard && addr < stack_guard + stack_guard_size) {
+        vm_guard_active = 0;
+        vm_fault_status = ERR_STACK_OVERFLOW;
+        siglongjmp(vm_fault_jmp, 1);
+    }
+    signal(sig, SIG_DFL);
+}
+
+/*
+ * Reserve the address space for our memory and hook up the fault handler. We
+ * only ever do this once, so it's also where we work out the DIV_CONST table.
  */
-typedef enum {
-    PUSH_IMM,
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    AND,
-    OR,
-    XOR,
-    NOT,
-    LSHIFT,
-    RSHIFT,
-    JIF,
-    POP_RES,
-    DONE
-} opcode;
+void memory_init() {
+    vm.memory = mmap(NULL, MEM_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm.memory == MAP_FAILED || mprotect(vm.memory, MEM_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Could not reserve VM memory\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = memory_fault_handler;
+
+    /*
+     * Don't block the signal while the handler runs. We jump out of it, and
+     * run_task doesn't save the signal mask when it sets up the jump, since
+     * that takes a system call per task.
+     */
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+    for (int d = 0; d < 256; d++) {
+        div_magics[d] = div_magic(d);
+    }
+}
 
 /*
- * Define possible termination statuses for our VM.
+ * Every engine says when it gets to DONE, and reset_vm says it's resetting,
+ * unless the host sets vm_quiet because it runs programs too often to want a
+ * line each time.
  */
-typedef enum result {
-    SUCCESS,
-    ERR_DIV_ZERO,
-    ERR_UNKNOWN_OPCODE
-} result;
+int vm_quiet;
+
+void print_done() {
+    if (!vm_quiet) {
+        printf("Done!\n");
+    }
+}
 
 /*
- * This doesn't do much right now.
+ * Empty the stack and zero out memory. Dropping the pages is cheaper than
+ * clearing them, since the kernel hands back zeroed pages on the next touch.
  */
 void reset_vm() {
-    printf("Resetting VM state\n");
+    if (!vm_quiet) {
+        printf("Resetting VM state\n");
+    }
+    if (vm.stack == NULL) {
+        vm.stack = default_stack + 1;
+    }
+    vm.stack_top = vm.stack;
+    vm.return_top = vm.return_stack;
+    if (vm.memory == NULL) {
+        memory_init();
+    } else {
+        madvise(vm.memory, MEM_SIZE, MADV_DONTNEED);
+    }
+}
+
+/*
+ * Run on a stack with room for exactly depth values from now on. Nothing
+ * checks for overflow as the engines push, so the slots end right where a
+ * PROT_NONE page starts, and a program that gets deeper than depth faults on
+ * that page and stops with ERR_STACK_OVERFLOW. That's what keeps a bound we
+ * were told rather than verified ourselves from costing more than the run.
+ * Returns 0 if we couldn't get the memory.
+ */
+int use_stack(uint32_t depth) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t bytes = ((size_t) depth + 1) * sizeof(uint64_t);
+    size_t rounded = (bytes + page - 1) / page * page;
+    uint8_t *map = mmap(NULL, rounded + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (mprotect(map + rounded, page, PROT_NONE) != 0) {
+        munmap(map, rounded + page);
+        return 0;
+    }
+    if (stack_map != NULL) {
+        munmap(stack_map, stack_map_size);
+    }
+    stack_map = map;
+    stack_map_size = rounded + page;
+    stack_guard = map + rounded;
+    stack_guard_size = page;
+    vm.stack = (uint64_t *) (stack_guard - bytes) + 1;
     vm.stack_top = vm.stack;
+    return 1;
 }
 
 /*
@@ -122,20 +305,22 @@ void do_mul() {
     stack_push(op1 * op2);
 }
 
-void do_div() {
+/*
+ * Division is the only operation that can fail, so it's the only helper that
+ * reports a status.
+ */
+result do_div() {
     uint64_t op2 = stack_pop();
     uint64_t op1 = stack_pop();
 
     /*
      * Check for division by zero.
-     *
-     * TODO How should we fail gracefully here?
      */
     if (op2 == 0) {
-        printf("Division by zero encountered\n");
-        exit(EXIT_FAILURE);
+        return ERR_DIV_ZERO;
     }
     stack_push(op1 / op2);
+    return SUCCESS;
 }
 
 void do_and() {
@@ -184,15 +369,204 @@ void do_jif(uint8_t *bytecode) {
     }
 }
 
+void do_jif_long(uint8_t *bytecode) {
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    } else {
+        vm.instruction_ptr += 4;
+    }
+}
+
+void do_jmp(uint8_t *bytecode) {
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+}
+
+void do_jiz(uint8_t *bytecode) {
+    if (*(vm.stack_top - 1) == 0) {
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    } else {
+        vm.instruction_ptr += 4;
+    }
+}
+
+void do_load() {
+    *(vm.stack_top - 1) = mem_cell(*(vm.stack_top - 1));
+}
+
+void do_store() {
+    uint64_t val = stack_pop();
+    uint64_t addr = stack_pop();
+    mem_cell(addr) = val;
+}
+
+/*
+ * Open a frame at base for a CALL, or close the current one for a RET. Both
+ * go before the return stack itself moves.
+ */
+#define enter_frame(base)                                           \
+    do {                                                            \
+        vm.frame_stack[vm.return_top - vm.return_stack] = vm.frame; \
+        vm.frame = (base);                                          \
+    } while (0)
+
+#define leave_frame() (vm.frame = vm.frame_stack[vm.return_top - vm.return_stack - 1])
+
+result do_call(uint8_t *bytecode) {
+    if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+        return ERR_CALL_OVERFLOW;
+    }
+    enter_frame(vm.stack_top);
+    *vm.return_top++ = vm.instruction_ptr + 4;
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    return SUCCESS;
+}
+
+result do_ret() {
+    if (vm.return_top == vm.return_stack) {
+        return ERR_RET_UNDERFLOW;
+    }
+    leave_frame();
+    vm.instruction_ptr = *--vm.return_top;
+    return SUCCESS;
+}
+
+void do_loop(uint8_t *bytecode) {
+    *(vm.stack_top - 1) -= vm.instruction_ptr[1];
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + vm.instruction_ptr[0] - 1;
+    } else {
+        vm.instruction_ptr += 2;
+    }
+}
+
 void do_pop_res() {
     vm.result = stack_pop();
 }
 
+void do_fadd() {
+    uint64_t op2 = stack_pop();
+    uint64_t op1 = stack_pop();
+    stack_push(value_fadd(op1, op2));
+}
+
+void do_fsub() {
+    uint64_t op2 = stack_pop();
+    uint64_t op1 = stack_pop();
+    stack_push(value_fsub(op1, op2));
+}
+
+void do_fmul() {
+    uint64_t op2 = stack_pop();
+    uint64_t op1 = stack_pop();
+    stack_push(value_fmul(op1, op2));
+}
+
+void do_fdiv() {
+    uint64_t op2 = stack_pop();
+    uint64_t op1 = stack_pop();
+    stack_push(value_fdiv(op1, op2));
+}
+
+void do_itof() {
+    *(vm.stack_top - 1) = value_itof(*(vm.stack_top - 1));
+}
+
+void do_ftoi() {
+    *(vm.stack_top - 1) = value_ftoi(*(vm.stack_top - 1));
+}
+
+void do_div_const() {
+    uint8_t divisor = *vm.instruction_ptr++;
+    *(vm.stack_top - 1) = div_by_magic(*(vm.stack_top - 1), div_magics[divisor]);
+}
+
+void do_lshift_const() {
+    *(vm.stack_top - 1) <<= *vm.instruction_ptr++;
+}
+
+void do_rshift_const() {
+    *(vm.stack_top - 1) >>= *vm.instruction_ptr++;
+}
+
+void do_dup() {
+    stack_push(*(vm.stack_top - 1));
+}
+
+void do_drop() {
+    vm.stack_top--;
+}
+
+void do_swap() {
+    uint64_t op2 = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = op2;
+}
+
+void do_over() {
+    stack_push(*(vm.stack_top - 2));
+}
+
+void do_rot() {
+    uint64_t op1 = *(vm.stack_top - 3);
+    *(vm.stack_top - 3) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = op1;
+}
+
+/*
+ * The index is signed, so that a procedure can reach its arguments.
+ */
+void do_load_local() {
+    int8_t slot = (int8_t) *vm.instruction_ptr++;
+    stack_push(vm.frame[slot]);
+}
+
+void do_store_local() {
+    int8_t slot = (int8_t) *vm.instruction_ptr++;
+    vm.frame[slot] = stack_pop();
+}
+
+/*
+ * Unlike the other helpers, these take their operands already decoded, since
+ * the bytecode and threaded engines find them in different places. The entry
+ * is whatever the engine's return addresses point at.
+ */
+result do_spawn(void *entry, uint8_t argc) {
+    if (argc > SPAWN_ARGS_MAX) {
+        return ERR_SPAWN_ARGS;
+    }
+    uint64_t handle;
+    struct spawn_task *t = spawn_alloc(&handle);
+    if (t == NULL) {
+        return ERR_TOO_MANY_TASKS;
+    }
+    t->engine = vm.engine;
+    t->bytecode = vm.code;
+    t->memory = vm.memory;
+    t->entry = entry;
+    t->cells = vm.cells;
+    t->argc = argc;
+    memcpy(t->args, vm.stack_top - argc, argc * sizeof(uint64_t));
+    spawn_submit(t);
+    stack_push(handle);
+    return SUCCESS;
+}
+
+result do_join() {
+    uint64_t value;
+    result r = spawn_wait(*(vm.stack_top - 1), &value);
+    if (r == SUCCESS) {
+        *(vm.stack_top - 1) = value;
+    }
+    return r;
+}
+
 /*
  * Direct threading dispatch using computed GOTO statements.
  */
 result interpret_threaded_dispatch(uint8_t *bytecode) {
-    vm.instruction_ptr = bytecode;
+    vm.instruction_ptr = vm.entry != NULL ? vm.entry : bytecode;
+    vm.frame = vm.stack;
 
     /*
      * e TODO
@@ -200,6 +574,7 @@ result interpret_threaded_dispatch(uint8_t *bytecode) {
     uint64_t op1;
     uint64_t op2;
     uint64_t imm;
+    result status;
 
     /*
      * This is our lookup table of GOTO labels for each instruction. We can use
@@ -219,7 +594,33 @@ result interpret_threaded_dispatch(uint8_t *bytecode) {
             &&rshift_label,
             &&jif_label,
             &&pop_res_label,
-            &&done_label
+            &&done_label,
+            &&jif_long_label,
+            &&load_label,
+            &&store_label,
+            &&call_label,
+            &&ret_label,
+            &&loop_label,
+            &&fadd_label,
+            &&fsub_label,
+            &&fmul_label,
+            &&fdiv_label,
+            &&itof_label,
+            &&ftoi_label,
+            &&jmp_label,
+            &&jiz_label,
+            &&div_const_label,
+            &&lshift_const_label,
+            &&rshift_const_label,
+            &&dup_label,
+            &&drop_label,
+            &&swap_label,
+            &&over_label,
+            &&rot_label,
+            &&load_local_label,
+            &&store_local_label,
+            &&spawn_label,
+            &&join_label
     };
 
     /*
@@ -309,6 +710,7 @@ result interpret_threaded_dispatch(uint8_t *bytecode) {
     vm.stack_top--;
     op2 = *vm.stack_top;
     vm.stack_top--;
+    op1 = *vm.stack_top;
     *vm.stack_top = op1 ^ op2;
     vm.stack_top++;
     go_next;
@@ -361,104 +763,400 @@ result interpret_threaded_dispatch(uint8_t *bytecode) {
     //vm.instruction_ptr++;
     go_next;
 
-    done_label:
-    printf("Done!\n");
-    return SUCCESS;
-}
+    jif_long_label:
+    if (*(vm.stack_top - 1) != 0) {
 
-/*
- * I want to test how much function calls slow down our dispatch loop.
- */
-result interpret_function_dispatch(uint8_t *bytecode) {
-    vm.instruction_ptr = bytecode;
-    for (;;) {
-        uint8_t instruction = *vm.instruction_ptr++;
-        switch (instruction) {
-            case PUSH_IMM: {
-                do_push_imm();
-                break;
-            }
-            case ADD: {
-                do_add();
-                break;
-            }
-            case SUB: {
-                do_sub();
-                break;
-            }
-            case MUL: {
-                do_mul();
-                break;
-            }
-            case DIV: {
-                do_div();
-                break;
-            }
-            case AND: {
-                do_and();
-                break;
-            }
-            case OR: {
-                do_or();
-                break;
-            }
-            case XOR: {
-                do_xor();
-                break;
-            }
-            case NOT: {
-                do_not();
-                break;
-            }
-            case LSHIFT: {
-                do_lshift();
-                break;
-            }
-            case RSHIFT: {
-                do_rshift();
-                break;
-            }
-            case JIF: {
-                do_jif(bytecode);
-                break;
-            }
-            case POP_RES: {
-                do_pop_res();
-                break;
-            }
-            case DONE: {
-                printf("Done!\n");
-                return SUCCESS;
-            }
-            default: {
-                fprintf(stderr, "Unknown opcode\n");
-                fflush(stderr);
-                return ERR_UNKNOWN_OPCODE;
-            }
-        }
+        /*
+         * Land one byte early because go_next bumps the pointer.
+         */
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr + 1) - 1;
+    } else {
+        vm.instruction_ptr += 4;
     }
-}
+    go_next;
 
-/*
- * Interpreter loop without any function calls.
- */
-result interpret_inline(uint8_t *bytecode) {
-    vm.instruction_ptr = bytecode;
-    for (;;) {
-        uint8_t instruction = *vm.instruction_ptr++;
-        switch (instruction) {
-            case PUSH_IMM: {
-                *vm.stack_top = *vm.instruction_ptr++;
-                vm.stack_top++;
-                break;
-            }
-            case ADD: {
-                vm.stack_top--;
-                uint64_t op2 = *vm.stack_top;
-                vm.stack_top--;
-                uint64_t op1 = *vm.stack_top;
-                *vm.stack_top = op1 + op2;
-                vm.stack_top++;
+    load_label:
+    *(vm.stack_top - 1) = mem_cell(*(vm.stack_top - 1));
+    go_next;
+
+    store_label:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    mem_cell(op1) = op2;
+    go_next;
+
+    call_label:
+    if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+        return ERR_CALL_OVERFLOW;
+    }
+    enter_frame(vm.stack_top);
+    *vm.return_top++ = vm.instruction_ptr + 5;
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr + 1) - 1;
+    go_next;
+
+    ret_label:
+    if (vm.return_top == vm.return_stack) {
+        return ERR_RET_UNDERFLOW;
+    }
+    leave_frame();
+    vm.instruction_ptr = (uint8_t *) *--vm.return_top - 1;
+    go_next;
+
+    loop_label:
+    *(vm.stack_top - 1) -= vm.instruction_ptr[2];
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + vm.instruction_ptr[1] - 2;
+    } else {
+        vm.instruction_ptr += 2;
+    }
+    go_next;
+
+    fadd_label:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fadd(op1, op2);
+    vm.stack_top++;
+    go_next;
+
+    fsub_label:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fsub(op1, op2);
+    vm.stack_top++;
+    go_next;
+
+    fmul_label:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fmul(op1, op2);
+    vm.stack_top++;
+    go_next;
+
+    fdiv_label:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fdiv(op1, op2);
+    vm.stack_top++;
+    go_next;
+
+    itof_label:
+    *(vm.stack_top - 1) = value_itof(*(vm.stack_top - 1));
+    go_next;
+
+    ftoi_label:
+    *(vm.stack_top - 1) = value_ftoi(*(vm.stack_top - 1));
+    go_next;
+
+    jmp_label:
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr + 1) - 1;
+    go_next;
+
+    jiz_label:
+    if (*(vm.stack_top - 1) == 0) {
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr + 1) - 1;
+    } else {
+        vm.instruction_ptr += 4;
+    }
+    go_next;
+
+    div_const_label:
+    vm.instruction_ptr++;
+    *(vm.stack_top - 1) = div_by_magic(*(vm.stack_top - 1), div_magics[*vm.instruction_ptr]);
+    go_next;
+
+    lshift_const_label:
+    vm.instruction_ptr++;
+    *(vm.stack_top - 1) <<= *vm.instruction_ptr;
+    go_next;
+
+    rshift_const_label:
+    vm.instruction_ptr++;
+    *(vm.stack_top - 1) >>= *vm.instruction_ptr;
+    go_next;
+
+    dup_label:
+    *vm.stack_top = *(vm.stack_top - 1);
+    vm.stack_top++;
+    go_next;
+
+    drop_label:
+    vm.stack_top--;
+    go_next;
+
+    swap_label:
+    op2 = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = op2;
+    go_next;
+
+    over_label:
+    *vm.stack_top = *(vm.stack_top - 2);
+    vm.stack_top++;
+    go_next;
+
+    rot_label:
+    op1 = *(vm.stack_top - 3);
+    *(vm.stack_top - 3) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = op1;
+    go_next;
+
+    load_local_label:
+    vm.instruction_ptr++;
+    *vm.stack_top = vm.frame[(int8_t) *vm.instruction_ptr];
+    vm.stack_top++;
+    go_next;
+
+    store_local_label:
+    vm.instruction_ptr++;
+    vm.stack_top--;
+    vm.frame[(int8_t) *vm.instruction_ptr] = *vm.stack_top;
+    go_next;
+
+    spawn_label:
+    status = do_spawn(bytecode + read_u32(vm.instruction_ptr + 1), vm.instruction_ptr[5]);
+    if (status != SUCCESS) {
+        return status;
+    }
+    vm.instruction_ptr += 5;
+    go_next;
+
+    join_label:
+    status = do_join();
+    if (status != SUCCESS) {
+        return status;
+    }
+    go_next;
+
+    done_label:
+    print_done();
+    return SUCCESS;
+}
+
+/*
+ * I want to test how much function calls slow down our dispatch loop.
+ */
+result interpret_function_dispatch(uint8_t *bytecode) {
+    vm.instruction_ptr = vm.entry != NULL ? vm.entry : bytecode;
+    vm.frame = vm.stack;
+    for (;;) {
+        uint8_t instruction = *vm.instruction_ptr++;
+        switch (instruction) {
+            case PUSH_IMM: {
+                do_push_imm();
+                break;
+            }
+            case ADD: {
+                do_add();
+                break;
+            }
+            case SUB: {
+                do_sub();
+                break;
+            }
+            case MUL: {
+                do_mul();
+                break;
+            }
+            case DIV: {
+                if (do_div() != SUCCESS) {
+                    return ERR_DIV_ZERO;
+                }
+                break;
+            }
+            case AND: {
+                do_and();
+                break;
+            }
+            case OR: {
+                do_or();
+                break;
+            }
+            case XOR: {
+                do_xor();
+                break;
+            }
+            case NOT: {
+                do_not();
+                break;
+            }
+            case LSHIFT: {
+                do_lshift();
+                break;
+            }
+            case RSHIFT: {
+                do_rshift();
+                break;
+            }
+            case JIF: {
+                do_jif(bytecode);
+                break;
+            }
+            case POP_RES: {
+                do_pop_res();
+                break;
+            }
+            case JIF_LONG: {
+                do_jif_long(bytecode);
+                break;
+            }
+            case LOAD: {
+                do_load();
+                break;
+            }
+            case STORE: {
+                do_store();
+                break;
+            }
+            case CALL: {
+                result r = do_call(bytecode);
+                if (r != SUCCESS) {
+                    return r;
+                }
+                break;
+            }
+            case RET: {
+                result r = do_ret();
+                if (r != SUCCESS) {
+                    return r;
+                }
+                break;
+            }
+            case LOOP: {
+                do_loop(bytecode);
+                break;
+            }
+            case FADD: {
+                do_fadd();
+                break;
+            }
+            case FSUB: {
+                do_fsub();
+                break;
+            }
+            case FMUL: {
+                do_fmul();
+                break;
+            }
+            case FDIV: {
+                do_fdiv();
+                break;
+            }
+            case ITOF: {
+                do_itof();
+                break;
+            }
+            case FTOI: {
+                do_ftoi();
+                break;
+            }
+            case JMP: {
+                do_jmp(bytecode);
+                break;
+            }
+            case JIZ: {
+                do_jiz(bytecode);
+                break;
+            }
+            case DIV_CONST: {
+                do_div_const();
+                break;
+            }
+            case LSHIFT_CONST: {
+                do_lshift_const();
+                break;
+            }
+            case RSHIFT_CONST: {
+                do_rshift_const();
+                break;
+            }
+            case DUP: {
+                do_dup();
+                break;
+            }
+            case DROP: {
+                do_drop();
+                break;
+            }
+            case SWAP: {
+                do_swap();
+                break;
+            }
+            case OVER: {
+                do_over();
+                break;
+            }
+            case ROT: {
+                do_rot();
+                break;
+            }
+            case LOAD_LOCAL: {
+                do_load_local();
+                break;
+            }
+            case STORE_LOCAL: {
+                do_store_local();
+                break;
+            }
+            case SPAWN: {
+                result r = do_spawn(bytecode + read_u32(vm.instruction_ptr), vm.instruction_ptr[4]);
+                if (r != SUCCESS) {
+                    return r;
+                }
+                vm.instruction_ptr += 5;
+                break;
+            }
+            case JOIN: {
+                result r = do_join();
+                if (r != SUCCESS) {
+                    return r;
+                }
+                break;
+            }
+            case DONE: {
+                print_done();
+                return SUCCESS;
+            }
+            default: {
+                fprintf(stderr, "Unknown opcode\n");
+                fflush(stderr);
+                return ERR_UNKNOWN_OPCODE;
+            }
+        }
+    }
+}
+
+/*
+ * Interpreter loop without any function calls.
+ */
+result interpret_inline(uint8_t *bytecode) {
+    vm.instruction_ptr = vm.entry != NULL ? vm.entry : bytecode;
+    vm.frame = vm.stack;
+    for (;;) {
+        uint8_t instruction = *vm.instruction_ptr++;
+        switch (instruction) {
+            case PUSH_IMM: {
+                *vm.stack_top = *vm.instruction_ptr++;
+                vm.stack_top++;
+                break;
+            }
+            case ADD: {
+                vm.stack_top--;
+                uint64_t op2 = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t op1 = *vm.stack_top;
+                *vm.stack_top = op1 + op2;
+                vm.stack_top++;
                 break;
             }
             case SUB: {
@@ -573,17 +1271,1551 @@ result interpret_inline(uint8_t *bytecode) {
                 vm.result = *vm.stack_top;
                 break;
             }
-            case DONE: {
-                printf("Done!\n");
-                return SUCCESS;
-            }
-            default: {
-                fprintf(stderr, "Unknown opcode\n");
-                fflush(stderr);
-                return ERR_UNKNOWN_OPCODE;
+            case JIF_LONG: {
+                if (*(vm.stack_top - 1) != 0) {
+                    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+                } else {
+                    vm.instruction_ptr += 4;
+                }
+                break;
             }
+            case LOAD: {
+
+                /*
+                 * No bounds check: see MEM_RESERVE.
+                 */
+                *(vm.stack_top - 1) = mem_cell(*(vm.stack_top - 1));
+                break;
+            }
+            case STORE: {
+                vm.stack_top--;
+                uint64_t val = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t addr = *vm.stack_top;
+                mem_cell(addr) = val;
+                break;
+            }
+            case CALL: {
+                if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+                    return ERR_CALL_OVERFLOW;
+                }
+                enter_frame(vm.stack_top);
+                *vm.return_top++ = vm.instruction_ptr + 4;
+                vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+                break;
+            }
+            case RET: {
+                if (vm.return_top == vm.return_stack) {
+                    return ERR_RET_UNDERFLOW;
+                }
+                leave_frame();
+                vm.instruction_ptr = *--vm.return_top;
+                break;
+            }
+            case LOOP: {
+                uint8_t loc = *vm.instruction_ptr++;
+                uint8_t step = *vm.instruction_ptr++;
+                *(vm.stack_top - 1) -= step;
+                if (*(vm.stack_top - 1) != 0) {
+                    vm.instruction_ptr = bytecode + loc - 1;
+                }
+                break;
+            }
+            case FADD: {
+                vm.stack_top--;
+                uint64_t op2 = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t op1 = *vm.stack_top;
+                *vm.stack_top = value_fadd(op1, op2);
+                vm.stack_top++;
+                break;
+            }
+            case FSUB: {
+                vm.stack_top--;
+                uint64_t op2 = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t op1 = *vm.stack_top;
+                *vm.stack_top = value_fsub(op1, op2);
+                vm.stack_top++;
+                break;
+            }
+            case FMUL: {
+                vm.stack_top--;
+                uint64_t op2 = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t op1 = *vm.stack_top;
+                *vm.stack_top = value_fmul(op1, op2);
+                vm.stack_top++;
+                break;
+            }
+            case FDIV: {
+                vm.stack_top--;
+                uint64_t op2 = *vm.stack_top;
+                vm.stack_top--;
+                uint64_t op1 = *vm.stack_top;
+                *vm.stack_top = value_fdiv(op1, op2);
+                vm.stack_top++;
+                break;
+            }
+            case ITOF: {
+                *(vm.stack_top - 1) = value_itof(*(vm.stack_top - 1));
+                break;
+            }
+            case FTOI: {
+                *(vm.stack_top - 1) = value_ftoi(*(vm.stack_top - 1));
+                break;
+            }
+            case JMP: {
+                vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+                break;
+            }
+            case JIZ: {
+                if (*(vm.stack_top - 1) == 0) {
+                    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+                } else {
+                    vm.instruction_ptr += 4;
+                }
+                break;
+            }
+            case DIV_CONST: {
+                uint8_t divisor = *vm.instruction_ptr++;
+                *(vm.stack_top - 1) = div_by_magic(*(vm.stack_top - 1), div_magics[divisor]);
+                break;
+            }
+            case LSHIFT_CONST: {
+                *(vm.stack_top - 1) <<= *vm.instruction_ptr++;
+                break;
+            }
+            case RSHIFT_CONST: {
+                *(vm.stack_top - 1) >>= *vm.instruction_ptr++;
+                break;
+            }
+            case DUP: {
+                *vm.stack_top = *(vm.stack_top - 1);
+                vm.stack_top++;
+                break;
+            }
+            case DROP: {
+                vm.stack_top--;
+                break;
+            }
+            case SWAP: {
+                uint64_t op2 = *(vm.stack_top - 1);
+                *(vm.stack_top - 1) = *(vm.stack_top - 2);
+                *(vm.stack_top - 2) = op2;
+                break;
+            }
+            case OVER: {
+                *vm.stack_top = *(vm.stack_top - 2);
+                vm.stack_top++;
+                break;
+            }
+            case ROT: {
+                uint64_t op1 = *(vm.stack_top - 3);
+                *(vm.stack_top - 3) = *(vm.stack_top - 2);
+                *(vm.stack_top - 2) = *(vm.stack_top - 1);
+                *(vm.stack_top - 1) = op1;
+                break;
+            }
+            case LOAD_LOCAL: {
+                int8_t slot = (int8_t) *vm.instruction_ptr++;
+                *vm.stack_top = vm.frame[slot];
+                vm.stack_top++;
+                break;
+            }
+            case STORE_LOCAL: {
+                int8_t slot = (int8_t) *vm.instruction_ptr++;
+                vm.stack_top--;
+                vm.frame[slot] = *vm.stack_top;
+                break;
+            }
+            case SPAWN: {
+                result r = do_spawn(bytecode + read_u32(vm.instruction_ptr), vm.instruction_ptr[4]);
+                if (r != SUCCESS) {
+                    return r;
+                }
+                vm.instruction_ptr += 5;
+                break;
+            }
+            case JOIN: {
+                result r = do_join();
+                if (r != SUCCESS) {
+                    return r;
+                }
+                break;
+            }
+            case DONE: {
+                print_done();
+                return SUCCESS;
+            }
+            default: {
+                fprintf(stderr, "Unknown opcode\n");
+                fflush(stderr);
+                return ERR_UNKNOWN_OPCODE;
+            }
+        }
+    }
+}
+
+/*
+ * Replicated switch dispatch. Instead of jumping back to a single switch at the
+ * top of a loop, every handler ends with its own copy of the switch, so the
+ * branch predictor gets a separate indirect jump per handler the same way it
+ * does with computed GOTOs. This one is plain C, though.
+ */
+#define replicated_dispatch                                                    \
+    switch (*vm.instruction_ptr++) {                                           \
+        case PUSH_IMM: goto push_imm_case;                                     \
+        case ADD: goto add_case;                                               \
+        case SUB: goto sub_case;                                               \
+        case MUL: goto mul_case;                                               \
+        case DIV: goto div_case;                                               \
+        case AND: goto and_case;                                               \
+        case OR: goto or_case;                                                 \
+        case XOR: goto xor_case;                                               \
+        case NOT: goto not_case;                                               \
+        case LSHIFT: goto lshift_case;                                         \
+        case RSHIFT: goto rshift_case;                                         \
+        case JIF: goto jif_case;                                               \
+        case POP_RES: goto pop_res_case;                                       \
+        case DONE: goto done_case;                                             \
+        case JIF_LONG: goto jif_long_case;                                     \
+        case LOAD: goto load_case;                                             \
+        case STORE: goto store_case;                                           \
+        case CALL: goto call_case;                                             \
+        case RET: goto ret_case;                                               \
+        case LOOP: goto loop_case;                                             \
+        case FADD: goto fadd_case;                                             \
+        case FSUB: goto fsub_case;                                             \
+        case FMUL: goto fmul_case;                                             \
+        case FDIV: goto fdiv_case;                                             \
+        case ITOF: goto itof_case;                                             \
+        case FTOI: goto ftoi_case;                                             \
+        case JMP: goto jmp_case;                                               \
+        case JIZ: goto jiz_case;                                               \
+        case DIV_CONST: goto div_const_case;                                   \
+        case LSHIFT_CONST: goto lshift_const_case;                             \
+        case RSHIFT_CONST: goto rshift_const_case;                             \
+        case DUP: goto dup_case;                                               \
+        case DROP: goto drop_case;                                             \
+        case SWAP: goto swap_case;                                             \
+        case OVER: goto over_case;                                             \
+        case ROT: goto rot_case;                                               \
+        case LOAD_LOCAL: goto load_local_case;                                 \
+        case STORE_LOCAL: goto store_local_case;                               \
+        case SPAWN: goto spawn_case;                                           \
+        case JOIN: goto join_case;                                             \
+        default: goto unknown_case;                                            \
+    }
+
+result interpret_replicated_switch(uint8_t *bytecode) {
+    vm.instruction_ptr = vm.entry != NULL ? vm.entry : bytecode;
+    vm.frame = vm.stack;
+    uint64_t op1;
+    uint64_t op2;
+    result status;
+
+    /*
+     * Get the ball rolling.
+     */
+    replicated_dispatch;
+
+    push_imm_case:
+    *vm.stack_top = *vm.instruction_ptr++;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    add_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 + op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    sub_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 - op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    mul_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 * op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    div_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    if (op2 == 0) {
+        return ERR_DIV_ZERO;
+    }
+    *vm.stack_top = op1 / op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    and_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 & op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    or_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 | op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    xor_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 ^ op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    not_case:
+    *(vm.stack_top - 1) = ~*(vm.stack_top - 1);
+    replicated_dispatch;
+
+    lshift_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 << op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    rshift_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = op1 >> op2;
+    vm.stack_top++;
+    replicated_dispatch;
+
+    jif_case:
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + *vm.instruction_ptr - 1;
+    } else {
+        vm.instruction_ptr++;
+    }
+    replicated_dispatch;
+
+    pop_res_case:
+    vm.stack_top--;
+    vm.result = *vm.stack_top;
+    replicated_dispatch;
+
+    jif_long_case:
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    } else {
+        vm.instruction_ptr += 4;
+    }
+    replicated_dispatch;
+
+    load_case:
+    *(vm.stack_top - 1) = mem_cell(*(vm.stack_top - 1));
+    replicated_dispatch;
+
+    store_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    mem_cell(op1) = op2;
+    replicated_dispatch;
+
+    call_case:
+    if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+        return ERR_CALL_OVERFLOW;
+    }
+    enter_frame(vm.stack_top);
+    *vm.return_top++ = vm.instruction_ptr + 4;
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    replicated_dispatch;
+
+    ret_case:
+    if (vm.return_top == vm.return_stack) {
+        return ERR_RET_UNDERFLOW;
+    }
+    leave_frame();
+    vm.instruction_ptr = *--vm.return_top;
+    replicated_dispatch;
+
+    loop_case:
+    *(vm.stack_top - 1) -= vm.instruction_ptr[1];
+    if (*(vm.stack_top - 1) != 0) {
+        vm.instruction_ptr = bytecode + *vm.instruction_ptr - 1;
+    } else {
+        vm.instruction_ptr += 2;
+    }
+    replicated_dispatch;
+
+    fadd_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fadd(op1, op2);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    fsub_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fsub(op1, op2);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    fmul_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fmul(op1, op2);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    fdiv_case:
+    vm.stack_top--;
+    op2 = *vm.stack_top;
+    vm.stack_top--;
+    op1 = *vm.stack_top;
+    *vm.stack_top = value_fdiv(op1, op2);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    itof_case:
+    *(vm.stack_top - 1) = value_itof(*(vm.stack_top - 1));
+    replicated_dispatch;
+
+    ftoi_case:
+    *(vm.stack_top - 1) = value_ftoi(*(vm.stack_top - 1));
+    replicated_dispatch;
+
+    jmp_case:
+    vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    replicated_dispatch;
+
+    jiz_case:
+    if (*(vm.stack_top - 1) == 0) {
+        vm.instruction_ptr = bytecode + read_u32(vm.instruction_ptr);
+    } else {
+        vm.instruction_ptr += 4;
+    }
+    replicated_dispatch;
+
+    div_const_case:
+    *(vm.stack_top - 1) = div_by_magic(*(vm.stack_top - 1), div_magics[*vm.instruction_ptr++]);
+    replicated_dispatch;
+
+    lshift_const_case:
+    *(vm.stack_top - 1) <<= *vm.instruction_ptr++;
+    replicated_dispatch;
+
+    rshift_const_case:
+    *(vm.stack_top - 1) >>= *vm.instruction_ptr++;
+    replicated_dispatch;
+
+    dup_case:
+    *vm.stack_top = *(vm.stack_top - 1);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    drop_case:
+    vm.stack_top--;
+    replicated_dispatch;
+
+    swap_case:
+    op2 = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = op2;
+    replicated_dispatch;
+
+    over_case:
+    *vm.stack_top = *(vm.stack_top - 2);
+    vm.stack_top++;
+    replicated_dispatch;
+
+    rot_case:
+    op1 = *(vm.stack_top - 3);
+    *(vm.stack_top - 3) = *(vm.stack_top - 2);
+    *(vm.stack_top - 2) = *(vm.stack_top - 1);
+    *(vm.stack_top - 1) = op1;
+    replicated_dispatch;
+
+    load_local_case:
+    *vm.stack_top = vm.frame[(int8_t) *vm.instruction_ptr++];
+    vm.stack_top++;
+    replicated_dispatch;
+
+    store_local_case:
+    vm.stack_top--;
+    vm.frame[(int8_t) *vm.instruction_ptr++] = *vm.stack_top;
+    replicated_dispatch;
+
+    spawn_case:
+    status = do_spawn(bytecode + read_u32(vm.instruction_ptr), vm.instruction_ptr[4]);
+    if (status != SUCCESS) {
+        return status;
+    }
+    vm.instruction_ptr += 5;
+    replicated_dispatch;
+
+    join_case:
+    status = do_join();
+    if (status != SUCCESS) {
+        return status;
+    }
+    replicated_dispatch;
+
+    done_case:
+    print_done();
+    return SUCCESS;
+
+    unknown_case:
+    fprintf(stderr, "Unknown opcode\n");
+    fflush(stderr);
+    return ERR_UNKNOWN_OPCODE;
+}
+
+/*
+ * The call-threaded and tail-call engines don't walk the bytecode itself.
+ * Before running, we translate it into "threaded code": an array of cells where
+ * each instruction becomes the address of its handler followed by its operand,
+ * already widened to a full cell. Jump and CALL operands become pointers
+ * straight to the target cell. LOOP has two operands and gets a cell
+ * for each: the target, then the step. So does SPAWN: its procedure, then how
+ * many values it copies.
+ */
+typedef union thread_cell {
+    void *handler;
+    uint64_t imm;
+    union thread_cell *target;
+} thread_cell;
+
+/*
+ * The threaded code an engine is running right now, if any, and the offset of
+ * the instruction each of its cells came from, so that a sampling profiler
+ * can map a cell back to the bytecode. cells is 0 when nothing is running.
+ */
+struct {
+    thread_cell *code;
+    uint32_t *offsets;
+    volatile size_t cells;
+} threaded_map;
+
+/*
+ * Write bytecode back out as source that stacka can assemble. Stops at the
+ * first opcode we don't recognize.
+ */
+void disassemble(FILE *f, uint8_t *bytecode, size_t len) {
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(bytecode[pc])) {
+        uint8_t op = bytecode[pc];
+        if (op >= NUM_OPCODES || pc + operand_bytes(op) >= len) {
+            fprintf(f, "# %zu: can't decode %02X\n", pc, op);
+            return;
+        }
+        fprintf(f, "%s\n", opcode_names[op]);
+        if (operand_bytes(op) == 4) {
+            fprintf(f, "%u\n", read_u32(bytecode + pc + 1));
+        } else if (op == LOOP) {
+            fprintf(f, "%u\n%u\n", bytecode[pc + 1], bytecode[pc + 2]);
+        } else if (op == SPAWN) {
+            fprintf(f, "%u\n%u\n", read_u32(bytecode + pc + 1), bytecode[pc + 5]);
+        } else if (op == LOAD_LOCAL || op == STORE_LOCAL) {
+            fprintf(f, "%d\n", (int8_t) bytecode[pc + 1]);
+        } else if (operand_bytes(op) == 1) {
+            fprintf(f, "%u\n", bytecode[pc + 1]);
+        }
+    }
+}
+
+/*
+ * Translate bytecode into threaded code using the given handler table, which
+ * has NUM_OPCODES entries plus one for unknown opcodes at the end.
+ *
+ * Bytecode doesn't carry its length, so we scan until we reach a DONE, RET or
+ * JMP (or an opcode we don't recognize) that no jump or call can get past.
+ * Returns NULL if a jump lands in the middle of an instruction, since there's
+ * no cell to point it to.
+ * The caller frees the result with free_threaded.
+ */
+thread_cell *translate_threaded(uint8_t *bytecode, void **handlers) {
+    size_t len = 0;
+    size_t furthest_target = 0;
+    for (size_t pc = 0;; pc += 1 + operand_bytes(bytecode[pc])) {
+        uint8_t op = bytecode[pc];
+        size_t target = jump_target(bytecode, pc);
+        if (target != SIZE_MAX && target > furthest_target) {
+            furthest_target = target;
+        }
+        if (((op == DONE || op == RET || op == JMP) && pc >= furthest_target) || op >= NUM_OPCODES) {
+            len = pc + 1;
+            break;
+        }
+    }
+
+    /*
+     * Every instruction and operand byte becomes at most one cell, so len
+     * cells is always enough.
+     */
+    thread_cell *code = malloc(len * sizeof(thread_cell));
+    size_t *cell_of = malloc(len * sizeof(size_t));
+    uint32_t *offsets = malloc(len * sizeof(uint32_t));
+    if (code == NULL || cell_of == NULL || offsets == NULL) {
+        free(code);
+        free(cell_of);
+        free(offsets);
+        return NULL;
+    }
+    for (size_t pc = 0; pc < len; pc++) {
+        cell_of[pc] = SIZE_MAX;
+    }
+
+    size_t n = 0;
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(bytecode[pc])) {
+        uint8_t op = bytecode[pc];
+        cell_of[pc] = n;
+        offsets[n] = pc;
+        code[n++].handler = handlers[op < NUM_OPCODES ? op : NUM_OPCODES];
+        if (operand_bytes(op) > 0) {
+            offsets[n] = pc;
+            code[n++].imm = bytecode[pc + 1];
+        }
+        if (op == LOOP || op == SPAWN) {
+            offsets[n] = pc;
+            code[n++].imm = bytecode[pc + operand_bytes(op)];
+        }
+    }
+
+    /*
+     * Now that every instruction has a cell, point the jumps at their targets.
+     */
+    for (size_t pc = 0; pc < len; pc += 1 + operand_bytes(bytecode[pc])) {
+        size_t target = jump_target(bytecode, pc);
+        if (target == SIZE_MAX && bytecode[pc] != JIF && bytecode[pc] != LOOP) {
+            continue;
+        }
+        if (target >= len || cell_of[target] == SIZE_MAX) {
+            free(code);
+            free(cell_of);
+            free(offsets);
+            return NULL;
+        }
+        code[cell_of[pc] + 1].target = &code[cell_of[target]];
+    }
+    free(cell_of);
+    threaded_map.code = code;
+    threaded_map.offsets = offsets;
+    threaded_map.cells = n;
+    return code;
+}
+
+void free_threaded(thread_cell *code) {
+    if (threaded_map.code == code) {
+        threaded_map.cells = 0;
+        free(threaded_map.offsets);
+        threaded_map.code = NULL;
+        threaded_map.offsets = NULL;
+    }
+    free(code);
+}
+
+/*
+ * Call threading. Each handler is a function that does its work and returns
+ * the next cell to execute, and the dispatch loop just keeps calling whatever
+ * it gets back. A NULL return stops the loop.
+ */
+typedef thread_cell *(*call_handler)(thread_cell *ip);
+
+/*
+ * Handlers can't return a status, so they leave it here before stopping.
+ */
+__thread result call_threaded_status;
+
+/*
+ * The cell the dispatch loop is on. It's a global rather than a local so that
+ * a sampling profiler can see it, which costs nothing in an -O0 build, where
+ * the local lives in memory too.
+ */
+__thread thread_cell *volatile call_threaded_ip;
+
+thread_cell *call_push_imm(thread_cell *ip) {
+    *vm.stack_top = ip[1].imm;
+    vm.stack_top++;
+    return ip + 2;
+}
+
+thread_cell *call_add(thread_cell *ip) {
+    do_add();
+    return ip + 1;
+}
+
+thread_cell *call_sub(thread_cell *ip) {
+    do_sub();
+    return ip + 1;
+}
+
+thread_cell *call_mul(thread_cell *ip) {
+    do_mul();
+    return ip + 1;
+}
+
+thread_cell *call_div(thread_cell *ip) {
+    vm.stack_top--;
+    uint64_t op2 = *vm.stack_top;
+    vm.stack_top--;
+    uint64_t op1 = *vm.stack_top;
+    if (op2 == 0) {
+        call_threaded_status = ERR_DIV_ZERO;
+        return NULL;
+    }
+    *vm.stack_top = op1 / op2;
+    vm.stack_top++;
+    return ip + 1;
+}
+
+thread_cell *call_and(thread_cell *ip) {
+    do_and();
+    return ip + 1;
+}
+
+thread_cell *call_or(thread_cell *ip) {
+    do_or();
+    return ip + 1;
+}
+
+thread_cell *call_xor(thread_cell *ip) {
+    do_xor();
+    return ip + 1;
+}
+
+thread_cell *call_not(thread_cell *ip) {
+    do_not();
+    return ip + 1;
+}
+
+thread_cell *call_lshift(thread_cell *ip) {
+    do_lshift();
+    return ip + 1;
+}
+
+thread_cell *call_rshift(thread_cell *ip) {
+    do_rshift();
+    return ip + 1;
+}
+
+thread_cell *call_jif(thread_cell *ip) {
+    if (*(vm.stack_top - 1) != 0) {
+        return ip[1].target;
+    }
+    return ip + 2;
+}
+
+thread_cell *call_pop_res(thread_cell *ip) {
+    do_pop_res();
+    return ip + 1;
+}
+
+thread_cell *call_load(thread_cell *ip) {
+    do_load();
+    return ip + 1;
+}
+
+thread_cell *call_store(thread_cell *ip) {
+    do_store();
+    return ip + 1;
+}
+
+thread_cell *call_call(thread_cell *ip) {
+    if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+        call_threaded_status = ERR_CALL_OVERFLOW;
+        return NULL;
+    }
+    enter_frame(vm.stack_top);
+    *vm.return_top++ = ip + 2;
+    return ip[1].target;
+}
+
+thread_cell *call_ret(thread_cell *ip) {
+    if (vm.return_top == vm.return_stack) {
+        call_threaded_status = ERR_RET_UNDERFLOW;
+        return NULL;
+    }
+    leave_frame();
+    return *--vm.return_top;
+}
+
+thread_cell *call_loop(thread_cell *ip) {
+    *(vm.stack_top - 1) -= ip[2].imm;
+    if (*(vm.stack_top - 1) != 0) {
+        return ip[1].target;
+    }
+    return ip + 3;
+}
+
+thread_cell *call_fadd(thread_cell *ip) {
+    do_fadd();
+    return ip + 1;
+}
+
+thread_cell *call_fsub(thread_cell *ip) {
+    do_fsub();
+    return ip + 1;
+}
+
+thread_cell *call_fmul(thread_cell *ip) {
+    do_fmul();
+    return ip + 1;
+}
+
+thread_cell *call_fdiv(thread_cell *ip) {
+    do_fdiv();
+    return ip + 1;
+}
+
+thread_cell *call_itof(thread_cell *ip) {
+    do_itof();
+    return ip + 1;
+}
+
+thread_cell *call_ftoi(thread_cell *ip) {
+    do_ftoi();
+    return ip + 1;
+}
+
+thread_cell *call_jmp(thread_cell *ip) {
+    return ip[1].target;
+}
+
+thread_cell *call_jiz(thread_cell *ip) {
+    if (*(vm.stack_top - 1) == 0) {
+        return ip[1].target;
+    }
+    return ip + 2;
+}
+
+thread_cell *call_div_const(thread_cell *ip) {
+    *(vm.stack_top - 1) = div_by_magic(*(vm.stack_top - 1), div_magics[ip[1].imm]);
+    return ip + 2;
+}
+
+thread_cell *call_lshift_const(thread_cell *ip) {
+    *(vm.stack_top - 1) <<= ip[1].imm;
+    return ip + 2;
+}
+
+thread_cell *call_rshift_const(thread_cell *ip) {
+    *(vm.stack_top - 1) >>= ip[1].imm;
+    return ip + 2;
+}
+
+thread_cell *call_dup(thread_cell *ip) {
+    do_dup();
+    return ip + 1;
+}
+
+thread_cell *call_drop(thread_cell *ip) {
+    do_drop();
+    return ip + 1;
+}
+
+thread_cell *call_swap(thread_cell *ip) {
+    do_swap();
+    return ip + 1;
+}
+
+thread_cell *call_over(thread_cell *ip) {
+    do_over();
+    return ip + 1;
+}
+
+thread_cell *call_rot(thread_cell *ip) {
+    do_rot();
+    return ip + 1;
+}
+
+thread_cell *call_load_local(thread_cell *ip) {
+    *vm.stack_top = vm.frame[(int8_t) ip[1].imm];
+    vm.stack_top++;
+    return ip + 2;
+}
+
+thread_cell *call_store_local(thread_cell *ip) {
+    vm.stack_top--;
+    vm.frame[(int8_t) ip[1].imm] = *vm.stack_top;
+    return ip + 2;
+}
+
+thread_cell *call_spawn(thread_cell *ip) {
+    result r = do_spawn(ip[1].target, (uint8_t) ip[2].imm);
+    if (r != SUCCESS) {
+        call_threaded_status = r;
+        return NULL;
+    }
+    return ip + 3;
+}
+
+thread_cell *call_join(thread_cell *ip) {
+    result r = do_join();
+    if (r != SUCCESS) {
+        call_threaded_status = r;
+        return NULL;
+    }
+    return ip + 1;
+}
+
+thread_cell *call_done(thread_cell *ip) {
+    print_done();
+    call_threaded_status = SUCCESS;
+    return NULL;
+}
+
+thread_cell *call_unknown(thread_cell *ip) {
+    fprintf(stderr, "Unknown opcode\n");
+    fflush(stderr);
+    call_threaded_status = ERR_UNKNOWN_OPCODE;
+    return NULL;
+}
+
+result interpret_call_threaded(uint8_t *bytecode) {
+    void *handlers[NUM_OPCODES + 1] = {
+            call_push_imm,
+            call_add,
+            call_sub,
+            call_mul,
+            call_div,
+            call_and,
+            call_or,
+            call_xor,
+            call_not,
+            call_lshift,
+            call_rshift,
+            call_jif,
+            call_pop_res,
+            call_done,
+            call_jif,
+            call_load,
+            call_store,
+            call_call,
+            call_ret,
+            call_loop,
+            call_fadd,
+            call_fsub,
+            call_fmul,
+            call_fdiv,
+            call_itof,
+            call_ftoi,
+            call_jmp,
+            call_jiz,
+            call_div_const,
+            call_lshift_const,
+            call_rshift_const,
+            call_dup,
+            call_drop,
+            call_swap,
+            call_over,
+            call_rot,
+            call_load_local,
+            call_store_local,
+            call_spawn,
+            call_join,
+            call_unknown
+    };
+
+    /*
+     * A task runs on the threaded code of the program that spawned it, which
+     * that program's run keeps alive until every task is done.
+     */
+    thread_cell *code = vm.cells;
+    if (code == NULL) {
+        code = translate_threaded(bytecode, handlers);
+        if (code == NULL) {
+            return ERR_INVALID_JUMP;
+        }
+        vm.cells = code;
+    }
+    vm.frame = vm.stack;
+    call_threaded_ip = vm.entry != NULL ? vm.entry : code;
+    while (call_threaded_ip != NULL) {
+        call_threaded_ip = ((call_handler) call_threaded_ip->handler)(call_threaded_ip);
+    }
+
+    /*
+     * Take the status before syncing, since a task we help finish on this
+     * thread sets it too.
+     */
+    result r = call_threaded_status;
+    if (vm.entry == NULL) {
+        spawn_sync();
+        if (!vm.keep_cells) {
+            vm.cells = NULL;
+            free_threaded(code);
+        }
+    }
+    return r;
+}
+
+/*
+ * Tail-call threading. Every handler ends by tail-calling the next one, so
+ * there's no central loop at all, and the instruction pointer, stack pointer
+ * and top-of-stack value travel as arguments and stay in registers the whole
+ * time.
+ *
+ * We need the tail calls to be guaranteed, otherwise every instruction would
+ * eat a stack frame. Compilers with musttail give us that directly. Older GCCs
+ * don't have it, but will still turn the calls into jumps if we ask for
+ * sibling call optimization on the handlers, even in an -O0 build.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#define TAIL_HANDLER
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#define TAIL_HANDLER __attribute__((optimize("O2")))
+#endif
+
+/*
+ * The stack pointer here points at the slot the top of the stack belongs in,
+ * rather than the first free slot, and that slot's contents are stale: the
+ * real value lives in tos.
+ */
+typedef result (*tail_handler)(thread_cell *ip, uint64_t *sp, uint64_t tos);
+
+#define tail_next(ip, sp, tos) \
+    MUSTTAIL return ((tail_handler) (ip)->handler)((ip), (sp), (tos))
+
+TAIL_HANDLER result tail_push_imm(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    sp++;
+    tos = ip[1].imm;
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_add(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp + tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_sub(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp - tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_mul(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp * tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_div(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    if (tos == 0) {
+
+        /*
+         * Leave the stack the way the other engines do: with both operands
+         * popped.
+         */
+        vm.stack_top = sp - 1;
+        return ERR_DIV_ZERO;
+    }
+    sp--;
+    tos = *sp / tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_and(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp & tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_or(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp | tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_xor(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp ^ tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_not(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos = ~tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_lshift(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp << tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_rshift(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp >> tos;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_jif(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    if (tos != 0) {
+        tail_next(ip[1].target, sp, tos);
+    }
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_pop_res(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    vm.result = tos;
+    sp--;
+    tos = *sp;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_load(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos = mem_cell(tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_store(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    mem_cell(*(sp - 1)) = tos;
+    sp -= 2;
+    tos = *sp;
+    tail_next(ip + 1, sp, tos);
+}
+
+/*
+ * Calls don't touch the operand stack at all, so sp and tos just carry on into
+ * the callee. Its frame starts at the first free slot, which is sp + 1 here.
+ */
+TAIL_HANDLER result tail_call(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    if (vm.return_top == vm.return_stack + RETURN_STACK_MAX) {
+        *sp = tos;
+        vm.stack_top = sp + 1;
+        return ERR_CALL_OVERFLOW;
+    }
+    enter_frame(sp + 1);
+    *vm.return_top++ = ip + 2;
+    tail_next(ip[1].target, sp, tos);
+}
+
+TAIL_HANDLER result tail_ret(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    if (vm.return_top == vm.return_stack) {
+        *sp = tos;
+        vm.stack_top = sp + 1;
+        return ERR_RET_UNDERFLOW;
+    }
+    leave_frame();
+    vm.return_top--;
+    tail_next((thread_cell *) *vm.return_top, sp, tos);
+}
+
+TAIL_HANDLER result tail_loop(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos -= ip[2].imm;
+    if (tos != 0) {
+        tail_next(ip[1].target, sp, tos);
+    }
+    tail_next(ip + 3, sp, tos);
+}
+
+TAIL_HANDLER result tail_fadd(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = value_fadd(*sp, tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_fsub(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = value_fsub(*sp, tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_fmul(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = value_fmul(*sp, tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_fdiv(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = value_fdiv(*sp, tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_itof(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos = value_itof(tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_ftoi(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos = value_ftoi(tos);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_jmp(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tail_next(ip[1].target, sp, tos);
+}
+
+TAIL_HANDLER result tail_jiz(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    if (tos == 0) {
+        tail_next(ip[1].target, sp, tos);
+    }
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_div_const(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos = div_by_magic(tos, div_magics[ip[1].imm]);
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_lshift_const(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos <<= ip[1].imm;
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_rshift_const(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    tos >>= ip[1].imm;
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_dup(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    sp++;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_drop(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    tos = *sp;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_swap(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    uint64_t under = *(sp - 1);
+    *(sp - 1) = tos;
+    tos = under;
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_over(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    sp++;
+    tos = *(sp - 2);
+    tail_next(ip + 1, sp, tos);
+}
+
+TAIL_HANDLER result tail_rot(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    uint64_t third = *(sp - 2);
+    *(sp - 2) = *(sp - 1);
+    *(sp - 1) = tos;
+    tos = third;
+    tail_next(ip + 1, sp, tos);
+}
+
+/*
+ * The slot the top of the stack belongs in is stale, and a local can be that
+ * slot, so spill before reading. Storing writes before reloading tos for the
+ * same reason.
+ */
+TAIL_HANDLER result tail_load_local(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    sp++;
+    tos = vm.frame[(int8_t) ip[1].imm];
+    tail_next(ip + 2, sp, tos);
+}
+
+TAIL_HANDLER result tail_store_local(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    sp--;
+    vm.frame[(int8_t) ip[1].imm] = tos;
+    tos = *sp;
+    tail_next(ip + 2, sp, tos);
+}
+
+/*
+ * Both go through the helpers, which want the stack in memory.
+ */
+TAIL_HANDLER result tail_spawn(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    vm.stack_top = sp + 1;
+    result r = do_spawn(ip[1].target, (uint8_t) ip[2].imm);
+    if (r != SUCCESS) {
+        return r;
+    }
+    sp++;
+    tos = *sp;
+    tail_next(ip + 3, sp, tos);
+}
+
+TAIL_HANDLER result tail_join(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    vm.stack_top = sp + 1;
+    result r = do_join();
+    if (r != SUCCESS) {
+        return r;
+    }
+    tos = *sp;
+    tail_next(ip + 1, sp, tos);
+}
+
+/*
+ * Write the cached top of the stack back so the VM state looks the same as
+ * with every other engine.
+ */
+result tail_done(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    vm.stack_top = sp + 1;
+    print_done();
+    return SUCCESS;
+}
+
+result tail_unknown(thread_cell *ip, uint64_t *sp, uint64_t tos) {
+    *sp = tos;
+    vm.stack_top = sp + 1;
+    fprintf(stderr, "Unknown opcode\n");
+    fflush(stderr);
+    return ERR_UNKNOWN_OPCODE;
+}
+
+result interpret_tail_call(uint8_t *bytecode) {
+    void *handlers[NUM_OPCODES + 1] = {
+            tail_push_imm,
+            tail_add,
+            tail_sub,
+            tail_mul,
+            tail_div,
+            tail_and,
+            tail_or,
+            tail_xor,
+            tail_not,
+            tail_lshift,
+            tail_rshift,
+            tail_jif,
+            tail_pop_res,
+            tail_done,
+            tail_jif,
+            tail_load,
+            tail_store,
+            tail_call,
+            tail_ret,
+            tail_loop,
+            tail_fadd,
+            tail_fsub,
+            tail_fmul,
+            tail_fdiv,
+            tail_itof,
+            tail_ftoi,
+            tail_jmp,
+            tail_jiz,
+            tail_div_const,
+            tail_lshift_const,
+            tail_rshift_const,
+            tail_dup,
+            tail_drop,
+            tail_swap,
+            tail_over,
+            tail_rot,
+            tail_load_local,
+            tail_store_local,
+            tail_spawn,
+            tail_join,
+            tail_unknown
+    };
+    thread_cell *code = vm.cells;
+    if (code == NULL) {
+        code = translate_threaded(bytecode, handlers);
+        if (code == NULL) {
+            return ERR_INVALID_JUMP;
+        }
+        vm.cells = code;
+    }
+
+    /*
+     * Load the top of the stack into its register. If the stack is empty, sp
+     * points at the floor slot, or at a task's last argument, which is why we
+     * load whatever is there rather than make up a placeholder.
+     */
+    uint64_t *sp = vm.stack_top - 1;
+    uint64_t tos = *sp;
+    vm.frame = vm.stack;
+    thread_cell *start = vm.entry != NULL ? vm.entry : code;
+    result r = ((tail_handler) start->handler)(start, sp, tos);
+    if (vm.entry == NULL) {
+        spawn_sync();
+        if (!vm.keep_cells) {
+            vm.cells = NULL;
+            free_threaded(code);
+        }
+    }
+    return r;
+}
+
+/*
+ * Every dispatch engine has the same signature (see engine_fn), so we keep
+ * them in a table and look them up by the name the user passes on the command
+ * line.
+ */
+struct engine {
+    const char *name;
+    const char *description;
+    engine_fn interpret;
+};
+
+struct engine engines[] = {
+        {"inline",     "inline interpreter",             interpret_inline},
+        {"func",       "function dispatch interpreter",  interpret_function_dispatch},
+        {"threaded",   "direct threaded interpreter",    interpret_threaded_dispatch},
+        {"replicated", "replicated switch interpreter",  interpret_replicated_switch},
+        {"call",       "call threaded interpreter",      interpret_call_threaded},
+        {"tail",       "tail-call threaded interpreter", interpret_tail_call}
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/*
+ * Run an engine with the memory guard armed, so that an out-of-bounds LOAD or
+ * STORE comes back as ERR_MEM_OUT_OF_BOUNDS, and a push past the end of a
+ * use_stack stack as ERR_STACK_OVERFLOW. Engines that keep VM state in
+ * registers can't write it back when that happens, so the stack is unspecified
+ * after that error.
+ */
+result run_engine(struct engine *e, uint8_t *bytecode) {
+    vm.entry = NULL;
+    vm.engine = e->interpret;
+    vm.code = bytecode;
+    if (!vm.keep_cells) {
+        vm.cells = NULL;
+    }
+    if (sigsetjmp(vm_fault_jmp, 1) != 0) {
+
+        /*
+         * The jump skipped the end of the call and tail engines, where they
+         * free their threaded code, so free it here once no task can be
+         * running on it.
+         */
+        result r = spawn_reap(vm_fault_status);
+        if (vm.cells != NULL) {
+            free_threaded(vm.cells);
+            vm.cells = NULL;
+        }
+        return r;
+    }
+    vm_guard_active = 1;
+    result r = e->interpret(bytecode);
+    vm_guard_active = 0;
+
+    /*
+     * Tasks nobody joined still get to finish, so that none of them is
+     * running when the host looks at memory or starts the next run, and the
+     * run fails if one of them did.
+     */
+    return spawn_reap(r);
+}
+
+/*
+ * Keep the threaded code the call and tail engines translate until
+ * drop_threaded_code, for a host that runs one program on one engine many
+ * times over. Running any other program or engine in between isn't safe.
+ */
+void keep_threaded_code() {
+    vm.keep_cells = 1;
+}
+
+void drop_threaded_code() {
+    vm.keep_cells = 0;
+    if (vm.cells != NULL) {
+        free_threaded(vm.cells);
+        vm.cells = NULL;
+    }
+}
+
+/*
+ * Run a task's procedure on a stack of its own, holding just its arguments
+ * under the frame, with everything else about the VM set aside until it
+ * returns. That's how a worker runs a task, and also how a JOIN runs one
+ * while it waits, in the middle of running something else. The procedure's
+ * last RET finds the return stack empty, which is how a task finishes, once
+ * the tasks it spawned have too.
+ */
+result run_task(struct spawn_task *t, uint64_t *value) {
+    uint64_t slots[STACK_MAX + 1];
+    __typeof__(vm) saved = vm;
+    sigjmp_buf saved_jmp;
+    memcpy(saved_jmp, vm_fault_jmp, sizeof(sigjmp_buf));
+    sig_atomic_t saved_guard = vm_guard_active;
+    struct spawn_task *saved_current = spawn_current;
+    uint32_t saved_children = spawn_children;
+    spawn_current = t;
+    spawn_children = SPAWN_NONE;
+
+    memcpy(slots + 1, t->args, t->argc * sizeof(uint64_t));
+    vm.stack = slots + 1 + t->argc;
+    vm.stack_top = vm.stack;
+    vm.return_top = vm.return_stack;
+    vm.memory = t->memory;
+    vm.entry = t->entry;
+    vm.engine = t->engine;
+    vm.code = t->bytecode;
+    vm.cells = t->cells;
+    result r;
+    if (sigsetjmp(vm_fault_jmp, 0) != 0) {
+        r = vm_fault_status;
+    } else {
+        vm_guard_active = 1;
+        r = t->engine(t->bytecode);
+        if (r == ERR_RET_UNDERFLOW) {
+            r = SUCCESS;
+        }
+        *value = *(vm.stack_top - 1);
+    }
+    r = spawn_reap(r);
+
+    spawn_current = saved_current;
+    spawn_children = saved_children;
+    vm_guard_active = saved_guard;
+    memcpy(vm_fault_jmp, saved_jmp, sizeof(sigjmp_buf));
+    vm = saved;
+    return r;
+}
+
+/*
+ * Returns NULL if we don't have an engine with the given name.
+ */
+struct engine *find_engine(const char *name) {
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            return &engines[i];
         }
     }
+    return NULL;
 }
 
 #endif
\ No newline at end of file
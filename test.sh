@@ -3,4 +3,7 @@
 make clean
 make all
 ./stacka programs/stack/lngjif.stack programs/stack/lngjif
-time for run in {1..1000}; do ./stckvm programs/stack/lngjif inline; done
\ No newline at end of file
+time for run in {1..1000}; do ./stckvm programs/stack/lngjif inline; done
+rm -rf .verse-cache
+time for run in {1..1000}; do ./stckvm programs/stack/lngjif inline --memo-dir .verse-cache; done
+cat .verse-cache/metrics